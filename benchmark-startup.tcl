@@ -0,0 +1,108 @@
+#! /usr/bin/env tclsh
+
+# Startup benchmark: times complete runs of xvfs-launcher against the
+# stock tclsh running the same main script from disk.  Each scenario
+# passes its arguments to the main script (the default launcher main
+# script evaluates them), so that both the bare interpreter boot and
+# the cost of loading more of the script library are measured.
+# Results are reported in milliseconds per run.
+
+proc printHelp {channel {errors ""}} {
+	foreach error $errors {
+		puts $channel "error: $error"
+	}
+	if {[llength $errors] != 0} {
+		puts $channel ""
+	}
+	puts $channel "Usage: benchmark-startup.tcl --launcher <executable> --script <mainScript> \[--tclsh <executable>\] \[--runs <count>\]"
+	flush $channel
+}
+
+# Scenario name and the arguments given to the main script
+set scenarios {
+	boot    {}
+	clock   {clock format 0 -gmt 1}
+	msgcat  {package require msgcat}
+}
+
+array set config {
+	tclsh  tclsh
+	runs   50
+}
+
+foreach {arg val} $argv {
+	switch -exact -- $arg {
+		"--help" {
+			printHelp stdout
+			exit 0
+		}
+		"--launcher" - "--tclsh" - "--script" - "--runs" {
+			set config([string range $arg 2 end]) $val
+		}
+		default {
+			printHelp stderr [list "Invalid option: $arg $val"]
+			exit 1
+		}
+	}
+}
+
+set errors [list]
+foreach key {launcher script} {
+	if {![info exists config($key)]} {
+		lappend errors "--$key must be specified"
+	}
+}
+if {![string is entier -strict $config(runs)] || $config(runs) < 1} {
+	lappend errors "--runs must be a positive integer"
+}
+if {[llength $errors] != 0} {
+	printHelp stderr $errors
+	exit 1
+}
+
+proc percentile {sortedSamples fraction} {
+	set idx [expr {int(ceil($fraction * [llength $sortedSamples])) - 1}]
+	if {$idx < 0} {
+		set idx 0
+	}
+
+	return [lindex $sortedSamples $idx]
+}
+
+proc timeRuns {command} {
+	# Warm up the page cache so that both sides start from the same state
+	exec {*}$command
+
+	set samples [list]
+	for {set run 0} {$run < $::config(runs)} {incr run} {
+		set start [clock microseconds]
+		exec {*}$command
+		lappend samples [expr {([clock microseconds] - $start) / 1000.0}]
+	}
+
+	return [lsort -real $samples]
+}
+
+set format "%-8s %-14s %10s %10s %10s"
+puts [format $format scenario command min median p90]
+foreach {scenario scriptArgs} $scenarios {
+	set commands [dict create \
+		tclsh    [list {*}$config(tclsh) $config(script) {*}$scriptArgs] \
+		launcher [list $config(launcher) {*}$scriptArgs] \
+	]
+
+	set medians [dict create]
+	dict for {name command} $commands {
+		set samples [timeRuns $command]
+		set median [percentile $samples 0.5]
+		dict set medians $name $median
+
+		puts [format $format $scenario $name \
+			[format %.2f [lindex $samples 0]] \
+			[format %.2f $median] \
+			[format %.2f [percentile $samples 0.9]] \
+		]
+	}
+
+	puts [format "%-8s launcher is %.2fx the median of tclsh" $scenario [expr {[dict get $medians launcher] / [dict get $medians tclsh]}]]
+}
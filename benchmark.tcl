@@ -1,78 +1,632 @@
 #! /usr/bin/env tclsh
 
+# Benchmark suite: builds a synthetic tree (see xvfs-create-synthetic),
+# packs it into standalone, client and flexible images and compares them
+# against the native filesystem (and zipfs where Tcl provides it).  Each
+# mode runs in its own tclsh so that images cannot interfere with each
+# other.  Results are reported in ns/op, as JSON.
+
+set sourceDirectory [file dirname [file normalize [info script]]]
 set LIB_SUFFIX [info sharedlibextension]
-load -global ./xvfs${LIB_SUFFIX}; # Optional, uses a dispatcher
-load ./example-flexible${LIB_SUFFIX} Xvfs_example
 
-set benchmarkFormat "%-6s  %-11s  %s"
+proc printHelp {channel {errors ""}} {
+	foreach error $errors {
+		puts $channel "error: $error"
+	}
+	if {[llength $errors] != 0} {
+		puts $channel ""
+	}
+	puts $channel "Usage: benchmark.tcl \[--files <count>\] \[--depth <levels>\] \[--fanout <dirsPerDir>\] \[--sizes <distribution>\] \[--seed <seed>\]"
+	puts $channel "                     \[--iterations <count>\] \[--samples <count>\] \[--modes <modeList>\] \[--tests <testList>\]"
+	puts $channel "                     \[--work-dir <dir>\] \[--output <file.json>\] \[--baseline <file.json>\] \[--threshold <percent>\]"
+	puts $channel "                     \[--cc <compiler>\] \[--cflags <flags>\] \[--libs <libs>\] \[--mountpoint <root>\]"
+	puts $channel ""
+	puts $channel "  Modes: [join $::allModes {, }]"
+	puts $channel "  Tests: [join [lsort [dict keys $::tests]] {, }]"
+	flush $channel
+}
 
-proc benchmark {type name code} {
-	set iterations 10000
+set allModes {native native-loaded standalone client flexible flexible-server zipfs}
 
-	set work [string trim [lindex [split [string trim $code] "\n"] 0]]
-	if {[string match "# iterations: *" $work]} {
-		set iterations [lindex $work 2]
+# Each test is run over a list of paths ("files", "dirs", "missing", or
+# "relative" to the root, which is then the current directory) and must
+# perform exactly one operation per path
+set tests {
+	stat {
+		paths files
+		body {
+			foreach path $paths {
+				file stat $path UNUSED
+			}
+		}
+	}
+	stat-missing {
+		paths missing
+		body {
+			foreach path $paths {
+				catch {
+					file stat $path UNUSED
+				}
+			}
+		}
+	}
+	exists {
+		paths files
+		body {
+			foreach path $paths {
+				file exists $path
+			}
+		}
+	}
+	exists-relative {
+		paths relative
+		body {
+			# A new path each time, as Tcl remembers which
+			# filesystem a path belongs to
+			foreach path $paths {
+				file exists [string cat ./ $path]
+			}
+		}
+	}
+	read {
+		paths files
+		body {
+			foreach path $paths {
+				set fd [open $path rb]
+				read $fd
+				close $fd
+			}
+		}
+	}
+	glob {
+		paths dirs
+		body {
+			foreach path $paths {
+				glob -nocomplain -directory $path *
+			}
+		}
+	}
+	cd {
+		paths dirs
+		body {
+			foreach path $paths {
+				cd $path
+				pwd
+			}
+		}
+	}
+	search {
+		paths root
+		scale 0
+		body {
+			foreach path $paths {
+				recursiveGlob $path
+			}
+		}
+	}
+	walk {
+		paths root
+		scale 0
+		body {
+			foreach path $paths {
+				recursiveWalk $path
+			}
+		}
 	}
-	
-	time $code [expr {max($iterations / 100, 1)}]
-	set time [time $code $iterations]
-
-	puts [format $::benchmarkFormat $type $name $time]
 }
 
-set rootDirMap(xvfs) "//xvfs:/example"
-set rootDirMap(native) [file join [pwd] example]
-
 proc recursiveGlob {dir} {
 	foreach subDir [glob -nocomplain -directory $dir -types d *] {
 		recursiveGlob $subDir
 	}
 }
 
-array set test {
-	CD {
-		cd $::rootDir
-		pwd
+# The same search in a single call where xvfs is loaded
+proc recursiveWalk {dir} {
+	if {[info commands ::xvfs::walk] eq ""} {
+		tailcall recursiveGlob $dir
 	}
-	Read {
-		set fd [open ${::rootDir}/main.tcl]
-		read $fd
-		close $fd
+
+	xvfs::walk $dir -types d
+}
+
+# Minimal JSON support, enough for the results files we write
+proc jsonString {string} {
+	return "\"[string map [list \\ \\\\ \" \\\" \n \\n \t \\t \r \\r] $string]\""
+}
+
+proc jsonNumber {number} {
+	if {[string is entier -strict $number]} {
+		return $number
+	}
+
+	return [format %.1f $number]
+}
+
+proc jsonObject {dict {indent ""}} {
+	set items [list]
+	dict for {key value} $dict {
+		lappend items "$indent\t[jsonString $key]: $value"
+	}
+
+	if {[llength $items] == 0} {
+		return "{}"
 	}
-	"Read Async" {
-		# iterations: 1000
-		set ::async_read_done false
-		set fd [open ${::rootDir}/main.tcl]
-		fconfigure $fd -blocking false
-		fileevent $fd readable [list apply {{fd} {
-			set input [read $fd 512]
-			if {[eof $fd] && $input eq ""} {
-				set ::async_read_done true
-				return
-			}
-		}} $fd]
-		vwait ::async_read_done
+
+	return "\{\n[join $items ",\n"]\n$indent\}"
+}
+
+proc jsonArray {list {indent ""}} {
+	if {[llength $list] == 0} {
+		return "\[\]"
+	}
+
+	return "\[\n$indent\t[join $list ",\n$indent\t"]\n$indent\]"
+}
+
+proc jsonDecode {json} {
+	set ::jsonInput $json
+	set ::jsonOffset 0
+	set value [jsonDecodeValue]
+	unset ::jsonInput ::jsonOffset
+
+	return $value
+}
+
+proc jsonSkipSpace {} {
+	regexp -start $::jsonOffset -indices {\A\s*} $::jsonInput match
+	set ::jsonOffset [expr {[lindex $match 1] + 1}]
+}
+
+proc jsonDecodeValue {} {
+	jsonSkipSpace
+
+	set char [string index $::jsonInput $::jsonOffset]
+	switch -exact -- $char {
+		"\{" {
+			incr ::jsonOffset
+			set result [dict create]
+			jsonSkipSpace
+			if {[string index $::jsonInput $::jsonOffset] eq "\}"} {
+				incr ::jsonOffset
+
+				return $result
+			}
+			while 1 {
+				set key [jsonDecodeValue]
+				jsonSkipSpace
+				if {[string index $::jsonInput $::jsonOffset] ne ":"} {
+					error "invalid JSON: expected \":\" at offset $::jsonOffset"
+				}
+				incr ::jsonOffset
+				dict set result $key [jsonDecodeValue]
+				jsonSkipSpace
+				set char [string index $::jsonInput $::jsonOffset]
+				incr ::jsonOffset
+				if {$char eq "\}"} {
+					return $result
+				}
+				if {$char ne ","} {
+					error "invalid JSON: expected \",\" at offset $::jsonOffset"
+				}
+			}
+		}
+		"\[" {
+			incr ::jsonOffset
+			set result [list]
+			jsonSkipSpace
+			if {[string index $::jsonInput $::jsonOffset] eq "\]"} {
+				incr ::jsonOffset
+
+				return $result
+			}
+			while 1 {
+				lappend result [jsonDecodeValue]
+				jsonSkipSpace
+				set char [string index $::jsonInput $::jsonOffset]
+				incr ::jsonOffset
+				if {$char eq "\]"} {
+					return $result
+				}
+				if {$char ne ","} {
+					error "invalid JSON: expected \",\" at offset $::jsonOffset"
+				}
+			}
+		}
+		"\"" {
+			if {![regexp -start $::jsonOffset -indices {\A"((?:[^"\\]|\\.)*)"} $::jsonInput match string]} {
+				error "invalid JSON: unterminated string at offset $::jsonOffset"
+			}
+			set ::jsonOffset [expr {[lindex $match 1] + 1}]
+
+			return [subst -nocommands -novariables [string range $::jsonInput {*}$string]]
+		}
+		default {
+			if {![regexp -start $::jsonOffset -indices {\A(?:-?[0-9.eE+-]+|true|false|null)} $::jsonInput match]} {
+				error "invalid JSON: unexpected \"$char\" at offset $::jsonOffset"
+			}
+			set ::jsonOffset [expr {[lindex $match 1] + 1}]
+
+			return [string range $::jsonInput {*}$match]
+		}
+	}
+}
+
+proc percentile {sortedSamples fraction} {
+	set index [expr {int(round($fraction * ([llength $sortedSamples] - 1)))}]
+
+	return [lindex $sortedSamples $index]
+}
+
+proc summarize {samples} {
+	set samples [lsort -real $samples]
+	set sum 0.0
+	foreach sample $samples {
+		set sum [expr {$sum + $sample}]
+	}
+
+	return [dict create \
+		mean [expr {$sum / [llength $samples]}] \
+		min  [lindex $samples 0] \
+		p50  [percentile $samples 0.50] \
+		p90  [percentile $samples 0.90] \
+		p99  [percentile $samples 0.99] \
+		max  [lindex $samples end] \
+	]
+}
+
+## Worker: runs every test for one mode, prints a Tcl dict of results
+proc runWorker {argv} {
+	array set config $argv
+
+	expr {srand($config(seed))}
+	set root [eval $config(setup)]
+
+	set fd [open $config(pathsFile)]
+	set pathSets [read $fd]
+	close $fd
+	set paths(files)   [lmap path [dict get $pathSets files] { string cat $root / $path }]
+	set paths(dirs)    [lmap path [dict get $pathSets dirs] { string trimright [string cat $root / $path] / }]
+	set paths(missing) [lmap path [dict get $pathSets files] { string cat $root / $path .missing }]
+	set paths(root)    [list $root]
+	set paths(relative) [dict get $pathSets files]
+
+	set startDir [pwd]
+	set results [dict create]
+	foreach test $config(tests) {
+		set testInfo [dict get $::tests $test]
+		proc benchmark_$test {paths} [dict get $testInfo body]
+
+		# Tests that cover the whole tree per operation are not
+		# scaled by the iteration count
+		set iterations $config(iterations)
+		if {[dict exists $testInfo scale] && ![dict get $testInfo scale]} {
+			set iterations $config(samples)
+		}
+
+		set batchSize [expr {max($iterations / $config(samples), 1)}]
+		set testPaths $paths([dict get $testInfo paths])
+		set batches [list]
+		for {set sample 0} {$sample < $config(samples)} {incr sample} {
+			set batch [list]
+			for {set idx 0} {$idx < $batchSize} {incr idx} {
+				lappend batch [lindex $testPaths [expr {int(rand() * [llength $testPaths])}]]
+			}
+			lappend batches $batch
+		}
+
+		if {[dict get $testInfo paths] eq "relative"} {
+			cd $root
+		}
+
+		# Warm up
+		benchmark_$test [lindex $batches 0]
+
+		set samples [list]
+		foreach batch $batches {
+			set start [clock microseconds]
+			benchmark_$test $batch
+			set elapsed [expr {[clock microseconds] - $start}]
+			lappend samples [expr {($elapsed * 1000.0) / [llength $batch]}]
+		}
+		cd $startDir
+
+		dict set results $test [dict create operations [expr {$batchSize * $config(samples)}] ns_per_op [summarize $samples]]
+	}
+
+	puts $results
+}
+
+if {[lindex $argv 0] eq "--worker"} {
+	runWorker [lrange $argv 1 end]
+	exit 0
+}
+
+## Driver
+array set config {
+	files       1000
+	depth       2
+	fanout      10
+	sizes       exponential:4096
+	seed        1
+	iterations  10000
+	samples     50
+	work-dir    benchmark-work
+	threshold   10
+	cc          cc
+	cflags      ""
+	libs        ""
+	mountpoint  //xvfs:/
+}
+set config(modes) $allModes
+set config(tests) [dict keys $tests]
+if {[info exists ::env(XVFS_ROOT_MOUNTPOINT)]} {
+	set config(mountpoint) $::env(XVFS_ROOT_MOUNTPOINT)
+}
+
+if {[llength $argv] % 2 != 0} {
+	printHelp stderr [list "Invalid option: [lindex $argv end]"]
+	exit 1
+}
+foreach {arg val} $argv {
+	if {$arg eq "--help"} {
+		printHelp stdout
+		exit 0
+	}
+
+	set key [string range $arg 2 end]
+	if {![string match "--*" $arg] || !([info exists config($key)] || $key in {output baseline})} {
+		printHelp stderr [list "Invalid option: $arg"]
+		exit 1
+	}
+
+	set config($key) $val
+}
+
+set errors [list]
+foreach mode $config(modes) {
+	if {$mode ni $allModes} {
+		lappend errors "Invalid mode: $mode"
+	}
+}
+foreach test $config(tests) {
+	if {![dict exists $tests $test]} {
+		lappend errors "Invalid test: $test"
+	}
+}
+if {[llength $errors] != 0} {
+	printHelp stderr $errors
+	exit 1
+}
+
+proc buildImages {} {
+	global config sourceDirectory LIB_SUFFIX
+
+	set workDir [file normalize $config(work-dir)]
+	set treeDir [file join $workDir tree]
+	set parameters [list $config(files) $config(depth) $config(fanout) $config(sizes) $config(seed) $config(cc) $config(cflags) $config(libs) $config(mountpoint)]
+
+	# Rebuild only when the parameters of the tree change
+	set stampFile [file join $workDir parameters]
+	if {[file exists $stampFile]} {
+		set fd [open $stampFile]
+		set lastParameters [read -nonewline $fd]
 		close $fd
+
+		if {$lastParameters eq $parameters} {
+			return $workDir
+		}
+	}
+
+	file delete -force $workDir
+	file mkdir $workDir
+
+	puts stderr "Generating tree with $config(files) files in $treeDir ..."
+	exec [info nameofexecutable] [file join $sourceDirectory xvfs-create-synthetic] \
+		--files $config(files) --depth $config(depth) --fanout $config(fanout) \
+		--sizes $config(sizes) --seed $config(seed) --tree $treeDir >@ stdout 2>@ stderr
+
+	puts stderr "Generating image ..."
+	exec [info nameofexecutable] [file join $sourceDirectory xvfs-create] \
+		--directory $treeDir --name bench --output [file join $workDir bench.c] >@ stdout 2>@ stderr
+
+	foreach mode {standalone client flexible} {
+		puts stderr "Compiling $mode image ..."
+		exec {*}$config(cc) {*}$config(cflags) -I$sourceDirectory \
+			-DXVFS_ROOT_MOUNTPOINT="$config(mountpoint)" -DXVFS_MODE_[string toupper $mode] \
+			-shared -o [file join $workDir bench-${mode}${LIB_SUFFIX}] [file join $workDir bench.c] \
+			{*}$config(libs) >@ stdout 2>@ stderr
 	}
-	Glob {
-		glob -directory ${::rootDir} *
+
+	# Record which paths exist so that workers do not need to
+	# walk the tree to pick targets
+	set files [list]
+	set dirs [list ""]
+	set queue [list ""]
+	while {[llength $queue] != 0} {
+		set queue [lassign $queue dir]
+		foreach child [lsort [glob -nocomplain -tails -directory [file join $treeDir $dir] *]] {
+			set path [string trimleft "$dir/$child" /]
+			if {[file isdirectory [file join $treeDir $path]]} {
+				lappend dirs $path
+				lappend queue $path
+			} else {
+				lappend files $path
+			}
+		}
 	}
-	Search {
-		recursiveGlob ${::rootDir}
+	if {[llength $files] == 0} {
+		lappend files ""
 	}
-	+Stat {
-		file stat ${::rootDir}/main.tcl UNUSED
+
+	set fd [open [file join $workDir paths] w]
+	puts $fd [dict create files $files dirs $dirs]
+	close $fd
+
+	if {[llength [info commands ::tcl::zipfs::mkzip]] != 0} {
+		puts stderr "Creating zip archive ..."
+		::tcl::zipfs::mkzip [file join $workDir bench.zip] $treeDir $treeDir
 	}
-	-Stat {
-		catch {
-			file stat ${::rootDir}/DOES-NOT-EXIST UNUSED
+
+	set fd [open $stampFile w]
+	puts $fd $parameters
+	close $fd
+
+	return $workDir
+}
+
+proc modeSetup {mode workDir} {
+	global config sourceDirectory LIB_SUFFIX
+
+	set server [file join $sourceDirectory xvfs${LIB_SUFFIX}]
+	set image [file join $workDir bench-[lindex [split $mode -] 0]${LIB_SUFFIX}]
+	set xvfsRoot "$config(mountpoint)bench"
+
+	switch -exact -- $mode {
+		"native" {
+			return [list apply {{root} { return $root }} [file join $workDir tree]]
+		}
+		"native-loaded" {
+			# The native filesystem with images registered alongside
+			# it, which Tcl asks about every path first
+			set images [lmap imageMode {standalone flexible} { file join $workDir bench-${imageMode}${LIB_SUFFIX} }]
+			return [list apply {{images root} { foreach image $images { load $image Xvfs_bench }; return $root }} $images [file join $workDir tree]]
+		}
+		"standalone" - "flexible" {
+			return [list apply {{image root} { load $image Xvfs_bench; return $root }} $image $xvfsRoot]
+		}
+		"client" {
+			return [list apply {{server image root} { load -global $server; load $image Xvfs_bench; return $root }} $server $image $xvfsRoot]
+		}
+		"flexible-server" {
+			return [list apply {{server image root} { load $server; load $image Xvfs_bench; return $root }} $server $image $xvfsRoot]
+		}
+		"zipfs" {
+			return [list apply {{zipFile} {
+				# The argument order of "zipfs mount" changed during 8.7 development
+				if {[catch { zipfs mount $zipFile /bench }]} {
+					zipfs mount /bench $zipFile
+				}
+				return [file join [zipfs root] bench]
+			}} [file join $workDir bench.zip]]
 		}
 	}
 }
 
-foreach {testName testBody} [lsort -stride 2 -dictionary [array get test]] {
-	foreach rootDirType {xvfs native} {
-		set rootDir $rootDirMap($rootDirType)
-		benchmark $rootDirType $testName $testBody
+set workDir [buildImages]
+
+set results [list]
+set skipped [list]
+foreach mode $config(modes) {
+	if {$mode eq "zipfs" && ![file exists [file join $workDir bench.zip]]} {
+		lappend skipped [jsonObject [dict create mode [jsonString $mode] reason [jsonString "zipfs is not available in Tcl [info patchlevel]"]] "\t\t"]
+		continue
+	}
+
+	puts stderr "Running $mode ..."
+	set workerArgs [list \
+		setup [modeSetup $mode $workDir] \
+		pathsFile [file join $workDir paths] \
+		tests $config(tests) \
+		iterations $config(iterations) \
+		samples $config(samples) \
+		seed $config(seed) \
+	]
+
+	if {[catch {
+		exec [info nameofexecutable] [file normalize [info script]] --worker {*}$workerArgs 2>@ stderr
+	} workerResults]} {
+		puts stderr "warning: $mode failed: $workerResults"
+		lappend skipped [jsonObject [dict create mode [jsonString $mode] reason [jsonString $workerResults]] "\t\t"]
+		continue
+	}
+
+	dict for {test testResult} $workerResults {
+		set nsPerOp [dict map {key value} [dict get $testResult ns_per_op] { jsonNumber $value }]
+		set result [dict create \
+			mode [jsonString $mode] \
+			test [jsonString $test] \
+			operations [dict get $testResult operations] \
+			ns_per_op [jsonObject $nsPerOp "\t\t\t"] \
+		]
+
+		lappend results [jsonObject $result "\t\t"]
+		dict set measured $mode $test [dict get $testResult ns_per_op]
 	}
 }
+
+set parameters [dict create]
+foreach key {files depth fanout seed iterations samples} {
+	dict set parameters $key $config($key)
+}
+dict set parameters sizes [jsonString $config(sizes)]
+dict set parameters tcl [jsonString [info patchlevel]]
+
+set output [jsonObject [dict create \
+	parameters [jsonObject $parameters "\t"] \
+	results [jsonArray $results "\t"] \
+	skipped [jsonArray $skipped "\t"] \
+]]
+
+if {[info exists config(output)]} {
+	set fd [open $config(output) w]
+	puts $fd $output
+	close $fd
+} else {
+	puts $output
+}
+
+## Compare against a baseline, flagging any median that grew by more
+## than the threshold
+if {![info exists config(baseline)]} {
+	exit 0
+}
+
+if {![file exists $config(baseline)]} {
+	puts stderr "No baseline at $config(baseline), skipping comparison"
+	exit 0
+}
+
+set fd [open $config(baseline)]
+set baseline [jsonDecode [read $fd]]
+close $fd
+
+dict for {key value} [dict get $baseline parameters] {
+	if {[dict exists $parameters $key] && [string trim [dict get $parameters $key] \"] ne $value} {
+		puts stderr "warning: baseline was recorded with $key = $value (now [dict get $parameters $key])"
+	}
+}
+
+set format "%-16s %-14s %12s %12s %8s  %s"
+puts [format $format Mode Test "Baseline p50" "p50" "Change" ""]
+set regressions 0
+foreach result [dict get $baseline results] {
+	set mode [dict get $result mode]
+	set test [dict get $result test]
+	if {![info exists measured] || ![dict exists $measured $mode $test]} {
+		continue
+	}
+
+	set before [dict get $result ns_per_op p50]
+	set after [dict get $measured $mode $test p50]
+	if {$before > 0} {
+		set change [expr {(($after - $before) * 100.0) / $before}]
+	} else {
+		set change 0.0
+	}
+
+	set flag ""
+	if {$change > $config(threshold)} {
+		set flag "REGRESSION"
+		incr regressions
+	}
+
+	puts [format $format $mode $test [format %.1f $before] [format %.1f $after] [format %+.1f%% $change] $flag]
+}
+
+if {$regressions != 0} {
+	puts stderr "$regressions regression(s) beyond $config(threshold)%"
+	exit 2
+}
+
+exit 0
@@ -0,0 +1,6 @@
+namespace eval ::hellomodule {
+	proc hi {} {
+		return "hi"
+	}
+}
+package provide hellomodule 1.0
@@ -3,6 +3,12 @@
 package require tcltest
 
 tcltest::testConstraint tcl87 [string match "8.7.*" [info patchlevel]]
+tcltest::testConstraint xvfsMount [llength [info commands ::xvfs::mount]]
+tcltest::testConstraint xvfsLauncher [info exists ::env(XVFS_LAUNCHER)]
+tcltest::testConstraint xvfsSubprocess [info exists ::env(XVFS_TEST_LOAD_COMMANDS)]
+tcltest::testConstraint xvfsTwoImages [expr {[file exists ./example-standalone[info sharedlibextension]] && [file exists ./example-flexible[info sharedlibextension]]}]
+tcltest::testConstraint xvfsCreateTCL [file exists ./xvfs-create]
+tcltest::testConstraint xvfsCreateC [file executable ./xvfs-create-c]
 
 tcltest::configure -verbose pbse
 tcltest::configure {*}$argv
@@ -14,7 +20,11 @@ if {![info exists ::env(XVFS_ROOT_MOUNTPOINT)]} {
 }
 
 set rootDir "${xvfsRootMountpoint}example"
+# A second filesystem built into the same library
+set rootDir2 "${xvfsRootMountpoint}example2"
 set rootDirNative  [file join [pwd] example]
+# The image is example with example-overlay layered over it
+set rootDirLayers  [list $rootDirNative [file join [pwd] example-overlay]]
 #set rootDir $rootDirNative
 set testFile "${rootDir}/foo"
 
@@ -97,6 +107,33 @@ tcltest::test xvfs-seek-read-past-eof "Xvfs Seek Then Read Past EOF Test" -setup
 	unset fd
 } -result ""
 
+tcltest::test xvfs-channel-size "Xvfs Channel Size Option Test" -setup {
+	set fd [open $testFile]
+} -body {
+	list [fconfigure $fd -size] [file size $testFile] [dict get [fconfigure $fd] -size] [fconfigure $fd -buffersize]
+} -cleanup {
+	close $fd
+	unset fd
+} -result [list 12 12 12 12]
+
+tcltest::test xvfs-channel-size-large "Xvfs Channel Buffer Capped For Large Files Test" -setup {
+	set fd [open $rootDir/main.tcl]
+} -body {
+	list [expr {[fconfigure $fd -size] > 4096}] [fconfigure $fd -buffersize] [expr {[string length [read $fd]] == [fconfigure $fd -size]}]
+} -cleanup {
+	close $fd
+	unset fd
+} -result {1 4096 1}
+
+tcltest::test xvfs-channel-size-neg "Xvfs Channel Unknown Option Test" -setup {
+	set fd [open $testFile]
+} -body {
+	fconfigure $fd -bogus
+} -cleanup {
+	close $fd
+	unset fd
+} -match glob -returnCodes error -result "bad option \"-bogus\": should be one of *, or -size"
+
 tcltest::test xvfs-basic-open-neg "Xvfs Open Non-Existant File Test" -body {
 	unset -nocomplain fd
 	set fd [open $rootDir/does-not-exist]
@@ -181,12 +218,20 @@ tcltest::test xvfs-match-almost-root-neg "Xvfs Match Almost Root" -body {
 
 tcltest::test xvfs-glob-basic-any "Xvfs Glob Match Any Test" -body {
 	llength [glob_verify *]
-} -result 3
+} -result 4
 
 tcltest::test xvfs-glob-files-any "Xvfs Glob Match Any File Test" -body {
 	llength [glob_verify -type f *]
 } -result 2
 
+tcltest::test xvfs-glob-repeated "Xvfs Glob Repeated Results Test" -body {
+	set first [lsort [glob -directory $rootDir -type f *]]
+	set second [lsort [glob -directory $rootDir -type f *]]
+	list [expr {$first eq $second}] [llength $second] [file size [lindex $second 0]] [file isfile [lindex $second 1]]
+} -cleanup {
+	unset -nocomplain first second
+} -match glob -result {1 2 * 1}
+
 tcltest::test xvfs-glob-dir-any "Xvfs Glob On a File Test" -body {
 	glob -nocomplain -directory $testFile *
 } -returnCodes error -result "not a directory"
@@ -236,8 +281,8 @@ tcltest::test xvfs-glob-hidden "Xvfs Glob Hidden Test " -body {
 } -result ""
 
 tcltest::test xvfs-glob-executable "Xvfs Glob Executable Test " -body {
-	glob -nocomplain -directory $rootDir -types x *
-} -result $rootDir/lib
+	lsort [glob -nocomplain -directory $rootDir -types x *]
+} -result [list $rootDir/layers $rootDir/lib]
 
 tcltest::test xvfs-access-basic-read "Xvfs acccess Read Basic Test" -body {
 	file readable $testFile
@@ -279,10 +324,52 @@ tcltest::test xvfs-stat-basic-dir "Xvfs stat Basic Directory Test" -body {
 	unset -nocomplain fileInfo
 } -result directory
 
+tcltest::test xvfs-layers-replace "Xvfs Upper Layer Replaces Files Test" -body {
+	lmap file {replaced.txt kept.txt} {
+		set fd [open $rootDir/layers/$file]
+		set data [read $fd]
+		close $fd
+		set data
+	}
+} -cleanup {
+	unset -nocomplain file fd data
+} -result [list "upper\n" "lower\n"]
+
+tcltest::test xvfs-layers-shadow "Xvfs Upper Layer File Shadows a Directory Test" -body {
+	list [file type $rootDir/layers/shadowed] [file size $rootDir/layers/shadowed] [file exists $rootDir/layers/shadowed/inner.txt] [glob -nocomplain -directory $rootDir/layers -types d *]
+} -result [list file 6 0 [list $rootDir/layers/merged]]
+
+tcltest::test xvfs-layers-merge "Xvfs Layers Merge Directories Test" -body {
+	list [lsort [glob -tails -directory $rootDir/layers *]] [lsort [glob -tails -directory $rootDir/layers/merged *]]
+} -result {{kept.txt merged replaced.txt shadowed} {lower.txt upper.txt}}
+
+tcltest::test xvfs-multi-read "Xvfs Library With Several Filesystems Read Test" -body {
+	lmap file [list $testFile $rootDir2/hello.txt] {
+		set fd [open $file]
+		set data [read $fd]
+		close $fd
+		set data
+	}
+} -cleanup {
+	unset -nocomplain file fd data
+} -result [list "Foo Bar Baz\n" "Hello from example2\n"]
+
+tcltest::test xvfs-multi-separate "Xvfs Library With Several Filesystems Keeps Them Apart Test" -body {
+	list [file exists $rootDir2/foo] [file exists $rootDir/hello.txt] [file isdirectory $rootDir2] [file isdirectory $rootDir2/sub]
+} -result {0 0 1 1}
+
+tcltest::test xvfs-multi-glob "Xvfs Library With Several Filesystems Glob Test" -body {
+	list [lsort [glob -tails -directory $rootDir2 *]] [glob -directory $rootDir2/sub *] [llength [glob -directory $rootDir *]]
+} -result [list {hello.txt sub} [list $rootDir2/sub/data.txt] 4]
+
+tcltest::test xvfs-multi-walk "Xvfs Library With Several Filesystems walk Test" -body {
+	list [lsort [xvfs::walk $rootDir2]] [llength [xvfs::walk $rootDir -pattern *.txt]]
+} -result [list [list $rootDir2/hello.txt $rootDir2/sub $rootDir2/sub/data.txt] 4]
+
 # Broken in Tcl 8.6 and earlier
 tcltest::test xvfs-glob-advanced-dir-with-pattern "Xvfs Glob Match Pattern and Directory Together" -body {
 	llength [glob ${rootDir}/*]
-} -constraints tcl87 -result 3
+} -constraints tcl87 -result 4
 
 tcltest::test xvfs-glob-file-dirname "Xvfs Relies on file dirname" -body {
 	lindex [glob -directory [file dirname $testFile] *] 0
@@ -309,17 +396,747 @@ tcltest::test xvfs-cwd-2 "Xvfs Can Be cwd" -setup {
 	unset startDir
 } -constraints tcl87 -result "hello"
 
-# Currently broken
+tcltest::test xvfs-cwd-native "Xvfs Leaves Relative Native Paths Alone" -body {
+	list [file exists [file join [file tail $rootDirNative] main.tcl]] [file exists main.tcl]
+} -result {1 0}
+
 tcltest::test xvfs-package "Xvfs Can Be Package Directory" -setup {
 	set startAutoPath $auto_path
 	lappend auto_path ${rootDir}/lib
 } -body {
 	package require hello
-	set auto_path
 } -cleanup {
+	package forget hello
 	set auto_path $startAutoPath
 	unset startAutoPath
-} -constraints knownBug -result ""
+} -constraints tcl87 -result 0
+
+tcltest::test xvfs-package-auto-path "Xvfs Package Lookup Leaves auto_path Alone" -setup {
+	set startAutoPath $auto_path
+	lappend auto_path ${rootDir}/lib
+	set expectedAutoPath $auto_path
+} -body {
+	catch {
+		package require xvfs-does-not-exist
+	}
+	expr {$auto_path eq $expectedAutoPath}
+} -cleanup {
+	set auto_path $startAutoPath
+	unset startAutoPath expectedAutoPath
+} -match boolean -result true
+
+tcltest::test xvfs-package-index "Xvfs Package Index Test" -body {
+	lsort [lmap record [split [dict get $::xvfs::packageIndexes $rootDir] "\n"] {
+		lindex [split $record "\t"] 0
+	}]
+} -result {{} pkgIndex tm}
+
+tcltest::test xvfs-package-index-names "Xvfs Package Index Names the Packages a pkgIndex.tcl Provides Test" -body {
+	lmap record [split [dict get $::xvfs::packageIndexes $rootDir] "\n"] {
+		lassign [split $record "\t"] kind packages path
+		if {$kind ne "pkgIndex"} {
+			continue
+		}
+		list $packages $path
+	}
+} -cleanup {
+	unset -nocomplain record kind packages path
+} -result {{hello lib/hello/pkgIndex.tcl}}
+
+tcltest::test xvfs-package-tm "Xvfs Can Be Tcl Module Directory" -setup {
+	::tcl::tm::path add ${rootDir}/lib/hello
+} -body {
+	package require hellomodule
+	hellomodule::hi
+} -cleanup {
+	::tcl::tm::path remove ${rootDir}/lib/hello
+	package forget hellomodule
+} -result "hi"
+
+tcltest::test xvfs-package-tm-newest "Xvfs Modules Are Registered Before Older Versions Elsewhere Test" -setup {
+	set tmDir [tcltest::makeDirectory xvfs-package-tm-newest]
+	tcltest::makeFile {package provide xvfsdiskmodule 1.0} xvfsdiskmodule-1.0.tm $tmDir
+	tcltest::makeFile {package provide hellomodule 0.5} hellomodule-0.5.tm $tmDir
+	::tcl::tm::path add $tmDir
+	::tcl::tm::path add ${rootDir}/lib/hello
+} -body {
+	# Looking up any module registers every module on disk that
+	# could hold it, including the older hellomodule, so the newer
+	# one in xvfs has to be registered by then as well
+	package require xvfsdiskmodule
+	package require hellomodule
+} -cleanup {
+	::tcl::tm::path remove ${rootDir}/lib/hello
+	::tcl::tm::path remove $tmDir
+	package forget xvfsdiskmodule hellomodule
+	tcltest::removeDirectory xvfs-package-tm-newest
+	unset -nocomplain tmDir
+} -result 1.0
+
+tcltest::test xvfs-lookup-filter "Xvfs Lookup Filter Finds Every Path Test" -setup {
+	set found [list]
+	set queue [list $rootDir]
+} -body {
+	while {[llength $queue] != 0} {
+		set queue [lassign $queue dir]
+		foreach path [glob -nocomplain -directory $dir *] {
+			lappend found [file exists $path] [file exists $path.missing]
+			if {[file isdirectory $path]} {
+				lappend queue $path
+			}
+		}
+	}
+	lsort -unique $found
+} -cleanup {
+	unset -nocomplain found queue dir path
+} -result {0 1}
+
+tcltest::test xvfs-advise-file "Xvfs advise File Test" -body {
+	xvfs::advise $rootDir/main.tcl willneed
+} -result ""
+
+tcltest::test xvfs-advise-dir "Xvfs advise Directory Test" -setup {
+	xvfs::advise $rootDir dontneed
+	xvfs::advise $rootDir sequential
+	set fd [open $rootDir/lib/hello/hello.tcl]
+} -body {
+	read $fd
+} -cleanup {
+	close $fd
+	unset fd
+} -match glob -result "*package provide hello*"
+
+tcltest::test xvfs-advise-bad-advice "Xvfs advise Invalid Advice Test" -body {
+	xvfs::advise $testFile forget
+} -match glob -returnCodes error -result "bad advice \"forget\": must be *"
+
+tcltest::test xvfs-advise-not-xvfs "Xvfs advise Non-Xvfs Path Test" -body {
+	xvfs::advise [info nameofexecutable] willneed
+} -match glob -returnCodes error -result "*is not in an xvfs filesystem"
+
+tcltest::test xvfs-advise-neg "Xvfs advise Negative Test" -body {
+	xvfs::advise $rootDir/does-not-exist willneed
+} -match glob -returnCodes error -result "*no such file or directory"
+
+tcltest::test xvfs-memory "Xvfs memory Test" -setup {
+	set fd [open $testFile]
+	read $fd
+	close $fd
+} -body {
+	set usage [xvfs::memory $testFile]
+	list \
+		[expr {[dict get $usage size] == [file size $testFile]}] \
+		[expr {[dict get $usage resident] == [dict get $usage size]}] \
+		[expr {[dict get $usage pages] >= 1}] \
+		[expr {[dict get $usage metadata size] > 0}]
+} -cleanup {
+	unset -nocomplain fd usage
+} -result {1 1 1 1}
+
+tcltest::test xvfs-memory-files "Xvfs memory Per-File Test" -body {
+	set usage [xvfs::memory -files $rootDir/lib]
+	set files [dict get $usage files]
+	set fileTotal 0
+	foreach file [glob -directory $rootDir/lib/hello *] {
+		incr fileTotal [dict get $files $file size]
+	}
+	list \
+		[lsort [dict keys $files]] \
+		[expr {[dict get $files $rootDir/lib/hello size] == $fileTotal}] \
+		[expr {[dict get $usage size] == $fileTotal}]
+} -cleanup {
+	unset -nocomplain usage files file fileTotal
+} -result [list [lsort [list $rootDir/lib/hello $rootDir/lib/hello/hello.tcl $rootDir/lib/hello/hellomodule-1.0.tm $rootDir/lib/hello/pkgIndex.tcl]] 1 1]
+
+tcltest::test xvfs-memory-neg "Xvfs memory Negative Test" -body {
+	list \
+		[catch {xvfs::memory -bogus $rootDir} err] $err \
+		[catch {xvfs::memory $rootDir/does-not-exist} err] $err
+} -cleanup {
+	unset -nocomplain err
+} -result {1 {bad option "-bogus": must be -files} 1 {no such file or directory}}
+
+tcltest::test xvfs-prefetch "Xvfs prefetch Test" -body {
+	set before [xvfs::prefetch -status]
+	set queued [xvfs::prefetch $rootDir/lib]
+	xvfs::prefetch -wait
+	set after [xvfs::prefetch -status]
+	set usage [xvfs::memory $rootDir/lib]
+	list \
+		$queued \
+		[expr {[dict get $after prefetched] - [dict get $before prefetched]}] \
+		[dict get $after pending] \
+		[expr {[dict get $usage resident] == [dict get $usage size]}] \
+		[expr {![dict exists $usage touched] || [dict get $usage touched] == [dict get $usage size]}]
+} -cleanup {
+	unset -nocomplain before queued after usage
+} -result {3 3 0 1 1}
+
+tcltest::test xvfs-prefetch-neg "Xvfs prefetch Negative Test" -body {
+	list \
+		[xvfs::prefetch -profile $rootDir] \
+		[xvfs::prefetch -cancel] \
+		[catch {xvfs::prefetch -bogus} err] $err \
+		[catch {xvfs::prefetch -wait $rootDir} err] $err \
+		[catch {xvfs::prefetch $rootDir/does-not-exist} err] $err
+} -cleanup {
+	unset -nocomplain err
+} -result {0 0 1 {bad option "-bogus": must be -cancel, -profile, -status, or -wait} 1 {wrong # args: should be "xvfs::prefetch -wait"} 1 {no such file or directory}}
+
+proc extract_verify {layers extracted} {
+	set mismatches [list]
+	set names [list]
+	foreach layer $layers {
+		foreach name [glob -nocomplain -tails -directory $layer *] {
+			if {$name ni $names} {
+				lappend names $name
+			}
+		}
+	}
+
+	foreach name $names {
+		# A file shadows whatever the layers below it have, a
+		# directory merges with the directories below it
+		set sources [list]
+		foreach layer $layers {
+			set file [file join $layer $name]
+			if {[file isdirectory $file]} {
+				if {[llength $sources] != 0 && ![file isdirectory [lindex $sources end]]} {
+					set sources [list]
+				}
+				lappend sources $file
+			} elseif {[file exists $file]} {
+				set sources [list $file]
+			}
+		}
+
+		set file [lindex $sources end]
+		set target [file join $extracted $name]
+		if {[file isdirectory $file]} {
+			lappend mismatches {*}[extract_verify $sources $target]
+			continue
+		}
+
+		if {![file isfile $target]} {
+			lappend mismatches $target
+			continue
+		}
+
+		set fd [open $file rb]
+		set expected [read $fd]
+		close $fd
+
+		set fd [open $target rb]
+		set actual [read $fd]
+		close $fd
+
+		if {$actual ne $expected} {
+			lappend mismatches $target
+		}
+	}
+
+	return $mismatches
+}
+
+tcltest::test xvfs-extract-dir "Xvfs extract Directory Test" -setup {
+	set target [tcltest::makeDirectory xvfs-extract]
+	file delete -force $target
+} -body {
+	xvfs::extract $rootDir $target -jobs 4
+	extract_verify $rootDirLayers $target
+} -cleanup {
+	tcltest::removeDirectory xvfs-extract
+	unset target
+} -result ""
+
+tcltest::test xvfs-extract-merge "Xvfs extract Into Existing Directory Test" -setup {
+	set target [tcltest::makeDirectory xvfs-extract]
+} -body {
+	xvfs::extract $rootDir/lib $target -jobs 1
+	xvfs::extract $rootDir/lib $target
+	extract_verify [list [file join $rootDirNative lib]] $target
+} -cleanup {
+	tcltest::removeDirectory xvfs-extract
+	unset target
+} -result ""
+
+tcltest::test xvfs-extract-file "Xvfs extract File Test" -setup {
+	set target [tcltest::makeDirectory xvfs-extract]
+} -body {
+	xvfs::extract $rootDir/main.tcl [file join $target main.tcl]
+	set fd [open [file join $target main.tcl] rb]
+	set extracted [read $fd]
+	close $fd
+	set fd [open [file join $rootDirNative main.tcl] rb]
+	expr {$extracted eq [read $fd]}
+} -cleanup {
+	close $fd
+	tcltest::removeDirectory xvfs-extract
+	unset target fd extracted
+} -result 1
+
+tcltest::test xvfs-extract-readonly "Xvfs extract Into Xvfs Test" -body {
+	xvfs::extract $rootDir/main.tcl $rootDir/main-copy.tcl
+} -match glob -returnCodes error -result "*read-only file system"
+
+tcltest::test xvfs-extract-neg "Xvfs extract Negative Test" -body {
+	xvfs::extract $rootDir/does-not-exist [file join [tcltest::temporaryDirectory] xvfs-extract]
+} -match glob -returnCodes error -result "*no such file or directory"
+
+tcltest::test xvfs-extract-bad-jobs "Xvfs extract Invalid Jobs Test" -body {
+	xvfs::extract $rootDir/main.tcl [file join [tcltest::temporaryDirectory] xvfs-extract] -jobs 0
+} -returnCodes error -result "-jobs must be at least 1"
+
+proc sendfile_verify {args} {
+	set outFile [file join [tcltest::temporaryDirectory] xvfs-sendfile]
+	set fd [open $outFile w]
+	try {
+		set count [xvfs::sendfile $::testFile $fd {*}$args]
+	} finally {
+		close $fd
+	}
+
+	set fd [open $outFile rb]
+	set rv [read $fd]
+	close $fd
+	file delete $outFile
+
+	set fd [open $::rootDirNative/foo rb]
+	lassign [list {*}$args 0 0] offset length
+	seek $fd $offset
+	if {$length == 0 && [llength $args] < 2} {
+		set verify [read $fd]
+	} else {
+		set verify [read $fd $length]
+	}
+	close $fd
+
+	return [list [expr {$count == [string length $verify]}] [expr {$rv eq $verify}]]
+}
+
+tcltest::test xvfs-sendfile "Xvfs sendfile Test" -body {
+	sendfile_verify
+} -result [list 1 1]
+
+tcltest::test xvfs-sendfile-range "Xvfs sendfile Range Test" -body {
+	list [sendfile_verify 3 5] [sendfile_verify 2] [sendfile_verify 1 0]
+} -result [list [list 1 1] [list 1 1] [list 1 1]]
+
+tcltest::test xvfs-sendfile-buffered "Xvfs sendfile Ordering Test" -setup {
+	set outFile [file join [tcltest::temporaryDirectory] xvfs-sendfile]
+	set fd [open $outFile w]
+	fconfigure $fd -translation binary
+} -body {
+	puts -nonewline $fd "<"
+	xvfs::sendfile $testFile $fd 0 4
+	puts -nonewline $fd ">"
+	close $fd
+	unset fd
+
+	set fd [open $outFile rb]
+	set rv [read $fd]
+	close $fd
+	unset fd
+
+	set fd [open $rootDirNative/foo rb]
+	set verify [read $fd 4]
+	close $fd
+	unset fd
+
+	string equal $rv "<$verify>"
+} -cleanup {
+	if {[info exists fd]} {
+		close $fd
+		unset fd
+	}
+	file delete $outFile
+	unset outFile
+} -result 1
+
+tcltest::test xvfs-sendfile-nonblocking "Xvfs sendfile Non-blocking Socket Test" -setup {
+	set server [socket -server [list apply {{fd args} {
+		set ::xvfsSendfileAccepted $fd
+	}}] -myaddr 127.0.0.1 0]
+	set client [socket 127.0.0.1 [lindex [fconfigure $server -sockname] 2]]
+	vwait ::xvfsSendfileAccepted
+	set accepted $::xvfsSendfileAccepted
+	fconfigure $accepted -translation binary
+	fconfigure $client -blocking 0 -translation crlf
+} -body {
+	# The line end written before is translated, the file (which has
+	# one too) must not be
+	puts $client "<"
+	set sent [xvfs::sendfile $testFile $client]
+	close $client
+	unset client
+	set rv [read $accepted]
+
+	set fd [open $rootDirNative/foo rb]
+	set verify [read $fd]
+	close $fd
+
+	list [expr {$sent == [string length $verify]}] [string equal $rv "<\r\n$verify"]
+} -cleanup {
+	if {[info exists client]} {
+		close $client
+	}
+	close $accepted
+	close $server
+	unset -nocomplain server client accepted ::xvfsSendfileAccepted sent rv fd verify
+} -result [list 1 1]
+
+tcltest::test xvfs-sendfile-bad-offset "Xvfs sendfile Negative Offset Test" -body {
+	xvfs::sendfile $testFile stdout -1
+} -returnCodes error -result "offset and length must not be negative"
+
+tcltest::test xvfs-sendfile-readonly "Xvfs sendfile Read-only Channel Test" -setup {
+	set fd [open $testFile]
+} -body {
+	xvfs::sendfile $testFile $fd
+} -cleanup {
+	close $fd
+	unset fd
+} -returnCodes error -match glob -result "channel \"*\" wasn't opened for writing"
+
+tcltest::test xvfs-sendfile-neg "Xvfs sendfile Negative Test" -body {
+	xvfs::sendfile $rootDir/does-not-exist stdout
+} -match glob -returnCodes error -result "*no such file or directory"
+
+tcltest::test xvfs-sendfile-neg-file "Xvfs sendfile Non-File Test" -body {
+	list \
+		[catch {xvfs::sendfile $rootDir/lib stdout} err] $err \
+		[catch {xvfs::sendfile $testFile stdout [expr {[file size $testFile] + 1}]} err] $err
+} -cleanup {
+	unset -nocomplain err
+} -result {1 {illegal operation on a directory} 1 {bad address in system call argument}}
+
+proc read_native {file} {
+	set fd [open [file join $::rootDirNative $file] rb]
+	set data [read $fd]
+	close $fd
+
+	return $data
+}
+
+tcltest::test xvfs-attributes-digest "Xvfs Digest Attribute Test" -body {
+	set data [read_native main.tcl]
+	string equal [file attributes $rootDir/main.tcl -digest] [format %08x%08x [zlib crc32 $data] [zlib adler32 $data]]
+} -cleanup {
+	unset -nocomplain data
+} -result 1
+
+tcltest::test xvfs-attributes-gzip "Xvfs Gzip Attribute Test" -body {
+	string equal [zlib gunzip [file attributes $rootDir/main.tcl -gzip]] [read_native main.tcl]
+} -result 1
+
+tcltest::test xvfs-attributes-none "Xvfs Missing Attributes Test" -body {
+	list [file attributes $testFile -gzip] [file attributes $rootDir/lib -digest]
+} -result [list "" ""]
+
+tcltest::test xvfs-attributes-list "Xvfs Attribute Names Test" -body {
+	dict keys [file attributes $testFile]
+} -result [list -digest -gzip]
+
+tcltest::test xvfs-attributes-readonly "Xvfs Set Attribute Test" -body {
+	file attributes $testFile -digest 0
+} -returnCodes error -match glob -result "*read-only file system"
+
+tcltest::test xvfs-attributes-neg "Xvfs Attribute Negative Test" -body {
+	file attributes $rootDir/does-not-exist -digest
+} -match glob -returnCodes error -result "*no such file or directory"
+
+tcltest::test xvfs-trace "Xvfs Trace Test" -setup {
+	xvfs::trace dump
+} -body {
+	xvfs::trace on
+	file size $testFile
+	set fd [open $testFile]
+	read $fd
+	close $fd
+	xvfs::trace off
+
+	set ops [list]
+	foreach event [xvfs::trace dump] {
+		if {[dict get $event path] in {"" foo example/foo} && [dict get $event duration] >= 0} {
+			lappend ops [dict get $event op]
+		}
+	}
+
+	list [lrange $ops 0 2] [lindex $ops end]
+} -cleanup {
+	xvfs::trace off
+	unset -nocomplain fd ops event
+} -result [list [list stat open read] read]
+
+tcltest::test xvfs-trace-off "Xvfs Trace Off Test" -setup {
+	xvfs::trace dump
+} -body {
+	file size $testFile
+	xvfs::trace dump
+} -result ""
+
+tcltest::test xvfs-trace-copies "Xvfs Trace Reaches Every Copy of the Core Test" -setup {
+	set script [tcltest::makeFile [string map [list @rootDir@ [list $rootDir] @suffix@ [info sharedlibextension]] {
+		load ./example-standalone@suffix@ Xvfs_example
+		load ./example-flexible@suffix@ Xvfs_example
+		xvfs::trace on
+		file size @rootDir@/foo
+		xvfs::trace off
+		puts [lmap event [xvfs::trace dump] { dict get $event op }]
+	}] trace-copies.tcl]
+} -body {
+	exec [info nameofexecutable] $script
+} -cleanup {
+	tcltest::removeFile trace-copies.tcl
+	unset -nocomplain script
+} -constraints xvfsTwoImages -result stat
+
+tcltest::test xvfs-trace-bad-subcommand "Xvfs Trace Invalid Subcommand Test" -body {
+	xvfs::trace start
+} -returnCodes error -result {bad subcommand "start": must be dump, off, or on}
+
+tcltest::test xvfs-access-trace "Xvfs Access Trace Records First Touches Test" -setup {
+	set script [tcltest::makeFile [string map [list @rootDir2@ [list $rootDir2]] {
+		eval $::env(XVFS_TEST_LOAD_COMMANDS)
+		set fd [open @rootDir2@/sub/data.txt]
+		read $fd
+		close $fd
+		file size @rootDir2@/hello.txt
+	}] access-trace.tcl]
+	set traceFile [tcltest::makeFile "" access-trace.txt]
+	file delete $traceFile
+} -body {
+	set ::env(XVFS_ACCESS_TRACE) $traceFile
+	exec [info nameofexecutable] $script
+	unset ::env(XVFS_ACCESS_TRACE)
+
+	set fd [open $traceFile]
+	set lines [split [string trim [read $fd]] "\n"]
+	close $fd
+
+	lmap line $lines {
+		set fields [split $line "\t"]
+		if {[lindex $fields 1] ne "example2"} {
+			continue
+		}
+		concat [lindex $fields 0] [lrange $fields 3 end]
+	}
+} -cleanup {
+	unset -nocomplain ::env(XVFS_ACCESS_TRACE)
+	tcltest::removeFile access-trace.tcl
+	tcltest::removeFile access-trace.txt
+	unset -nocomplain script traceFile fd lines line fields
+} -constraints xvfsSubprocess -result [list {open sub/data.txt} {read sub/data.txt 0 14} {stat hello.txt}]
+
+foreach {generator command} [list \
+	tcl [list [info nameofexecutable] ./xvfs-create] \
+	c   [list ./xvfs-create-c] \
+] {
+	tcltest::test xvfs-access-trace-layout-$generator "Xvfs $generator Generator Lays Out Traced Files First Test" -setup {
+		set traceFile [tcltest::makeFile "open\texample2\t3\tsub/data.txt" access-trace.txt]
+	} -body {
+		set offsets [list]
+		foreach traceArgs [list {} [list --access-trace $traceFile]] {
+			set image [exec {*}$command --directory example2 --name example2 {*}$traceArgs]
+			set order [list]
+			foreach {- name offset} [regexp -all -inline {\.name = "([^"]+)",[^\}]*?\.fileContents = xvfs_example2_payload \+ ([0-9]+),} $image] {
+				lappend order [list $name $offset]
+			}
+			lappend offsets [lmap entry [lsort -integer -index 1 $order] { lindex $entry 0 }]
+		}
+		set offsets
+	} -cleanup {
+		tcltest::removeFile access-trace.txt
+		unset -nocomplain traceFile offsets traceArgs image order - name offset entry
+	} -constraints [list xvfsCreate[string toupper $generator]] -result [list {hello.txt sub/data.txt} {sub/data.txt hello.txt}]
+}
+unset generator command
+
+tcltest::test xvfs-walk "Xvfs walk Test" -body {
+	lsort [xvfs::walk $rootDir]
+} -result [lsort [lmap file {foo main.tcl layers layers/kept.txt layers/replaced.txt layers/merged layers/merged/lower.txt layers/merged/upper.txt layers/shadowed lib lib/hello lib/hello/hello.tcl lib/hello/hellomodule-1.0.tm lib/hello/pkgIndex.tcl} {
+	string cat $rootDir / $file
+}]]
+
+tcltest::test xvfs-walk-preorder "Xvfs walk Directories Before Contents Test" -body {
+	set found [xvfs::walk $rootDir]
+	expr {[lsearch -exact $found $rootDir/lib] < [lsearch -exact $found $rootDir/lib/hello] && [lsearch -exact $found $rootDir/lib/hello] < [lsearch -exact $found $rootDir/lib/hello/hello.tcl]}
+} -cleanup {
+	unset -nocomplain found
+} -result 1
+
+tcltest::test xvfs-walk-filtered "Xvfs walk Types and Pattern Test" -body {
+	list [llength [xvfs::walk $rootDir -types f]] [xvfs::walk $rootDir -types d -pattern h*] [lsort [xvfs::walk $rootDir/lib -types f -pattern *.tcl]]
+} -result [list 10 [list $rootDir/lib/hello] [list $rootDir/lib/hello/hello.tcl $rootDir/lib/hello/pkgIndex.tcl]]
+
+tcltest::test xvfs-walk-file "Xvfs walk On a File Test" -body {
+	xvfs::walk $testFile
+} -returnCodes error -result "not a directory"
+
+tcltest::test xvfs-walk-bad-type "Xvfs walk Invalid Type Test" -body {
+	xvfs::walk $rootDir -types l
+} -returnCodes error -result {bad type "l": must be d or f}
+
+tcltest::test xvfs-readdir "Xvfs readdir Pages Through a Directory Test" -setup {
+	set cursor [xvfs::readdir open $rootDir/lib/hello]
+} -body {
+	set pages [list]
+	while {[llength [set page [xvfs::readdir next $cursor 2]]] != 0} {
+		lappend pages $page
+	}
+	list [lmap page $pages {llength $page}] [lsort [concat {*}$pages]]
+} -cleanup {
+	xvfs::readdir close $cursor
+	unset -nocomplain cursor pages page
+} -result {{2 1} {hello.tcl hellomodule-1.0.tm pkgIndex.tcl}}
+
+tcltest::test xvfs-readdir-filtered "Xvfs readdir Types, Pattern and Inodes Test" -setup {
+	set cursors [list]
+} -body {
+	file stat $rootDir/lib/hello info
+	lappend cursors [xvfs::readdir open $rootDir/lib -types d -inodes 1]
+	lappend cursors [xvfs::readdir open $rootDir/lib/hello -types f -pattern *.tcl]
+	list [expr {[xvfs::readdir next [lindex $cursors 0]] eq [list $info(ino)]}] [lsort [xvfs::readdir next [lindex $cursors 1]]]
+} -cleanup {
+	foreach cursor $cursors {
+		xvfs::readdir close $cursor
+	}
+	unset -nocomplain cursors cursor info
+} -result {1 {hello.tcl pkgIndex.tcl}}
+
+tcltest::test xvfs-readdir-neg "Xvfs readdir Invalid Arguments Test" -setup {
+	set cursor [xvfs::readdir open $rootDir]
+	xvfs::readdir close $cursor
+} -body {
+	list \
+		[catch {xvfs::readdir open $testFile} err] $err \
+		[catch {xvfs::readdir next $cursor} err] $err \
+		[catch {xvfs::readdir open $rootDir -types l} err] $err
+} -cleanup {
+	unset -nocomplain cursor err
+} -match glob -result {1 {not a directory} 1 {can not find directory cursor named "xvfsdir*"} 1 {bad type "l": must be d or f}}
+
+tcltest::test xvfs-mount "Xvfs mount Replaces the Image Test" -setup {
+	set fd [open $testFile]
+	set library [file join [pwd] example-flexible[info sharedlibextension]]
+} -body {
+	list [xvfs::mount example $library] [read $fd] [xvfs::walk $rootDir/lib -types d]
+} -cleanup {
+	close $fd
+	unset -nocomplain fd library
+} -constraints xvfsMount -result [list ${xvfsRootMountpoint}example "Foo Bar Baz\n" [list $rootDir/lib/hello]]
+
+tcltest::test xvfs-mount-watch "Xvfs mount Watched Library Test" -setup {
+	set library [file join [tcltest::temporaryDirectory] xvfs-mount-watch[info sharedlibextension]]
+	file copy -force [file join [pwd] example-flexible[info sharedlibextension]] $library
+	xvfs::mount -watch 10 example $library
+	set fd [open $testFile]
+} -body {
+	file delete $library
+	file copy [file join [pwd] example-flexible[info sharedlibextension]] $library
+	file mtime $library [expr {[clock seconds] + 60}]
+
+	after 100 [list set ::xvfsMountWatched 1]
+	vwait ::xvfsMountWatched
+
+	list [read $fd] [file size $testFile]
+} -cleanup {
+	close $fd
+	xvfs::mount -watch 0 example $library
+	file delete $library
+	unset -nocomplain fd library ::xvfsMountWatched
+} -constraints xvfsMount -result [list "Foo Bar Baz\n" 12]
+
+tcltest::test xvfs-mount-cache "Xvfs mount Cached Copy Test" -setup {
+	set cache [file join [tcltest::temporaryDirectory] xvfs-mount-cache]
+	set library [file join [pwd] example-flexible[info sharedlibextension]]
+} -body {
+	xvfs::mount -cache $cache example $library
+	set first [glob -directory $cache *]
+	xvfs::mount -cache $cache example $library
+	set second [glob -directory $cache *]
+
+	list [llength $second] [expr {$first eq $second}] [string match "xvfs-example-*" [file tail $first]] [file size $testFile]
+} -cleanup {
+	file delete -force $cache
+	unset -nocomplain cache library first second
+} -constraints xvfsMount -result [list 1 1 1 12]
+
+tcltest::test xvfs-mount-cache-rewritten "Xvfs mount Cached Copy of a Library Rewritten In Place Test" -setup {
+	set cache [file join [tcltest::temporaryDirectory] xvfs-mount-cache]
+	set library [file join [tcltest::temporaryDirectory] xvfs-mount-cache[info sharedlibextension]]
+	file copy -force [file join [pwd] example-flexible[info sharedlibextension]] $library
+} -body {
+	xvfs::mount -cache $cache example $library
+	set fd [open $testFile]
+	set first [read $fd]
+	close $fd
+
+	# Change the contents of "foo" without changing the size or
+	# modification time of the library
+	set mtime [file mtime $library]
+	set fd [open $library r+b]
+	set offset [string first "Foo Bar Baz\n" [read $fd]]
+	seek $fd [expr {$offset + 10}]
+	puts -nonewline $fd "x"
+	close $fd
+	file mtime $library $mtime
+
+	xvfs::mount -cache $cache example $library
+	set fd [open $testFile]
+	set second [read $fd]
+	close $fd
+
+	list $first $second [llength [glob -directory $cache *]]
+} -cleanup {
+	xvfs::mount example [file join [pwd] example-flexible[info sharedlibextension]]
+	file delete -force $cache $library
+	unset -nocomplain cache library fd first second mtime offset
+} -constraints xvfsMount -result [list "Foo Bar Baz\n" "Foo Bar Bax\n" 2]
+
+tcltest::test xvfs-mount-intern "Xvfs mount Drops Interned Paths of Replaced Images Test" -setup {
+	set library [file join [pwd] example-flexible[info sharedlibextension]]
+	set copy [file join [tcltest::temporaryDirectory] xvfs-mount-intern[info sharedlibextension]]
+	file copy -force $library $copy
+	proc refCount {value} {
+		regexp {refcount of ([0-9]+)} [tcl::unsupported::representation $value] -> refCount
+		return $refCount
+	}
+} -body {
+	set held [glob -directory $rootDir/lib *]
+	set before [refCount [lindex $held 0]]
+
+	# Each mount alternates between two libraries, so every one is a
+	# new generation of the image
+	for {set idx 0} {$idx < 10} {incr idx} {
+		xvfs::mount example [lindex [list $copy $library] [expr {$idx % 2}]]
+		set listed [glob -directory $rootDir/lib *]
+	}
+
+	list [expr {$before - [refCount [lindex $held 0]]}] [expr {$listed eq $held}]
+} -cleanup {
+	xvfs::mount example $library
+	file delete $copy
+	rename refCount ""
+	unset -nocomplain library copy held before idx listed
+} -constraints xvfsMount -result [list 1 1]
+
+tcltest::test xvfs-mount-wrong-name "Xvfs mount Wrong Name Test" -body {
+	xvfs::mount nosuchfs [file join [pwd] example-flexible[info sharedlibextension]]
+} -constraints xvfsMount -returnCodes error -match glob -result {cannot find symbol "Xvfs_nosuchfs_Init"*}
+
+tcltest::test xvfs-mount-neg "Xvfs mount Missing Library Test" -body {
+	xvfs::mount example [file join [pwd] nosuchlibrary[info sharedlibextension]]
+} -constraints xvfsMount -returnCodes error -match glob -result {couldn't mount "*": no such file or directory}
+
+tcltest::test xvfs-launcher "Xvfs Launcher Boots Tcl From Its Image Test" -body {
+	set root $::env(XVFS_LAUNCHER_ROOT_MOUNTPOINT)
+	set library [exec $::env(XVFS_LAUNCHER) info library]
+	set script [exec $::env(XVFS_LAUNCHER) info script]
+	list [string match "${root}*" $library] [string match "${root}*/main.tcl" $script] [exec $::env(XVFS_LAUNCHER) file isfile $library/init.tcl]
+} -cleanup {
+	unset -nocomplain root library script
+} -constraints xvfsLauncher -result {1 1 1}
 
 # Output results
 if {$::tcltest::numTests(Failed) != 0} {
@@ -0,0 +1,9 @@
+#! /usr/bin/env tclsh
+
+# Default main script of xvfs-launcher: evaluates its arguments as a
+# script, or reports where Tcl was booted from when there are none
+if {$argc > 0} {
+	puts [uplevel #0 [join $argv]]
+} else {
+	puts "Tcl [info patchlevel] from [info library]"
+}
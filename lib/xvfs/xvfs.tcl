@@ -17,11 +17,19 @@ proc ::xvfs::printHelp {channel {errors ""}} {
 		}
 		puts $channel ""
 	}
-	puts $channel "Usage: xvfs-create \[--help\] \[--static-init {true|false}\] \[--set-mode {flexible|standalone|client}\] \[--output <filename>\] --directory <rootDirectory> --name <fsName>"
+	puts $channel "Usage: xvfs-create \[--help\] \[--static-init {true|false}\] \[--set-mode {flexible|standalone|client}\] \[--output <filename>\] \[--access-trace <traceFile>\] \[--prefetch {true|false}\] \[--payload-align <bytes>\] \[--shards <count>\] \[--gzip <pattern>,...\] --directory <rootDirectory> \[--directory <overlayDirectory>...\] --name <fsName> \[\[--directory <rootDirectory>...\] --name <fsName>...\]"
+	puts $channel ""
+	puts $channel "  Each additional --directory is layered over the ones before it"
+	puts $channel "  Each --name is a filesystem made of the --directory options before it (or after it, if there are none before it),"
+	puts $channel "  all of which are registered by the initialization of the first one"
 	flush $channel
 }
 
 proc ::xvfs::sanitizeCString {string} {
+	if {[regexp {^[A-Za-z0-9./-]*$} $string]} {
+		return $string
+	}
+
 	set output [join [lmap char [split $string ""] {
 		if {![regexp {[A-Za-z0-9./-]} $char]} {
 			binary scan $char H* char
@@ -104,59 +112,468 @@ proc ::xvfs::processFile {fsName inputFile outputFile fileInfoDict} {
 				close $fd
 			}
 			set size [string length $data]
-			set data [string trimleft [binaryToCHex $data "\t\t\t"]]
+
+			# The digest is crc32 followed by adler32, which is
+			# cheap to compute and identifies the contents well
+			# enough for use as an entity tag
+			set digest [format %08x%08x [zlib crc32 $data] [zlib adler32 $data]]
+
+			# Pre-compressed variants are only kept when they
+			# are actually smaller
+			set gzip ""
+			foreach pattern $::xvfs::gzipPatterns {
+				if {[string match $pattern $outputFile]} {
+					set gzip [zlib gzip $data -level 9]
+					if {[string length $gzip] >= $size} {
+						set gzip ""
+					}
+					break
+				}
+			}
 		}
 		"directory" {
 			set type "XVFS_FILE_TYPE_DIR"
-			set children $fileInfo(children)
-			set size [llength $children]
-			
-			if {$size == 0} {
-				set children "NULL"
-			} else {
-				set children [string trimleft [sanitizeCStringList $children "\t\t\t"]]
-				# This initializes it using a C99 compound literal, C99 is required
-				set children "(const char *\[\]) \{$children\}"
-			}
+			set data $fileInfo(children)
+			set size [llength $data]
 		}
 		default {
 			return -code error "Unable to process $inputFile, unknown type: $fileInfo(type)"
 		}
 	}
 
-	::xvfs::_emitLine "\t\{"
-	::xvfs::_emitLine "\t\t.name = \"[sanitizeCString $outputFile]\","
-	::xvfs::_emitLine "\t\t.type = $type,"
-	switch -exact -- $fileInfo(type) {
-		"file" {
-			::xvfs::_emitLine "\t\t.data.fileContents = (const unsigned char *) $data,"
+	# Entries are emitted once the whole tree is known, so
+	# that they may be laid out in any order
+	set entry [dict create type $type size $size data $data]
+	if {$type eq "XVFS_FILE_TYPE_REG"} {
+		dict set entry digest $digest
+		dict set entry gzip $gzip
+	}
+	dict set ::xvfs::_entries $outputFile $entry
+}
+
+proc ::xvfs::readAccessTrace {fsName traceFile} {
+	set fd [open $traceFile]
+	fconfigure $fd -encoding utf-8 -translation lf
+	set trace [read $fd]
+	close $fd
+
+	set paths [list]
+	foreach line [split $trace "\n"] {
+		set line [split $line "\t"]
+		if {[llength $line] < 4} {
+			continue
 		}
-		"directory" {
-			::xvfs::_emitLine "\t\t.data.dirChildren  = $children,"
+
+		if {[lindex $line 1] ne $fsName} {
+			continue
 		}
+
+		set path [lindex $line 3]
+
+		if {[info exists seen($path)]} {
+			continue
+		}
+		set seen($path) 1
+
+		lappend paths $path
 	}
-	::xvfs::_emitLine "\t\t.size = $size"
-	::xvfs::_emitLine "\t\},"
+
+	return $paths
 }
 
-proc ::xvfs::processDirectory {fsName directory {subDirectory ""}} {
-	set subDirectories [list]
-	set outputFiles [list]
-	set workingDirectory [file join $directory $subDirectory]
-	set outputDirectory $subDirectory
+proc ::xvfs::_numberEntry {outputFile} {
+	set ::xvfs::_numbered($outputFile) 1
+	lappend ::xvfs::_inodes $outputFile
+
+	set entry [dict get $::xvfs::_entries $outputFile]
+	if {[dict get $entry type] eq "XVFS_FILE_TYPE_DIR"} {
+		foreach child [dict get $entry data] {
+			if {$outputFile ne ""} {
+				set child "$outputFile/$child"
+			}
+
+			if {[info exists ::xvfs::_numbered($child)] || ![dict exists $::xvfs::_entries $child]} {
+				continue
+			}
+
+			_numberEntry $child
+		}
+	}
+
+	dict set ::xvfs::_entries $outputFile subtreeEnd [llength $::xvfs::_inodes]
+}
+
+# Number the entries in preorder, each directory immediately followed
+# by everything beneath it, so that any subtree is a contiguous range
+# of inodes.  Anything not reachable from the root is numbered after
+# it, in the order it was found
+proc ::xvfs::numberEntries {outputFiles} {
+	set ::xvfs::_inodes [list]
+	array set ::xvfs::_numbered {}
+
+	foreach outputFile [list "" {*}$outputFiles] {
+		if {[info exists ::xvfs::_numbered($outputFile)] || ![dict exists $::xvfs::_entries $outputFile]} {
+			continue
+		}
+
+		_numberEntry $outputFile
+	}
+
+	set inodes $::xvfs::_inodes
+	unset ::xvfs::_inodes ::xvfs::_numbered
+
+	return $inodes
+}
+
+proc ::xvfs::orderEntries {outputFiles} {
+	if {![info exists ::xvfs::accessOrder]} {
+		return $outputFiles
+	}
+
+	# Put everything the access trace touched first, in the order
+	# it was first touched, followed by everything else in the
+	# order it was found
+	set orderedFiles [list]
+	foreach outputFile $::xvfs::accessOrder {
+		if {![dict exists $::xvfs::_entries $outputFile]} {
+			continue
+		}
+
+		set seen($outputFile) 1
+		lappend orderedFiles $outputFile
+	}
+
+	foreach outputFile $outputFiles {
+		if {[info exists seen($outputFile)]} {
+			continue
+		}
+
+		lappend orderedFiles $outputFile
+	}
+
+	return $orderedFiles
+}
+
+# Preamble for payload shards, which are compiled on their own
+# without the rest of the image
+set ::xvfs::shardPreamble [join {
+	"#ifndef XVFS_ALIGNED"
+	"#  if defined(__GNUC__) || defined(__clang__)"
+	"#    define XVFS_ALIGNED(n) __attribute__((aligned(n)))"
+	"#  elif defined(_MSC_VER)"
+	"#    define XVFS_ALIGNED(n) __declspec(align(n))"
+	"#  else"
+	"#    define XVFS_ALIGNED(n)"
+	"#  endif"
+	"#endif"
+	""
+	"#ifndef XVFS_INTERNAL"
+	"#  if defined(__GNUC__) || defined(__clang__)"
+	"#    define XVFS_INTERNAL __attribute__((visibility(\"hidden\")))"
+	"#  else"
+	"#    define XVFS_INTERNAL"
+	"#  endif"
+	"#endif"
+	""
+} "\n"]
+
+proc ::xvfs::shardFileName {fsName shard} {
+	# Each filesystem in a library has its own shards
+	if {[llength $::xvfs::filesystems] > 1} {
+		return "[file rootname $::xvfs::outputFile]-${fsName}-shard${shard}.c"
+	}
+
+	return "[file rootname $::xvfs::outputFile]-shard${shard}.c"
+}
+
+proc ::xvfs::generatePayload {fsName outputFiles shard offsetsVar} {
+	upvar $offsetsVar offsets
+
+	set align $::xvfs::payloadAlign
+	if {$::xvfs::shards > 1} {
+		set declaration "XVFS_INTERNAL const unsigned char"
+		set arrayName "xvfs_${fsName}_payload_${shard}"
+	} else {
+		set declaration "static const unsigned char"
+		set arrayName "xvfs_${fsName}_payload"
+	}
+	if {$align > 1} {
+		append declaration " XVFS_ALIGNED($align)"
+	}
+
+	set offset 0
+	set payload [list]
+	foreach outputFile $outputFiles {
+		set entry [dict get $::xvfs::_entries $outputFile]
+		if {[dict get $entry type] ne "XVFS_FILE_TYPE_REG"} {
+			continue
+		}
+
+		if {[dict get $entry shard] != $shard} {
+			continue
+		}
+
+		# Files with identical contents, such as those that are
+		# unchanged between layers, share the first copy of them
+		set contentsKey "[dict get $entry size]/[dict get $entry digest]"
+		if {[info exists shared($contentsKey)]} {
+			set sharedEntry [dict get $::xvfs::_entries $shared($contentsKey)]
+			if {[dict get $sharedEntry data] eq [dict get $entry data]} {
+				set offsets($outputFile) $offsets($shared($contentsKey))
+				continue
+			}
+		} else {
+			set shared($contentsKey) $outputFile
+		}
 
-	if {$subDirectory eq ""} {
-		set isTopLevel true
+		# Payloads at least as large as the alignment start on
+		# an alignment boundary so that they may be advised
+		# without affecting their neighbors
+		if {$align > 1 && [dict get $entry size] >= $align && $offset % $align != 0} {
+			set padding [expr {$align - ($offset % $align)}]
+			lappend payload [binaryToCHex [string repeat "\x00" $padding] "\t" 64]
+			incr offset $padding
+		}
+
+		set offsets($outputFile) "$arrayName + $offset"
+		incr offset [dict get $entry size]
+
+		if {[dict get $entry size] == 0} {
+			continue
+		}
+
+		lappend payload [binaryToCHex [dict get $entry data] "\t"]
+	}
+	if {[llength $payload] == 0} {
+		lappend payload "\t\"\""
+	}
+
+	return "$declaration ${arrayName}\[\] = \n[join $payload "\n"];\n"
+}
+
+proc ::xvfs::emitEntries {fsName outputFiles payloadFiles} {
+	# All file contents are placed in a single array so that
+	# their placement in the image follows the payload order.  When
+	# sharding, that array is cut into pieces of roughly equal
+	# size which are each written to their own file, so that they
+	# may be compiled in parallel
+	set shards $::xvfs::shards
+	set totalSize 0
+	foreach outputFile $payloadFiles {
+		set entry [dict get $::xvfs::_entries $outputFile]
+		if {[dict get $entry type] eq "XVFS_FILE_TYPE_REG"} {
+			incr totalSize [dict get $entry size]
+		}
+	}
+
+	set start 0
+	foreach outputFile $payloadFiles {
+		set entry [dict get $::xvfs::_entries $outputFile]
+		if {[dict get $entry type] ne "XVFS_FILE_TYPE_REG"} {
+			continue
+		}
+
+		if {$totalSize == 0} {
+			set shard 0
+		} else {
+			set shard [expr {($start * $shards) / $totalSize}]
+		}
+		dict set ::xvfs::_entries $outputFile shard $shard
+		incr start [dict get $entry size]
+	}
+
+	if {$shards == 1} {
+		::xvfs::_emitLine [generatePayload $fsName $payloadFiles 0 offsets]
 	} else {
-		set isTopLevel false
+		for {set shard 0} {$shard < $shards} {incr shard} {
+			set fd [open [shardFileName $fsName $shard] w]
+			fconfigure $fd -translation lf
+			puts $fd "/*"
+			puts $fd " * Payload shard $shard of $shards for the \"[sanitizeCString $fsName]\" image"
+			puts $fd " */"
+			puts $fd $::xvfs::shardPreamble
+			puts -nonewline $fd [generatePayload $fsName $payloadFiles $shard offsets]
+			close $fd
+
+			::xvfs::_emitLine "extern XVFS_INTERNAL const unsigned char xvfs_${fsName}_payload_${shard}\[\];"
+		}
+		::xvfs::_emitLine ""
 	}
 
-	if {$isTopLevel} {
-		::xvfs::_emitLine "static const struct xvfs_file_data xvfs_${fsName}_data\[\] = \{"
+	::xvfs::_emitLine "static const struct xvfs_file_data xvfs_${fsName}_data\[\] = \{"
+	foreach outputFile $outputFiles {
+		set entry [dict get $::xvfs::_entries $outputFile]
+
+		::xvfs::_emitLine "\t\{"
+		::xvfs::_emitLine "\t\t.name = \"[sanitizeCString $outputFile]\","
+		::xvfs::_emitLine "\t\t.type = [dict get $entry type],"
+		switch -exact -- [dict get $entry type] {
+			"XVFS_FILE_TYPE_REG" {
+				::xvfs::_emitLine "\t\t.data.fileContents = $offsets($outputFile),"
+				::xvfs::_emitLine "\t\t.digest = \"[dict get $entry digest]\","
+				set gzip [dict get $entry gzip]
+				if {$gzip ne ""} {
+					::xvfs::_emitLine "\t\t.gzipContents = (const unsigned char *)"
+					::xvfs::_emitLine "[binaryToCHex $gzip "\t\t\t"],"
+					::xvfs::_emitLine "\t\t.gzipSize = [string length $gzip],"
+				}
+			}
+			"XVFS_FILE_TYPE_DIR" {
+				set children [dict get $entry data]
+				if {[llength $children] == 0} {
+					set children "NULL"
+				} else {
+					set children [string trimleft [sanitizeCStringList $children "\t\t\t"]]
+					# This initializes it using a C99 compound literal, C99 is required
+					set children "(const char *\[\]) \{$children\}"
+				}
+				::xvfs::_emitLine "\t\t.data.dirChildren  = $children,"
+				::xvfs::_emitLine "\t\t.subtreeEnd = [dict get $entry subtreeEnd],"
+			}
+		}
+		::xvfs::_emitLine "\t\t.size = [dict get $entry size]"
+		::xvfs::_emitLine "\t\},"
 	}
+	::xvfs::_emitLine "\};"
+}
+
+# Find the packages a pkgIndex.tcl script declares by evaluating it in
+# a safe interpreter with only harmless commands available.  Anything
+# that cannot be determined this way is reported as "*", meaning the
+# script must be sourced at runtime for any package
+proc ::xvfs::_pkgIndexPackage {subcommand args} {
+	switch -exact -- $subcommand {
+		"ifneeded" {
+			if {[llength $args] != 3} {
+				error "unsupported"
+			}
+			lappend ::xvfs::_pkgIndexFound [lindex $args 0]
+			return
+		}
+		"vsatisfies" - "vcompare" {
+			return [package $subcommand {*}$args]
+		}
+		"provide" {
+			if {[llength $args] != 1} {
+				error "unsupported"
+			}
+			return [package provide {*}$args]
+		}
+	}
+
+	error "unsupported"
+}
+
+proc ::xvfs::_pkgIndexFile {subcommand args} {
+	if {$subcommand ni {join dirname tail rootname extension split}} {
+		error "unsupported"
+	}
+
+	return [file $subcommand {*}$args]
+}
+
+proc ::xvfs::pkgIndexPackages {script} {
+	set ::xvfs::_pkgIndexFound [list]
+
+	set interp [interp create -safe]
+	interp alias $interp package {} ::xvfs::_pkgIndexPackage
+	interp alias $interp file {} ::xvfs::_pkgIndexFile
+	interp eval $interp [list set dir /xvfs-package-index]
+	set code [catch {
+		interp eval $interp $script
+	}]
+	interp delete $interp
+
+	set packages [lsort -unique $::xvfs::_pkgIndexFound]
+	unset ::xvfs::_pkgIndexFound
+
+	if {$code ni {0 2} || [llength $packages] == 0} {
+		return "*"
+	}
+
+	foreach package $packages {
+		if {[regexp {[[:space:]]} $package]} {
+			return "*"
+		}
+	}
+
+	return [join $packages " "]
+}
+
+# The body of getPrefetch: with --prefetch, the inodes of every file in
+# the access trace in the order they were first touched
+proc ::xvfs::generatePrefetchList {outputFiles} {
+	set inodes [list]
+	if {$::xvfs::prefetch && [info exists ::xvfs::accessOrder]} {
+		set inode 0
+		foreach outputFile $outputFiles {
+			dict set inodeOf $outputFile $inode
+			incr inode
+		}
+
+		foreach outputFile $::xvfs::accessOrder {
+			if {![dict exists $inodeOf $outputFile]} {
+				continue
+			}
+
+			if {[dict get $::xvfs::_entries $outputFile type] ne "XVFS_FILE_TYPE_REG"} {
+				continue
+			}
+
+			lappend inodes [dict get $inodeOf $outputFile]
+		}
+	}
+
+	if {[llength $inodes] == 0} {
+		return "\t*count = 0;\n\treturn(NULL);"
+	}
+
+	set lines [list]
+	lappend lines "\tstatic const long prefetch\[\] = \{"
+	lappend lines "\t\t[join $inodes ",\n\t\t"]"
+	lappend lines "\t\};"
+	lappend lines ""
+	lappend lines "\t*count = [llength $inodes];"
+	lappend lines "\treturn(prefetch);"
+
+	return [join $lines "\n"]
+}
+
+# Records of "kind<TAB>packages<TAB>path<NEWLINE>" for every package
+# index script and Tcl module in the image
+proc ::xvfs::generatePackageIndex {outputFiles} {
+	set records [list]
+	foreach outputFile $outputFiles {
+		set entry [dict get $::xvfs::_entries $outputFile]
+		if {[dict get $entry type] ne "XVFS_FILE_TYPE_REG"} {
+			continue
+		}
+
+		if {[regexp "\[\t\n\]" $outputFile]} {
+			continue
+		}
+
+		if {[file tail $outputFile] eq "pkgIndex.tcl"} {
+			set packages [pkgIndexPackages [encoding convertfrom utf-8 [dict get $entry data]]]
+			lappend records "\t\t\"[sanitizeCString "pkgIndex\t${packages}\t${outputFile}\n"]\""
+		} elseif {[file extension $outputFile] eq ".tm"} {
+			lappend records "\t\t\"[sanitizeCString "tm\t\t${outputFile}\n"]\""
+		}
+	}
+
+	if {[llength $records] == 0} {
+		lappend records "\t\t\"\""
+	}
+
+	return [join $records "\n"]
+}
+
+proc ::xvfs::_processDirectory {fsName directory subDirectory} {
+	set subDirectories [list]
+	set workingDirectory [file join $directory $subDirectory]
+	set outputDirectory $subDirectory
 
 	# XXX:TODO: Include hidden files ?
-	set children [list]
 	foreach file [glob -nocomplain -tails -directory $workingDirectory *] {
 		if {$file in {. ..}} {
 			continue
@@ -187,57 +604,118 @@ proc ::xvfs::processDirectory {fsName directory {subDirectory ""}} {
 		}
 
 		processFile $fsName $inputFile $outputFile [array get fileInfo]
-		lappend outputFiles $outputFile
+		dict set ::xvfs::_outputFiles $outputFile file
 	}
 
 	foreach subDirectory $subDirectories {
-		lappend outputFiles {*}[processDirectory $fsName $directory $subDirectory]
+		_processDirectory $fsName $directory $subDirectory
 	}
-	
+
 	set inputFile $directory
 	set outputFile $outputDirectory
 	if {[info command ::xvfs::callback::setOutputFileName] ne ""} {
 		set outputFile [::xvfs::callback::setOutputFileName $directory $directory $inputFile $outputDirectory $outputFile]
 	}
 
+	# Directories are processed once the whole tree is known,
+	# since that is when their children are
 	if {$outputFile ne "/"} {
 		unset -nocomplain fileInfo
 		file stat $inputFile fileInfo
-		set children [list]
-		set outputFileLen [string length $outputFile]
-		foreach child $outputFiles {
-			if {[string range /$child 0 $outputFileLen] eq "/${outputFile}"} {
-				set child [string trimleft [string range $child $outputFileLen end] /]
-				if {![string match "*/*" $child]} {
-					lappend children $child
-				}
+		dict set ::xvfs::_directories $outputFile [list $inputFile [array get fileInfo]]
+		dict set ::xvfs::_outputFiles $outputFile directory
+	}
+}
+
+proc ::xvfs::processDirectory {fsName directories} {
+	set ::xvfs::_entries [dict create]
+	set ::xvfs::_directories [dict create]
+	set ::xvfs::_outputFiles [dict create]
+
+	# Layers are processed from the bottom up, each one shadowing
+	# whatever the layers below it have at the same paths, so that
+	# they are merged into a single image with a single index
+	foreach directory $directories {
+		_processDirectory $fsName $directory ""
+	}
+
+	# Anything below a path which an upper layer has as a file is
+	# shadowed by that file
+	set kinds $::xvfs::_outputFiles
+	set outputFiles [list]
+	set shadowed [dict create]
+	dict for {outputFile kind} $kinds {
+		set parent $outputFile
+		while {[set slash [string last "/" $parent]] >= 0} {
+			set parent [string range $parent 0 $slash-1]
+			if {[dict exists $kinds $parent] && [dict get $kinds $parent] eq "file"} {
+				set kind "shadowed"
+				break
 			}
 		}
-		set fileInfo(children) $children
 
-		processFile $fsName $inputFile $outputFile [array get fileInfo]
+		if {$kind eq "shadowed"} {
+			dict set shadowed $outputFile 1
+			dict unset ::xvfs::_entries $outputFile
+			continue
+		}
+
 		lappend outputFiles $outputFile
 	}
 
-	if {$isTopLevel} {
-		if {[info command ::xvfs::callback::addOutputFiles] ne ""} {
-			lappend outputFiles {*}[::xvfs::callback::addOutputFiles $fsName]
+	set directories [list]
+	dict for {outputFile directoryInfo} $::xvfs::_directories {
+		if {[dict get $kinds $outputFile] eq "directory" && ![dict exists $shadowed $outputFile]} {
+			lappend directories $outputFile {*}$directoryInfo
+		}
+	}
+	unset ::xvfs::_outputFiles ::xvfs::_directories
+
+	# Build every directory's list of children in a single pass
+	set children [dict create]
+	foreach outputFile $outputFiles {
+		if {$outputFile eq ""} {
+			continue
+		}
+
+		set slash [string last "/" $outputFile]
+		dict lappend children [string range $outputFile 0 $slash-1] [string range $outputFile $slash+1 end]
+	}
+
+	foreach {outputFile inputFile fileInfoDict} $directories {
+		if {[dict exists $children $outputFile]} {
+			dict set fileInfoDict children [dict get $children $outputFile]
+		} else {
+			dict set fileInfoDict children [list]
 		}
 
-		::xvfs::_emitLine "\};"
+		processFile $fsName $inputFile $outputFile $fileInfoDict
 	}
 
+	if {[info command ::xvfs::callback::addOutputFiles] ne ""} {
+		lappend outputFiles {*}[::xvfs::callback::addOutputFiles $fsName]
+	}
+
+	# Inodes are numbered in preorder, while the payload follows
+	# the access trace when one is given
+	set outputFiles [numberEntries $outputFiles]
+
+	emitEntries $fsName $outputFiles [orderEntries $outputFiles]
+
 	return $outputFiles
 }
 
 proc ::xvfs::main {argv} {
 	# Main entry point
+	set ::xvfs::_emitLine [list]
+
 	## 1. Parse arguments
 	if {[llength $argv] % 2 != 0} {
 		lappend argv ""
 	}
 
 	set staticInit false
+	set prefetch false
 	foreach {arg val} $argv {
 		switch -exact -- $arg {
 			"--help" {
@@ -245,7 +723,7 @@ proc ::xvfs::main {argv} {
 				exit 0
 			}
 			"--directory" {
-				set rootDirectory $val
+				lappend rootDirectories $val
 			}
 			"--name" {
 				set fsName $val
@@ -253,7 +731,27 @@ proc ::xvfs::main {argv} {
 			"--static-init" {
 				set staticInit $val
 			}
-			"--output" - "--header" - "--set-mode" {
+			"--access-trace" {
+				set accessTraceFile $val
+			}
+			"--prefetch" {
+				set prefetch $val
+			}
+			"--payload-align" {
+				set payloadAlign $val
+			}
+			"--shards" {
+				set shards $val
+			}
+			"--gzip" {
+				set gzipPatterns [split $val ,]
+			}
+			"--output" {
+				# Opened as part of some other process, but
+				# shards are named after it
+				set outputFile $val
+			}
+			"--header" - "--set-mode" {
 				# Ignored, handled as part of some other process
 			}
 			default {
@@ -265,12 +763,29 @@ proc ::xvfs::main {argv} {
 
 	## 2. Validate arguments
 	set errors [list]
-	if {![info exists rootDirectory]} {
+	if {![info exists rootDirectories]} {
 		lappend errors "--directory must be specified"
 	}
 	if {![info exists fsName]} {
 		lappend errors "--name must be specified"
 	}
+	if {![info exists payloadAlign]} {
+		set payloadAlign 0
+	}
+	if {![string is entier -strict $payloadAlign] || $payloadAlign < 0 || ($payloadAlign & ($payloadAlign - 1)) != 0} {
+		lappend errors "--payload-align must be a power of two"
+	}
+	if {![string is boolean -strict $prefetch]} {
+		lappend errors "--prefetch must be a boolean"
+	}
+	if {![info exists shards]} {
+		set shards 1
+	}
+	if {![string is entier -strict $shards] || $shards < 1} {
+		lappend errors "--shards must be a positive integer"
+	} elseif {$shards > 1 && ![info exists outputFile]} {
+		lappend errors "--shards requires --output"
+	}
 
 	if {[llength $errors] != 0} {
 		printHelp stderr $errors
@@ -282,21 +797,152 @@ proc ::xvfs::main {argv} {
 		::xvfs::_emitLine "#define XVFS_${fsName}_INIT_STATIC 1"
 	}
 
+	set ::xvfs::payloadAlign $payloadAlign
+	set ::xvfs::prefetch [expr {$prefetch ? 1 : 0}]
+	set ::xvfs::shards $shards
+	set ::xvfs::gzipPatterns [list]
+	if {[info exists gzipPatterns]} {
+		set ::xvfs::gzipPatterns $gzipPatterns
+	}
+	if {[info exists outputFile]} {
+		set ::xvfs::outputFile $outputFile
+	}
+
+	unset -nocomplain ::xvfs::accessOrder
+	if {[info exists accessTraceFile]} {
+		set ::xvfs::accessOrder [readAccessTrace $fsName $accessTraceFile]
+	}
+
 	## 4. Start processing directory and producing initial output
-	set ::xvfs::outputFiles [processDirectory $fsName $rootDirectory]
+	set ::xvfs::outputFiles [processDirectory $fsName $rootDirectories]
 
 	set ::xvfs::fsName $fsName
-	set ::xvfs::rootDirectory $rootDirectory
+	set ::xvfs::rootDirectory [lindex $rootDirectories 0]
+
+	set ::xvfs::packageIndex [generatePackageIndex $::xvfs::outputFiles]
+	set ::xvfs::prefetchList [generatePrefetchList $::xvfs::outputFiles]
 
 	# Return the output
 	return [join $::xvfs::_emitLine "\n"]
 }
 
+# Split the arguments for a library into the arguments for each
+# filesystem in it.  Each --name takes the --directory options just
+# before it, or if there are none, the ones just after it, and every
+# other option applies to all of them.
+proc ::xvfs::splitFilesystems {argv} {
+	if {[llength $argv] % 2 != 0} {
+		lappend argv ""
+	}
+
+	set common [list]
+	set names [list]
+	set directories [list]
+	set pending [list]
+	set pendingName ""
+	foreach {arg val} $argv {
+		switch -exact -- $arg {
+			"--directory" {
+				lappend pending $val
+			}
+			"--name" {
+				if {$pendingName ne "" || [llength $pending] == 0} {
+					if {$pendingName ne ""} {
+						lappend names $pendingName
+						lappend directories $pending
+						set pending [list]
+					}
+
+					set pendingName $val
+					continue
+				}
+
+				lappend names $val
+				lappend directories $pending
+				set pending [list]
+			}
+			default {
+				lappend common $arg $val
+			}
+		}
+	}
+	if {$pendingName ne ""} {
+		lappend names $pendingName
+		lappend directories $pending
+	} elseif {[llength $pending] != 0} {
+		# Leftover directories are reported as missing a name
+		lappend names ""
+		lappend directories $pending
+	}
+
+	if {[llength $names] != [llength [lsort -unique $names]]} {
+		printHelp stderr [list "each --name may only be used once"]
+		exit 1
+	}
+
+	set retval [list]
+	foreach name $names nameDirectories $directories {
+		set fsArgv $common
+		foreach directory $nameDirectories {
+			lappend fsArgv --directory $directory
+		}
+		if {$name ne ""} {
+			lappend fsArgv --name $name
+		}
+		lappend retval $fsArgv
+	}
+
+	if {[llength $retval] == 0} {
+		lappend retval $common
+	}
+
+	return $retval
+}
+
+# Run the template for each filesystem in a library.  The first one is
+# emitted last, so that its initialization can register all of the
+# others, and the core is only included with the first one emitted.
+proc ::xvfs::runFilesystems {argv script} {
+	set ::xvfs::filesystems [splitFilesystems $argv]
+
+	set primary [lindex $::xvfs::filesystems 0]
+	set others [lrange $::xvfs::filesystems 1 end]
+
+	set initRegistrations [list]
+	foreach fsArgv $others {
+		if {![dict exists $fsArgv --name]} {
+			continue
+		}
+		set fsName [dict get $fsArgv --name]
+
+		lappend initRegistrations ""
+		lappend initRegistrations "\tregister_ret = Xvfs_Register(interp, &xvfs_${fsName}_fsInfo);"
+		lappend initRegistrations "\tif (register_ret != TCL_OK) \{"
+		lappend initRegistrations "\t\treturn(register_ret);"
+		lappend initRegistrations "\t\}"
+	}
+	if {[llength $initRegistrations] != 0} {
+		lappend initRegistrations ""
+	}
+
+	foreach fsArgv [list {*}$others $primary] registrations [list {*}[lrepeat [llength $others] ""] [join $initRegistrations "\n"]] {
+		set ::xvfs::argv $fsArgv
+		set ::xvfs::initRegistrations $registrations
+
+		uplevel #0 $script
+
+		if {[info exists ::xvfs::xvfsCoreH]} {
+			set ::xvfs::xvfsCoreH ""
+		}
+	}
+}
+
 proc ::xvfs::run {args} {
 	uplevel #0 { package require minirivet }
 
-	set ::xvfs::argv $args
-	::minirivet::parse [file join $::xvfs::_xvfsDir xvfs.c.rvt]
+	::xvfs::runFilesystems $args {
+		::minirivet::parse [file join $::xvfs::_xvfsDir xvfs.c.rvt]
+	}
 }
 
 proc ::xvfs::setOutputChannel {channel} {
@@ -607,4 +1253,65 @@ proc ::xvfs::generateHashTable {outCVarName cVarName cVarLength invalidValue nam
 	return [dict create header [join $outputHeader "\n"] body [join $outputBody "\n"]]
 }
 
+proc ::xvfs::generateFilter {outCVarName cVarName cVarLength invalidValue nameList args} {
+	# Manage config
+	## Default config
+	array set config {
+		prefix      ""
+		bitsPerName 12
+	}
+
+	## User config
+	foreach {configKey configVal} $args {
+		if {![info exists config($configKey)]} {
+			error "Invalid option: $configKey"
+		}
+	}
+	array set config $args
+
+	# A blocked Bloom filter: each name sets 3 bits within a single
+	# 64-bit block, so a lookup touches exactly one word
+	set blockCount [expr {max(1, ([llength $nameList] * $config(bitsPerName) + 63) / 64)}]
+	for {set block 0} {$block < $blockCount} {incr block} {
+		set blocks($block) 0
+	}
+
+	foreach name $nameList {
+		set hash [zlib crc32 $name 0]
+		set block [expr {$hash % $blockCount}]
+		set hash2 [expr {($hash * 0x9E3779B1) & 0xffffffff}]
+		foreach shift {26 20 14} {
+			set bit [expr {($hash2 >> $shift) & 63}]
+			set blocks($block) [expr {$blocks($block) | (1 << $bit)}]
+		}
+	}
+
+	lappend outputHeader "${config(prefix)}unsigned int ${outCVarName}_hash, ${outCVarName}_hash2;"
+	lappend outputHeader "${config(prefix)}Tcl_WideUInt ${outCVarName}_mask;"
+	lappend outputHeader "${config(prefix)}static const Tcl_WideUInt ${outCVarName}_blocks\[${blockCount}\] = \{"
+	set row [list]
+	for {set block 0} {$block < $blockCount} {incr block} {
+		lappend row [format "0x%016llxULL" $blocks($block)]
+		if {[llength $row] == 4} {
+			lappend outputHeader "${config(prefix)}\t[join $row {, }],"
+			set row [list]
+		}
+	}
+	if {[llength $row] != 0} {
+		lappend outputHeader "${config(prefix)}\t[join $row {, }],"
+	}
+	lappend outputHeader "${config(prefix)}\};"
+
+	lappend outputBody "${config(prefix)}${outCVarName}_hash = Tcl_ZlibCRC32(0, (unsigned char *) ${cVarName}, ${cVarLength});"
+	lappend outputBody "${config(prefix)}${outCVarName}_hash2 = (${outCVarName}_hash * 0x9E3779B1U) & 0xffffffffU;"
+	lappend outputBody "${config(prefix)}${outCVarName}_mask = (((Tcl_WideUInt) 1) << (${outCVarName}_hash2 >> 26)) |"
+	lappend outputBody "${config(prefix)}\t(((Tcl_WideUInt) 1) << ((${outCVarName}_hash2 >> 20) & 63)) |"
+	lappend outputBody "${config(prefix)}\t(((Tcl_WideUInt) 1) << ((${outCVarName}_hash2 >> 14) & 63));"
+	lappend outputBody "${config(prefix)}if ((${outCVarName}_blocks\[${outCVarName}_hash % ${blockCount}\] & ${outCVarName}_mask) != ${outCVarName}_mask) \{"
+	lappend outputBody "${config(prefix)}\treturn(${invalidValue});"
+	lappend outputBody "${config(prefix)}\}"
+
+	return [dict create header [join $outputHeader "\n"] body [join $outputBody "\n"]]
+}
+
 package provide xvfs 1
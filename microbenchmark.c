@@ -0,0 +1,500 @@
+/*
+ * Microbenchmark harness: calls the generated lookup functions and the
+ * Tcl filesystem entry points of an image directly, without going
+ * through the interpreter, and reports the cost per operation.
+ *
+ * Hardware counters are read using perf_event_open() where available;
+ * otherwise (or when a counter cannot be opened) only wall-clock time
+ * is reported.
+ *
+ * By default the "example" image is benchmarked, another image may be
+ * used by defining XVFS_MICROBENCHMARK_IMAGE (the generated C file) and
+ * XVFS_MICROBENCHMARK_NAME (its fsName).
+ */
+#include <tcl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+
+#if defined(__linux__)
+#  include <linux/perf_event.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#  define XVFS_MICROBENCHMARK_HAVE_PERF 1
+#endif
+
+#undef  XVFS_DEBUG
+#define XVFS_MODE_STANDALONE
+#ifndef XVFS_MICROBENCHMARK_IMAGE
+#  define XVFS_MICROBENCHMARK_IMAGE "example.c"
+#  define XVFS_MICROBENCHMARK_NAME example
+#endif
+#include XVFS_MICROBENCHMARK_IMAGE
+
+#define XVFS_MB_PASTE_(prefix, name, suffix) prefix ## name ## suffix
+#define XVFS_MB_PASTE(prefix, name, suffix) XVFS_MB_PASTE_(prefix, name, suffix)
+#define XVFS_MB_FS(suffix) XVFS_MB_PASTE(xvfs_, XVFS_MICROBENCHMARK_NAME, suffix)
+#define XVFS_MB_INIT XVFS_MB_PASTE(Xvfs_, XVFS_MICROBENCHMARK_NAME, _Init)
+
+struct xvfs_mb_item {
+	const char *path;
+	Tcl_Obj *pathObj;
+};
+
+struct xvfs_mb_workload {
+	struct xvfs_mb_item *items;
+	unsigned long count;
+	unsigned long len;
+};
+
+/*
+ * Hardware performance counters
+ */
+#define XVFS_MB_COUNTER_COUNT 4
+static const char * const xvfs_mb_counter_names[XVFS_MB_COUNTER_COUNT] = {
+	"cycles", "instr", "br-miss", "cache-miss"
+};
+
+struct xvfs_mb_counters {
+	int fd[XVFS_MB_COUNTER_COUNT];
+	long long value[XVFS_MB_COUNTER_COUNT];
+};
+
+static void xvfs_mb_counters_open(struct xvfs_mb_counters *counters) {
+#ifdef XVFS_MICROBENCHMARK_HAVE_PERF
+	static const unsigned long long configs[XVFS_MB_COUNTER_COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_MISSES
+	};
+	struct perf_event_attr attr;
+	int idx;
+
+	for (idx = 0; idx < XVFS_MB_COUNTER_COUNT; idx++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = configs[idx];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		counters->fd[idx] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (counters->fd[idx] < 0 && idx == 0) {
+			fprintf(stderr, "warning: perf_event_open failed (%s), reporting time only\n", strerror(errno));
+		}
+	}
+#else
+	int idx;
+
+	for (idx = 0; idx < XVFS_MB_COUNTER_COUNT; idx++) {
+		counters->fd[idx] = -1;
+	}
+#endif
+
+	return;
+}
+
+static void xvfs_mb_counters_start(struct xvfs_mb_counters *counters) {
+#ifdef XVFS_MICROBENCHMARK_HAVE_PERF
+	int idx;
+
+	for (idx = 0; idx < XVFS_MB_COUNTER_COUNT; idx++) {
+		if (counters->fd[idx] < 0) {
+			continue;
+		}
+
+		ioctl(counters->fd[idx], PERF_EVENT_IOC_RESET, 0);
+		ioctl(counters->fd[idx], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+
+	return;
+}
+
+static void xvfs_mb_counters_stop(struct xvfs_mb_counters *counters) {
+	int idx;
+
+	for (idx = 0; idx < XVFS_MB_COUNTER_COUNT; idx++) {
+		counters->value[idx] = -1;
+
+#ifdef XVFS_MICROBENCHMARK_HAVE_PERF
+		if (counters->fd[idx] < 0) {
+			continue;
+		}
+
+		ioctl(counters->fd[idx], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counters->fd[idx], &counters->value[idx], sizeof(counters->value[idx])) != sizeof(counters->value[idx])) {
+			counters->value[idx] = -1;
+		}
+#endif
+	}
+
+	return;
+}
+
+static double xvfs_mb_now(void) {
+#if defined(CLOCK_MONOTONIC)
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return((now.tv_sec * 1000000000.0) + now.tv_nsec);
+#else
+	return((clock() * 1000000000.0) / CLOCKS_PER_SEC);
+#endif
+}
+
+/*
+ * Operations under test, each performs one operation on one item
+ */
+static Tcl_Interp *xvfs_mb_interp;
+
+static long xvfs_mb_op_nameToIndex(struct xvfs_mb_item *item) {
+	return(XVFS_MB_FS(_nameToIndex)(item->path));
+}
+
+static long xvfs_mb_op_getStat(struct xvfs_mb_item *item) {
+	Tcl_StatBuf statBuf;
+
+	return(XVFS_MB_FS(_getStat)(item->path, XVFS_INODE_NULL, &statBuf));
+}
+
+static long xvfs_mb_op_getData(struct xvfs_mb_item *item) {
+	Tcl_WideInt length;
+
+	length = 0;
+	XVFS_MB_FS(_getData)(item->path, XVFS_INODE_NULL, 0, &length);
+
+	return(length);
+}
+
+static long xvfs_mb_op_getChildren(struct xvfs_mb_item *item) {
+	Tcl_WideInt count;
+
+	XVFS_MB_FS(_getChildren)(item->path, XVFS_INODE_NULL, &count);
+
+	return(count);
+}
+
+static long xvfs_mb_op_pathInFilesystem(struct xvfs_mb_item *item) {
+	ClientData clientData;
+
+	return(xvfs_tclfs_standalone_pathInFilesystem(item->pathObj, &clientData));
+}
+
+static long xvfs_mb_op_stat(struct xvfs_mb_item *item) {
+	Tcl_StatBuf statBuf;
+
+	return(xvfs_tclfs_standalone_stat(item->pathObj, &statBuf));
+}
+
+static long xvfs_mb_op_access(struct xvfs_mb_item *item) {
+	return(xvfs_tclfs_standalone_access(item->pathObj, R_OK));
+}
+
+static long xvfs_mb_op_open(struct xvfs_mb_item *item) {
+	Tcl_Channel channel;
+
+	channel = xvfs_tclfs_standalone_openFileChannel(NULL, item->pathObj, O_RDONLY, 0);
+	if (!channel) {
+		return(0);
+	}
+
+	Tcl_Close(NULL, channel);
+
+	return(1);
+}
+
+static long xvfs_mb_op_matchInDir(struct xvfs_mb_item *item) {
+	Tcl_Obj *resultObj;
+	int tclRet;
+
+	resultObj = Tcl_NewObj();
+	Tcl_IncrRefCount(resultObj);
+	tclRet = xvfs_tclfs_standalone_matchInDir(xvfs_mb_interp, resultObj, item->pathObj, "*", NULL);
+	Tcl_DecrRefCount(resultObj);
+
+	return(tclRet);
+}
+
+static const struct {
+	const char *name;
+	long (*proc)(struct xvfs_mb_item *item);
+} xvfs_mb_ops[] = {
+	{"nameToIndex",      xvfs_mb_op_nameToIndex},
+	{"getStat",          xvfs_mb_op_getStat},
+	{"getData",          xvfs_mb_op_getData},
+	{"getChildren",      xvfs_mb_op_getChildren},
+	{"pathInFilesystem", xvfs_mb_op_pathInFilesystem},
+	{"stat",             xvfs_mb_op_stat},
+	{"access",           xvfs_mb_op_access},
+	{"open+close",       xvfs_mb_op_open},
+	{"matchInDir",       xvfs_mb_op_matchInDir},
+	{NULL, NULL}
+};
+
+/*
+ * Workloads
+ */
+/*
+ * The library may hold several filesystems, find the mountpoint of
+ * the one being benchmarked
+ */
+static Tcl_Obj *xvfs_mb_mountpoint(void) {
+	int idx;
+
+	for (idx = 0; idx < xvfs_tclfs_standalone_infoCount; idx++) {
+		if (xvfs_tclfs_standalone_infos[idx]->fsInfo == &XVFS_MB_FS(_fsInfo)) {
+			return(xvfs_tclfs_standalone_infos[idx]->mountpoint);
+		}
+	}
+
+	fprintf(stderr, "error: %s is not registered\n", XVFS_MB_FS(_fsInfo).name);
+	exit(1);
+}
+
+static void xvfs_mb_workload_add(struct xvfs_mb_workload *workload, const char *path) {
+	struct xvfs_mb_item *item;
+	Tcl_Obj *pathObj;
+
+	if (workload->count == workload->len) {
+		workload->len = (workload->len * 2) + 16;
+		workload->items = realloc(workload->items, sizeof(*workload->items) * workload->len);
+	}
+
+	pathObj = Tcl_DuplicateObj(xvfs_mb_mountpoint());
+	if (path[0] != '\0') {
+		Tcl_AppendToObj(pathObj, "/", 1);
+		Tcl_AppendToObj(pathObj, path, -1);
+	}
+	Tcl_IncrRefCount(pathObj);
+
+	item = &workload->items[workload->count];
+	item->path = strdup(path);
+	item->pathObj = pathObj;
+
+	workload->count++;
+
+	return;
+}
+
+static int xvfs_mb_workload_synthetic(struct xvfs_mb_workload *workload, int missPercent, unsigned long seed) {
+	struct xvfs_mb_item swapItem;
+	unsigned long count, idx, swapIdx;
+	char *missPath;
+
+	count = sizeof(XVFS_MB_FS(_data)) / sizeof(XVFS_MB_FS(_data)[0]);
+	for (idx = 0; idx < count; idx++) {
+		xvfs_mb_workload_add(workload, XVFS_MB_FS(_data)[idx].name);
+
+		if (missPercent > 0 && (long) (idx % 100) < missPercent) {
+			missPath = malloc(strlen(XVFS_MB_FS(_data)[idx].name) + 9);
+			sprintf(missPath, "%s.missing", XVFS_MB_FS(_data)[idx].name);
+			xvfs_mb_workload_add(workload, missPath);
+			free(missPath);
+		}
+	}
+
+	/*
+	 * Shuffle so that access order does not follow layout order
+	 */
+	for (idx = workload->count; idx > 1; idx--) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		swapIdx = seed % idx;
+
+		swapItem = workload->items[idx - 1];
+		workload->items[idx - 1] = workload->items[swapIdx];
+		workload->items[swapIdx] = swapItem;
+	}
+
+	return(1);
+}
+
+/*
+ * Recorded workloads use the XVFS_ACCESS_TRACE format: op, fsName,
+ * inode, path, each separated by a tab
+ */
+static int xvfs_mb_workload_trace(struct xvfs_mb_workload *workload, const char *traceFile) {
+	FILE *fp;
+	char line[16384];
+	char *fields[4], *field;
+	int fieldIdx;
+
+	fp = fopen(traceFile, "r");
+	if (!fp) {
+		fprintf(stderr, "error: Unable to open %s: %s\n", traceFile, strerror(errno));
+
+		return(0);
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		field = line;
+		for (fieldIdx = 0; fieldIdx < 4 && field; fieldIdx++) {
+			fields[fieldIdx] = field;
+			field = strchr(field, '\t');
+			if (field) {
+				*field = '\0';
+				field++;
+			}
+		}
+
+		if (fieldIdx != 4) {
+			continue;
+		}
+
+		if (strcmp(fields[1], XVFS_MB_FS(_fsInfo).name) != 0) {
+			continue;
+		}
+
+		xvfs_mb_workload_add(workload, fields[3]);
+	}
+
+	fclose(fp);
+
+	return(1);
+}
+
+static void xvfs_mb_run(struct xvfs_mb_workload *workload, unsigned long iterations, struct xvfs_mb_counters *counters) {
+	volatile long sink;
+	double start, elapsed;
+	unsigned long idx, itemIdx;
+	int opIdx, counterIdx;
+
+	printf("%-18s %10s", "Operation", "ns/op");
+	for (counterIdx = 0; counterIdx < XVFS_MB_COUNTER_COUNT; counterIdx++) {
+		printf(" %12s", xvfs_mb_counter_names[counterIdx]);
+	}
+	printf("\n");
+
+	sink = 0;
+	for (opIdx = 0; xvfs_mb_ops[opIdx].name; opIdx++) {
+		/*
+		 * Warm up over the whole workload once
+		 */
+		for (itemIdx = 0; itemIdx < workload->count; itemIdx++) {
+			sink += xvfs_mb_ops[opIdx].proc(&workload->items[itemIdx]);
+		}
+
+		itemIdx = 0;
+		start = xvfs_mb_now();
+		xvfs_mb_counters_start(counters);
+		for (idx = 0; idx < iterations; idx++) {
+			sink += xvfs_mb_ops[opIdx].proc(&workload->items[itemIdx]);
+
+			itemIdx++;
+			if (itemIdx == workload->count) {
+				itemIdx = 0;
+			}
+		}
+		xvfs_mb_counters_stop(counters);
+		elapsed = xvfs_mb_now() - start;
+
+		printf("%-18s %10.1f", xvfs_mb_ops[opIdx].name, elapsed / iterations);
+		for (counterIdx = 0; counterIdx < XVFS_MB_COUNTER_COUNT; counterIdx++) {
+			if (counters->value[counterIdx] < 0) {
+				printf(" %12s", "n/a");
+			} else {
+				printf(" %12.1f", (double) counters->value[counterIdx] / iterations);
+			}
+		}
+		printf("\n");
+	}
+
+	(void) sink;
+
+	return;
+}
+
+int main(int argc, char **argv) {
+	struct xvfs_mb_workload workload = {0};
+	struct xvfs_mb_counters counters;
+	const char *traceFile;
+	unsigned long iterations, seed;
+	int missPercent;
+	int tclRet;
+	int idx;
+
+	traceFile = NULL;
+	iterations = 1000000;
+	seed = 1;
+	missPercent = 10;
+
+	for (idx = 1; idx < argc; idx++) {
+		if (idx + 1 >= argc) {
+			fprintf(stderr, "Usage: microbenchmark [--trace <traceFile>] [--iterations <count>] [--misses <percent>] [--seed <seed>]\n");
+
+			return(1);
+		}
+
+		if (strcmp(argv[idx], "--trace") == 0) {
+			traceFile = argv[idx + 1];
+		} else if (strcmp(argv[idx], "--iterations") == 0) {
+			iterations = strtoul(argv[idx + 1], NULL, 10);
+		} else if (strcmp(argv[idx], "--misses") == 0) {
+			missPercent = atoi(argv[idx + 1]);
+		} else if (strcmp(argv[idx], "--seed") == 0) {
+			seed = strtoul(argv[idx + 1], NULL, 10);
+		} else {
+			fprintf(stderr, "Invalid argument %s\n", argv[idx]);
+
+			return(1);
+		}
+
+		idx++;
+	}
+
+	if (iterations == 0 || seed == 0) {
+		fprintf(stderr, "error: --iterations and --seed must be positive\n");
+
+		return(1);
+	}
+
+	Tcl_FindExecutable(argv[0]);
+
+	xvfs_mb_interp = Tcl_CreateInterp();
+	if (!xvfs_mb_interp) {
+		fprintf(stderr, "Tcl_CreateInterp failed\n");
+
+		return(1);
+	}
+
+	tclRet = XVFS_MB_INIT(xvfs_mb_interp);
+	if (tclRet != TCL_OK) {
+		fprintf(stderr, "Xvfs Init failed: %s\n", Tcl_GetStringResult(xvfs_mb_interp));
+
+		return(1);
+	}
+
+	if (traceFile) {
+		if (!xvfs_mb_workload_trace(&workload, traceFile)) {
+			return(1);
+		}
+	} else {
+		xvfs_mb_workload_synthetic(&workload, missPercent, seed);
+	}
+
+	if (workload.count == 0) {
+		fprintf(stderr, "error: The workload is empty\n");
+
+		return(1);
+	}
+
+	printf("Image: %s, workload: %lu paths (%s), %lu iterations per operation\n",
+		XVFS_MB_FS(_fsInfo).name, workload.count, traceFile ? traceFile : "synthetic", iterations
+	);
+
+	xvfs_mb_counters_open(&counters);
+	xvfs_mb_run(&workload, iterations, &counters);
+
+	return(0);
+}
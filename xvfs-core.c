@@ -2,6 +2,9 @@
 #ifndef XVFS_CORE_C_1B4B28D60EBAA11D5FF85642FA7CA22C29E8E817
 #define XVFS_CORE_C_1B4B28D60EBAA11D5FF85642FA7CA22C29E8E817 1
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -9,7 +12,11 @@
 
 #ifdef XVFS_DEBUG
 #include <stdio.h> /* Needed for XVFS_DEBUG_PRINTF */
+#if defined(__GNUC__) || defined(__clang__)
+static __thread int xvfs_debug_depth = 0;
+#else
 static int xvfs_debug_depth = 0;
+#endif
 #define XVFS_DEBUG_PRINTF(fmt, ...) fprintf(stderr, "[XVFS:DEBUG:%-30s:%4i] %s" fmt "\n", __func__, __LINE__, "                                                                                " + (80 - (xvfs_debug_depth * 4)), __VA_ARGS__)
 #define XVFS_DEBUG_PUTS(str) XVFS_DEBUG_PRINTF("%s", str);
 #define XVFS_DEBUG_ENTER { xvfs_debug_depth++; XVFS_DEBUG_PUTS("Entered"); }
@@ -21,15 +28,45 @@ static int xvfs_debug_depth = 0;
 #define XVFS_DEBUG_LEAVE /**/
 #endif /* XVFS_DEBUG */
 
-#if defined(XVFS_MODE_FLEXIBLE) || defined(XVFS_MODE_SERVER)
-#define XVFS_INTERNAL_SERVER_MAGIC "\xD4\xF3\x05\x96\x25\xCF\xAF\xFE"
+/*
+ * Memory advice is only available where there is an madvise()
+ */
+#if !defined(_WIN32)
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  define XVFS_HAVE_MADVISE 1
+#  define XVFS_HAVE_MINCORE 1
+#endif
+
+/*
+ * Which pages this process has touched is only known where the page
+ * tables may be inspected through /proc/self/pagemap
+ */
+#if defined(__linux__)
+#  define XVFS_HAVE_PAGEMAP 1
+#endif
+
+#if defined(XVFS_MODE_FLEXIBLE) || defined(XVFS_MODE_SERVER) || defined(XVFS_MODE_STANDALONE)
+#define XVFS_INTERNAL_SERVER_MAGIC "\xD4\xF3\x05\x96\x25\xCF\xAF\xFF"
 #define XVFS_INTERNAL_SERVER_MAGIC_LEN 8
 
+/*
+ * Every Tcl_Filesystem registered by xvfs carries one of these as
+ * its ClientData so that any copy of the core can find the
+ * filesystem responsible for a path.  The registerProc is only
+ * set for the dispatcher (server).  The trace procs reach the
+ * runtime tracing of the copy of the core which registered it.
+ */
+struct xvfs_trace_event;
 struct xvfs_tclfs_server_info {
 	char magic[XVFS_INTERNAL_SERVER_MAGIC_LEN];
 	int (*registerProc)(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo);
+	struct Xvfs_FSInfo *(*pathToFSInfoProc)(Tcl_Obj *path, Tcl_Obj **relativePath, ClientData *reference);
+	void (*releaseProc)(ClientData reference);
+	void (*traceEnableProc)(int enabled);
+	void (*traceCollectProc)(struct xvfs_trace_event **events, unsigned long *eventCount);
 };
-#endif /* XVFS_MODE_FLEXIBLE || XVFS_MODE_SERVER */
+#endif /* XVFS_MODE_FLEXIBLE || XVFS_MODE_SERVER || XVFS_MODE_STANDALONE */
 
 #if defined(XVFS_MODE_SERVER) || defined(XVFS_MODE_STANDALONE) || defined(XVFS_MODE_FLEXIBLE)
 #ifndef XVFS_ROOT_MOUNTPOINT
@@ -47,11 +84,598 @@ struct xvfs_tclfs_server_info {
 struct xvfs_tclfs_instance_info {
 	struct Xvfs_FSInfo *fsInfo;
 	Tcl_Obj            *mountpoint;
+	Tcl_Filesystem     *fs;
+	unsigned long      generation;
+	int                refCount;
+	Tcl_LoadHandle     loadHandle;
+};
+
+/*
+ * Instances are reference counted: the filesystem holds a reference
+ * for as long as an instance is mounted, and each operation in
+ * progress and each open channel holds another.  An instance that
+ * has been replaced is freed, and the library it was loaded from
+ * unloaded, once the last of these is released.
+ */
+TCL_DECLARE_MUTEX(xvfs_tclfs_instanceMutex)
+
+static void xvfs_tclfs_instanceRetain(struct xvfs_tclfs_instance_info *instanceInfo) {
+	Tcl_MutexLock(&xvfs_tclfs_instanceMutex);
+	instanceInfo->refCount++;
+	Tcl_MutexUnlock(&xvfs_tclfs_instanceMutex);
+
+	return;
+}
+
+static void xvfs_tclfs_instanceRelease(struct xvfs_tclfs_instance_info *instanceInfo) {
+	int refCount;
+
+	Tcl_MutexLock(&xvfs_tclfs_instanceMutex);
+	instanceInfo->refCount--;
+	refCount = instanceInfo->refCount;
+	Tcl_MutexUnlock(&xvfs_tclfs_instanceMutex);
+
+	if (refCount != 0) {
+		return;
+	}
+
+	Tcl_DecrRefCount(instanceInfo->mountpoint);
+
+	if (instanceInfo->loadHandle) {
+		Tcl_FSUnloadFile(NULL, instanceInfo->loadHandle);
+	}
+
+	Tcl_Free((char *) instanceInfo);
+
+	return;
+}
+
+/*
+ * Access trace recording
+ *
+ * When the environment variable XVFS_ACCESS_TRACE names a file at
+ * registration time, every stat, open, and read is appended to that
+ * file as a tab-separated line:
+ *     <op> <fsName> <inode> <path> [<offset> <length>]
+ * The generators accept this file (--access-trace) to lay out the
+ * image in the order it was touched.
+ */
+static FILE *xvfs_accessTrace = NULL;
+
+static void xvfs_accessTraceOpen(void) {
+	static int initialized = 0;
+	const char *traceFile;
+
+	if (initialized) {
+		return;
+	}
+	initialized = 1;
+
+	traceFile = getenv("XVFS_ACCESS_TRACE");
+	if (!traceFile || traceFile[0] == '\0') {
+		return;
+	}
+
+	xvfs_accessTrace = fopen(traceFile, "a");
+	if (!xvfs_accessTrace) {
+		return;
+	}
+
+	/*
+	 * Multiple images may append to the same file, keep each
+	 * event on a line of its own
+	 */
+	setvbuf(xvfs_accessTrace, NULL, _IOLBF, 0);
+
+	return;
+}
+
+static void xvfs_accessTraceRecord(const char *op, struct xvfs_tclfs_instance_info *instanceInfo, long inode, const char *path, Tcl_WideInt offset, Tcl_WideInt length) {
+	if (!xvfs_accessTrace) {
+		return;
+	}
+
+	if (!path) {
+		path = "";
+	}
+
+	if (offset < 0) {
+		fprintf(xvfs_accessTrace, "%s\t%s\t%li\t%s\n", op, instanceInfo->fsInfo->name, inode, path);
+	} else {
+		fprintf(xvfs_accessTrace, "%s\t%s\t%li\t%s\t%lli\t%lli\n", op, instanceInfo->fsInfo->name, inode, path, (long long) offset, (long long) length);
+	}
+
+	return;
+}
+
+/*
+ * Runtime tracing
+ *
+ * Filesystem operations may be traced while the process runs, which
+ * is enabled and drained with "xvfs::trace".  Each thread records
+ * events into a ring of its own without locking, so while tracing is
+ * off an operation costs only a test of a flag.  A ring is claimed
+ * the first time a thread records an event and is handed on to a
+ * later thread once its owner exits, so events not yet drained are
+ * kept and memory stays bounded by the number of concurrent threads.
+ *
+ * Where <sys/sdt.h> is available each operation also fires the USDT
+ * probes xvfs:op__start(op, fsName, path) and xvfs:op__done(op,
+ * fsName, relativePath, inode, result), which are no-ops unless a
+ * tracer is attached.
+ */
+#if defined(__has_include)
+#  if __has_include(<sys/sdt.h>)
+#    include <sys/sdt.h>
+#    define XVFS_HAVE_SDT 1
+#  endif
+#endif
+
+#if !defined(_WIN32)
+#  include <time.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define XVFS_TRACE_LOAD(var) __atomic_load_n(&(var), __ATOMIC_ACQUIRE)
+#  define XVFS_TRACE_STORE(var, value) __atomic_store_n(&(var), (value), __ATOMIC_RELEASE)
+#  define XVFS_TRACE_FENCE_LOADS() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#  define XVFS_TRACE_FENCE_STORES() __atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+#  define XVFS_TRACE_LOAD(var) (var)
+#  define XVFS_TRACE_STORE(var, value) ((var) = (value))
+#  define XVFS_TRACE_FENCE_LOADS() /**/
+#  define XVFS_TRACE_FENCE_STORES() /**/
+#endif
+
+#define XVFS_TRACE_RING_SIZE 2048
+#define XVFS_TRACE_PATH_LEN  80
+
+struct xvfs_trace_event {
+	Tcl_WideInt  time;
+	Tcl_WideInt  duration;
+	Tcl_WideInt  result;
+	const char   *op;
+	const char   *fsName;
+	Tcl_ThreadId thread;
+	long         inode;
+	char         path[XVFS_TRACE_PATH_LEN];
+};
+
+/*
+ * The head is only written by the thread owning the ring, the tail
+ * and the rest of the bookkeeping is guarded by xvfs_traceMutex
+ */
+struct xvfs_trace_ring {
+	struct xvfs_trace_ring  *next;
+	int                     inUse;
+	unsigned long           head;
+	unsigned long           tail;
+	struct xvfs_trace_event events[XVFS_TRACE_RING_SIZE];
+};
+
+static int xvfs_traceEnabled = 0;
+static struct xvfs_trace_ring *xvfs_traceRings = NULL;
+static Tcl_ThreadDataKey xvfs_traceRingKey;
+TCL_DECLARE_MUTEX(xvfs_traceMutex)
+
+#ifdef XVFS_HAVE_SDT
+#  define XVFS_TRACE_PROBE_START(op, instanceInfo, path) DTRACE_PROBE3(xvfs, op__start, op, (instanceInfo)->fsInfo->name, path)
+#  define XVFS_TRACE_PROBE_DONE(op, instanceInfo, path, inode, result) DTRACE_PROBE5(xvfs, op__done, op, (instanceInfo)->fsInfo->name, path, inode, result)
+#else
+#  define XVFS_TRACE_PROBE_START(op, instanceInfo, path) /**/
+#  define XVFS_TRACE_PROBE_DONE(op, instanceInfo, path, inode, result) /**/
+#endif
+
+/*
+ * Operations begin with XVFS_TRACE_START and end with XVFS_TRACE_DONE
+ * at each return, a start time of 0 means tracing was off when the
+ * operation began and nothing is recorded
+ */
+#define XVFS_TRACE_START(start, op, instanceInfo, path) { \
+	XVFS_TRACE_PROBE_START(op, instanceInfo, path); \
+	start = xvfs_traceEnabled ? xvfs_traceNow() : 0; \
+}
+#define XVFS_TRACE_DONE(start, op, instanceInfo, path, inode, result) { \
+	XVFS_TRACE_PROBE_DONE(op, instanceInfo, path, inode, result); \
+	if (start != 0) { \
+		xvfs_traceRecord(start, op, instanceInfo, path, inode, result); \
+	} \
+}
+
+static Tcl_WideInt xvfs_traceNow(void) {
+#if !defined(_WIN32)
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return(((Tcl_WideInt) now.tv_sec) * 1000000000 + now.tv_nsec);
+#else
+	Tcl_Time now;
+
+	Tcl_GetTime(&now);
+
+	return((((Tcl_WideInt) now.sec) * 1000000 + now.usec) * 1000);
+#endif
+}
+
+static void xvfs_traceThreadExit(ClientData clientData) {
+	struct xvfs_trace_ring *ring;
+
+	ring = (struct xvfs_trace_ring *) clientData;
+
+	Tcl_MutexLock(&xvfs_traceMutex);
+	ring->inUse = 0;
+	Tcl_MutexUnlock(&xvfs_traceMutex);
+
+	return;
+}
+
+static struct xvfs_trace_ring *xvfs_traceRing(void) {
+	struct xvfs_trace_ring **ringPtr, *ring;
+
+	ringPtr = (struct xvfs_trace_ring **) Tcl_GetThreadData(&xvfs_traceRingKey, sizeof(*ringPtr));
+	if (*ringPtr) {
+		return(*ringPtr);
+	}
+
+	Tcl_MutexLock(&xvfs_traceMutex);
+	for (ring = xvfs_traceRings; ring; ring = ring->next) {
+		if (!ring->inUse) {
+			break;
+		}
+	}
+
+	if (!ring) {
+		ring = (struct xvfs_trace_ring *) Tcl_Alloc(sizeof(*ring));
+		memset(ring, 0, sizeof(*ring));
+		ring->next = xvfs_traceRings;
+		xvfs_traceRings = ring;
+	}
+	ring->inUse = 1;
+	Tcl_MutexUnlock(&xvfs_traceMutex);
+
+	Tcl_CreateThreadExitHandler(xvfs_traceThreadExit, ring);
+
+	*ringPtr = ring;
+
+	return(ring);
+}
+
+static void xvfs_traceRecord(Tcl_WideInt start, const char *op, struct xvfs_tclfs_instance_info *instanceInfo, const char *path, long inode, Tcl_WideInt result) {
+	struct xvfs_trace_ring *ring;
+	struct xvfs_trace_event *event;
+	unsigned long head;
+	size_t pathLen;
+
+	ring = xvfs_traceRing();
+	head = ring->head;
+
+	/*
+	 * The previous head must be visible before the slot it
+	 * reuses starts being overwritten
+	 */
+	XVFS_TRACE_FENCE_STORES();
+
+	event = &ring->events[head % XVFS_TRACE_RING_SIZE];
+	event->time     = start;
+	event->duration = xvfs_traceNow() - start;
+	event->result   = result;
+	event->op       = op;
+	event->fsName   = instanceInfo->fsInfo->name;
+	event->thread   = Tcl_GetCurrentThread();
+	event->inode    = inode;
+
+	/*
+	 * Long paths keep their end, which is the more telling part
+	 */
+	if (!path) {
+		path = "";
+	}
+	pathLen = strlen(path);
+	if (pathLen >= XVFS_TRACE_PATH_LEN) {
+		path += pathLen - (XVFS_TRACE_PATH_LEN - 1);
+		pathLen = XVFS_TRACE_PATH_LEN - 1;
+	}
+	memcpy(event->path, path, pathLen + 1);
+
+	XVFS_TRACE_STORE(ring->head, head + 1);
+
+	return;
+}
+
+static int xvfs_traceCompareEvents(const void *a_p, const void *b_p) {
+	const struct xvfs_trace_event *a = a_p, *b = b_p;
+
+	if (a->time < b->time) {
+		return(-1);
+	}
+
+	if (a->time > b->time) {
+		return(1);
+	}
+
+	return(0);
+}
+
+static void xvfs_traceEnable(int enabled) {
+	xvfs_traceEnabled = enabled;
+
+	return;
+}
+
+/*
+ * Remove all recorded events from every ring of this copy of the
+ * core, appending them to those already in *eventsPtr
+ */
+static void xvfs_traceCollect(struct xvfs_trace_event **eventsPtr, unsigned long *eventCountPtr) {
+	struct xvfs_trace_ring *ring;
+	struct xvfs_trace_event *events;
+	unsigned long eventCount, head, start, idx, firstValid;
+
+	events = *eventsPtr;
+	eventCount = *eventCountPtr;
+
+	Tcl_MutexLock(&xvfs_traceMutex);
+	for (ring = xvfs_traceRings; ring; ring = ring->next) {
+		head = XVFS_TRACE_LOAD(ring->head);
+		start = ring->tail;
+		if (head - start > XVFS_TRACE_RING_SIZE) {
+			start = head - XVFS_TRACE_RING_SIZE;
+		}
+
+		if (head == start) {
+			continue;
+		}
+
+		events = (struct xvfs_trace_event *) Tcl_Realloc((char *) events, sizeof(*events) * (eventCount + (head - start)));
+		for (idx = start; idx < head; idx++) {
+			events[eventCount + (idx - start)] = ring->events[idx % XVFS_TRACE_RING_SIZE];
+		}
+
+		/*
+		 * The owner may have reused the slots of the oldest events
+		 * while they were being copied, those are dropped
+		 */
+		XVFS_TRACE_FENCE_LOADS();
+		firstValid = XVFS_TRACE_LOAD(ring->head);
+		if (firstValid >= XVFS_TRACE_RING_SIZE) {
+			firstValid = firstValid + 1 - XVFS_TRACE_RING_SIZE;
+		} else {
+			firstValid = 0;
+		}
+
+		if (firstValid > start) {
+			if (firstValid > head) {
+				firstValid = head;
+			}
+
+			memmove(&events[eventCount], &events[eventCount + (firstValid - start)], sizeof(*events) * (head - firstValid));
+			start = firstValid;
+		}
+
+		eventCount += head - start;
+		ring->tail = head;
+	}
+	Tcl_MutexUnlock(&xvfs_traceMutex);
+
+	*eventsPtr = events;
+	*eventCountPtr = eventCount;
+
+	return;
+}
+
+/*
+ * Each copy of the core has runtime tracing of its own, such as
+ * every standalone image besides the server, while "xvfs::trace"
+ * belongs to whichever copy created it first.  So that it reaches
+ * all of them, the copies serving filesystems in an interpreter are
+ * listed in it by the server_info of the Tcl_Filesystem they
+ * registered, which stays registered for as long as the process
+ * runs.
+ */
+#define XVFS_TRACE_COPIES_ASSOC "xvfs::traceCopies"
+struct xvfs_trace_copies {
+	int enabled;
+	int count;
+	struct xvfs_tclfs_server_info **copies;
 };
 
+static void xvfs_traceCopiesDeleteAssoc(ClientData clientData, Tcl_Interp *interp) {
+	struct xvfs_trace_copies *copies;
+
+	copies = (struct xvfs_trace_copies *) clientData;
+
+	if (copies->copies) {
+		Tcl_Free((char *) copies->copies);
+	}
+	Tcl_Free((char *) copies);
+
+	return;
+}
+
+static struct xvfs_trace_copies *xvfs_traceCopies(Tcl_Interp *interp) {
+	struct xvfs_trace_copies *copies;
+
+	copies = (struct xvfs_trace_copies *) Tcl_GetAssocData(interp, XVFS_TRACE_COPIES_ASSOC, NULL);
+	if (!copies) {
+		copies = (struct xvfs_trace_copies *) Tcl_Alloc(sizeof(*copies));
+		copies->enabled = 0;
+		copies->count = 0;
+		copies->copies = NULL;
+		Tcl_SetAssocData(interp, XVFS_TRACE_COPIES_ASSOC, xvfs_traceCopiesDeleteAssoc, (ClientData) copies);
+	}
+
+	return(copies);
+}
+
+/*
+ * A copy added while tracing is on in the interpreter starts
+ * tracing too
+ */
+static void xvfs_traceAddCopy(Tcl_Interp *interp, struct xvfs_tclfs_server_info *copy) {
+	struct xvfs_trace_copies *copies;
+	int idx;
+
+	if (!interp || !copy->traceEnableProc || !copy->traceCollectProc) {
+		return;
+	}
+
+	copies = xvfs_traceCopies(interp);
+	for (idx = 0; idx < copies->count; idx++) {
+		if (copies->copies[idx] == copy) {
+			return;
+		}
+	}
+
+	copies->copies = (struct xvfs_tclfs_server_info **) Tcl_Realloc((char *) copies->copies, sizeof(*copies->copies) * (copies->count + 1));
+	copies->copies[copies->count] = copy;
+	copies->count++;
+
+	if (copies->enabled) {
+		copy->traceEnableProc(1);
+	}
+
+	return;
+}
+
+static void xvfs_traceEnableCopies(Tcl_Interp *interp, int enabled) {
+	struct xvfs_trace_copies *copies;
+	int idx;
+
+	copies = xvfs_traceCopies(interp);
+	copies->enabled = enabled;
+
+	/*
+	 * The copy this command belongs to need not serve a filesystem
+	 * itself
+	 */
+	xvfs_traceEnable(enabled);
+	for (idx = 0; idx < copies->count; idx++) {
+		copies->copies[idx]->traceEnableProc(enabled);
+	}
+
+	return;
+}
+
+/*
+ * Remove all recorded events from every copy of the core in the
+ * interpreter, returning them as a list of dictionaries ordered by
+ * the time they started
+ */
+static Tcl_Obj *xvfs_traceDrain(Tcl_Interp *interp) {
+	struct xvfs_trace_copies *copies;
+	struct xvfs_trace_event *events, *event;
+	unsigned long eventCount, idx;
+	Tcl_Obj *result, *eventObj;
+	char thread[64];
+	int copyIdx;
+
+	events = NULL;
+	eventCount = 0;
+
+	copies = xvfs_traceCopies(interp);
+	xvfs_traceCollect(&events, &eventCount);
+	for (copyIdx = 0; copyIdx < copies->count; copyIdx++) {
+		if (copies->copies[copyIdx]->traceCollectProc == xvfs_traceCollect) {
+			continue;
+		}
+
+		copies->copies[copyIdx]->traceCollectProc(&events, &eventCount);
+	}
+
+	if (eventCount > 1) {
+		qsort(events, eventCount, sizeof(*events), xvfs_traceCompareEvents);
+	}
+
+	result = Tcl_NewObj();
+	for (idx = 0; idx < eventCount; idx++) {
+		event = &events[idx];
+
+		snprintf(thread, sizeof(thread), "tid%p", (void *) event->thread);
+
+		eventObj = Tcl_NewObj();
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("thread", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj(thread, -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("time", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewWideIntObj(event->time));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("op", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj(event->op, -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("fs", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj(event->fsName, -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("path", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj(event->path, -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("inode", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewWideIntObj(event->inode));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("result", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewWideIntObj(event->result));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewStringObj("duration", -1));
+		Tcl_ListObjAppendElement(NULL, eventObj, Tcl_NewWideIntObj(event->duration));
+
+		Tcl_ListObjAppendElement(NULL, result, eventObj);
+	}
+
+	if (events) {
+		Tcl_Free((char *) events);
+	}
+
+	return(result);
+}
+
 /*
  * Internal Core Utilities
  */
+/*
+ * Tcl only changes into a directory in xvfs through its chdirProc, so
+ * until that has happened the current directory is known to be
+ * elsewhere and relative paths are never in xvfs.  It is not reset
+ * when changing back out, which only costs looking up the current
+ * directory again.
+ */
+static int xvfs_cwdMayBeInside = 0;
+
+/*
+ * Whether a path, once made absolute, begins with a prefix.  Tcl asks
+ * this of every path it has not seen before, including every native
+ * one, so nothing is allocated: a relative path is compared in place
+ * against the current directory followed by the path.
+ */
+static int xvfs_pathHasPrefix(Tcl_Obj *path, const char *prefix, int prefixLen) {
+	Tcl_Obj *currentDirectory;
+	const char *pathStr, *directoryStr;
+	int pathLen, directoryLen;
+	int retval;
+
+	pathStr = Tcl_GetStringFromObj(path, &pathLen);
+
+	if (pathStr[0] == '/') {
+		return(pathLen >= prefixLen && memcmp(pathStr, prefix, prefixLen) == 0);
+	}
+
+	if (!xvfs_cwdMayBeInside) {
+		return(0);
+	}
+
+	currentDirectory = Tcl_FSGetCwd(NULL);
+	if (!currentDirectory) {
+		return(0);
+	}
+
+	directoryStr = Tcl_GetStringFromObj(currentDirectory, &directoryLen);
+
+	if (directoryLen >= prefixLen) {
+		retval = (memcmp(directoryStr, prefix, prefixLen) == 0);
+	} else {
+		retval = (memcmp(directoryStr, prefix, directoryLen) == 0 &&
+		          prefix[directoryLen] == '/' &&
+		          pathLen >= prefixLen - directoryLen - 1 &&
+		          memcmp(pathStr, prefix + directoryLen + 1, prefixLen - directoryLen - 1) == 0);
+	}
+
+	Tcl_DecrRefCount(currentDirectory);
+
+	return(retval);
+}
+
 static Tcl_Obj *xvfs_absolutePath(Tcl_Obj *path) {
 	Tcl_Obj *currentDirectory;
 	const char *pathStr;
@@ -139,9 +763,210 @@ static const char *xvfs_relativePath(Tcl_Obj *path, struct xvfs_tclfs_instance_i
 	return(pathFinal);
 }
 
-static int xvfs_errorToErrno(int xvfs_error) {
-	if (xvfs_error >= 0) {
-		return(0);
+/*
+ * Absolute path objects always name the same file, so the inode they
+ * name, or that they name nothing, is remembered as their internal
+ * representation for this filesystem.  The generation of the
+ * instance it was found in is remembered with it, so that it is not
+ * used with an image mounted in that one's place.  Other paths
+ * depend on the current directory and are not remembered.
+ */
+struct xvfs_tclfs_intrep {
+	unsigned long generation;
+	long          inode;
+};
+
+/*
+ * Passing this inode, with a NULL path, to an image's lookup
+ * functions fails with XVFS_RV_ERR_ENOENT
+ */
+#define XVFS_TCLFS_INODE_MISSING (-2)
+
+static ClientData xvfs_tclfs_createInternalRep(Tcl_Obj *path, struct xvfs_tclfs_instance_info *instanceInfo) {
+	struct xvfs_tclfs_intrep *internalRep;
+	const char *pathStr;
+	Tcl_StatBuf statBuf;
+
+	pathStr = Tcl_GetString(path);
+	if (pathStr[0] != '/') {
+		return(NULL);
+	}
+
+	pathStr = xvfs_relativePath(path, instanceInfo);
+	if (!pathStr) {
+		return(NULL);
+	}
+
+	internalRep = (struct xvfs_tclfs_intrep *) Tcl_Alloc(sizeof(*internalRep));
+	internalRep->generation = instanceInfo->generation;
+	internalRep->inode = XVFS_TCLFS_INODE_MISSING;
+
+	if (instanceInfo->fsInfo->getStatProc(pathStr, XVFS_INODE_NULL, &statBuf) == 0) {
+		internalRep->inode = statBuf.st_ino;
+	}
+
+	return((ClientData) internalRep);
+}
+
+static ClientData xvfs_tclfs_dupInternalRep(ClientData clientData) {
+	struct xvfs_tclfs_intrep *internalRep;
+
+	internalRep = (struct xvfs_tclfs_intrep *) Tcl_Alloc(sizeof(*internalRep));
+	memcpy(internalRep, clientData, sizeof(*internalRep));
+
+	return((ClientData) internalRep);
+}
+
+static void xvfs_tclfs_freeInternalRep(ClientData clientData) {
+	Tcl_Free((char *) clientData);
+
+	return;
+}
+
+/*
+ * Find the inode a path object is known to name, XVFS_INODE_NULL if
+ * it must be looked up by name
+ */
+static long xvfs_tclfs_pathInode(Tcl_Obj *path, struct xvfs_tclfs_instance_info *instanceInfo) {
+	struct xvfs_tclfs_intrep *internalRep;
+
+	internalRep = (struct xvfs_tclfs_intrep *) Tcl_FSGetInternalRep(path, instanceInfo->fs);
+	if (!internalRep || internalRep->generation != instanceInfo->generation) {
+		return(XVFS_INODE_NULL);
+	}
+
+	return(internalRep->inode);
+}
+
+/*
+ * Interned path objects
+ *
+ * Globbing a directory hands out one shared path object per child,
+ * created the first time that child matches, so repeatedly globbing
+ * the same directory allocates nothing.  Being absolute, the objects
+ * also remember their inode once used.  Tcl objects may not cross
+ * threads, so each thread has its own table, released when the
+ * thread exits.  It holds one set of directories, keyed by inode, for
+ * each filesystem name, which belongs to the newest generation seen
+ * under that name: the entries of an instance that has been replaced
+ * are dropped the next time its replacement is listed, and one still
+ * in use by an operation begun before then is no longer interned.
+ */
+struct xvfs_tclfs_intern_directory {
+	Tcl_WideInt childCount;
+	Tcl_Obj     *children[1];
+};
+
+struct xvfs_tclfs_intern_mount {
+	unsigned long generation;
+	Tcl_HashTable directories;
+};
+
+struct xvfs_tclfs_intern_table {
+	int           initialized;
+	Tcl_HashTable mounts;
+};
+
+static Tcl_ThreadDataKey xvfs_tclfs_internTableKey;
+
+static void xvfs_tclfs_internClearMount(struct xvfs_tclfs_intern_mount *mount) {
+	struct xvfs_tclfs_intern_directory *directory;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch search;
+	Tcl_WideInt idx;
+
+	for (entry = Tcl_FirstHashEntry(&mount->directories, &search); entry; entry = Tcl_NextHashEntry(&search)) {
+		directory = (struct xvfs_tclfs_intern_directory *) Tcl_GetHashValue(entry);
+
+		for (idx = 0; idx < directory->childCount; idx++) {
+			if (directory->children[idx]) {
+				Tcl_DecrRefCount(directory->children[idx]);
+			}
+		}
+
+		Tcl_Free((char *) directory);
+	}
+
+	Tcl_DeleteHashTable(&mount->directories);
+	Tcl_InitHashTable(&mount->directories, TCL_ONE_WORD_KEYS);
+
+	return;
+}
+
+static void xvfs_tclfs_internThreadExit(ClientData clientData) {
+	struct xvfs_tclfs_intern_table *table;
+	struct xvfs_tclfs_intern_mount *mount;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch search;
+
+	table = (struct xvfs_tclfs_intern_table *) clientData;
+
+	for (entry = Tcl_FirstHashEntry(&table->mounts, &search); entry; entry = Tcl_NextHashEntry(&search)) {
+		mount = (struct xvfs_tclfs_intern_mount *) Tcl_GetHashValue(entry);
+
+		xvfs_tclfs_internClearMount(mount);
+		Tcl_DeleteHashTable(&mount->directories);
+
+		Tcl_Free((char *) mount);
+	}
+
+	Tcl_DeleteHashTable(&table->mounts);
+	table->initialized = 0;
+
+	return;
+}
+
+static struct xvfs_tclfs_intern_directory *xvfs_tclfs_internDirectory(struct xvfs_tclfs_instance_info *instanceInfo, long inode, Tcl_WideInt childCount) {
+	struct xvfs_tclfs_intern_table *table;
+	struct xvfs_tclfs_intern_mount *mount;
+	struct xvfs_tclfs_intern_directory *directory;
+	Tcl_HashEntry *entry;
+	int isNew;
+
+	table = (struct xvfs_tclfs_intern_table *) Tcl_GetThreadData(&xvfs_tclfs_internTableKey, sizeof(*table));
+	if (!table->initialized) {
+		Tcl_InitHashTable(&table->mounts, TCL_STRING_KEYS);
+		Tcl_CreateThreadExitHandler(xvfs_tclfs_internThreadExit, table);
+		table->initialized = 1;
+	}
+
+	entry = Tcl_CreateHashEntry(&table->mounts, instanceInfo->fsInfo->name, &isNew);
+	if (isNew) {
+		mount = (struct xvfs_tclfs_intern_mount *) Tcl_Alloc(sizeof(*mount));
+		mount->generation = instanceInfo->generation;
+		Tcl_InitHashTable(&mount->directories, TCL_ONE_WORD_KEYS);
+
+		Tcl_SetHashValue(entry, mount);
+	} else {
+		mount = (struct xvfs_tclfs_intern_mount *) Tcl_GetHashValue(entry);
+	}
+
+	if (instanceInfo->generation < mount->generation) {
+		return(NULL);
+	}
+
+	if (instanceInfo->generation > mount->generation) {
+		xvfs_tclfs_internClearMount(mount);
+		mount->generation = instanceInfo->generation;
+	}
+
+	entry = Tcl_CreateHashEntry(&mount->directories, (const char *) (size_t) inode, &isNew);
+	if (!isNew) {
+		return((struct xvfs_tclfs_intern_directory *) Tcl_GetHashValue(entry));
+	}
+
+	directory = (struct xvfs_tclfs_intern_directory *) Tcl_Alloc(sizeof(*directory) + sizeof(directory->children[0]) * childCount);
+	directory->childCount = childCount;
+	memset(directory->children, 0, sizeof(directory->children[0]) * childCount);
+
+	Tcl_SetHashValue(entry, directory);
+
+	return(directory);
+}
+
+static int xvfs_errorToErrno(int xvfs_error) {
+	if (xvfs_error >= 0) {
+		return(0);
 	}
 
 	switch (xvfs_error) {
@@ -202,6 +1027,7 @@ struct xvfs_tclfs_channel_id {
 	Tcl_Channel channel;
 	struct xvfs_tclfs_instance_info *fsInstanceInfo;
 	long inode;
+	Tcl_Obj *tracePath;
 	Tcl_WideInt currentOffset;
 	Tcl_WideInt fileSize;
 	int eofMarked;
@@ -214,7 +1040,12 @@ struct xvfs_tclfs_channel_event {
 };
 static Tcl_ChannelType xvfs_tclfs_channelType;
 
-static Tcl_Channel xvfs_tclfs_openChannel(Tcl_Interp *interp, Tcl_Obj *path, struct xvfs_tclfs_instance_info *instanceInfo) {
+/*
+ * Tcl's default channel buffer size
+ */
+#define XVFS_CHANNEL_BUFFER_SIZE_MAX 4096
+
+static Tcl_Channel xvfs_tclfs_openChannel(Tcl_Interp *interp, Tcl_Obj *path, long inode, struct xvfs_tclfs_instance_info *instanceInfo) {
 	struct xvfs_tclfs_channel_id *channelInstanceData;
 	Tcl_Channel channel;
 	Tcl_StatBuf fileInfo;
@@ -224,7 +1055,7 @@ static Tcl_Channel xvfs_tclfs_openChannel(Tcl_Interp *interp, Tcl_Obj *path, str
 	XVFS_DEBUG_ENTER;
 	XVFS_DEBUG_PRINTF("Opening file \"%s\" ...", Tcl_GetString(path));
 
-	statRet = instanceInfo->fsInfo->getStatProc(Tcl_GetString(path), XVFS_INODE_NULL, &fileInfo);
+	statRet = instanceInfo->fsInfo->getStatProc(inode == XVFS_INODE_NULL ? Tcl_GetString(path) : NULL, inode, &fileInfo);
 	if (statRet < 0) {
 		XVFS_DEBUG_PRINTF("... failed: %s", xvfs_strerror(statRet));
 
@@ -250,6 +1081,7 @@ static Tcl_Channel xvfs_tclfs_openChannel(Tcl_Interp *interp, Tcl_Obj *path, str
 	channelInstanceData->closed = 0;
 	channelInstanceData->channel = NULL;
 	channelInstanceData->inode = fileInfo.st_ino;
+	channelInstanceData->tracePath = NULL;
 
 	channelName = Tcl_ObjPrintf("xvfs0x%llx", (unsigned long long) channelInstanceData);
 	if (!channelName) {
@@ -270,7 +1102,6 @@ static Tcl_Channel xvfs_tclfs_openChannel(Tcl_Interp *interp, Tcl_Obj *path, str
 	if (!channel) {
 		XVFS_DEBUG_PUTS("... failed");
 
-		Tcl_DecrRefCount(path);
 		Tcl_Free((char *) channelInstanceData);
 
 		XVFS_DEBUG_LEAVE;
@@ -279,6 +1110,33 @@ static Tcl_Channel xvfs_tclfs_openChannel(Tcl_Interp *interp, Tcl_Obj *path, str
 
 	channelInstanceData->channel = channel;
 
+	/*
+	 * The instance outlives being replaced for as long as the
+	 * channel is open
+	 */
+	xvfs_tclfs_instanceRetain(instanceInfo);
+
+	/*
+	 * Files smaller than the default buffer get one no larger than
+	 * their contents (which are already in memory), so reading all
+	 * of one takes a single read, and no channel holds more than the
+	 * default however large its file is.  Tcl always reads through
+	 * the buffer a buffer at a time, and may discard buffered input
+	 * if its size is changed later, so it is chosen now.
+	 */
+	if (fileInfo.st_size > XVFS_CHANNEL_BUFFER_SIZE_MAX) {
+		Tcl_SetChannelBufferSize(channel, XVFS_CHANNEL_BUFFER_SIZE_MAX);
+	} else if (fileInfo.st_size > 0) {
+		Tcl_SetChannelBufferSize(channel, (int) fileInfo.st_size);
+	}
+
+	if (xvfs_accessTrace) {
+		channelInstanceData->tracePath = path;
+		Tcl_IncrRefCount(channelInstanceData->tracePath);
+
+		xvfs_accessTraceRecord("open", instanceInfo, channelInstanceData->inode, Tcl_GetString(path), -1, -1);
+	}
+
 	XVFS_DEBUG_PRINTF("... ok (%p)", channelInstanceData);
 
 	XVFS_DEBUG_LEAVE;
@@ -327,6 +1185,12 @@ static int xvfs_tclfs_closeChannel(ClientData channelInstanceData_p, Tcl_Interp
 		return(0);
 	}
 
+	if (channelInstanceData->tracePath) {
+		Tcl_DecrRefCount(channelInstanceData->tracePath);
+	}
+
+	xvfs_tclfs_instanceRelease(channelInstanceData->fsInstanceInfo);
+
 	Tcl_Free((char *) channelInstanceData);
 
 	XVFS_DEBUG_PUTS("... ok");
@@ -338,7 +1202,7 @@ static int xvfs_tclfs_closeChannel(ClientData channelInstanceData_p, Tcl_Interp
 static int xvfs_tclfs_readChannel(ClientData channelInstanceData_p, char *buf, int bufSize, int *errorCodePtr) {
 	struct xvfs_tclfs_channel_id *channelInstanceData;
 	const unsigned char *data;
-	Tcl_WideInt offset, length;
+	Tcl_WideInt offset, length, traceStart;
 	long inode;
 
 	channelInstanceData = (struct xvfs_tclfs_channel_id *) channelInstanceData_p;
@@ -355,9 +1219,13 @@ static int xvfs_tclfs_readChannel(ClientData channelInstanceData_p, char *buf, i
 	offset = channelInstanceData->currentOffset;
 	length = bufSize;
 
+	XVFS_TRACE_START(traceStart, "read", channelInstanceData->fsInstanceInfo, NULL);
+
 	data = channelInstanceData->fsInstanceInfo->fsInfo->getDataProc(NULL, inode, offset, &length);
 
 	if (length < 0) {
+		XVFS_TRACE_DONE(traceStart, "read", channelInstanceData->fsInstanceInfo, NULL, inode, length);
+
 		*errorCodePtr = xvfs_errorToErrno(length);
 
 		return(-1);
@@ -368,9 +1236,15 @@ static int xvfs_tclfs_readChannel(ClientData channelInstanceData_p, char *buf, i
 	} else {
 		memcpy(buf, data, length);
 
+		if (channelInstanceData->tracePath) {
+			xvfs_accessTraceRecord("read", channelInstanceData->fsInstanceInfo, inode, Tcl_GetString(channelInstanceData->tracePath), offset, length);
+		}
+
 		channelInstanceData->currentOffset += length;
 	}
 
+	XVFS_TRACE_DONE(traceStart, "read", channelInstanceData->fsInstanceInfo, NULL, inode, length);
+
 	return(length);
 }
 
@@ -414,7 +1288,7 @@ static void xvfs_tclfs_watchChannel(ClientData channelInstanceData_p, int mask)
 	return;
 }
 
-static int xvfs_tclfs_seekChannel(ClientData channelInstanceData_p, long offset, int mode, int *errorCodePtr) {
+static Tcl_WideInt xvfs_tclfs_wideSeekChannel(ClientData channelInstanceData_p, Tcl_WideInt offset, int mode, int *errorCodePtr) {
 	struct xvfs_tclfs_channel_id *channelInstanceData;
 	Tcl_WideInt newOffset, fileSize;
 
@@ -458,6 +1332,42 @@ static int xvfs_tclfs_seekChannel(ClientData channelInstanceData_p, long offset,
 	return(channelInstanceData->currentOffset);
 }
 
+static int xvfs_tclfs_seekChannel(ClientData channelInstanceData_p, long offset, int mode, int *errorCodePtr) {
+	Tcl_WideInt retval;
+
+	retval = xvfs_tclfs_wideSeekChannel(channelInstanceData_p, offset, mode, errorCodePtr);
+	if (retval != (int) retval) {
+		*errorCodePtr = xvfs_errorToErrno(XVFS_RV_ERR_EINVAL);
+
+		return(-1);
+	}
+
+	return((int) retval);
+}
+
+/*
+ * The size of the file can be found without seeking to its end
+ */
+static int xvfs_tclfs_getOptionChannel(ClientData channelInstanceData_p, Tcl_Interp *interp, const char *optionName, Tcl_DString *dsPtr) {
+	struct xvfs_tclfs_channel_id *channelInstanceData;
+	char fileSize[32];
+
+	channelInstanceData = (struct xvfs_tclfs_channel_id *) channelInstanceData_p;
+
+	if (optionName && strcmp(optionName, "-size") != 0) {
+		return(Tcl_BadChannelOption(interp, optionName, "size"));
+	}
+
+	if (!optionName) {
+		Tcl_DStringAppendElement(dsPtr, "-size");
+	}
+
+	sprintf(fileSize, "%lld", (long long) channelInstanceData->fileSize);
+	Tcl_DStringAppendElement(dsPtr, fileSize);
+
+	return(TCL_OK);
+}
+
 static void xvfs_tclfs_prepareChannelType(void) {
 	xvfs_tclfs_channelType.typeName = "xvfs";
 	xvfs_tclfs_channelType.version = TCL_CHANNEL_VERSION_2;
@@ -468,12 +1378,12 @@ static void xvfs_tclfs_prepareChannelType(void) {
 	xvfs_tclfs_channelType.getHandleProc = NULL;
 	xvfs_tclfs_channelType.seekProc = xvfs_tclfs_seekChannel;
 	xvfs_tclfs_channelType.setOptionProc = NULL;
-	xvfs_tclfs_channelType.getOptionProc = NULL;
+	xvfs_tclfs_channelType.getOptionProc = xvfs_tclfs_getOptionChannel;
 	xvfs_tclfs_channelType.close2Proc = NULL;
 	xvfs_tclfs_channelType.blockModeProc = NULL;
 	xvfs_tclfs_channelType.flushProc = NULL;
 	xvfs_tclfs_channelType.handlerProc = NULL;
-	xvfs_tclfs_channelType.wideSeekProc = NULL;
+	xvfs_tclfs_channelType.wideSeekProc = xvfs_tclfs_wideSeekChannel;
 	xvfs_tclfs_channelType.threadActionProc = NULL;
 	xvfs_tclfs_channelType.truncateProc = NULL;
 }
@@ -482,13 +1392,25 @@ static void xvfs_tclfs_prepareChannelType(void) {
  * Internal Tcl_Filesystem functions, with the appropriate instance info
  */
 static int xvfs_tclfs_pathInFilesystem(Tcl_Obj *path, ClientData *dataPtr, struct xvfs_tclfs_instance_info *instanceInfo) {
-	const char *relativePath;
+	const char *relativePath, *rootStr;
+	int rootLen;
 	int retval;
 
 	XVFS_DEBUG_ENTER;
 
 	XVFS_DEBUG_PRINTF("Checking to see if path \"%s\" is in the filesystem ...", Tcl_GetString(path));
 
+	/*
+	 * Most paths are rejected without building the absolute path
+	 */
+	rootStr = Tcl_GetStringFromObj(instanceInfo->mountpoint, &rootLen);
+	if (!xvfs_pathHasPrefix(path, rootStr, rootLen)) {
+		XVFS_DEBUG_PUTS("... no");
+
+		XVFS_DEBUG_LEAVE;
+		return(-1);
+	}
+
 	path = xvfs_absolutePath(path);
 
 	relativePath = xvfs_relativePath(path, instanceInfo);
@@ -508,25 +1430,36 @@ static int xvfs_tclfs_pathInFilesystem(Tcl_Obj *path, ClientData *dataPtr, struc
 
 static int xvfs_tclfs_stat(Tcl_Obj *path, Tcl_StatBuf *statBuf, struct xvfs_tclfs_instance_info *instanceInfo) {
 	const char *pathStr;
+	Tcl_WideInt traceStart;
+	long inode;
 	int retval;
 
 	XVFS_DEBUG_ENTER;
+	XVFS_TRACE_START(traceStart, "stat", instanceInfo, Tcl_GetString(path));
 
 	XVFS_DEBUG_PRINTF("Getting stat() on \"%s\" ...", Tcl_GetString(path));
 
+	inode = xvfs_tclfs_pathInode(path, instanceInfo);
+
 	path = xvfs_absolutePath(path);
 
 	pathStr = xvfs_relativePath(path, instanceInfo);
 
-	retval = instanceInfo->fsInfo->getStatProc(pathStr, XVFS_INODE_NULL, statBuf);
+	retval = instanceInfo->fsInfo->getStatProc(inode == XVFS_INODE_NULL ? pathStr : NULL, inode, statBuf);
 	if (retval < 0) {
 		XVFS_DEBUG_PRINTF("... failed: %s", xvfs_strerror(retval));
 
+		XVFS_TRACE_DONE(traceStart, "stat", instanceInfo, pathStr, XVFS_INODE_NULL, retval);
+
 		Tcl_SetErrno(xvfs_errorToErrno(retval));
 
 		retval = -1;
 	} else {
 		XVFS_DEBUG_PUTS("... ok");
+
+		XVFS_TRACE_DONE(traceStart, "stat", instanceInfo, pathStr, (long) statBuf->st_ino, retval);
+
+		xvfs_accessTraceRecord("stat", instanceInfo, statBuf->st_ino, pathStr, -1, -1);
 	}
 
 	Tcl_DecrRefCount(path);
@@ -538,45 +1471,60 @@ static int xvfs_tclfs_stat(Tcl_Obj *path, Tcl_StatBuf *statBuf, struct xvfs_tclf
 static int xvfs_tclfs_access(Tcl_Obj *path, int mode, struct xvfs_tclfs_instance_info *instanceInfo) {
 	const char *pathStr;
 	Tcl_StatBuf fileInfo;
+	Tcl_WideInt traceStart;
+	long inode;
 	int statRetVal;
 
 	XVFS_DEBUG_ENTER;
+	XVFS_TRACE_START(traceStart, "access", instanceInfo, Tcl_GetString(path));
 
 	XVFS_DEBUG_PRINTF("Getting access(..., %i) on \"%s\" ...", mode, Tcl_GetString(path));
 
 	if (mode & W_OK) {
 		XVFS_DEBUG_PUTS("... no (not writable)");
 
+		XVFS_TRACE_DONE(traceStart, "access", instanceInfo, NULL, XVFS_INODE_NULL, XVFS_RV_ERR_EROFS);
+
 		XVFS_DEBUG_LEAVE;
 		return(-1);
 	}
 
+	inode = xvfs_tclfs_pathInode(path, instanceInfo);
+
 	path = xvfs_absolutePath(path);
 
 	pathStr = xvfs_relativePath(path, instanceInfo);
 	if (!pathStr) {
 		XVFS_DEBUG_PUTS("... no (not in our path)");
 
+		XVFS_TRACE_DONE(traceStart, "access", instanceInfo, NULL, XVFS_INODE_NULL, XVFS_RV_ERR_ENOENT);
+
 		Tcl_DecrRefCount(path);
 
 		XVFS_DEBUG_LEAVE;
 		return(-1);
 	}
 
-	statRetVal = instanceInfo->fsInfo->getStatProc(pathStr, XVFS_INODE_NULL, &fileInfo);
+	statRetVal = instanceInfo->fsInfo->getStatProc(inode == XVFS_INODE_NULL ? pathStr : NULL, inode, &fileInfo);
 	if (statRetVal < 0) {
 		XVFS_DEBUG_PUTS("... no (not statable)");
 
+		XVFS_TRACE_DONE(traceStart, "access", instanceInfo, pathStr, XVFS_INODE_NULL, statRetVal);
+
 		Tcl_DecrRefCount(path);
 
 		XVFS_DEBUG_LEAVE;
 		return(-1);
 	}
 
+	xvfs_accessTraceRecord("stat", instanceInfo, fileInfo.st_ino, pathStr, -1, -1);
+
 	if (mode & X_OK) {
 		if (!(fileInfo.st_mode & 040000)) {
 			XVFS_DEBUG_PUTS("... no (not a directory and X_OK specified)");
 
+			XVFS_TRACE_DONE(traceStart, "access", instanceInfo, pathStr, (long) fileInfo.st_ino, -1);
+
 			Tcl_DecrRefCount(path);
 
 			XVFS_DEBUG_LEAVE;
@@ -584,6 +1532,8 @@ static int xvfs_tclfs_access(Tcl_Obj *path, int mode, struct xvfs_tclfs_instance
 		}
 	}
 
+	XVFS_TRACE_DONE(traceStart, "access", instanceInfo, pathStr, (long) fileInfo.st_ino, 0);
+
 	Tcl_DecrRefCount(path);
 
 	XVFS_DEBUG_PUTS("... ok");
@@ -592,12 +1542,36 @@ static int xvfs_tclfs_access(Tcl_Obj *path, int mode, struct xvfs_tclfs_instance
 	return(0);
 }
 
+/*
+ * The checks Tcl would otherwise make itself, see xvfs_cwdMayBeInside
+ */
+static int xvfs_tclfs_chdir(Tcl_Obj *path, struct xvfs_tclfs_instance_info *instanceInfo) {
+	Tcl_StatBuf statBuf;
+
+	if (xvfs_tclfs_stat(path, &statBuf, instanceInfo) != 0) {
+		return(-1);
+	}
+
+	if (!(statBuf.st_mode & 040000)) {
+		Tcl_SetErrno(xvfs_errorToErrno(XVFS_RV_ERR_ENOTDIR));
+
+		return(-1);
+	}
+
+	xvfs_cwdMayBeInside = 1;
+
+	return(0);
+}
+
 static Tcl_Channel xvfs_tclfs_openFileChannel(Tcl_Interp *interp, Tcl_Obj *path, int mode, int permissions, struct xvfs_tclfs_instance_info *instanceInfo) {
 	Tcl_Channel retval;
 	Tcl_Obj *pathRel;
 	const char *pathStr;
+	Tcl_WideInt traceStart;
+	long inode;
 
 	XVFS_DEBUG_ENTER;
+	XVFS_TRACE_START(traceStart, "open", instanceInfo, Tcl_GetString(path));
 
 	XVFS_DEBUG_PRINTF("Asked to open(\"%s\", %x)...", Tcl_GetString(path), mode);
 
@@ -606,21 +1580,30 @@ static Tcl_Channel xvfs_tclfs_openFileChannel(Tcl_Interp *interp, Tcl_Obj *path,
 
 		xvfs_setresults_error(interp, XVFS_RV_ERR_EROFS);
 
+		XVFS_TRACE_DONE(traceStart, "open", instanceInfo, NULL, XVFS_INODE_NULL, XVFS_RV_ERR_EROFS);
+
 		XVFS_DEBUG_LEAVE;
 		return(NULL);
 	}
 
+	inode = xvfs_tclfs_pathInode(path, instanceInfo);
+
 	path = xvfs_absolutePath(path);
 
 	pathStr = xvfs_relativePath(path, instanceInfo);
 
 	pathRel = Tcl_NewStringObj(pathStr, -1);
+	Tcl_IncrRefCount(pathRel);
 
 	Tcl_DecrRefCount(path);
 
 	XVFS_DEBUG_PUTS("... done, passing off to channel handler");
 
-	retval = xvfs_tclfs_openChannel(interp, pathRel, instanceInfo);
+	retval = xvfs_tclfs_openChannel(interp, pathRel, inode, instanceInfo);
+
+	XVFS_TRACE_DONE(traceStart, "open", instanceInfo, Tcl_GetString(pathRel), retval ? ((struct xvfs_tclfs_channel_id *) Tcl_GetChannelInstanceData(retval))->inode : XVFS_INODE_NULL, retval ? 0 : -1);
+
+	Tcl_DecrRefCount(pathRel);
 
 	XVFS_DEBUG_LEAVE;
 	return(retval);
@@ -728,11 +1711,13 @@ static int xvfs_tclfs_verifyType(Tcl_Obj *path, Tcl_GlobTypeData *types, struct
 }
 
 static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj *path, const char *pattern, Tcl_GlobTypeData *types, struct xvfs_tclfs_instance_info *instanceInfo) {
-	const char *pathStr;
+	struct xvfs_tclfs_intern_directory *internDirectory;
+	const char *pathStr, *absolutePathStr;
 	const char **children, *child;
-	Tcl_WideInt childrenCount, idx;
+	Tcl_WideInt childrenCount, idx, traceStart;
 	Tcl_Obj *childObj;
-	int tclRetVal;
+	long inode;
+	int tclRetVal, rootLen, absolutePathLen;
 
 	if (pattern == NULL) {
 		if (xvfs_tclfs_verifyType(path, types, instanceInfo)) {
@@ -743,6 +1728,9 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 	}
 
 	XVFS_DEBUG_ENTER;
+	XVFS_TRACE_START(traceStart, "glob", instanceInfo, Tcl_GetString(path));
+
+	inode = xvfs_tclfs_pathInode(path, instanceInfo);
 
 	path = xvfs_absolutePath(path);
 
@@ -756,6 +1744,8 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 	if (!pathStr) {
 		XVFS_DEBUG_PUTS("... error (not in our VFS)");
 
+		XVFS_TRACE_DONE(traceStart, "glob", instanceInfo, NULL, XVFS_INODE_NULL, XVFS_RV_ERR_ENOENT);
+
 		Tcl_DecrRefCount(path);
 
 		xvfs_setresults_error(interp, XVFS_RV_ERR_ENOENT);
@@ -765,10 +1755,12 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 	}
 
 	childrenCount = 0;
-	children = instanceInfo->fsInfo->getChildrenProc(pathStr, XVFS_INODE_NULL, &childrenCount);
+	children = instanceInfo->fsInfo->getChildrenProc(inode == XVFS_INODE_NULL ? pathStr : NULL, inode, &childrenCount);
 	if (childrenCount < 0) {
 		XVFS_DEBUG_PRINTF("... error: %s", xvfs_strerror(childrenCount));
 
+		XVFS_TRACE_DONE(traceStart, "glob", instanceInfo, pathStr, XVFS_INODE_NULL, childrenCount);
+
 		Tcl_DecrRefCount(path);
 
 		xvfs_setresults_error(interp, childrenCount);
@@ -777,6 +1769,19 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 		return(TCL_ERROR);
 	}
 
+	/*
+	 * Children of a directory named in its canonical form, which is
+	 * how the results are named, share interned path objects
+	 */
+	internDirectory = NULL;
+	if (inode >= 0) {
+		Tcl_GetStringFromObj(instanceInfo->mountpoint, &rootLen);
+		absolutePathStr = Tcl_GetStringFromObj(path, &absolutePathLen);
+		if (absolutePathLen == rootLen || (pathStr == absolutePathStr + rootLen + 1 && pathStr[0] != '\0')) {
+			internDirectory = xvfs_tclfs_internDirectory(instanceInfo, inode, childrenCount);
+		}
+	}
+
 	for (idx = 0; idx < childrenCount; idx++) {
 		child = children[idx];
 
@@ -784,9 +1789,18 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 			continue;
 		}
 
-		childObj = Tcl_DuplicateObj(path);
+		if (internDirectory && internDirectory->children[idx]) {
+			childObj = internDirectory->children[idx];
+		} else {
+			childObj = Tcl_DuplicateObj(path);
+			Tcl_AppendStringsToObj(childObj, "/", child, NULL);
+
+			if (internDirectory) {
+				internDirectory->children[idx] = childObj;
+				Tcl_IncrRefCount(childObj);
+			}
+		}
 		Tcl_IncrRefCount(childObj);
-		Tcl_AppendStringsToObj(childObj, "/", child, NULL);
 
 		if (!xvfs_tclfs_verifyType(childObj, types, instanceInfo)) {
 			Tcl_DecrRefCount(childObj);
@@ -799,6 +1813,9 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 
 		if (tclRetVal != TCL_OK) {
 			XVFS_DEBUG_PUTS("... error (lappend)");
+
+			XVFS_TRACE_DONE(traceStart, "glob", instanceInfo, pathStr, XVFS_INODE_NULL, XVFS_RV_ERR_INTERNAL);
+
 			Tcl_DecrRefCount(path);
 
 			XVFS_DEBUG_LEAVE;
@@ -806,6 +1823,8 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 		}
 	}
 
+	XVFS_TRACE_DONE(traceStart, "glob", instanceInfo, pathStr, XVFS_INODE_NULL, childrenCount);
+
 	Tcl_DecrRefCount(path);
 
 	XVFS_DEBUG_PRINTF("... ok (returning items: %s)", Tcl_GetString(resultPtr));
@@ -813,92 +1832,2855 @@ static int xvfs_tclfs_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj
 	XVFS_DEBUG_LEAVE;
 	return(TCL_OK);
 }
-#endif /* XVFS_MODE_SERVER || XVFS_MODE_STANDALONE || XVFS_MODE_FLEIXBLE */
 
-#if defined(XVFS_MODE_STANDALONE) || defined(XVFS_MODE_FLEXIBLE)
 /*
- * Tcl_Filesystem handlers for the standalone implementation
+ * File attributes, which are precomputed by the generator so that
+ * requesting them costs nothing beyond a lookup.  The order of
+ * the names must match the attributes they request.
  */
-static struct xvfs_tclfs_instance_info xvfs_tclfs_standalone_info;
-static int xvfs_tclfs_standalone_pathInFilesystem(Tcl_Obj *path, ClientData *dataPtr) {
-	return(xvfs_tclfs_pathInFilesystem(path, dataPtr, &xvfs_tclfs_standalone_info));
-}
+static const char *const xvfs_tclfs_attributeNames[] = {
+	"-digest",
+	"-gzip",
+	NULL
+};
+static const int xvfs_tclfs_attributeIds[] = {
+	XVFS_ATTRIBUTE_DIGEST,
+	XVFS_ATTRIBUTE_GZIP
+};
 
-static int xvfs_tclfs_standalone_stat(Tcl_Obj *path, Tcl_StatBuf *statBuf) {
-	return(xvfs_tclfs_stat(path, statBuf, &xvfs_tclfs_standalone_info));
+static const char *const *xvfs_tclfs_fileAttrStrings(Tcl_Obj *path, Tcl_Obj **objPtrRef) {
+	return(xvfs_tclfs_attributeNames);
 }
 
-static int xvfs_tclfs_standalone_access(Tcl_Obj *path, int mode) {
-	return(xvfs_tclfs_access(path, mode, &xvfs_tclfs_standalone_info));
-}
+static int xvfs_tclfs_fileAttrsGet(Tcl_Interp *interp, int index, Tcl_Obj *path, Tcl_Obj **objPtrRef, struct xvfs_tclfs_instance_info *instanceInfo) {
+	struct Xvfs_FSInfo *fsInfo;
+	const unsigned char *data;
+	const char *pathStr;
+	Tcl_StatBuf statBuf;
+	Tcl_WideInt length, traceStart;
+	long inode;
 
-static Tcl_Channel xvfs_tclfs_standalone_openFileChannel(Tcl_Interp *interp, Tcl_Obj *path, int mode, int permissions) {
-	return(xvfs_tclfs_openFileChannel(interp, path, mode, permissions, &xvfs_tclfs_standalone_info));
-}
+	XVFS_DEBUG_ENTER;
+	XVFS_TRACE_START(traceStart, "attributes", instanceInfo, Tcl_GetString(path));
 
-static int xvfs_tclfs_standalone_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj *pathPtr, const char *pattern, Tcl_GlobTypeData *types) {
-	return(xvfs_tclfs_matchInDir(interp, resultPtr, pathPtr, pattern, types, &xvfs_tclfs_standalone_info));
-}
+	XVFS_DEBUG_PRINTF("Getting attribute %s of \"%s\" ...", xvfs_tclfs_attributeNames[index], Tcl_GetString(path));
 
-/*
- * There are three (3) modes of operation for Xvfs_Register:
- *    1. standalone -- We register our own Tcl_Filesystem
- *                     and handle requests under `//xvfs:/<fsName>`
- *    2. client -- A single Tcl_Filesystem is registered for the
- *                 interp to handle requests under `//xvfs:/` which
- *                 then dispatches to the appropriate registered
- *                 handler
- *    3. flexible -- Attempts to find a core Xvfs instance for the
- *                   process at runtime, if found do #2, otherwise
- *                   fallback to #1
- *
- */
-static Tcl_Filesystem xvfs_tclfs_standalone_fs;
-static int xvfs_standalone_register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo) {
-	int tclRet;
-	static int registered = 0;
+	inode = xvfs_tclfs_pathInode(path, instanceInfo);
+
+	path = xvfs_absolutePath(path);
+
+	pathStr = xvfs_relativePath(path, instanceInfo);
 
 	/*
-	 * Ensure this instance is not already registered
+	 * Images built before attributes existed have none, but
+	 * the file must still exist
 	 */
-	if (registered) {
-		return(TCL_OK);
+	fsInfo = instanceInfo->fsInfo;
+	if (fsInfo->protocolVersion >= 3 && fsInfo->getAttributeProc) {
+		data = fsInfo->getAttributeProc(inode == XVFS_INODE_NULL ? pathStr : NULL, inode, xvfs_tclfs_attributeIds[index], &length);
+	} else {
+		data = NULL;
+		length = fsInfo->getStatProc(inode == XVFS_INODE_NULL ? pathStr : NULL, inode, &statBuf);
 	}
-	registered = 1;
 
-	/*
-	 * In standalone mode, we only support the same protocol we are
-	 * compiling for.
-	 */
-	if (fsInfo->protocolVersion != XVFS_PROTOCOL_VERSION) {
-		if (interp) {
-			Tcl_SetResult(interp, "Protocol mismatch", NULL);
-		}
+	XVFS_TRACE_DONE(traceStart, "attributes", instanceInfo, pathStr, XVFS_INODE_NULL, length);
+
+	Tcl_DecrRefCount(path);
+
+	if (length < 0) {
+		XVFS_DEBUG_PRINTF("... failed: %s", xvfs_strerror(length));
+
+		xvfs_setresults_error(interp, length);
+
+		XVFS_DEBUG_LEAVE;
 		return(TCL_ERROR);
 	}
 
-	xvfs_tclfs_standalone_fs.typeName                   = "xvfsInstance";
-	xvfs_tclfs_standalone_fs.structureLength            = sizeof(xvfs_tclfs_standalone_fs);
-	xvfs_tclfs_standalone_fs.version                    = TCL_FILESYSTEM_VERSION_1;
-	xvfs_tclfs_standalone_fs.pathInFilesystemProc       = xvfs_tclfs_standalone_pathInFilesystem;
-	xvfs_tclfs_standalone_fs.dupInternalRepProc         = NULL;
-	xvfs_tclfs_standalone_fs.freeInternalRepProc        = NULL;
-	xvfs_tclfs_standalone_fs.internalToNormalizedProc   = NULL;
-	xvfs_tclfs_standalone_fs.createInternalRepProc      = NULL;
-	xvfs_tclfs_standalone_fs.normalizePathProc          = NULL;
-	xvfs_tclfs_standalone_fs.filesystemPathTypeProc     = NULL;
-	xvfs_tclfs_standalone_fs.filesystemSeparatorProc    = NULL;
-	xvfs_tclfs_standalone_fs.statProc                   = xvfs_tclfs_standalone_stat;
-	xvfs_tclfs_standalone_fs.accessProc                 = xvfs_tclfs_standalone_access;
-	xvfs_tclfs_standalone_fs.openFileChannelProc        = xvfs_tclfs_standalone_openFileChannel;
-	xvfs_tclfs_standalone_fs.matchInDirectoryProc       = xvfs_tclfs_standalone_matchInDir;
-	xvfs_tclfs_standalone_fs.utimeProc                  = NULL;
-	xvfs_tclfs_standalone_fs.linkProc                   = NULL;
-	xvfs_tclfs_standalone_fs.listVolumesProc            = NULL;
-	xvfs_tclfs_standalone_fs.fileAttrStringsProc        = NULL;
-	xvfs_tclfs_standalone_fs.fileAttrsGetProc           = NULL;
-	xvfs_tclfs_standalone_fs.fileAttrsSetProc           = NULL;
-	xvfs_tclfs_standalone_fs.createDirectoryProc        = NULL;
+	if (!data) {
+		*objPtrRef = Tcl_NewObj();
+	} else if (xvfs_tclfs_attributeIds[index] == XVFS_ATTRIBUTE_DIGEST) {
+		*objPtrRef = Tcl_NewStringObj((const char *) data, length);
+	} else {
+		*objPtrRef = Tcl_NewByteArrayObj(data, length);
+	}
+
+	XVFS_DEBUG_PRINTF("... ok (%lli bytes)", (long long) length);
+
+	XVFS_DEBUG_LEAVE;
+	return(TCL_OK);
+}
+
+static int xvfs_tclfs_fileAttrsSet(Tcl_Interp *interp, int index, Tcl_Obj *path, Tcl_Obj *objPtr) {
+	xvfs_setresults_error(interp, XVFS_RV_ERR_EROFS);
+
+	return(TCL_ERROR);
+}
+
+/*
+ * Tcl commands (::xvfs::*)
+ *
+ * These may be created by any copy of the core, so they resolve
+ * paths through whichever xvfs filesystem is responsible for them
+ * rather than through this copy's instance information.
+ */
+/*
+ * A command holds a reference to the image it operates on, so that
+ * it cannot be unloaded until the command releases it
+ */
+struct xvfs_tclfs_command_reference {
+	struct xvfs_tclfs_server_info *fsHandlerData;
+	ClientData                    reference;
+};
+
+static struct Xvfs_FSInfo *xvfs_tclfs_commandPathToFSInfo(Tcl_Interp *interp, Tcl_Obj *path, Tcl_Obj **relativePath, struct xvfs_tclfs_command_reference *reference) {
+	const Tcl_Filesystem *fsHandler;
+	struct xvfs_tclfs_server_info *fsHandlerData;
+	struct Xvfs_FSInfo *fsInfo;
+
+	fsHandler = Tcl_FSGetFileSystemForPath(path);
+	fsHandlerData = NULL;
+	if (fsHandler) {
+		fsHandlerData = (struct xvfs_tclfs_server_info *) Tcl_FSData(fsHandler);
+	}
+
+	if (!fsHandlerData || memcmp(fsHandlerData->magic, XVFS_INTERNAL_SERVER_MAGIC, sizeof(fsHandlerData->magic)) != 0) {
+		if (interp) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("\"%s\" is not in an xvfs filesystem", Tcl_GetString(path)));
+		}
+
+		return(NULL);
+	}
+
+	reference->fsHandlerData = fsHandlerData;
+	reference->reference = NULL;
+
+	fsInfo = fsHandlerData->pathToFSInfoProc(path, relativePath, &reference->reference);
+	if (!fsInfo) {
+		xvfs_setresults_error(interp, XVFS_RV_ERR_ENOENT);
+
+		return(NULL);
+	}
+
+	return(fsInfo);
+}
+
+static void xvfs_tclfs_commandRelease(struct xvfs_tclfs_command_reference *reference) {
+	if (reference->fsHandlerData->releaseProc) {
+		reference->fsHandlerData->releaseProc(reference->reference);
+	}
+
+	return;
+}
+
+/*
+ * C file API, see xvfs-core.h.  A file holds a reference to its
+ * image just as a command does while it runs.
+ */
+struct Xvfs_File {
+	struct xvfs_tclfs_command_reference reference;
+	const unsigned char                 *data;
+	Tcl_WideInt                         length;
+};
+
+struct Xvfs_File *Xvfs_Lookup(Tcl_Interp *interp, const char *path) {
+	struct Xvfs_File *file;
+	struct Xvfs_FSInfo *fsInfo;
+	Tcl_Obj *pathObj, *relativePath;
+	Tcl_WideInt length;
+
+	if (!path) {
+		xvfs_setresults_error(interp, XVFS_RV_ERR_EINVAL);
+
+		return(NULL);
+	}
+
+	file = (struct Xvfs_File *) Tcl_Alloc(sizeof(*file));
+
+	pathObj = Tcl_NewStringObj(path, -1);
+	Tcl_IncrRefCount(pathObj);
+	fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, pathObj, &relativePath, &file->reference);
+	Tcl_DecrRefCount(pathObj);
+	if (!fsInfo) {
+		Tcl_Free((char *) file);
+
+		return(NULL);
+	}
+
+	length = 0;
+	file->data = fsInfo->getDataProc(Tcl_GetString(relativePath), XVFS_INODE_NULL, 0, &length);
+	Tcl_DecrRefCount(relativePath);
+	if (length < 0) {
+		xvfs_tclfs_commandRelease(&file->reference);
+		Tcl_Free((char *) file);
+
+		xvfs_setresults_error(interp, length);
+
+		return(NULL);
+	}
+	file->length = length;
+
+	return(file);
+}
+
+int Xvfs_MapFile(struct Xvfs_File *file, const unsigned char **data, Tcl_WideInt *length) {
+	if (!file || !data || !length) {
+		return(XVFS_RV_ERR_EINVAL);
+	}
+
+	*data = file->data;
+	*length = file->length;
+
+	return(0);
+}
+
+void Xvfs_ReleaseFile(struct Xvfs_File *file) {
+	if (!file) {
+		return;
+	}
+
+	xvfs_tclfs_commandRelease(&file->reference);
+	Tcl_Free((char *) file);
+
+	return;
+}
+
+/*
+ * C directory API, see xvfs-core.h.  The children of a directory are
+ * a static array in the image, so a cursor is only a position in it;
+ * entries are stat'd only when their type or inode is needed.
+ */
+struct Xvfs_Dir {
+	struct xvfs_tclfs_command_reference reference;
+	struct Xvfs_FSInfo                  *fsInfo;
+	const char                          **children;
+	Tcl_WideInt                         childrenCount;
+	Tcl_WideInt                         position;
+	int                                 types;
+	char                                *pattern;
+	Tcl_DString                         path;
+	int                                 pathLen;
+};
+
+struct Xvfs_Dir *Xvfs_OpenDir(Tcl_Interp *interp, const char *path, int types, const char *pattern) {
+	struct Xvfs_Dir *dir;
+	struct Xvfs_FSInfo *fsInfo;
+	Tcl_Obj *pathObj, *relativePath;
+
+	if (!path) {
+		xvfs_setresults_error(interp, XVFS_RV_ERR_EINVAL);
+
+		return(NULL);
+	}
+
+	dir = (struct Xvfs_Dir *) Tcl_Alloc(sizeof(*dir));
+
+	pathObj = Tcl_NewStringObj(path, -1);
+	Tcl_IncrRefCount(pathObj);
+	fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, pathObj, &relativePath, &dir->reference);
+	Tcl_DecrRefCount(pathObj);
+	if (!fsInfo) {
+		Tcl_Free((char *) dir);
+
+		return(NULL);
+	}
+
+	dir->children = fsInfo->getChildrenProc(Tcl_GetString(relativePath), XVFS_INODE_NULL, &dir->childrenCount);
+	if (dir->childrenCount < 0) {
+		xvfs_setresults_error(interp, dir->childrenCount);
+
+		Tcl_DecrRefCount(relativePath);
+		xvfs_tclfs_commandRelease(&dir->reference);
+		Tcl_Free((char *) dir);
+
+		return(NULL);
+	}
+
+	dir->fsInfo = fsInfo;
+	dir->position = 0;
+	dir->types = types & (XVFS_DIR_TYPE_DIRECTORY | XVFS_DIR_TYPE_FILE);
+	if (dir->types == (XVFS_DIR_TYPE_DIRECTORY | XVFS_DIR_TYPE_FILE)) {
+		dir->types = 0;
+	}
+
+	dir->pattern = NULL;
+	if (pattern) {
+		dir->pattern = Tcl_Alloc(strlen(pattern) + 1);
+		strcpy(dir->pattern, pattern);
+	}
+
+	Tcl_DStringInit(&dir->path);
+	Tcl_DStringAppend(&dir->path, Tcl_GetString(relativePath), -1);
+	if (Tcl_DStringLength(&dir->path) != 0) {
+		Tcl_DStringAppend(&dir->path, "/", 1);
+	}
+	dir->pathLen = Tcl_DStringLength(&dir->path);
+	Tcl_DecrRefCount(relativePath);
+
+	return(dir);
+}
+
+Tcl_WideInt Xvfs_ReadDir(struct Xvfs_Dir *dir, const char **names, long *inodes, Tcl_WideInt count) {
+	Tcl_StatBuf statBuf;
+	Tcl_WideInt filled;
+	const char *name;
+	int statRet, isDirectory;
+
+	if (!dir || count < 0) {
+		return(XVFS_RV_ERR_EINVAL);
+	}
+
+	filled = 0;
+	while (filled < count && dir->position < dir->childrenCount) {
+		name = dir->children[dir->position];
+		dir->position++;
+
+		if (dir->pattern && !Tcl_StringMatch(name, dir->pattern)) {
+			continue;
+		}
+
+		if (dir->types || inodes) {
+			Tcl_DStringSetLength(&dir->path, dir->pathLen);
+			Tcl_DStringAppend(&dir->path, name, -1);
+
+			/*
+			 * The entry is left to be read again, so the entries
+			 * filled in so far are returned and the error is
+			 * reported by the next call
+			 */
+			statRet = dir->fsInfo->getStatProc(Tcl_DStringValue(&dir->path), XVFS_INODE_NULL, &statBuf);
+			if (statRet < 0) {
+				dir->position--;
+
+				if (filled != 0) {
+					return(filled);
+				}
+
+				return(statRet);
+			}
+
+			isDirectory = ((statBuf.st_mode & 040000) != 0);
+			if (dir->types && !(dir->types & (isDirectory ? XVFS_DIR_TYPE_DIRECTORY : XVFS_DIR_TYPE_FILE))) {
+				continue;
+			}
+
+			if (inodes) {
+				inodes[filled] = (long) statBuf.st_ino;
+			}
+		}
+
+		if (names) {
+			names[filled] = name;
+		}
+		filled++;
+	}
+
+	return(filled);
+}
+
+void Xvfs_CloseDir(struct Xvfs_Dir *dir) {
+	if (!dir) {
+		return;
+	}
+
+	xvfs_tclfs_commandRelease(&dir->reference);
+	Tcl_DStringFree(&dir->path);
+	if (dir->pattern) {
+		Tcl_Free(dir->pattern);
+	}
+	Tcl_Free((char *) dir);
+
+	return;
+}
+
+#ifdef XVFS_HAVE_MADVISE
+static int xvfs_adviseRange(const unsigned char *data, Tcl_WideInt length, int advice) {
+	unsigned long pageSize, start, end;
+
+	if (length <= 0) {
+		return(0);
+	}
+
+	pageSize = sysconf(_SC_PAGESIZE);
+	start = (unsigned long) data;
+	end = start + length;
+
+	/*
+	 * Dropping pages must not affect anything outside of the
+	 * range, so only whole pages are dropped.  All other advice
+	 * is harmless to neighbors and covers any partial pages.
+	 */
+	if (advice == MADV_DONTNEED) {
+		start = (start + pageSize - 1) & ~(pageSize - 1);
+		end = end & ~(pageSize - 1);
+	} else {
+		start = start & ~(pageSize - 1);
+		end = (end + pageSize - 1) & ~(pageSize - 1);
+	}
+
+	if (end <= start) {
+		return(0);
+	}
+
+	return(madvise((void *) start, end - start, advice));
+}
+
+/*
+ * Advise the kernel about the embedded data for a file, or every
+ * file beneath a directory
+ */
+static int xvfs_advise(struct Xvfs_FSInfo *fsInfo, Tcl_DString *path, int advice) {
+	const unsigned char *data;
+	const char **children;
+	Tcl_WideInt length, childrenCount, idx;
+	int pathLen, retval;
+
+	length = 0;
+	data = fsInfo->getDataProc(Tcl_DStringValue(path), XVFS_INODE_NULL, 0, &length);
+	if (length >= 0) {
+		if (xvfs_adviseRange(data, length, advice) != 0) {
+			return(XVFS_RV_ERR_INTERNAL);
+		}
+
+		return(0);
+	}
+
+	if (length != XVFS_RV_ERR_EISDIR) {
+		return(length);
+	}
+
+	children = fsInfo->getChildrenProc(Tcl_DStringValue(path), XVFS_INODE_NULL, &childrenCount);
+	if (childrenCount < 0) {
+		return(childrenCount);
+	}
+
+	pathLen = Tcl_DStringLength(path);
+	for (idx = 0; idx < childrenCount; idx++) {
+		if (pathLen != 0) {
+			Tcl_DStringAppend(path, "/", 1);
+		}
+		Tcl_DStringAppend(path, children[idx], -1);
+
+		retval = xvfs_advise(fsInfo, path, advice);
+
+		Tcl_DStringSetLength(path, pathLen);
+
+		if (retval < 0) {
+			return(retval);
+		}
+	}
+
+	return(0);
+}
+#endif
+
+static int xvfs_tclfs_adviseCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+#ifdef XVFS_HAVE_MADVISE
+	static const char *adviceNames[] = {"willneed", "dontneed", "sequential", "random", "normal", NULL};
+	static const int adviceValues[] = {MADV_WILLNEED, MADV_DONTNEED, MADV_SEQUENTIAL, MADV_RANDOM, MADV_NORMAL};
+	struct xvfs_tclfs_command_reference reference;
+	struct Xvfs_FSInfo *fsInfo;
+	Tcl_Obj *relativePath;
+	Tcl_DString path;
+	int adviceIndex;
+	int retval;
+
+	if (objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "path advice");
+
+		return(TCL_ERROR);
+	}
+
+	if (Tcl_GetIndexFromObj(interp, objv[2], adviceNames, "advice", 0, &adviceIndex) != TCL_OK) {
+		return(TCL_ERROR);
+	}
+
+	fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, objv[1], &relativePath, &reference);
+	if (!fsInfo) {
+		return(TCL_ERROR);
+	}
+
+	Tcl_DStringInit(&path);
+	Tcl_DStringAppend(&path, Tcl_GetString(relativePath), -1);
+	Tcl_DecrRefCount(relativePath);
+
+	retval = xvfs_advise(fsInfo, &path, adviceValues[adviceIndex]);
+
+	Tcl_DStringFree(&path);
+	xvfs_tclfs_commandRelease(&reference);
+
+	if (retval < 0) {
+		if (retval == XVFS_RV_ERR_INTERNAL) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("madvise failed: %s", Tcl_ErrnoMsg(Tcl_GetErrno())));
+		} else {
+			xvfs_setresults_error(interp, retval);
+		}
+
+		return(TCL_ERROR);
+	}
+
+	return(TCL_OK);
+#else
+	Tcl_SetResult(interp, "memory advice is not supported on this platform", NULL);
+
+	return(TCL_ERROR);
+#endif
+}
+
+#ifdef XVFS_HAVE_MINCORE
+/*
+ * Memory accounting
+ *
+ * The embedded data of an image is part of the mapping of the
+ * library it was loaded from, so mincore() tells which of its pages
+ * are resident (i.e., in the page cache) and, where the page tables
+ * are available, /proc/self/pagemap tells which pages this process
+ * has touched (faulted in) since it started.  Bytes are attributed
+ * to files exactly, but pages are counted once even when they are
+ * shared by neighboring files.
+ */
+#define XVFS_MEMORY_PAGE_BATCH 1024
+
+struct xvfs_memory_usage {
+	Tcl_WideInt size;
+	Tcl_WideInt resident;
+	Tcl_WideInt touched;
+};
+
+struct xvfs_memory_state {
+	unsigned long pageSize;
+	int           pagemapFd;
+	Tcl_HashTable edgePages;
+	Tcl_WideInt   pages;
+	Tcl_WideInt   residentPages;
+	Tcl_WideInt   touchedPages;
+	Tcl_Obj       *prefix;
+	int           skip;
+	Tcl_Obj       *files;
+};
+
+static Tcl_Obj *xvfs_memory_usageObj(struct xvfs_memory_state *state, struct xvfs_memory_usage *usage) {
+	Tcl_Obj *usageObj;
+
+	usageObj = Tcl_NewDictObj();
+	Tcl_DictObjPut(NULL, usageObj, Tcl_NewStringObj("size", -1), Tcl_NewWideIntObj(usage->size));
+	Tcl_DictObjPut(NULL, usageObj, Tcl_NewStringObj("resident", -1), Tcl_NewWideIntObj(usage->resident));
+	if (state->pagemapFd >= 0) {
+		Tcl_DictObjPut(NULL, usageObj, Tcl_NewStringObj("touched", -1), Tcl_NewWideIntObj(usage->touched));
+	}
+
+	return(usageObj);
+}
+
+/*
+ * Account for one contiguous range of embedded data, returning 0 or
+ * XVFS_RV_ERR_INTERNAL with errno set
+ */
+static int xvfs_memoryRange(struct xvfs_memory_state *state, const unsigned char *data, Tcl_WideInt length, struct xvfs_memory_usage *usage) {
+	unsigned char residency[XVFS_MEMORY_PAGE_BATCH];
+#ifdef XVFS_HAVE_PAGEMAP
+	uint64_t pagemap[XVFS_MEMORY_PAGE_BATCH];
+	ssize_t pagemapRead;
+#endif
+	unsigned long start, end, firstPage, lastPage, page, batchEnd, overlapStart, overlapEnd;
+	Tcl_WideInt overlap;
+	int isResident, isTouched, isNew, idx;
+
+	if (length <= 0 || !data) {
+		return(0);
+	}
+
+	start = (unsigned long) data;
+	end = start + length;
+	firstPage = start & ~(state->pageSize - 1);
+	lastPage = (end - 1) & ~(state->pageSize - 1);
+
+	for (page = firstPage; page <= lastPage; page = batchEnd) {
+		batchEnd = page + XVFS_MEMORY_PAGE_BATCH * state->pageSize;
+		if (batchEnd > lastPage + state->pageSize) {
+			batchEnd = lastPage + state->pageSize;
+		}
+
+		if (mincore((void *) page, batchEnd - page, (void *) residency) != 0) {
+			return(XVFS_RV_ERR_INTERNAL);
+		}
+
+#ifdef XVFS_HAVE_PAGEMAP
+		if (state->pagemapFd >= 0) {
+			pagemapRead = pread(state->pagemapFd, pagemap, ((batchEnd - page) / state->pageSize) * sizeof(*pagemap), (off_t) ((page / state->pageSize) * sizeof(*pagemap)));
+			if (pagemapRead != (ssize_t) (((batchEnd - page) / state->pageSize) * sizeof(*pagemap))) {
+				return(XVFS_RV_ERR_INTERNAL);
+			}
+		}
+#endif
+
+		for (idx = 0; page + idx * state->pageSize < batchEnd; idx++) {
+			overlapStart = page + idx * state->pageSize;
+			overlapEnd = overlapStart + state->pageSize;
+			if (overlapStart < start) {
+				overlapStart = start;
+			}
+			if (overlapEnd > end) {
+				overlapEnd = end;
+			}
+			overlap = overlapEnd - overlapStart;
+
+			isResident = residency[idx] & 1;
+			isTouched = 0;
+#ifdef XVFS_HAVE_PAGEMAP
+			if (state->pagemapFd >= 0) {
+				/* Bit 63 is "page present" */
+				isTouched = (pagemap[idx] >> 63) & 1;
+			}
+#endif
+
+			usage->size += overlap;
+			if (isResident) {
+				usage->resident += overlap;
+			}
+			if (isTouched) {
+				usage->touched += overlap;
+			}
+
+			/*
+			 * Only the first and last pages of a range may be
+			 * shared with another file
+			 */
+			isNew = 1;
+			if (page + idx * state->pageSize == firstPage || page + idx * state->pageSize == lastPage) {
+				Tcl_CreateHashEntry(&state->edgePages, (const char *) (page + idx * state->pageSize), &isNew);
+			}
+			if (isNew) {
+				state->pages++;
+				state->residentPages += isResident;
+				state->touchedPages += isTouched;
+			}
+		}
+	}
+
+	return(0);
+}
+
+/*
+ * Account for the embedded data of a file, or every file beneath a
+ * directory, recording each of them if asked to
+ */
+static int xvfs_memory(struct Xvfs_FSInfo *fsInfo, Tcl_DString *path, struct xvfs_memory_state *state, struct xvfs_memory_usage *usage) {
+	struct xvfs_memory_usage childUsage;
+	const unsigned char *data;
+	const char **children;
+	Tcl_WideInt length, childrenCount, idx;
+	Tcl_Obj *pathObj;
+	int pathLen, retval;
+
+	length = 0;
+	data = fsInfo->getDataProc(Tcl_DStringValue(path), XVFS_INODE_NULL, 0, &length);
+	if (length >= 0) {
+		return(xvfs_memoryRange(state, data, length, usage));
+	}
+
+	if (length != XVFS_RV_ERR_EISDIR) {
+		return(length);
+	}
+
+	children = fsInfo->getChildrenProc(Tcl_DStringValue(path), XVFS_INODE_NULL, &childrenCount);
+	if (childrenCount < 0) {
+		return(childrenCount);
+	}
+
+	pathLen = Tcl_DStringLength(path);
+	for (idx = 0; idx < childrenCount; idx++) {
+		if (pathLen != 0) {
+			Tcl_DStringAppend(path, "/", 1);
+		}
+		Tcl_DStringAppend(path, children[idx], -1);
+
+		memset(&childUsage, 0, sizeof(childUsage));
+		retval = xvfs_memory(fsInfo, path, state, &childUsage);
+		if (retval == 0 && state->files) {
+			pathObj = Tcl_DuplicateObj(state->prefix);
+			Tcl_AppendToObj(pathObj, Tcl_DStringValue(path) + state->skip, -1);
+			Tcl_DictObjPut(NULL, state->files, pathObj, xvfs_memory_usageObj(state, &childUsage));
+		}
+
+		Tcl_DStringSetLength(path, pathLen);
+
+		if (retval < 0) {
+			return(retval);
+		}
+
+		usage->size += childUsage.size;
+		usage->resident += childUsage.resident;
+		usage->touched += childUsage.touched;
+	}
+
+	return(0);
+}
+#endif
+
+/*
+ * Report how much of the embedded data beneath a path is resident
+ * and how much this process has touched, along with the table
+ * describing the entries of the image, and optionally the same for
+ * every file and directory beneath the path
+ */
+static int xvfs_tclfs_memoryCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+#ifdef XVFS_HAVE_MINCORE
+	static const char *const optionNames[] = {"-files", NULL};
+	struct xvfs_tclfs_command_reference reference;
+	struct xvfs_memory_state state, metadataState;
+	struct xvfs_memory_usage usage, metadataUsage;
+	struct Xvfs_FSInfo *fsInfo;
+	const unsigned char *metadata;
+	Tcl_WideInt metadataLength;
+	Tcl_Obj *relativePath, *pathObj, *resultObj;
+	Tcl_DString path;
+	const char *directory;
+	int directoryLen, wantFiles, optionIndex;
+	int retval;
+
+	if (objc != 2 && objc != 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-files? path");
+
+		return(TCL_ERROR);
+	}
+
+	wantFiles = 0;
+	if (objc == 3) {
+		if (Tcl_GetIndexFromObj(interp, objv[1], optionNames, "option", 0, &optionIndex) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+
+		wantFiles = 1;
+	}
+	pathObj = objv[objc - 1];
+
+	fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, pathObj, &relativePath, &reference);
+	if (!fsInfo) {
+		return(TCL_ERROR);
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.pageSize = sysconf(_SC_PAGESIZE);
+	state.pagemapFd = -1;
+#ifdef XVFS_HAVE_PAGEMAP
+	state.pagemapFd = open("/proc/self/pagemap", O_RDONLY);
+#endif
+	Tcl_InitHashTable(&state.edgePages, TCL_ONE_WORD_KEYS);
+
+	if (wantFiles) {
+		directory = Tcl_GetStringFromObj(pathObj, &directoryLen);
+		while (directoryLen > 1 && directory[directoryLen - 1] == '/') {
+			directoryLen--;
+		}
+
+		state.prefix = Tcl_NewStringObj(directory, directoryLen);
+		Tcl_AppendToObj(state.prefix, "/", 1);
+		Tcl_IncrRefCount(state.prefix);
+
+		state.skip = 0;
+		if (Tcl_GetCharLength(relativePath) != 0) {
+			state.skip = strlen(Tcl_GetString(relativePath)) + 1;
+		}
+
+		state.files = Tcl_NewDictObj();
+		Tcl_IncrRefCount(state.files);
+	}
+
+	Tcl_DStringInit(&path);
+	Tcl_DStringAppend(&path, Tcl_GetString(relativePath), -1);
+	Tcl_DecrRefCount(relativePath);
+
+	memset(&usage, 0, sizeof(usage));
+	retval = xvfs_memory(fsInfo, &path, &state, &usage);
+
+	/*
+	 * The metadata is accounted for separately, its pages are not
+	 * counted with those of the data
+	 */
+	memset(&metadataUsage, 0, sizeof(metadataUsage));
+	metadata = NULL;
+	if (retval == 0 && fsInfo->protocolVersion >= 5 && fsInfo->getMetadataProc) {
+		metadata = fsInfo->getMetadataProc(&metadataLength);
+		if (metadata) {
+			memset(&metadataState, 0, sizeof(metadataState));
+			metadataState.pageSize = state.pageSize;
+			metadataState.pagemapFd = state.pagemapFd;
+			Tcl_InitHashTable(&metadataState.edgePages, TCL_ONE_WORD_KEYS);
+
+			retval = xvfs_memoryRange(&metadataState, metadata, metadataLength, &metadataUsage);
+
+			Tcl_DeleteHashTable(&metadataState.edgePages);
+		}
+	}
+
+	Tcl_DStringFree(&path);
+	Tcl_DeleteHashTable(&state.edgePages);
+	xvfs_tclfs_commandRelease(&reference);
+
+	if (retval < 0) {
+		if (state.files) {
+			Tcl_DecrRefCount(state.files);
+			Tcl_DecrRefCount(state.prefix);
+		}
+		if (state.pagemapFd >= 0) {
+			close(state.pagemapFd);
+		}
+
+		if (retval == XVFS_RV_ERR_INTERNAL) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to query memory: %s", Tcl_ErrnoMsg(Tcl_GetErrno())));
+		} else {
+			xvfs_setresults_error(interp, retval);
+		}
+
+		return(TCL_ERROR);
+	}
+
+	resultObj = xvfs_memory_usageObj(&state, &usage);
+	Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("pages", -1), Tcl_NewWideIntObj(state.pages));
+	Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("residentPages", -1), Tcl_NewWideIntObj(state.residentPages));
+	if (state.pagemapFd >= 0) {
+		Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("touchedPages", -1), Tcl_NewWideIntObj(state.touchedPages));
+	}
+	if (metadata) {
+		Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("metadata", -1), xvfs_memory_usageObj(&state, &metadataUsage));
+	}
+	if (state.files) {
+		Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("files", -1), state.files);
+		Tcl_DecrRefCount(state.files);
+		Tcl_DecrRefCount(state.prefix);
+	}
+
+	if (state.pagemapFd >= 0) {
+		close(state.pagemapFd);
+	}
+
+	Tcl_SetObjResult(interp, resultObj);
+
+	return(TCL_OK);
+#else
+	Tcl_SetResult(interp, "memory accounting is not supported on this platform", NULL);
+
+	return(TCL_ERROR);
+#endif
+}
+
+/*
+ * Write embedded data to a channel in large slices, bypassing the
+ * channel's buffers, encoding, and translation, returning 0 or an
+ * errno value.  A non-blocking channel may take only part of the
+ * data, how much was written is stored in *writtenPtr (if given).
+ */
+#define XVFS_WRITE_SLICE_SIZE (64 * 1024 * 1024)
+
+static int xvfs_writeRaw(Tcl_Channel channel, const unsigned char *data, Tcl_WideInt length, Tcl_WideInt *writtenPtr) {
+	Tcl_WideInt offset, slice;
+	int written, errorCode;
+
+	errorCode = 0;
+	for (offset = 0; offset < length; offset += written) {
+		slice = length - offset;
+		if (slice > XVFS_WRITE_SLICE_SIZE) {
+			slice = XVFS_WRITE_SLICE_SIZE;
+		}
+
+		written = Tcl_WriteRaw(channel, (const char *) data + offset, (int) slice);
+		if (written <= 0) {
+			errorCode = Tcl_GetErrno();
+			if (errorCode == EAGAIN || errorCode == EWOULDBLOCK) {
+				errorCode = 0;
+			} else if (errorCode == 0) {
+				errorCode = EIO;
+			}
+
+			break;
+		}
+	}
+
+	if (writtenPtr) {
+		*writtenPtr = offset;
+	}
+
+	return(errorCode);
+}
+
+/*
+ * Extraction
+ *
+ * Copies a file, or a directory and everything beneath it, out of
+ * an image onto another filesystem.  Directories are created first
+ * by the calling thread, then the files are written straight from
+ * the embedded data, without any intermediate buffering, by a pool
+ * of worker threads.
+ */
+#define XVFS_EXTRACT_MAX_JOBS 64
+
+struct xvfs_extract_file {
+	char                *path;
+	const unsigned char *data;
+	Tcl_WideInt         length;
+};
+
+struct xvfs_extract_state {
+	struct xvfs_extract_file *files;
+	Tcl_WideInt              fileCount;
+	Tcl_WideInt              fileLen;
+	Tcl_WideInt              nextFile;
+	Tcl_WideInt              errorFile;
+	int                      errorCode;
+	Tcl_Mutex                mutex;
+};
+
+static int xvfs_extractDefaultJobs(void) {
+#ifdef _SC_NPROCESSORS_ONLN
+	long processors;
+
+	processors = sysconf(_SC_NPROCESSORS_ONLN);
+	if (processors > 0) {
+		return(processors);
+	}
+#endif
+
+	return(1);
+}
+
+static int xvfs_extractCollect(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo, Tcl_DString *path, Tcl_DString *target, struct xvfs_extract_state *state) {
+	struct xvfs_extract_file *file;
+	const unsigned char *data;
+	const char **children;
+	Tcl_WideInt length, childrenCount, idx;
+	Tcl_StatBuf targetInfo;
+	Tcl_Obj *targetObj;
+	int pathLen, targetLen;
+	int errorCode, retval;
+
+	length = 0;
+	data = fsInfo->getDataProc(Tcl_DStringValue(path), XVFS_INODE_NULL, 0, &length);
+	if (length >= 0) {
+		if (state->fileCount == state->fileLen) {
+			state->fileLen = state->fileLen * 2 + 64;
+			state->files = (struct xvfs_extract_file *) Tcl_Realloc((char *) state->files, sizeof(*state->files) * state->fileLen);
+		}
+
+		file = &state->files[state->fileCount];
+		state->fileCount++;
+
+		file->path = Tcl_Alloc(Tcl_DStringLength(target) + 1);
+		memcpy(file->path, Tcl_DStringValue(target), Tcl_DStringLength(target) + 1);
+		file->data = data;
+		file->length = length;
+
+		return(TCL_OK);
+	}
+
+	if (length != XVFS_RV_ERR_EISDIR) {
+		xvfs_setresults_error(interp, length);
+
+		return(TCL_ERROR);
+	}
+
+	children = fsInfo->getChildrenProc(Tcl_DStringValue(path), XVFS_INODE_NULL, &childrenCount);
+	if (childrenCount < 0) {
+		xvfs_setresults_error(interp, childrenCount);
+
+		return(TCL_ERROR);
+	}
+
+	targetObj = Tcl_NewStringObj(Tcl_DStringValue(target), Tcl_DStringLength(target));
+	Tcl_IncrRefCount(targetObj);
+	if (Tcl_FSCreateDirectory(targetObj) != TCL_OK) {
+		errorCode = Tcl_GetErrno();
+		if (errorCode != EEXIST || Tcl_FSStat(targetObj, &targetInfo) != 0 || (targetInfo.st_mode & 040000) == 0) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to create directory \"%s\": %s", Tcl_GetString(targetObj), Tcl_ErrnoMsg(errorCode)));
+			Tcl_DecrRefCount(targetObj);
+
+			return(TCL_ERROR);
+		}
+	}
+	Tcl_DecrRefCount(targetObj);
+
+	pathLen = Tcl_DStringLength(path);
+	targetLen = Tcl_DStringLength(target);
+	for (idx = 0; idx < childrenCount; idx++) {
+		if (pathLen != 0) {
+			Tcl_DStringAppend(path, "/", 1);
+		}
+		Tcl_DStringAppend(path, children[idx], -1);
+
+		Tcl_DStringAppend(target, "/", 1);
+		Tcl_DStringAppend(target, children[idx], -1);
+
+		retval = xvfs_extractCollect(interp, fsInfo, path, target, state);
+
+		Tcl_DStringSetLength(path, pathLen);
+		Tcl_DStringSetLength(target, targetLen);
+
+		if (retval != TCL_OK) {
+			return(retval);
+		}
+	}
+
+	return(TCL_OK);
+}
+
+/*
+ * Write one file, returning 0 or an errno value
+ */
+static int xvfs_extractWrite(struct xvfs_extract_file *file) {
+	Tcl_Channel channel;
+	Tcl_Obj *pathObj;
+	int errorCode;
+
+	pathObj = Tcl_NewStringObj(file->path, -1);
+	Tcl_IncrRefCount(pathObj);
+	channel = Tcl_FSOpenFileChannel(NULL, pathObj, "w", 0666);
+	Tcl_DecrRefCount(pathObj);
+	if (!channel) {
+		errorCode = Tcl_GetErrno();
+		if (errorCode == 0) {
+			errorCode = EIO;
+		}
+
+		return(errorCode);
+	}
+
+	errorCode = xvfs_writeRaw(channel, file->data, file->length, NULL);
+
+	if (Tcl_Close(NULL, channel) != TCL_OK && errorCode == 0) {
+		errorCode = Tcl_GetErrno();
+	}
+
+	return(errorCode);
+}
+
+static void xvfs_extractRun(struct xvfs_extract_state *state) {
+	Tcl_WideInt idx;
+	int errorCode;
+
+	while (1) {
+		Tcl_MutexLock(&state->mutex);
+		if (state->errorCode != 0 || state->nextFile >= state->fileCount) {
+			Tcl_MutexUnlock(&state->mutex);
+
+			break;
+		}
+		idx = state->nextFile;
+		state->nextFile++;
+		Tcl_MutexUnlock(&state->mutex);
+
+		errorCode = xvfs_extractWrite(&state->files[idx]);
+		if (errorCode != 0) {
+			Tcl_MutexLock(&state->mutex);
+			if (state->errorCode == 0) {
+				state->errorCode = errorCode;
+				state->errorFile = idx;
+			}
+			Tcl_MutexUnlock(&state->mutex);
+		}
+	}
+
+	return;
+}
+
+#ifdef TCL_THREADS
+static Tcl_ThreadCreateType xvfs_extractWorker(ClientData clientData) {
+	xvfs_extractRun((struct xvfs_extract_state *) clientData);
+
+	Tcl_ExitThread(0);
+
+	TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+static int xvfs_tclfs_extractCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	static const char *optionNames[] = {"-jobs", NULL};
+	struct xvfs_tclfs_command_reference reference;
+	struct xvfs_extract_state state;
+	struct Xvfs_FSInfo *fsInfo;
+	const Tcl_Filesystem *targetHandler;
+	struct xvfs_tclfs_server_info *targetHandlerData;
+	Tcl_ThreadId threads[XVFS_EXTRACT_MAX_JOBS];
+	Tcl_Obj *relativePath, *targetObj;
+	Tcl_DString path, target;
+	Tcl_WideInt idx;
+	int threadCount, threadResult;
+	int jobs, optionIndex, argIdx;
+	int retval;
+
+	if (objc < 3 || (objc % 2) != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "source target ?-jobs count?");
+
+		return(TCL_ERROR);
+	}
+
+	jobs = xvfs_extractDefaultJobs();
+	for (argIdx = 3; argIdx < objc; argIdx += 2) {
+		if (Tcl_GetIndexFromObj(interp, objv[argIdx], optionNames, "option", 0, &optionIndex) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+
+		if (Tcl_GetIntFromObj(interp, objv[argIdx + 1], &jobs) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+
+		if (jobs < 1) {
+			Tcl_SetResult(interp, "-jobs must be at least 1", NULL);
+
+			return(TCL_ERROR);
+		}
+	}
+	if (jobs > XVFS_EXTRACT_MAX_JOBS) {
+		jobs = XVFS_EXTRACT_MAX_JOBS;
+	}
+
+	targetHandler = Tcl_FSGetFileSystemForPath(objv[2]);
+	targetHandlerData = NULL;
+	if (targetHandler) {
+		targetHandlerData = (struct xvfs_tclfs_server_info *) Tcl_FSData(targetHandler);
+	}
+	if (targetHandlerData && memcmp(targetHandlerData->magic, XVFS_INTERNAL_SERVER_MAGIC, sizeof(targetHandlerData->magic)) == 0) {
+		xvfs_setresults_error(interp, XVFS_RV_ERR_EROFS);
+
+		return(TCL_ERROR);
+	}
+
+	targetObj = Tcl_FSGetNormalizedPath(interp, objv[2]);
+	if (!targetObj) {
+		return(TCL_ERROR);
+	}
+
+	fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, objv[1], &relativePath, &reference);
+	if (!fsInfo) {
+		return(TCL_ERROR);
+	}
+
+	memset(&state, 0, sizeof(state));
+
+	Tcl_DStringInit(&path);
+	Tcl_DStringAppend(&path, Tcl_GetString(relativePath), -1);
+	Tcl_DecrRefCount(relativePath);
+
+	Tcl_DStringInit(&target);
+	Tcl_DStringAppend(&target, Tcl_GetString(targetObj), -1);
+
+	retval = xvfs_extractCollect(interp, fsInfo, &path, &target, &state);
+
+	Tcl_DStringFree(&path);
+	Tcl_DStringFree(&target);
+
+	if (retval == TCL_OK) {
+		threadCount = 0;
+		if (jobs > state.fileCount) {
+			jobs = state.fileCount;
+		}
+
+		/*
+		 * Without thread support (or if threads cannot be
+		 * created) the calling thread does all the work
+		 */
+#ifdef TCL_THREADS
+		while (threadCount < jobs - 1) {
+			if (Tcl_CreateThread(&threads[threadCount], xvfs_extractWorker, (ClientData) &state, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) != TCL_OK) {
+				break;
+			}
+
+			threadCount++;
+		}
+#endif
+
+		xvfs_extractRun(&state);
+
+		for (idx = 0; idx < threadCount; idx++) {
+			Tcl_JoinThread(threads[idx], &threadResult);
+		}
+
+		if (state.errorCode != 0) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("unable to write \"%s\": %s", state.files[state.errorFile].path, Tcl_ErrnoMsg(state.errorCode)));
+
+			retval = TCL_ERROR;
+		}
+	}
+
+	for (idx = 0; idx < state.fileCount; idx++) {
+		Tcl_Free(state.files[idx].path);
+	}
+	if (state.files) {
+		Tcl_Free((char *) state.files);
+	}
+	Tcl_MutexFinalize(&state.mutex);
+
+	xvfs_tclfs_commandRelease(&reference);
+
+	return(retval);
+}
+
+/*
+ * Prefetching
+ *
+ * Files are queued, in priority order, for a background thread
+ * which asks the kernel to read them ahead (where madvise() is
+ * available) and then touches every page of their embedded data,
+ * a chunk at a time, so that the first reads of them by the
+ * interpreter do not take a major fault each.  Each batch of files
+ * holds a reference to the image it came from, which is released
+ * on the thread that queued it once the batch is done or canceled.
+ * Without thread support (TCL_THREADS) the files are prefetched by
+ * the calling thread before the command returns.
+ */
+#define XVFS_PREFETCH_CHUNK_SIZE (256 * 1024)
+
+struct xvfs_prefetch_range {
+	const unsigned char *data;
+	Tcl_WideInt         length;
+};
+
+struct xvfs_prefetch_batch {
+	struct xvfs_prefetch_batch          *next;
+	struct xvfs_prefetch_range          *ranges;
+	Tcl_WideInt                         rangeCount;
+	Tcl_WideInt                         rangeLen;
+	Tcl_WideInt                         nextRange;
+	Tcl_WideInt                         offset;
+	int                                 inFlight;
+	struct xvfs_tclfs_command_reference reference;
+	Tcl_ThreadId                        owner;
+};
+
+struct xvfs_prefetch_event {
+	Tcl_Event                  header;
+	struct xvfs_prefetch_batch *batch;
+};
+
+#define XVFS_PREFETCH_THREAD_NONE     0
+#define XVFS_PREFETCH_THREAD_RUNNING  1
+#define XVFS_PREFETCH_THREAD_FINISHED 2
+
+TCL_DECLARE_MUTEX(xvfs_prefetchMutex)
+#ifdef TCL_THREADS
+static Tcl_Condition xvfs_prefetchCondition = NULL;
+static Tcl_ThreadId xvfs_prefetchThread;
+static int xvfs_prefetchThreadState = XVFS_PREFETCH_THREAD_NONE;
+static int xvfs_prefetchExitHandler = 0;
+#endif
+static struct xvfs_prefetch_batch *xvfs_prefetchQueue = NULL;
+static Tcl_WideInt xvfs_prefetchQueued = 0;
+static Tcl_WideInt xvfs_prefetchFiles = 0;
+static Tcl_WideInt xvfs_prefetchCanceled = 0;
+static Tcl_WideInt xvfs_prefetchBytes = 0;
+
+static int xvfs_prefetchReleaseEvent(Tcl_Event *event_p, int flags) {
+	struct xvfs_prefetch_batch *batch;
+
+	batch = ((struct xvfs_prefetch_event *) event_p)->batch;
+
+	xvfs_tclfs_commandRelease(&batch->reference);
+
+	Tcl_Free((char *) batch->ranges);
+	Tcl_Free((char *) batch);
+
+	return(1);
+}
+
+/*
+ * Remove a batch which is done from the queue, handing it back to
+ * the thread that queued it to be freed.  Must be called with the
+ * mutex held.
+ */
+static void xvfs_prefetchFinish(struct xvfs_prefetch_batch *batch) {
+	struct xvfs_prefetch_batch **link;
+	struct xvfs_prefetch_event *event;
+
+	for (link = &xvfs_prefetchQueue; *link; link = &(*link)->next) {
+		if (*link == batch) {
+			*link = batch->next;
+
+			break;
+		}
+	}
+
+	event = (struct xvfs_prefetch_event *) Tcl_Alloc(sizeof(*event));
+	event->header.proc = xvfs_prefetchReleaseEvent;
+	event->batch = batch;
+
+	Tcl_ThreadQueueEvent(batch->owner, (Tcl_Event *) event, TCL_QUEUE_TAIL);
+	Tcl_ThreadAlert(batch->owner);
+
+	Tcl_ConditionNotify(&xvfs_prefetchCondition);
+
+	return;
+}
+
+static void xvfs_prefetchTouch(const unsigned char *data, Tcl_WideInt length) {
+	const volatile unsigned char *bytes;
+	Tcl_WideInt offset, pageSize;
+	unsigned char sum;
+
+#ifdef XVFS_HAVE_MADVISE
+	pageSize = sysconf(_SC_PAGESIZE);
+#else
+	pageSize = 4096;
+#endif
+
+	/*
+	 * One byte from every page faults them all in, the reads are
+	 * volatile so that they are not optimized away
+	 */
+	bytes = (const volatile unsigned char *) data;
+	sum = 0;
+	for (offset = 0; offset < length; offset += pageSize) {
+		sum += bytes[offset];
+	}
+	sum += bytes[length - 1];
+
+	(void) sum;
+
+	return;
+}
+
+/*
+ * Prefetch everything queued, a chunk at a time so that canceling
+ * takes effect promptly
+ */
+static void xvfs_prefetchRun(void) {
+	struct xvfs_prefetch_batch *batch;
+	struct xvfs_prefetch_range *range;
+	const unsigned char *data;
+	Tcl_WideInt length;
+	int firstChunk, lastChunk;
+
+	Tcl_MutexLock(&xvfs_prefetchMutex);
+	while (1) {
+		for (batch = xvfs_prefetchQueue; batch; batch = batch->next) {
+			if (batch->nextRange < batch->rangeCount) {
+				break;
+			}
+		}
+
+		if (!batch) {
+			break;
+		}
+
+		range = &batch->ranges[batch->nextRange];
+		firstChunk = (batch->offset == 0);
+		data = range->data + batch->offset;
+		length = range->length - batch->offset;
+		if (length > XVFS_PREFETCH_CHUNK_SIZE) {
+			length = XVFS_PREFETCH_CHUNK_SIZE;
+		}
+
+		batch->offset += length;
+		lastChunk = (batch->offset >= range->length);
+		if (lastChunk) {
+			batch->nextRange++;
+			batch->offset = 0;
+		}
+		batch->inFlight++;
+		Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+#ifdef XVFS_HAVE_MADVISE
+		/*
+		 * The kernel reads the whole file ahead while the first
+		 * chunk is being touched
+		 */
+		if (firstChunk) {
+			xvfs_adviseRange(range->data, range->length, MADV_WILLNEED);
+		}
+#else
+		(void) firstChunk;
+#endif
+
+		xvfs_prefetchTouch(data, length);
+
+		Tcl_MutexLock(&xvfs_prefetchMutex);
+		batch->inFlight--;
+		xvfs_prefetchBytes += length;
+		if (lastChunk) {
+			xvfs_prefetchFiles++;
+		}
+
+		if (batch->nextRange >= batch->rangeCount && batch->inFlight == 0) {
+			xvfs_prefetchFinish(batch);
+		}
+	}
+	Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+	return;
+}
+
+#ifdef TCL_THREADS
+static Tcl_ThreadCreateType xvfs_prefetchWorker(ClientData clientData) {
+	xvfs_prefetchRun();
+
+	Tcl_MutexLock(&xvfs_prefetchMutex);
+	xvfs_prefetchThreadState = XVFS_PREFETCH_THREAD_FINISHED;
+	Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+	Tcl_ExitThread(0);
+
+	TCL_THREAD_CREATE_RETURN;
+}
+#endif
+
+/*
+ * Drop everything that has not been prefetched yet, returning the
+ * number of files dropped.  Must be called with the mutex held.
+ */
+static Tcl_WideInt xvfs_prefetchCancel(void) {
+	struct xvfs_prefetch_batch *batch, *next;
+	Tcl_WideInt canceled;
+
+	canceled = 0;
+	for (batch = xvfs_prefetchQueue; batch; batch = next) {
+		next = batch->next;
+
+		canceled += batch->rangeCount - batch->nextRange;
+		batch->nextRange = batch->rangeCount;
+
+		/*
+		 * The worker finishes the batch it is in the middle of
+		 */
+		if (batch->inFlight == 0) {
+			xvfs_prefetchFinish(batch);
+		}
+	}
+
+	xvfs_prefetchCanceled += canceled;
+
+	return(canceled);
+}
+
+#ifdef TCL_THREADS
+/*
+ * The worker is stopped before Tcl is finalized
+ */
+static void xvfs_prefetchExit(ClientData clientData) {
+	int threadResult;
+
+	Tcl_MutexLock(&xvfs_prefetchMutex);
+	xvfs_prefetchCancel();
+	Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+	if (xvfs_prefetchThreadState != XVFS_PREFETCH_THREAD_NONE) {
+		Tcl_JoinThread(xvfs_prefetchThread, &threadResult);
+		xvfs_prefetchThreadState = XVFS_PREFETCH_THREAD_NONE;
+	}
+
+	return;
+}
+#endif
+
+/*
+ * Queue a batch, starting the worker if it is not running
+ */
+static void xvfs_prefetchQueueBatch(struct xvfs_prefetch_batch *batch) {
+	struct xvfs_prefetch_batch **link;
+#ifdef TCL_THREADS
+	int threadResult;
+#endif
+	int runHere;
+
+	batch->owner = Tcl_GetCurrentThread();
+
+	Tcl_MutexLock(&xvfs_prefetchMutex);
+	for (link = &xvfs_prefetchQueue; *link; link = &(*link)->next) {
+		/* Find the tail */
+	}
+	*link = batch;
+	xvfs_prefetchQueued += batch->rangeCount;
+
+	runHere = 1;
+#ifdef TCL_THREADS
+	if (xvfs_prefetchThreadState == XVFS_PREFETCH_THREAD_FINISHED) {
+		Tcl_JoinThread(xvfs_prefetchThread, &threadResult);
+		xvfs_prefetchThreadState = XVFS_PREFETCH_THREAD_NONE;
+	}
+
+	if (xvfs_prefetchThreadState == XVFS_PREFETCH_THREAD_NONE) {
+		if (!xvfs_prefetchExitHandler) {
+			Tcl_CreateExitHandler(xvfs_prefetchExit, NULL);
+			xvfs_prefetchExitHandler = 1;
+		}
+
+		if (Tcl_CreateThread(&xvfs_prefetchThread, xvfs_prefetchWorker, NULL, TCL_THREAD_STACK_DEFAULT, TCL_THREAD_JOINABLE) == TCL_OK) {
+			xvfs_prefetchThreadState = XVFS_PREFETCH_THREAD_RUNNING;
+		}
+	}
+
+	if (xvfs_prefetchThreadState == XVFS_PREFETCH_THREAD_RUNNING) {
+		runHere = 0;
+	}
+#endif
+	Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+	if (runHere) {
+		xvfs_prefetchRun();
+	}
+
+	return;
+}
+
+static void xvfs_prefetchAddRange(struct xvfs_prefetch_batch *batch, const unsigned char *data, Tcl_WideInt length) {
+	if (length <= 0) {
+		return;
+	}
+
+	if (batch->rangeCount == batch->rangeLen) {
+		batch->rangeLen = batch->rangeLen * 2 + 64;
+		batch->ranges = (struct xvfs_prefetch_range *) Tcl_Realloc((char *) batch->ranges, sizeof(*batch->ranges) * batch->rangeLen);
+	}
+
+	batch->ranges[batch->rangeCount].data = data;
+	batch->ranges[batch->rangeCount].length = length;
+	batch->rangeCount++;
+
+	return;
+}
+
+/*
+ * Collect the embedded data for a file, or every file beneath a
+ * directory
+ */
+static int xvfs_prefetchCollect(struct Xvfs_FSInfo *fsInfo, Tcl_DString *path, struct xvfs_prefetch_batch *batch) {
+	const unsigned char *data;
+	const char **children;
+	Tcl_WideInt length, childrenCount, idx;
+	int pathLen, retval;
+
+	length = 0;
+	data = fsInfo->getDataProc(Tcl_DStringValue(path), XVFS_INODE_NULL, 0, &length);
+	if (length >= 0) {
+		xvfs_prefetchAddRange(batch, data, length);
+
+		return(0);
+	}
+
+	if (length != XVFS_RV_ERR_EISDIR) {
+		return(length);
+	}
+
+	children = fsInfo->getChildrenProc(Tcl_DStringValue(path), XVFS_INODE_NULL, &childrenCount);
+	if (childrenCount < 0) {
+		return(childrenCount);
+	}
+
+	pathLen = Tcl_DStringLength(path);
+	for (idx = 0; idx < childrenCount; idx++) {
+		if (pathLen != 0) {
+			Tcl_DStringAppend(path, "/", 1);
+		}
+		Tcl_DStringAppend(path, children[idx], -1);
+
+		retval = xvfs_prefetchCollect(fsInfo, path, batch);
+
+		Tcl_DStringSetLength(path, pathLen);
+
+		if (retval < 0) {
+			return(retval);
+		}
+	}
+
+	return(0);
+}
+
+/*
+ * Collect the files profiled when the image was built
+ */
+static void xvfs_prefetchCollectProfile(struct Xvfs_FSInfo *fsInfo, struct xvfs_prefetch_batch *batch) {
+	const unsigned char *data;
+	const long *inodes;
+	Tcl_WideInt count, length, idx;
+
+	if (fsInfo->protocolVersion < 6 || !fsInfo->getPrefetchProc) {
+		return;
+	}
+
+	inodes = fsInfo->getPrefetchProc(&count);
+	for (idx = 0; inodes && idx < count; idx++) {
+		length = 0;
+		data = fsInfo->getDataProc(NULL, inodes[idx], 0, &length);
+		xvfs_prefetchAddRange(batch, data, length);
+	}
+
+	return;
+}
+
+/*
+ * Prefetch files in the background:
+ *     xvfs::prefetch ?-profile? path ?path ...?
+ * queues each file (or every file beneath each directory), or with
+ * -profile the files profiled when the image each path is in was
+ * built, and returns the number of files queued
+ *     xvfs::prefetch -cancel
+ * drops everything not yet prefetched and returns the number of files
+ * dropped
+ *     xvfs::prefetch -wait
+ * waits until everything queued has been prefetched
+ *     xvfs::prefetch -status
+ * returns counts of the files pending, prefetched, and canceled, and
+ * of the bytes prefetched
+ */
+static int xvfs_tclfs_prefetchCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	static const char *const optionNames[] = {"-cancel", "-profile", "-status", "-wait", NULL};
+	enum { XVFS_PREFETCH_CANCEL, XVFS_PREFETCH_PROFILE, XVFS_PREFETCH_STATUS, XVFS_PREFETCH_WAIT };
+	struct xvfs_prefetch_batch **batches;
+	struct Xvfs_FSInfo *fsInfo;
+	Tcl_Obj *relativePath, *resultObj;
+	Tcl_DString path;
+	Tcl_WideInt queued, canceled;
+	int optionIndex, argIdx, batchCount, idx;
+	int profile;
+	int retval;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-profile? path ?path ...?");
+
+		return(TCL_ERROR);
+	}
+
+	profile = 0;
+	argIdx = 1;
+	if (Tcl_GetString(objv[1])[0] == '-') {
+		if (Tcl_GetIndexFromObj(interp, objv[1], optionNames, "option", 0, &optionIndex) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+
+		if (optionIndex != XVFS_PREFETCH_PROFILE && objc != 2) {
+			Tcl_WrongNumArgs(interp, 1, objv, optionNames[optionIndex]);
+
+			return(TCL_ERROR);
+		}
+
+		switch (optionIndex) {
+			case XVFS_PREFETCH_CANCEL:
+				Tcl_MutexLock(&xvfs_prefetchMutex);
+				canceled = xvfs_prefetchCancel();
+				Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+				Tcl_SetObjResult(interp, Tcl_NewWideIntObj(canceled));
+
+				return(TCL_OK);
+			case XVFS_PREFETCH_STATUS:
+				resultObj = Tcl_NewDictObj();
+
+				Tcl_MutexLock(&xvfs_prefetchMutex);
+				Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("pending", -1), Tcl_NewWideIntObj(xvfs_prefetchQueued - xvfs_prefetchFiles - xvfs_prefetchCanceled));
+				Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("prefetched", -1), Tcl_NewWideIntObj(xvfs_prefetchFiles));
+				Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("canceled", -1), Tcl_NewWideIntObj(xvfs_prefetchCanceled));
+				Tcl_DictObjPut(NULL, resultObj, Tcl_NewStringObj("bytes", -1), Tcl_NewWideIntObj(xvfs_prefetchBytes));
+				Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+				Tcl_SetObjResult(interp, resultObj);
+
+				return(TCL_OK);
+			case XVFS_PREFETCH_WAIT:
+				Tcl_MutexLock(&xvfs_prefetchMutex);
+				while (xvfs_prefetchQueue) {
+					Tcl_ConditionWait(&xvfs_prefetchCondition, &xvfs_prefetchMutex, NULL);
+				}
+				Tcl_MutexUnlock(&xvfs_prefetchMutex);
+
+				return(TCL_OK);
+		}
+
+		if (objc < 3) {
+			Tcl_WrongNumArgs(interp, 1, objv, "?-profile? path ?path ...?");
+
+			return(TCL_ERROR);
+		}
+
+		profile = 1;
+		argIdx = 2;
+	}
+
+	/*
+	 * Every path is resolved before anything is queued, so that
+	 * nothing is queued if any of them is invalid
+	 */
+	batches = (struct xvfs_prefetch_batch **) Tcl_Alloc(sizeof(*batches) * objc);
+	batchCount = 0;
+	retval = TCL_OK;
+	for (; argIdx < objc; argIdx++) {
+		batches[batchCount] = (struct xvfs_prefetch_batch *) Tcl_Alloc(sizeof(**batches));
+		memset(batches[batchCount], 0, sizeof(**batches));
+
+		fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, objv[argIdx], &relativePath, &batches[batchCount]->reference);
+		if (!fsInfo) {
+			Tcl_Free((char *) batches[batchCount]);
+
+			retval = TCL_ERROR;
+
+			break;
+		}
+		batchCount++;
+
+		if (profile) {
+			Tcl_DecrRefCount(relativePath);
+
+			xvfs_prefetchCollectProfile(fsInfo, batches[batchCount - 1]);
+
+			continue;
+		}
+
+		Tcl_DStringInit(&path);
+		Tcl_DStringAppend(&path, Tcl_GetString(relativePath), -1);
+		Tcl_DecrRefCount(relativePath);
+
+		retval = xvfs_prefetchCollect(fsInfo, &path, batches[batchCount - 1]);
+
+		Tcl_DStringFree(&path);
+
+		if (retval < 0) {
+			xvfs_setresults_error(interp, retval);
+
+			retval = TCL_ERROR;
+
+			break;
+		}
+
+		retval = TCL_OK;
+	}
+
+	queued = 0;
+	for (idx = 0; idx < batchCount; idx++) {
+		if (retval != TCL_OK || batches[idx]->rangeCount == 0) {
+			xvfs_tclfs_commandRelease(&batches[idx]->reference);
+
+			if (batches[idx]->ranges) {
+				Tcl_Free((char *) batches[idx]->ranges);
+			}
+			Tcl_Free((char *) batches[idx]);
+
+			continue;
+		}
+
+		queued += batches[idx]->rangeCount;
+
+		xvfs_prefetchQueueBatch(batches[idx]);
+	}
+
+	Tcl_Free((char *) batches);
+
+	if (retval != TCL_OK) {
+		return(retval);
+	}
+
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(queued));
+
+	return(TCL_OK);
+}
+
+/*
+ * Send all or part of a file's embedded data to a channel, such as
+ * a socket.  The data goes directly from the image to the channel
+ * driver, after anything already buffered, so it is never
+ * translated or encoded.  Blocking channels are sent all of it.  A
+ * non-blocking channel is sent only as much as it takes without
+ * waiting, and nothing while output queued before is still being
+ * flushed in the background, so the result (the number of bytes
+ * sent) may be short and the caller sends the rest once the channel
+ * is writable again.
+ */
+static int xvfs_tclfs_sendfileCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	struct Xvfs_File *file;
+	const unsigned char *data;
+	Tcl_Channel channel;
+	Tcl_DString blocking;
+	Tcl_WideInt offset, length, size, sent;
+	int mode, isBlocking, errorCode;
+
+	if (objc < 3 || objc > 5) {
+		Tcl_WrongNumArgs(interp, 1, objv, "path channel ?offset? ?length?");
+
+		return(TCL_ERROR);
+	}
+
+	channel = Tcl_GetChannel(interp, Tcl_GetString(objv[2]), &mode);
+	if (!channel) {
+		return(TCL_ERROR);
+	}
+
+	if ((mode & TCL_WRITABLE) == 0) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("channel \"%s\" wasn't opened for writing", Tcl_GetString(objv[2])));
+
+		return(TCL_ERROR);
+	}
+
+	offset = 0;
+	if (objc > 3 && Tcl_GetWideIntFromObj(interp, objv[3], &offset) != TCL_OK) {
+		return(TCL_ERROR);
+	}
+
+	length = -1;
+	if (objc > 4 && Tcl_GetWideIntFromObj(interp, objv[4], &length) != TCL_OK) {
+		return(TCL_ERROR);
+	}
+
+	if (offset < 0 || (objc > 4 && length < 0)) {
+		Tcl_SetResult(interp, "offset and length must not be negative", NULL);
+
+		return(TCL_ERROR);
+	}
+
+	file = Xvfs_Lookup(interp, Tcl_GetString(objv[1]));
+	if (!file) {
+		return(TCL_ERROR);
+	}
+
+	Xvfs_MapFile(file, &data, &size);
+	if (offset > size) {
+		Xvfs_ReleaseFile(file);
+
+		xvfs_setresults_error(interp, XVFS_RV_ERR_EFAULT);
+
+		return(TCL_ERROR);
+	}
+
+	data += offset;
+	sent = size - offset;
+	if (length >= 0 && length < sent) {
+		sent = length;
+	}
+
+	Tcl_DStringInit(&blocking);
+	Tcl_GetChannelOption(NULL, channel, "-blocking", &blocking);
+	isBlocking = strcmp(Tcl_DStringValue(&blocking), "0") != 0;
+	Tcl_DStringFree(&blocking);
+
+	errorCode = 0;
+	if (Tcl_Flush(channel) != TCL_OK) {
+		errorCode = Tcl_GetErrno();
+	} else if (!isBlocking && Tcl_OutputBuffered(channel) != 0) {
+		sent = 0;
+	} else {
+		errorCode = xvfs_writeRaw(channel, data, sent, &sent);
+	}
+
+	/*
+	 * Everything has been written by now, so nothing refers to the
+	 * image past this point
+	 */
+	Xvfs_ReleaseFile(file);
+
+	if (errorCode != 0) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("error writing \"%s\": %s", Tcl_GetString(objv[2]), Tcl_ErrnoMsg(errorCode)));
+
+		return(TCL_ERROR);
+	}
+
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(sent));
+
+	return(TCL_OK);
+}
+
+/*
+ * Subtree walks
+ *
+ * Images with preorder inode numbering (protocol version 4) walk
+ * a subtree in a single pass over a contiguous range of inodes,
+ * older ones are walked one directory at a time.
+ */
+#define XVFS_WALK_TYPE_DIRECTORY 1
+#define XVFS_WALK_TYPE_FILE      2
+
+struct xvfs_walk_state {
+	Tcl_Obj    *result;
+	Tcl_Obj    *prefix;
+	int        skip;
+	const char *pattern;
+	int        types;
+};
+
+static Tcl_WideInt xvfs_walkChildren(struct Xvfs_FSInfo *fsInfo, Tcl_DString *path, xvfs_walk_callback_t callback, void *clientData, int *stopped) {
+	const char **children;
+	Tcl_WideInt childrenCount, grandchildrenCount, idx, count, retval;
+	int pathLen, isDirectory;
+
+	children = fsInfo->getChildrenProc(Tcl_DStringValue(path), XVFS_INODE_NULL, &childrenCount);
+	if (childrenCount < 0) {
+		return(childrenCount);
+	}
+
+	count = 0;
+	pathLen = Tcl_DStringLength(path);
+	for (idx = 0; idx < childrenCount && !*stopped; idx++) {
+		if (pathLen != 0) {
+			Tcl_DStringAppend(path, "/", 1);
+		}
+		Tcl_DStringAppend(path, children[idx], -1);
+
+		fsInfo->getChildrenProc(Tcl_DStringValue(path), XVFS_INODE_NULL, &grandchildrenCount);
+		isDirectory = (grandchildrenCount >= 0);
+
+		count++;
+		if (callback(Tcl_DStringValue(path), XVFS_INODE_NULL, isDirectory, clientData) != 0) {
+			*stopped = 1;
+		}
+
+		if (isDirectory && !*stopped) {
+			retval = xvfs_walkChildren(fsInfo, path, callback, clientData, stopped);
+			if (retval < 0) {
+				Tcl_DStringSetLength(path, pathLen);
+
+				return(retval);
+			}
+
+			count += retval;
+		}
+
+		Tcl_DStringSetLength(path, pathLen);
+	}
+
+	return(count);
+}
+
+static Tcl_WideInt xvfs_walk(struct Xvfs_FSInfo *fsInfo, const char *path, xvfs_walk_callback_t callback, void *clientData) {
+	Tcl_DString pathBuffer;
+	Tcl_WideInt retval;
+	int stopped;
+
+	if (fsInfo->protocolVersion >= 4 && fsInfo->walkProc) {
+		return(fsInfo->walkProc(path, XVFS_INODE_NULL, callback, clientData));
+	}
+
+	stopped = 0;
+
+	Tcl_DStringInit(&pathBuffer);
+	Tcl_DStringAppend(&pathBuffer, path, -1);
+
+	retval = xvfs_walkChildren(fsInfo, &pathBuffer, callback, clientData, &stopped);
+
+	Tcl_DStringFree(&pathBuffer);
+
+	return(retval);
+}
+
+static int xvfs_tclfs_walkCallback(const char *path, long inode, int isDirectory, void *clientData) {
+	struct xvfs_walk_state *state;
+	const char *tail;
+	Tcl_Obj *pathObj;
+
+	state = (struct xvfs_walk_state *) clientData;
+
+	if (!(state->types & (isDirectory ? XVFS_WALK_TYPE_DIRECTORY : XVFS_WALK_TYPE_FILE))) {
+		return(0);
+	}
+
+	if (state->pattern) {
+		tail = strrchr(path, '/');
+		if (tail) {
+			tail++;
+		} else {
+			tail = path;
+		}
+
+		if (!Tcl_StringMatch(tail, state->pattern)) {
+			return(0);
+		}
+	}
+
+	pathObj = Tcl_DuplicateObj(state->prefix);
+	Tcl_AppendToObj(pathObj, path + state->skip, -1);
+	Tcl_ListObjAppendElement(NULL, state->result, pathObj);
+
+	return(0);
+}
+
+/*
+ * List everything beneath a directory, each directory before its
+ * contents, optionally limited to files or directories whose names
+ * match a pattern
+ */
+static int xvfs_tclfs_walkCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	static const char *const optionNames[] = {"-pattern", "-types", NULL};
+	static const char *const typeNames[] = {"d", "f", NULL};
+	static const int typeValues[] = {XVFS_WALK_TYPE_DIRECTORY, XVFS_WALK_TYPE_FILE};
+	enum { XVFS_WALK_OPTION_PATTERN, XVFS_WALK_OPTION_TYPES };
+	struct xvfs_tclfs_command_reference reference;
+	struct xvfs_walk_state state;
+	struct Xvfs_FSInfo *fsInfo;
+	Tcl_Obj *relativePath, **typeObjs;
+	Tcl_WideInt retval;
+	const char *directory;
+	int optionIndex, typeIndex, typeCount, directoryLen, argIdx, idx;
+
+	if (objc < 2 || (objc % 2) != 0) {
+		Tcl_WrongNumArgs(interp, 1, objv, "directory ?-types f|d? ?-pattern pattern?");
+
+		return(TCL_ERROR);
+	}
+
+	state.pattern = NULL;
+	state.types = XVFS_WALK_TYPE_DIRECTORY | XVFS_WALK_TYPE_FILE;
+	for (argIdx = 2; argIdx < objc; argIdx += 2) {
+		if (Tcl_GetIndexFromObj(interp, objv[argIdx], optionNames, "option", 0, &optionIndex) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+
+		switch (optionIndex) {
+			case XVFS_WALK_OPTION_PATTERN:
+				state.pattern = Tcl_GetString(objv[argIdx + 1]);
+				break;
+			case XVFS_WALK_OPTION_TYPES:
+				if (Tcl_ListObjGetElements(interp, objv[argIdx + 1], &typeCount, &typeObjs) != TCL_OK) {
+					return(TCL_ERROR);
+				}
+
+				state.types = 0;
+				for (idx = 0; idx < typeCount; idx++) {
+					if (Tcl_GetIndexFromObj(interp, typeObjs[idx], typeNames, "type", 0, &typeIndex) != TCL_OK) {
+						return(TCL_ERROR);
+					}
+
+					state.types |= typeValues[typeIndex];
+				}
+				break;
+		}
+	}
+
+	fsInfo = xvfs_tclfs_commandPathToFSInfo(interp, objv[1], &relativePath, &reference);
+	if (!fsInfo) {
+		return(TCL_ERROR);
+	}
+
+	/*
+	 * Results are named relative to the directory as given, the
+	 * walk names them relative to the root of the filesystem
+	 */
+	directory = Tcl_GetStringFromObj(objv[1], &directoryLen);
+	while (directoryLen > 1 && directory[directoryLen - 1] == '/') {
+		directoryLen--;
+	}
+
+	state.prefix = Tcl_NewStringObj(directory, directoryLen);
+	Tcl_AppendToObj(state.prefix, "/", 1);
+	Tcl_IncrRefCount(state.prefix);
+
+	state.skip = 0;
+	if (Tcl_GetCharLength(relativePath) != 0) {
+		state.skip = strlen(Tcl_GetString(relativePath)) + 1;
+	}
+
+	state.result = Tcl_NewObj();
+	Tcl_IncrRefCount(state.result);
+
+	retval = xvfs_walk(fsInfo, Tcl_GetString(relativePath), xvfs_tclfs_walkCallback, &state);
+
+	xvfs_tclfs_commandRelease(&reference);
+	Tcl_DecrRefCount(relativePath);
+	Tcl_DecrRefCount(state.prefix);
+
+	if (retval < 0) {
+		Tcl_DecrRefCount(state.result);
+
+		xvfs_setresults_error(interp, retval);
+
+		return(TCL_ERROR);
+	}
+
+	Tcl_SetObjResult(interp, state.result);
+	Tcl_DecrRefCount(state.result);
+
+	return(TCL_OK);
+}
+
+/*
+ * Cursors over large directories ("xvfs::readdir"), built on the C
+ * directory API.  Each interpreter keeps its open cursors by name,
+ * and closes any left open when it is deleted.
+ */
+#define XVFS_TCLFS_READDIR_ASSOC "xvfs::readdir"
+#define XVFS_TCLFS_READDIR_BATCH 64
+
+struct xvfs_tclfs_readdir_cursors {
+	Tcl_HashTable cursors;
+	unsigned long nextId;
+};
+
+struct xvfs_tclfs_readdir_cursor {
+	struct Xvfs_Dir *dir;
+	int             inodes;
+};
+
+static void xvfs_tclfs_readdirFree(struct xvfs_tclfs_readdir_cursor *cursor) {
+	Xvfs_CloseDir(cursor->dir);
+	Tcl_Free((char *) cursor);
+
+	return;
+}
+
+static void xvfs_tclfs_readdirDeleteAssoc(ClientData clientData, Tcl_Interp *interp) {
+	struct xvfs_tclfs_readdir_cursors *cursors;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch search;
+
+	cursors = (struct xvfs_tclfs_readdir_cursors *) clientData;
+
+	for (entry = Tcl_FirstHashEntry(&cursors->cursors, &search); entry; entry = Tcl_NextHashEntry(&search)) {
+		xvfs_tclfs_readdirFree((struct xvfs_tclfs_readdir_cursor *) Tcl_GetHashValue(entry));
+	}
+
+	Tcl_DeleteHashTable(&cursors->cursors);
+	Tcl_Free((char *) cursors);
+
+	return;
+}
+
+static int xvfs_tclfs_readdirOpen(Tcl_Interp *interp, struct xvfs_tclfs_readdir_cursors *cursors, int objc, Tcl_Obj *const objv[]) {
+	static const char *const optionNames[] = {"-inodes", "-pattern", "-types", NULL};
+	static const char *const typeNames[] = {"d", "f", NULL};
+	static const int typeValues[] = {XVFS_DIR_TYPE_DIRECTORY, XVFS_DIR_TYPE_FILE};
+	enum { XVFS_READDIR_OPTION_INODES, XVFS_READDIR_OPTION_PATTERN, XVFS_READDIR_OPTION_TYPES };
+	struct xvfs_tclfs_readdir_cursor *cursor;
+	struct Xvfs_Dir *dir;
+	Tcl_HashEntry *entry;
+	Tcl_Obj **typeObjs, *nameObj;
+	const char *pattern;
+	int optionIndex, typeIndex, typeCount, types, inodes, isNew, argIdx, idx;
+
+	if (objc < 3 || (objc % 2) != 1) {
+		Tcl_WrongNumArgs(interp, 2, objv, "directory ?-types f|d? ?-pattern pattern? ?-inodes boolean?");
+
+		return(TCL_ERROR);
+	}
+
+	pattern = NULL;
+	types = 0;
+	inodes = 0;
+	for (argIdx = 3; argIdx < objc; argIdx += 2) {
+		if (Tcl_GetIndexFromObj(interp, objv[argIdx], optionNames, "option", 0, &optionIndex) != TCL_OK) {
+			return(TCL_ERROR);
+		}
+
+		switch (optionIndex) {
+			case XVFS_READDIR_OPTION_INODES:
+				if (Tcl_GetBooleanFromObj(interp, objv[argIdx + 1], &inodes) != TCL_OK) {
+					return(TCL_ERROR);
+				}
+				break;
+			case XVFS_READDIR_OPTION_PATTERN:
+				pattern = Tcl_GetString(objv[argIdx + 1]);
+				break;
+			case XVFS_READDIR_OPTION_TYPES:
+				if (Tcl_ListObjGetElements(interp, objv[argIdx + 1], &typeCount, &typeObjs) != TCL_OK) {
+					return(TCL_ERROR);
+				}
+
+				types = 0;
+				for (idx = 0; idx < typeCount; idx++) {
+					if (Tcl_GetIndexFromObj(interp, typeObjs[idx], typeNames, "type", 0, &typeIndex) != TCL_OK) {
+						return(TCL_ERROR);
+					}
+
+					types |= typeValues[typeIndex];
+				}
+				break;
+		}
+	}
+
+	dir = Xvfs_OpenDir(interp, Tcl_GetString(objv[2]), types, pattern);
+	if (!dir) {
+		return(TCL_ERROR);
+	}
+
+	cursor = (struct xvfs_tclfs_readdir_cursor *) Tcl_Alloc(sizeof(*cursor));
+	cursor->dir = dir;
+	cursor->inodes = inodes;
+
+	nameObj = Tcl_ObjPrintf("xvfsdir%lu", cursors->nextId);
+	cursors->nextId++;
+
+	entry = Tcl_CreateHashEntry(&cursors->cursors, Tcl_GetString(nameObj), &isNew);
+	Tcl_SetHashValue(entry, (ClientData) cursor);
+
+	Tcl_SetObjResult(interp, nameObj);
+
+	return(TCL_OK);
+}
+
+static int xvfs_tclfs_readdirNext(Tcl_Interp *interp, struct xvfs_tclfs_readdir_cursor *cursor, Tcl_WideInt count) {
+	const char *names[XVFS_TCLFS_READDIR_BATCH];
+	long inodes[XVFS_TCLFS_READDIR_BATCH];
+	Tcl_WideInt filled, listed, idx;
+	Tcl_Obj *result;
+
+	result = Tcl_NewObj();
+	listed = 0;
+	while (count > 0) {
+		if (cursor->inodes) {
+			filled = Xvfs_ReadDir(cursor->dir, NULL, inodes, count < XVFS_TCLFS_READDIR_BATCH ? count : XVFS_TCLFS_READDIR_BATCH);
+		} else {
+			filled = Xvfs_ReadDir(cursor->dir, names, NULL, count < XVFS_TCLFS_READDIR_BATCH ? count : XVFS_TCLFS_READDIR_BATCH);
+		}
+
+		/*
+		 * Entries already listed are returned, the error is
+		 * reported by the next call
+		 */
+		if (filled < 0) {
+			if (listed != 0) {
+				break;
+			}
+
+			Tcl_DecrRefCount(result);
+
+			xvfs_setresults_error(interp, filled);
+
+			return(TCL_ERROR);
+		}
+
+		if (filled == 0) {
+			break;
+		}
+
+		for (idx = 0; idx < filled; idx++) {
+			if (cursor->inodes) {
+				Tcl_ListObjAppendElement(NULL, result, Tcl_NewLongObj(inodes[idx]));
+			} else {
+				Tcl_ListObjAppendElement(NULL, result, Tcl_NewStringObj(names[idx], -1));
+			}
+		}
+
+		count -= filled;
+		listed += filled;
+	}
+
+	Tcl_SetObjResult(interp, result);
+
+	return(TCL_OK);
+}
+
+/*
+ * Page through a directory: "open" returns a cursor, each "next"
+ * returns the names (or inodes) of up to "count" further entries,
+ * an empty list once there are none left, and "close" releases it
+ */
+static int xvfs_tclfs_readdirCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	static const char *const subcommands[] = {"close", "next", "open", NULL};
+	enum { XVFS_READDIR_CLOSE, XVFS_READDIR_NEXT, XVFS_READDIR_OPEN };
+	struct xvfs_tclfs_readdir_cursors *cursors;
+	struct xvfs_tclfs_readdir_cursor *cursor;
+	Tcl_HashEntry *entry;
+	Tcl_WideInt count;
+	int subcommand;
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "open|next|close ?arg ...?");
+
+		return(TCL_ERROR);
+	}
+
+	if (Tcl_GetIndexFromObj(interp, objv[1], subcommands, "subcommand", 0, &subcommand) != TCL_OK) {
+		return(TCL_ERROR);
+	}
+
+	cursors = (struct xvfs_tclfs_readdir_cursors *) Tcl_GetAssocData(interp, XVFS_TCLFS_READDIR_ASSOC, NULL);
+	if (!cursors) {
+		cursors = (struct xvfs_tclfs_readdir_cursors *) Tcl_Alloc(sizeof(*cursors));
+		Tcl_InitHashTable(&cursors->cursors, TCL_STRING_KEYS);
+		cursors->nextId = 0;
+		Tcl_SetAssocData(interp, XVFS_TCLFS_READDIR_ASSOC, xvfs_tclfs_readdirDeleteAssoc, (ClientData) cursors);
+	}
+
+	if (subcommand == XVFS_READDIR_OPEN) {
+		return(xvfs_tclfs_readdirOpen(interp, cursors, objc, objv));
+	}
+
+	if ((subcommand == XVFS_READDIR_CLOSE && objc != 3) || (subcommand == XVFS_READDIR_NEXT && objc != 3 && objc != 4)) {
+		Tcl_WrongNumArgs(interp, 2, objv, subcommand == XVFS_READDIR_NEXT ? "cursor ?count?" : "cursor");
+
+		return(TCL_ERROR);
+	}
+
+	entry = Tcl_FindHashEntry(&cursors->cursors, Tcl_GetString(objv[2]));
+	if (!entry) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("can not find directory cursor named \"%s\"", Tcl_GetString(objv[2])));
+
+		return(TCL_ERROR);
+	}
+	cursor = (struct xvfs_tclfs_readdir_cursor *) Tcl_GetHashValue(entry);
+
+	switch (subcommand) {
+		case XVFS_READDIR_CLOSE:
+			Tcl_DeleteHashEntry(entry);
+			xvfs_tclfs_readdirFree(cursor);
+			break;
+		case XVFS_READDIR_NEXT:
+			count = XVFS_TCLFS_READDIR_BATCH;
+			if (objc == 4) {
+				if (Tcl_GetWideIntFromObj(interp, objv[3], &count) != TCL_OK) {
+					return(TCL_ERROR);
+				}
+
+				if (count < 1) {
+					Tcl_SetObjResult(interp, Tcl_ObjPrintf("count must be a positive integer, got \"%s\"", Tcl_GetString(objv[3])));
+
+					return(TCL_ERROR);
+				}
+			}
+
+			return(xvfs_tclfs_readdirNext(interp, cursor, count));
+	}
+
+	return(TCL_OK);
+}
+
+/*
+ * Control runtime tracing: "on" and "off" start and stop recording,
+ * "dump" drains what has been recorded
+ */
+static int xvfs_tclfs_traceCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	static const char *const subcommands[] = {"dump", "off", "on", NULL};
+	enum { XVFS_TRACE_DUMP, XVFS_TRACE_OFF, XVFS_TRACE_ON };
+	int subcommand;
+
+	if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "on|off|dump");
+
+		return(TCL_ERROR);
+	}
+
+	if (Tcl_GetIndexFromObj(interp, objv[1], subcommands, "subcommand", 0, &subcommand) != TCL_OK) {
+		return(TCL_ERROR);
+	}
+
+	switch (subcommand) {
+		case XVFS_TRACE_DUMP:
+			Tcl_SetObjResult(interp, xvfs_traceDrain(interp));
+			break;
+		case XVFS_TRACE_OFF:
+			xvfs_traceEnableCopies(interp, 0);
+			break;
+		case XVFS_TRACE_ON:
+			xvfs_traceEnableCopies(interp, 1);
+			break;
+	}
+
+	return(TCL_OK);
+}
+
+/*
+ * Package index
+ *
+ * Images carry a list of every pkgIndex.tcl and Tcl module they
+ * contain, so that "package require" can be satisfied for
+ * directories inside xvfs without scanning them.  The index of
+ * each image registered into an interpreter is kept in
+ * ::xvfs::packageIndexes as a list of mountpoint/index pairs, which
+ * a "package unknown" handler consults before delegating to the
+ * previous handler.
+ */
+static const char *xvfs_tclfs_packageUnknownScript =
+	"namespace eval ::xvfs {}\n"
+	"if {[info commands ::xvfs::packageUnknown] eq \"\"} {\n"
+	"	proc ::xvfs::packageUnknown {next name args} {\n"
+	"		variable packageIndexes\n"
+	"		global auto_path\n"
+	"\n"
+	"		set tmRoots [list]\n"
+	"		if {[info exists ::tcl::tm::paths]} {\n"
+	"			set tmRoots $::tcl::tm::paths\n"
+	"		}\n"
+	"\n"
+	"		set xvfsAutoPath [list]\n"
+	"		set xvfsTmRoots [list]\n"
+	"		set seen [dict create]\n"
+	"		foreach {mountpoint index} $packageIndexes {\n"
+	"			foreach dir $auto_path {\n"
+	"				if {[string first \"$mountpoint/\" \"$dir/\"] == 0} {\n"
+	"					lappend xvfsAutoPath $dir\n"
+	"				}\n"
+	"			}\n"
+	"			foreach root $tmRoots {\n"
+	"				if {[string first \"$mountpoint/\" \"$root/\"] == 0} {\n"
+	"					lappend xvfsTmRoots $root\n"
+	"				}\n"
+	"			}\n"
+	"\n"
+	"			foreach record [split $index \"\\n\"] {\n"
+	"				lassign [split $record \"\\t\"] kind packages path\n"
+	"				if {$path eq \"\"} {\n"
+	"					continue\n"
+	"				}\n"
+	"				set path \"$mountpoint/$path\"\n"
+	"\n"
+	"				if {$kind eq \"pkgIndex\"} {\n"
+	"					if {$name ni $packages && \"*\" ni $packages} {\n"
+	"						continue\n"
+	"					}\n"
+	"\n"
+	"					regsub {/[^/]*$} $path {} dir\n"
+	"					regsub {/[^/]*$} $dir {} parentDir\n"
+	"					if {$dir ni $xvfsAutoPath && $parentDir ni $xvfsAutoPath} {\n"
+	"						continue\n"
+	"					}\n"
+	"\n"
+	"					if {[dict exists $seen $path]} {\n"
+	"						continue\n"
+	"					}\n"
+	"					dict set seen $path 1\n"
+	"\n"
+	"					if {[catch {\n"
+	"						::apply {{dir} { source \"$dir/pkgIndex.tcl\" } ::} $dir\n"
+	"					} err]} {\n"
+	"						catch {\n"
+	"							::tclLog \"error reading package index file $path: $err\"\n"
+	"						}\n"
+	"					}\n"
+	"				} elseif {$kind eq \"tm\"} {\n"
+	"					foreach root $xvfsTmRoots {\n"
+	"						if {[string first \"$root/\" $path] != 0} {\n"
+	"							continue\n"
+	"						}\n"
+	"\n"
+	"						set module [string range $path [string length \"$root/\"] end-3]\n"
+	"						if {![regexp {^(.*)-([[:digit:]][^-]*)$} $module -> package version]} {\n"
+	"							continue\n"
+	"						}\n"
+	"						set package [string map {/ ::} $package]\n"
+	"\n"
+	"						# Like tm.tcl, every module in the directory\n"
+	"						# that would hold the package is registered\n"
+	"						if {[namespace qualifiers $package] ne [namespace qualifiers $name] || [catch {package vcompare $version $version}]} {\n"
+	"							continue\n"
+	"						}\n"
+	"\n"
+	"						if {[package ifneeded $package $version] eq \"\"} {\n"
+	"							package ifneeded $package $version [list source -encoding utf-8 $path]\n"
+	"						}\n"
+	"					}\n"
+	"				}\n"
+	"			}\n"
+	"		}\n"
+	"\n"
+	"		if {[llength $next] == 0} {\n"
+	"			return\n"
+	"		}\n"
+	"\n"
+	"		# Everything else is left to the previous handler, without\n"
+	"		# the directories inside xvfs so it does not scan them\n"
+	"		set savedAutoPath $auto_path\n"
+	"		set filteredAutoPath [lmap dir $auto_path {\n"
+	"			if {$dir in $xvfsAutoPath} {\n"
+	"				continue\n"
+	"			}\n"
+	"			set dir\n"
+	"		}]\n"
+	"		set auto_path $filteredAutoPath\n"
+	"\n"
+	"		if {[llength $xvfsTmRoots] != 0} {\n"
+	"			set savedTmRoots $::tcl::tm::paths\n"
+	"			set filteredTmRoots [lmap root $::tcl::tm::paths {\n"
+	"				if {$root in $xvfsTmRoots} {\n"
+	"					continue\n"
+	"				}\n"
+	"				set root\n"
+	"			}]\n"
+	"			set ::tcl::tm::paths $filteredTmRoots\n"
+	"		}\n"
+	"\n"
+	"		try {\n"
+	"			uplevel 1 [list {*}$next $name {*}$args]\n"
+	"		} finally {\n"
+	"			if {$auto_path eq $filteredAutoPath} {\n"
+	"				set auto_path $savedAutoPath\n"
+	"			} else {\n"
+	"				foreach dir $xvfsAutoPath {\n"
+	"					if {$dir ni $auto_path} {\n"
+	"						lappend auto_path $dir\n"
+	"					}\n"
+	"				}\n"
+	"			}\n"
+	"\n"
+	"			if {[info exists savedTmRoots]} {\n"
+	"				if {$::tcl::tm::paths eq $filteredTmRoots} {\n"
+	"					set ::tcl::tm::paths $savedTmRoots\n"
+	"				} else {\n"
+	"					foreach root $xvfsTmRoots {\n"
+	"						if {$root ni $::tcl::tm::paths} {\n"
+	"							lappend ::tcl::tm::paths $root\n"
+	"						}\n"
+	"					}\n"
+	"				}\n"
+	"			}\n"
+	"		}\n"
+	"	}\n"
+	"}\n"
+	"if {![string match \"::xvfs::packageUnknown *\" [package unknown]]} {\n"
+	"	package unknown [list ::xvfs::packageUnknown [package unknown]]\n"
+	"}\n";
+
+static void xvfs_tclfs_registerPackageIndex(Tcl_Interp *interp, Tcl_Obj *mountpoint, struct Xvfs_FSInfo *fsInfo) {
+	const char *packageIndex;
+	int tclRet;
+
+	if (!interp) {
+		return;
+	}
+
+	if (fsInfo->protocolVersion < 2 || !fsInfo->getPackageIndexProc) {
+		return;
+	}
+
+	packageIndex = fsInfo->getPackageIndexProc();
+	if (!packageIndex || packageIndex[0] == '\0') {
+		return;
+	}
+
+	Tcl_SetVar2Ex(interp, "::xvfs::packageIndexes", NULL, mountpoint, TCL_GLOBAL_ONLY | TCL_APPEND_VALUE | TCL_LIST_ELEMENT);
+	Tcl_SetVar2(interp, "::xvfs::packageIndexes", NULL, packageIndex, TCL_GLOBAL_ONLY | TCL_APPEND_VALUE | TCL_LIST_ELEMENT);
+
+	tclRet = Tcl_EvalEx(interp, xvfs_tclfs_packageUnknownScript, -1, TCL_EVAL_GLOBAL);
+	if (tclRet != TCL_OK) {
+		XVFS_DEBUG_PRINTF("Unable to install package unknown handler: %s", Tcl_GetStringResult(interp));
+	}
+	Tcl_ResetResult(interp);
+
+	return;
+}
+
+/*
+ * Start prefetching the files profiled when the image was built, if
+ * it has any, once it is registered
+ */
+static void xvfs_tclfs_registerPrefetch(Tcl_Interp *interp, Tcl_Obj *mountpoint, struct Xvfs_FSInfo *fsInfo) {
+	Tcl_Obj *objv[3];
+	Tcl_WideInt count;
+	int tclRet, idx;
+
+	if (!interp) {
+		return;
+	}
+
+	if (fsInfo->protocolVersion < 6 || !fsInfo->getPrefetchProc) {
+		return;
+	}
+
+	if (!fsInfo->getPrefetchProc(&count) || count <= 0) {
+		return;
+	}
+
+	objv[0] = Tcl_NewStringObj("::xvfs::prefetch", -1);
+	objv[1] = Tcl_NewStringObj("-profile", -1);
+	objv[2] = mountpoint;
+	for (idx = 0; idx < 3; idx++) {
+		Tcl_IncrRefCount(objv[idx]);
+	}
+
+	tclRet = Tcl_EvalObjv(interp, 3, objv, TCL_EVAL_GLOBAL);
+	if (tclRet != TCL_OK) {
+		XVFS_DEBUG_PRINTF("Unable to start prefetching: %s", Tcl_GetStringResult(interp));
+	}
+	Tcl_ResetResult(interp);
+
+	for (idx = 0; idx < 3; idx++) {
+		Tcl_DecrRefCount(objv[idx]);
+	}
+
+	return;
+}
+
+/*
+ * Commands that already exist are left alone: they may belong to a
+ * copy of the core (such as the server) which outlives this one
+ */
+static void xvfs_tclfs_createCommand(Tcl_Interp *interp, const char *name, Tcl_ObjCmdProc *proc) {
+	Tcl_CmdInfo cmdInfo;
+
+	if (Tcl_GetCommandInfo(interp, name, &cmdInfo)) {
+		return;
+	}
+
+	Tcl_CreateObjCommand(interp, name, proc, NULL, NULL);
+
+	return;
+}
+
+static void xvfs_tclfs_createCommands(Tcl_Interp *interp) {
+	if (!interp) {
+		return;
+	}
+
+	xvfs_tclfs_createCommand(interp, "::xvfs::advise", xvfs_tclfs_adviseCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::extract", xvfs_tclfs_extractCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::memory", xvfs_tclfs_memoryCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::prefetch", xvfs_tclfs_prefetchCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::readdir", xvfs_tclfs_readdirCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::sendfile", xvfs_tclfs_sendfileCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::trace", xvfs_tclfs_traceCmd);
+	xvfs_tclfs_createCommand(interp, "::xvfs::walk", xvfs_tclfs_walkCmd);
+
+	return;
+}
+#endif /* XVFS_MODE_SERVER || XVFS_MODE_STANDALONE || XVFS_MODE_FLEIXBLE */
+
+#if defined(XVFS_MODE_STANDALONE) || defined(XVFS_MODE_FLEXIBLE)
+/*
+ * Tcl_Filesystem handlers for the standalone implementation
+ *
+ * A library may contain several filesystems, all of which are served
+ * by the one Tcl_Filesystem it registers, so each request is handed
+ * to the instance whose mountpoint the path is under
+ */
+static struct xvfs_tclfs_instance_info **xvfs_tclfs_standalone_infos = NULL;
+static int xvfs_tclfs_standalone_infoCount = 0;
+
+static struct xvfs_tclfs_instance_info *xvfs_tclfs_standalone_pathToInfo(Tcl_Obj *path) {
+	int idx;
+
+	/*
+	 * Tcl only hands us paths we have claimed, so with a single
+	 * filesystem there is nothing to check
+	 */
+	if (xvfs_tclfs_standalone_infoCount == 1) {
+		return(xvfs_tclfs_standalone_infos[0]);
+	}
+
+	for (idx = 0; idx < xvfs_tclfs_standalone_infoCount; idx++) {
+		if (xvfs_tclfs_pathInFilesystem(path, NULL, xvfs_tclfs_standalone_infos[idx]) == TCL_OK) {
+			return(xvfs_tclfs_standalone_infos[idx]);
+		}
+	}
+
+	return(NULL);
+}
+
+static int xvfs_tclfs_standalone_pathInFilesystem(Tcl_Obj *path, ClientData *dataPtr) {
+	int idx;
+
+	/*
+	 * Every filesystem is beneath the root, so other paths are
+	 * rejected once rather than by each of them
+	 */
+	if (xvfs_tclfs_standalone_infoCount != 1 && !xvfs_pathHasPrefix(path, XVFS_ROOT_MOUNTPOINT, strlen(XVFS_ROOT_MOUNTPOINT))) {
+		return(-1);
+	}
+
+	for (idx = 0; idx < xvfs_tclfs_standalone_infoCount; idx++) {
+		if (xvfs_tclfs_pathInFilesystem(path, dataPtr, xvfs_tclfs_standalone_infos[idx]) == TCL_OK) {
+			return(TCL_OK);
+		}
+	}
+
+	return(-1);
+}
+
+static ClientData xvfs_tclfs_standalone_createInternalRep(Tcl_Obj *path) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		return(NULL);
+	}
+
+	return(xvfs_tclfs_createInternalRep(path, instanceInfo));
+}
+
+static int xvfs_tclfs_standalone_stat(Tcl_Obj *path, Tcl_StatBuf *statBuf) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		Tcl_SetErrno(xvfs_errorToErrno(XVFS_RV_ERR_ENOENT));
+
+		return(-1);
+	}
+
+	return(xvfs_tclfs_stat(path, statBuf, instanceInfo));
+}
+
+static int xvfs_tclfs_standalone_chdir(Tcl_Obj *path) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		Tcl_SetErrno(xvfs_errorToErrno(XVFS_RV_ERR_ENOENT));
+
+		return(-1);
+	}
+
+	return(xvfs_tclfs_chdir(path, instanceInfo));
+}
+
+static int xvfs_tclfs_standalone_access(Tcl_Obj *path, int mode) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		return(-1);
+	}
+
+	return(xvfs_tclfs_access(path, mode, instanceInfo));
+}
+
+static Tcl_Channel xvfs_tclfs_standalone_openFileChannel(Tcl_Interp *interp, Tcl_Obj *path, int mode, int permissions) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		return(NULL);
+	}
+
+	return(xvfs_tclfs_openFileChannel(interp, path, mode, permissions, instanceInfo));
+}
+
+static int xvfs_tclfs_standalone_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj *pathPtr, const char *pattern, Tcl_GlobTypeData *types) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(pathPtr);
+	if (!instanceInfo) {
+		return(TCL_ERROR);
+	}
+
+	return(xvfs_tclfs_matchInDir(interp, resultPtr, pathPtr, pattern, types, instanceInfo));
+}
+
+static int xvfs_tclfs_standalone_fileAttrsGet(Tcl_Interp *interp, int index, Tcl_Obj *path, Tcl_Obj **objPtrRef) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		xvfs_setresults_error(interp, XVFS_RV_ERR_ENOENT);
+
+		return(TCL_ERROR);
+	}
+
+	return(xvfs_tclfs_fileAttrsGet(interp, index, path, objPtrRef, instanceInfo));
+}
+
+static struct Xvfs_FSInfo *xvfs_tclfs_standalone_pathToFSInfo(Tcl_Obj *path, Tcl_Obj **relativePath, ClientData *reference) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	const char *pathStr;
+
+	path = xvfs_absolutePath(path);
+
+	instanceInfo = xvfs_tclfs_standalone_pathToInfo(path);
+	if (!instanceInfo) {
+		Tcl_DecrRefCount(path);
+
+		return(NULL);
+	}
+
+	pathStr = xvfs_relativePath(path, instanceInfo);
+	if (!pathStr) {
+		Tcl_DecrRefCount(path);
+
+		return(NULL);
+	}
+
+	*relativePath = Tcl_NewStringObj(pathStr, -1);
+	Tcl_IncrRefCount(*relativePath);
+
+	Tcl_DecrRefCount(path);
+
+	return(instanceInfo->fsInfo);
+}
+
+/*
+ * There are three (3) modes of operation for Xvfs_Register:
+ *    1. standalone -- We register our own Tcl_Filesystem
+ *                     and handle requests under `//xvfs:/<fsName>`
+ *    2. client -- A single Tcl_Filesystem is registered for the
+ *                 interp to handle requests under `//xvfs:/` which
+ *                 then dispatches to the appropriate registered
+ *                 handler
+ *    3. flexible -- Attempts to find a core Xvfs instance for the
+ *                   process at runtime, if found do #2, otherwise
+ *                   fallback to #1
+ *
+ */
+static Tcl_Filesystem xvfs_tclfs_standalone_fs;
+static struct xvfs_tclfs_server_info xvfs_tclfs_standalone_fsdata;
+static int xvfs_standalone_register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	int tclRet;
+	int idx;
+	static int registered = 0;
+
+	/*
+	 * Commands are created for every interpreter we are loaded into
+	 */
+	xvfs_tclfs_createCommands(interp);
+	if (registered) {
+		xvfs_traceAddCopy(interp, &xvfs_tclfs_standalone_fsdata);
+	}
+
+	/*
+	 * Ensure this instance is not already registered
+	 */
+	for (idx = 0; idx < xvfs_tclfs_standalone_infoCount; idx++) {
+		instanceInfo = xvfs_tclfs_standalone_infos[idx];
+
+		if (instanceInfo->fsInfo == fsInfo) {
+			xvfs_tclfs_registerPackageIndex(interp, instanceInfo->mountpoint, fsInfo);
+
+			return(TCL_OK);
+		}
+	}
+
+	/*
+	 * In standalone mode, we only support the same protocol we are
+	 * compiling for.
+	 */
+	if (fsInfo->protocolVersion != XVFS_PROTOCOL_VERSION) {
+		if (interp) {
+			Tcl_SetResult(interp, "Protocol mismatch", NULL);
+		}
+		return(TCL_ERROR);
+	}
+
+	/*
+	 * Each filesystem gets its own generation, so that an inode a
+	 * path remembers from one is never used for another
+	 */
+	instanceInfo = (struct xvfs_tclfs_instance_info *) Tcl_Alloc(sizeof(*instanceInfo));
+	instanceInfo->fsInfo = fsInfo;
+	instanceInfo->fs = &xvfs_tclfs_standalone_fs;
+	instanceInfo->mountpoint = Tcl_NewObj();
+	instanceInfo->generation = xvfs_tclfs_standalone_infoCount;
+	instanceInfo->refCount = 1;
+	instanceInfo->loadHandle = NULL;
+
+	Tcl_IncrRefCount(instanceInfo->mountpoint);
+	Tcl_AppendStringsToObj(instanceInfo->mountpoint, XVFS_ROOT_MOUNTPOINT, fsInfo->name, NULL);
+
+	xvfs_tclfs_standalone_infos = (struct xvfs_tclfs_instance_info **) Tcl_Realloc((char *) xvfs_tclfs_standalone_infos, sizeof(*xvfs_tclfs_standalone_infos) * (xvfs_tclfs_standalone_infoCount + 1));
+	xvfs_tclfs_standalone_infos[xvfs_tclfs_standalone_infoCount] = instanceInfo;
+	xvfs_tclfs_standalone_infoCount++;
+
+	/*
+	 * The Tcl_Filesystem is registered once for all of them
+	 */
+	if (registered) {
+		Tcl_FSMountsChanged(&xvfs_tclfs_standalone_fs);
+
+		xvfs_tclfs_registerPackageIndex(interp, instanceInfo->mountpoint, fsInfo);
+		xvfs_tclfs_registerPrefetch(interp, instanceInfo->mountpoint, fsInfo);
+
+		return(TCL_OK);
+	}
+	registered = 1;
+
+	xvfs_tclfs_standalone_fs.typeName                   = "xvfsInstance";
+	xvfs_tclfs_standalone_fs.structureLength            = sizeof(xvfs_tclfs_standalone_fs);
+	xvfs_tclfs_standalone_fs.version                    = TCL_FILESYSTEM_VERSION_1;
+	xvfs_tclfs_standalone_fs.pathInFilesystemProc       = xvfs_tclfs_standalone_pathInFilesystem;
+	xvfs_tclfs_standalone_fs.dupInternalRepProc         = xvfs_tclfs_dupInternalRep;
+	xvfs_tclfs_standalone_fs.freeInternalRepProc        = xvfs_tclfs_freeInternalRep;
+	xvfs_tclfs_standalone_fs.internalToNormalizedProc   = NULL;
+	xvfs_tclfs_standalone_fs.createInternalRepProc      = xvfs_tclfs_standalone_createInternalRep;
+	xvfs_tclfs_standalone_fs.normalizePathProc          = NULL;
+	xvfs_tclfs_standalone_fs.filesystemPathTypeProc     = NULL;
+	xvfs_tclfs_standalone_fs.filesystemSeparatorProc    = NULL;
+	xvfs_tclfs_standalone_fs.statProc                   = xvfs_tclfs_standalone_stat;
+	xvfs_tclfs_standalone_fs.accessProc                 = xvfs_tclfs_standalone_access;
+	xvfs_tclfs_standalone_fs.openFileChannelProc        = xvfs_tclfs_standalone_openFileChannel;
+	xvfs_tclfs_standalone_fs.matchInDirectoryProc       = xvfs_tclfs_standalone_matchInDir;
+	xvfs_tclfs_standalone_fs.utimeProc                  = NULL;
+	xvfs_tclfs_standalone_fs.linkProc                   = NULL;
+	xvfs_tclfs_standalone_fs.listVolumesProc            = NULL;
+	xvfs_tclfs_standalone_fs.fileAttrStringsProc        = xvfs_tclfs_fileAttrStrings;
+	xvfs_tclfs_standalone_fs.fileAttrsGetProc           = xvfs_tclfs_standalone_fileAttrsGet;
+	xvfs_tclfs_standalone_fs.fileAttrsSetProc           = xvfs_tclfs_fileAttrsSet;
+	xvfs_tclfs_standalone_fs.createDirectoryProc        = NULL;
 	xvfs_tclfs_standalone_fs.removeDirectoryProc        = NULL;
 	xvfs_tclfs_standalone_fs.deleteFileProc             = NULL;
 	xvfs_tclfs_standalone_fs.copyFileProc               = NULL;
@@ -907,232 +4689,743 @@ static int xvfs_standalone_register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsIn
 	xvfs_tclfs_standalone_fs.lstatProc                  = NULL;
 	xvfs_tclfs_standalone_fs.loadFileProc               = NULL;
 	xvfs_tclfs_standalone_fs.getCwdProc                 = NULL;
-	xvfs_tclfs_standalone_fs.chdirProc                  = NULL;
+	xvfs_tclfs_standalone_fs.chdirProc                  = xvfs_tclfs_standalone_chdir;
+
+	memcpy(xvfs_tclfs_standalone_fsdata.magic, XVFS_INTERNAL_SERVER_MAGIC, XVFS_INTERNAL_SERVER_MAGIC_LEN);
+	xvfs_tclfs_standalone_fsdata.registerProc = NULL;
+	xvfs_tclfs_standalone_fsdata.pathToFSInfoProc = xvfs_tclfs_standalone_pathToFSInfo;
+	xvfs_tclfs_standalone_fsdata.releaseProc = NULL;
+	xvfs_tclfs_standalone_fsdata.traceEnableProc = xvfs_traceEnable;
+	xvfs_tclfs_standalone_fsdata.traceCollectProc = xvfs_traceCollect;
+
+	tclRet = Tcl_FSRegister((ClientData) &xvfs_tclfs_standalone_fsdata, &xvfs_tclfs_standalone_fs);
+	if (tclRet != TCL_OK) {
+		xvfs_tclfs_standalone_infoCount--;
+
+		Tcl_DecrRefCount(instanceInfo->mountpoint);
+		Tcl_Free((char *) instanceInfo);
+
+		if (interp) {
+			Tcl_SetResult(interp, "Tcl_FSRegister() failed", NULL);
+		}
+
+		return(tclRet);
+	}
+
+	xvfs_tclfs_prepareChannelType();
+
+	xvfs_accessTraceOpen();
+	xvfs_traceAddCopy(interp, &xvfs_tclfs_standalone_fsdata);
+
+	xvfs_tclfs_registerPackageIndex(interp, instanceInfo->mountpoint, fsInfo);
+	xvfs_tclfs_registerPrefetch(interp, instanceInfo->mountpoint, fsInfo);
+
+	return(TCL_OK);
+}
+#endif /* XVFS_MODE_STANDALONE || XVFS_MODE_FLEXIBLE */
+
+#if defined(XVFS_MODE_FLEXIBLE)
+static int xvfs_flexible_register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo) {
+	ClientData fsHandlerDataRaw;
+	struct xvfs_tclfs_server_info *fsHandlerData;
+	const Tcl_Filesystem *fsHandler;
+	int (*xvfs_register)(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo);
+	Tcl_Obj *rootPathObj;
+
+	XVFS_DEBUG_ENTER;
+
+	xvfs_register = &xvfs_standalone_register;
+
+	rootPathObj = Tcl_NewStringObj(XVFS_ROOT_MOUNTPOINT, -1);
+	if (!rootPathObj) {
+		XVFS_DEBUG_LEAVE;
+
+		return(xvfs_register(interp, fsInfo));
+	}
+
+	Tcl_IncrRefCount(rootPathObj);
+	fsHandler = Tcl_FSGetFileSystemForPath(rootPathObj);
+	Tcl_DecrRefCount(rootPathObj);
+
+	if (!fsHandler) {
+		XVFS_DEBUG_LEAVE;
+
+		return(xvfs_register(interp, fsInfo));
+	}
+
+	fsHandlerDataRaw = Tcl_FSData(fsHandler);
+	if (!fsHandlerDataRaw) {
+		XVFS_DEBUG_LEAVE;
+
+		return(xvfs_register(interp, fsInfo));
+	}
+
+	fsHandlerData = (struct xvfs_tclfs_server_info *) fsHandlerDataRaw;
+
+	/*
+	 * XXX:TODO: What is the chance that the handler for //xvfs:/ hold
+	 * client data smaller than XVFS_INTERNAL_SERVER_MAGIC_LEN ?
+	 */
+	if (memcmp(fsHandlerData->magic, XVFS_INTERNAL_SERVER_MAGIC, sizeof(fsHandlerData->magic)) == 0 && fsHandlerData->registerProc) {
+		XVFS_DEBUG_PUTS("Found a server handler");
+		xvfs_register = fsHandlerData->registerProc;
+
+		/*
+		 * The server may not have been loaded into this interpreter
+		 */
+		xvfs_tclfs_createCommands(interp);
+		xvfs_traceAddCopy(interp, fsHandlerData);
+	}
+
+	XVFS_DEBUG_LEAVE;
+
+	return(xvfs_register(interp, fsInfo));
+}
+#endif /* XVFS_MODE_FLEXIBLE */
+
+#if defined(XVFS_MODE_SERVER)
+static Tcl_Filesystem xvfs_tclfs_dispatch_fs;
+static Tcl_HashTable xvfs_tclfs_dispatch_map;
+static struct xvfs_tclfs_server_info xvfs_tclfs_dispatch_fsdata;
+static unsigned long xvfs_tclfs_dispatch_generation = 0;
+
+static int xvfs_tclfs_dispatch_pathInFS(Tcl_Obj *path, ClientData *dataPtr) {
+	XVFS_DEBUG_ENTER;
+
+	XVFS_DEBUG_PRINTF("Verifying that \"%s\" belongs in XVFS ...", Tcl_GetString(path));
+
+	if (!xvfs_pathHasPrefix(path, XVFS_ROOT_MOUNTPOINT, strlen(XVFS_ROOT_MOUNTPOINT))) {
+		XVFS_DEBUG_PUTS("... failed (incorrect prefix)");
+		XVFS_DEBUG_LEAVE;
+		return(-1);
+	}
+
+	XVFS_DEBUG_PUTS("... yes");
+
+	XVFS_DEBUG_LEAVE;
+
+	return(TCL_OK);
+}
+
+static struct xvfs_tclfs_instance_info *xvfs_tclfs_dispatch_pathToInfo(Tcl_Obj *path) {
+	Tcl_HashEntry *mapEntry;
+	struct xvfs_tclfs_instance_info *retval;
+	int rootLen;
+	char *pathStr, *fsName, *fsNameEnds, origSep;
+
+	XVFS_DEBUG_ENTER;
+
+	path = xvfs_absolutePath(path);
+
+	if (xvfs_tclfs_dispatch_pathInFS(path, NULL) != TCL_OK) {
+		Tcl_DecrRefCount(path);
+
+		XVFS_DEBUG_LEAVE;
+
+		return(NULL);
+	}
+
+	rootLen = strlen(XVFS_ROOT_MOUNTPOINT);
+	pathStr = Tcl_GetString(path);
+
+	fsName = ((char *) pathStr) + rootLen;
+
+	fsNameEnds = strchr(fsName, '/');
+	if (fsNameEnds) {
+		origSep = *fsNameEnds;
+		*fsNameEnds = '\0';
+	}
+
+	XVFS_DEBUG_PRINTF("... fsName = %s...", fsName);
+
+	/*
+	 * The instance found is retained for the caller, who must
+	 * release it, so that it cannot be unloaded if it is replaced
+	 * while still in use
+	 */
+	Tcl_MutexLock(&xvfs_tclfs_instanceMutex);
+
+	mapEntry = Tcl_FindHashEntry(&xvfs_tclfs_dispatch_map, fsName);
+
+	if (fsNameEnds) {
+		*fsNameEnds = origSep;
+	}
+
+	if (mapEntry) {
+		retval = (struct xvfs_tclfs_instance_info *) Tcl_GetHashValue(mapEntry);
+		retval->refCount++;
+		XVFS_DEBUG_PRINTF("... found a registered filesystem: %p", retval);
+	} else {
+		retval = NULL;
+		XVFS_DEBUG_PUTS("... found no registered filesystem.");
+	}
+
+	Tcl_MutexUnlock(&xvfs_tclfs_instanceMutex);
+
+	Tcl_DecrRefCount(path);
+
+	XVFS_DEBUG_LEAVE;
+	return(retval);
+
+	/*
+	 * UNREACH: We do no need the more specific check because we
+	 * claim everything under the root, but we want to suppress
+	 * a warning about it not being used.
+	 */
+	xvfs_tclfs_pathInFilesystem(NULL, NULL, NULL);
+	return(NULL);
+}
+
+static struct Xvfs_FSInfo *xvfs_tclfs_dispatch_pathToFSInfo(Tcl_Obj *path, Tcl_Obj **relativePath, ClientData *reference) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	const char *pathStr;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		return(NULL);
+	}
+
+	path = xvfs_absolutePath(path);
+
+	pathStr = xvfs_relativePath(path, instanceInfo);
+	if (!pathStr) {
+		Tcl_DecrRefCount(path);
+
+		xvfs_tclfs_instanceRelease(instanceInfo);
+
+		return(NULL);
+	}
+
+	*relativePath = Tcl_NewStringObj(pathStr, -1);
+	Tcl_IncrRefCount(*relativePath);
+
+	Tcl_DecrRefCount(path);
+
+	*reference = (ClientData) instanceInfo;
+
+	return(instanceInfo->fsInfo);
+}
+
+static void xvfs_tclfs_dispatch_release(ClientData reference) {
+	xvfs_tclfs_instanceRelease((struct xvfs_tclfs_instance_info *) reference);
+
+	return;
+}
+
+static ClientData xvfs_tclfs_dispatch_createInternalRep(Tcl_Obj *path) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	ClientData retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		return(NULL);
+	}
+
+	retval = xvfs_tclfs_createInternalRep(path, instanceInfo);
+
+	xvfs_tclfs_instanceRelease(instanceInfo);
+
+	return(retval);
+}
+
+static int xvfs_tclfs_dispatch_stat(Tcl_Obj *path, Tcl_StatBuf *statBuf) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	int retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		Tcl_SetErrno(xvfs_errorToErrno(XVFS_RV_ERR_ENOENT));
+
+		return(-1);
+	}
+
+	retval = xvfs_tclfs_stat(path, statBuf, instanceInfo);
+
+	xvfs_tclfs_instanceRelease(instanceInfo);
+
+	return(retval);
+}
+
+static int xvfs_tclfs_dispatch_chdir(Tcl_Obj *path) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	int retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		Tcl_SetErrno(xvfs_errorToErrno(XVFS_RV_ERR_ENOENT));
+
+		return(-1);
+	}
+
+	retval = xvfs_tclfs_chdir(path, instanceInfo);
+
+	xvfs_tclfs_instanceRelease(instanceInfo);
+
+	return(retval);
+}
+
+static int xvfs_tclfs_dispatch_access(Tcl_Obj *path, int mode) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	int retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		return(-1);
+	}
+
+	retval = xvfs_tclfs_access(path, mode, instanceInfo);
+
+	xvfs_tclfs_instanceRelease(instanceInfo);
+
+	return(retval);
+}
+
+static Tcl_Channel xvfs_tclfs_dispatch_openFileChannel(Tcl_Interp *interp, Tcl_Obj *path, int mode, int permissions) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	Tcl_Channel retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		return(NULL);
+	}
+
+	retval = xvfs_tclfs_openFileChannel(interp, path, mode, permissions, instanceInfo);
+
+	xvfs_tclfs_instanceRelease(instanceInfo);
+
+	return(retval);
+}
+
+static int xvfs_tclfs_dispatch_fileAttrsGet(Tcl_Interp *interp, int index, Tcl_Obj *path, Tcl_Obj **objPtrRef) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	int retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
+	if (!instanceInfo) {
+		xvfs_setresults_error(interp, XVFS_RV_ERR_ENOENT);
+
+		return(TCL_ERROR);
+	}
+
+	retval = xvfs_tclfs_fileAttrsGet(interp, index, path, objPtrRef, instanceInfo);
+
+	xvfs_tclfs_instanceRelease(instanceInfo);
+
+	return(retval);
+}
+
+static int xvfs_tclfs_dispatch_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj *pathPtr, const char *pattern, Tcl_GlobTypeData *types) {
+	struct xvfs_tclfs_instance_info *instanceInfo;
+	int retval;
+
+	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(pathPtr);
+	if (!instanceInfo) {
+		return(TCL_ERROR);
+	}
 
-	xvfs_tclfs_standalone_info.fsInfo = fsInfo;
-	xvfs_tclfs_standalone_info.mountpoint = Tcl_NewObj();
+	retval = xvfs_tclfs_matchInDir(interp, resultPtr, pathPtr, pattern, types, instanceInfo);
 
-	Tcl_IncrRefCount(xvfs_tclfs_standalone_info.mountpoint);
-	Tcl_AppendStringsToObj(xvfs_tclfs_standalone_info.mountpoint, XVFS_ROOT_MOUNTPOINT, fsInfo->name, NULL);
-	
-	tclRet = Tcl_FSRegister(NULL, &xvfs_tclfs_standalone_fs);
-	if (tclRet != TCL_OK) {
-		Tcl_DecrRefCount(xvfs_tclfs_standalone_info.mountpoint);
+	xvfs_tclfs_instanceRelease(instanceInfo);
 
-		if (interp) {
-			Tcl_SetResult(interp, "Tcl_FSRegister() failed", NULL);
-		}
+	return(retval);
+}
 
-		return(tclRet);
+/*
+ * Mounting image libraries
+ *
+ * An image library mounted with "xvfs::mount" is loaded from a
+ * private copy, so that the library can be replaced on disk (and
+ * mounted again) while it is in use, and is swapped in for
+ * whatever is mounted under its name.  Operations already in
+ * progress and channels already open keep using the image they
+ * started with until they are done with it.  With "-watch" the
+ * library is checked periodically, and mounted again once it has
+ * changed and stayed unchanged for one interval.  Loading runs the
+ * image's initialization, which has to happen in the interpreter's
+ * thread, so watching is done from the event loop.
+ *
+ * With "-cache" the copy is instead kept in a cache directory, named
+ * after the image and the size and digest (crc32 followed by
+ * adler32, as for file contents) of the library it was copied from.
+ * The library is read to find its digest each time it is mounted,
+ * since a library rewritten in place within the same second keeps
+ * its size and timestamps.  A new copy is named after its own
+ * digest, in case the library changed while it was being copied.
+ * Copies are never modified once they are in place, so every
+ * process mounting the same library maps the same file (sharing its
+ * pages), and a process which is restarted finds its copy already
+ * made.
+ */
+struct xvfs_tclfs_mount_pending {
+	const char     *fsName;
+	Tcl_LoadHandle loadHandle;
+	int            registered;
+	int            rejected;
+};
+
+static Tcl_ThreadDataKey xvfs_tclfs_mountPendingKey;
+
+struct xvfs_tclfs_mount_stamp {
+	Tcl_WideInt mtime;
+	Tcl_WideInt ctime;
+	Tcl_WideInt size;
+	Tcl_WideInt inode;
+};
+
+struct xvfs_tclfs_mount {
+	Tcl_Interp                    *interp;
+	Tcl_Obj                       *fsName;
+	Tcl_Obj                       *library;
+	Tcl_Obj                       *cache;
+	int                           interval;
+	Tcl_TimerToken                timer;
+	struct xvfs_tclfs_mount_stamp seen;
+	struct xvfs_tclfs_mount_stamp loaded;
+};
+
+#define XVFS_TCLFS_MOUNT_ASSOC "xvfs::mount"
+
+static const char *xvfs_tclfs_mountCopyLambda =
+	"{library cache key} {\n"
+	"	if {$cache eq \"\"} {\n"
+	"		close [file tempfile copy xvfs-image[file extension $library]]\n"
+	"		file copy -force $library $copy\n"
+	"		return [list $copy 1]\n"
+	"	}\n"
+	"\n"
+	"	set digest {{file} {\n"
+	"		set fd [open $file rb]\n"
+	"		try {\n"
+	"			set crc 0\n"
+	"			set adler 1\n"
+	"			while {[set chunk [read $fd 1048576]] ne \"\"} {\n"
+	"				set crc [zlib crc32 $chunk $crc]\n"
+	"				set adler [zlib adler32 $chunk $adler]\n"
+	"			}\n"
+	"		} finally {\n"
+	"			close $fd\n"
+	"		}\n"
+	"		return [format %08x%08x $crc $adler]\n"
+	"	}}\n"
+	"\n"
+	"	set copy [file join $cache $key-[apply $digest $library][file extension $library]]\n"
+	"	if {![file exists $copy]} {\n"
+	"		file mkdir $cache\n"
+	"		close [file tempfile partial [file join $cache $key]]\n"
+	"		if {[catch {\n"
+	"			file copy -force $library $partial\n"
+	"			set copy [file join $cache $key-[apply $digest $partial][file extension $library]]\n"
+	"			file rename -force $partial $copy\n"
+	"		} err opts]} {\n"
+	"			file delete -force $partial\n"
+	"			return -options $opts $err\n"
+	"		}\n"
+	"	}\n"
+	"\n"
+	"	return [list $copy 0]\n"
+	"}";
+
+static int xvfs_tclfs_mountStamp(Tcl_Obj *library, struct xvfs_tclfs_mount_stamp *stamp) {
+	Tcl_StatBuf statBuf;
+
+	if (Tcl_FSStat(library, &statBuf) != 0) {
+		return(-1);
 	}
 
-	xvfs_tclfs_prepareChannelType();
+	stamp->mtime = statBuf.st_mtime;
+	stamp->ctime = statBuf.st_ctime;
+	stamp->size = statBuf.st_size;
+	stamp->inode = statBuf.st_ino;
 
-	return(TCL_OK);
+	return(0);
 }
-#endif /* XVFS_MODE_STANDALONE || XVFS_MODE_FLEXIBLE */
-
-#if defined(XVFS_MODE_FLEXIBLE)
-static int xvfs_flexible_register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo) {
-	ClientData fsHandlerDataRaw;
-	struct xvfs_tclfs_server_info *fsHandlerData;
-	const Tcl_Filesystem *fsHandler;
-	int (*xvfs_register)(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo);
-	Tcl_Obj *rootPathObj;
 
-	XVFS_DEBUG_ENTER;
+static int xvfs_tclfs_mountLoad(Tcl_Interp *interp, Tcl_Obj *fsName, Tcl_Obj *library, Tcl_Obj *cache, struct xvfs_tclfs_mount_stamp *stamp) {
+	struct xvfs_tclfs_mount_pending *pending;
+	const char *symbols[2];
+	Tcl_PackageInitProc *initProc;
+	Tcl_LoadHandle loadHandle;
+	Tcl_Obj *objv[5], *copy, *symbol;
+	int tclRet, registered, rejected, temporary;
 
-	xvfs_register = &xvfs_standalone_register;
+	/*
+	 * The dynamic linker would hand back the library already
+	 * loaded from the same path, so each load is of a fresh copy,
+	 * or of the cached copy for exactly this library
+	 */
+	objv[0] = Tcl_NewStringObj("apply", -1);
+	objv[1] = Tcl_NewStringObj(xvfs_tclfs_mountCopyLambda, -1);
+	objv[2] = library;
+	objv[3] = cache ? cache : Tcl_NewObj();
+	objv[4] = Tcl_ObjPrintf("xvfs-%s-%llx", Tcl_GetString(fsName), (unsigned long long) stamp->size);
+	Tcl_IncrRefCount(objv[0]);
+	Tcl_IncrRefCount(objv[1]);
+	Tcl_IncrRefCount(objv[3]);
+	Tcl_IncrRefCount(objv[4]);
+
+	tclRet = Tcl_EvalObjv(interp, 5, objv, TCL_EVAL_GLOBAL);
+
+	Tcl_DecrRefCount(objv[0]);
+	Tcl_DecrRefCount(objv[1]);
+	Tcl_DecrRefCount(objv[3]);
+	Tcl_DecrRefCount(objv[4]);
 
-	rootPathObj = Tcl_NewStringObj(XVFS_ROOT_MOUNTPOINT, -1);
-	if (!rootPathObj) {
-		XVFS_DEBUG_LEAVE;
+	if (tclRet != TCL_OK) {
+		return(tclRet);
+	}
 
-		return(xvfs_register(interp, fsInfo));
+	if (Tcl_ListObjIndex(interp, Tcl_GetObjResult(interp), 0, &copy) != TCL_OK || !copy) {
+		return(TCL_ERROR);
 	}
+	Tcl_IncrRefCount(copy);
 
-	Tcl_IncrRefCount(rootPathObj);
-	fsHandler = Tcl_FSGetFileSystemForPath(rootPathObj);
-	Tcl_DecrRefCount(rootPathObj);
+	temporary = 1;
+	Tcl_ListObjIndex(NULL, Tcl_GetObjResult(interp), 1, &objv[0]);
+	if (objv[0]) {
+		Tcl_GetBooleanFromObj(NULL, objv[0], &temporary);
+	}
+	Tcl_ResetResult(interp);
 
-	if (!fsHandler) {
-		XVFS_DEBUG_LEAVE;
+	symbol = Tcl_ObjPrintf("Xvfs_%s_Init", Tcl_GetString(fsName));
+	Tcl_IncrRefCount(symbol);
 
-		return(xvfs_register(interp, fsInfo));
-	}
+	symbols[0] = Tcl_GetString(symbol);
+	symbols[1] = NULL;
 
-	fsHandlerDataRaw = Tcl_FSData(fsHandler);
-	if (!fsHandlerDataRaw) {
-		XVFS_DEBUG_LEAVE;
+	tclRet = Tcl_LoadFile(interp, copy, symbols, 0, &initProc, &loadHandle);
 
-		return(xvfs_register(interp, fsInfo));
+	if (temporary) {
+		Tcl_FSDeleteFile(copy);
 	}
+	Tcl_DecrRefCount(copy);
+	Tcl_DecrRefCount(symbol);
 
-	fsHandlerData = (struct xvfs_tclfs_server_info *) fsHandlerDataRaw;
+	if (tclRet != TCL_OK) {
+		return(tclRet);
+	}
 
 	/*
-	 * XXX:TODO: What is the chance that the handler for //xvfs:/ hold
-	 * client data smaller than XVFS_INTERNAL_SERVER_MAGIC_LEN ?
+	 * The image's initialization registers it, which is where the
+	 * load handle is handed over to the instance mounted
 	 */
-	if (memcmp(fsHandlerData->magic, XVFS_INTERNAL_SERVER_MAGIC, sizeof(fsHandlerData->magic)) == 0) {
-		XVFS_DEBUG_PUTS("Found a server handler");
-		xvfs_register = fsHandlerData->registerProc;
-	}
+	pending = (struct xvfs_tclfs_mount_pending *) Tcl_GetThreadData(&xvfs_tclfs_mountPendingKey, sizeof(*pending));
+	pending->fsName = Tcl_GetString(fsName);
+	pending->loadHandle = loadHandle;
+	pending->registered = 0;
+	pending->rejected = 0;
 
-	XVFS_DEBUG_LEAVE;
+	tclRet = initProc(interp);
 
-	return(xvfs_register(interp, fsInfo));
-}
-#endif /* XVFS_MODE_FLEXIBLE */
+	registered = pending->registered;
+	rejected = pending->rejected;
+	pending->fsName = NULL;
+	pending->loadHandle = NULL;
 
-#if defined(XVFS_MODE_SERVER)
-static Tcl_Filesystem xvfs_tclfs_dispatch_fs;
-static Tcl_HashTable xvfs_tclfs_dispatch_map;
-static struct xvfs_tclfs_server_info xvfs_tclfs_dispatch_fsdata;
+	if (registered) {
+		Tcl_ResetResult(interp);
 
-static int xvfs_tclfs_dispatch_pathInFS(Tcl_Obj *path, ClientData *dataPtr) {
-	const char *pathStr, *rootStr;
-	int pathLen, rootLen;
+		return(TCL_OK);
+	}
 
-	XVFS_DEBUG_ENTER;
+	/*
+	 * An image which registered itself elsewhere may still be in
+	 * use, so only one which was turned away is unloaded
+	 */
+	if (rejected) {
+		Tcl_FSUnloadFile(NULL, loadHandle);
+	}
 
-	XVFS_DEBUG_PRINTF("Verifying that \"%s\" belongs in XVFS ...", Tcl_GetString(path));
+	if (tclRet == TCL_OK) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("\"%s\" did not mount \"%s\"", Tcl_GetString(library), Tcl_GetString(fsName)));
+	}
 
-	path = xvfs_absolutePath(path);
+	return(TCL_ERROR);
+}
 
-	rootStr = XVFS_ROOT_MOUNTPOINT;
-	rootLen = strlen(XVFS_ROOT_MOUNTPOINT);
+static void xvfs_tclfs_mountTimer(ClientData clientData) {
+	struct xvfs_tclfs_mount *mount;
+	struct xvfs_tclfs_mount_stamp stamp;
+	Tcl_Interp *interp;
+	int settled;
 
-	pathStr = Tcl_GetStringFromObj(path, &pathLen);
+	mount = (struct xvfs_tclfs_mount *) clientData;
+	interp = mount->interp;
 
-	if (pathLen < rootLen) {
-		Tcl_DecrRefCount(path);
+	mount->timer = Tcl_CreateTimerHandler(mount->interval, xvfs_tclfs_mountTimer, (ClientData) mount);
 
-		XVFS_DEBUG_PUTS("... failed (length too short)");
-		XVFS_DEBUG_LEAVE;
-		return(-1);
+	if (xvfs_tclfs_mountStamp(mount->library, &stamp) != 0) {
+		memset(&mount->seen, 0, sizeof(mount->seen));
+
+		return;
 	}
 
-	if (memcmp(pathStr, rootStr, rootLen) != 0) {
-		Tcl_DecrRefCount(path);
+	settled = (memcmp(&stamp, &mount->seen, sizeof(stamp)) == 0);
+	mount->seen = stamp;
 
-		XVFS_DEBUG_PUTS("... failed (incorrect prefix)");
-		XVFS_DEBUG_LEAVE;
-		return(-1);
+	if (!settled || memcmp(&stamp, &mount->loaded, sizeof(stamp)) == 0) {
+		return;
 	}
 
-	Tcl_DecrRefCount(path);
-
-	XVFS_DEBUG_PUTS("... yes");
+	/*
+	 * A library which fails to mount is not tried again until it
+	 * changes again
+	 */
+	mount->loaded = stamp;
 
-	XVFS_DEBUG_LEAVE;
+	Tcl_Preserve((ClientData) interp);
 
-	return(TCL_OK);
-}
+	if (xvfs_tclfs_mountLoad(interp, mount->fsName, mount->library, mount->cache, &stamp) != TCL_OK) {
+		Tcl_AddErrorInfo(interp, "\n    (remounting xvfs image)");
+		Tcl_BackgroundException(interp, TCL_ERROR);
+	}
 
-static struct xvfs_tclfs_instance_info *xvfs_tclfs_dispatch_pathToInfo(Tcl_Obj *path) {
-	Tcl_HashEntry *mapEntry;
-	struct xvfs_tclfs_instance_info *retval;
-	int rootLen;
-	char *pathStr, *fsName, *fsNameEnds, origSep;
+	Tcl_Release((ClientData) interp);
 
-	XVFS_DEBUG_ENTER;
+	return;
+}
 
-	path = xvfs_absolutePath(path);
+static void xvfs_tclfs_mountFree(struct xvfs_tclfs_mount *mount) {
+	if (mount->timer) {
+		Tcl_DeleteTimerHandler(mount->timer);
+	}
 
-	if (xvfs_tclfs_dispatch_pathInFS(path, NULL) != TCL_OK) {
-		Tcl_DecrRefCount(path);
+	Tcl_DecrRefCount(mount->fsName);
+	Tcl_DecrRefCount(mount->library);
+	if (mount->cache) {
+		Tcl_DecrRefCount(mount->cache);
+	}
 
-		XVFS_DEBUG_LEAVE;
+	Tcl_Free((char *) mount);
 
-		return(NULL);
-	}
+	return;
+}
 
-	rootLen = strlen(XVFS_ROOT_MOUNTPOINT);
-	pathStr = Tcl_GetString(path);
+static void xvfs_tclfs_mountDeleteAssoc(ClientData clientData, Tcl_Interp *interp) {
+	Tcl_HashTable *mounts;
+	Tcl_HashEntry *entry;
+	Tcl_HashSearch search;
 
-	fsName = ((char *) pathStr) + rootLen;
+	mounts = (Tcl_HashTable *) clientData;
 
-	fsNameEnds = strchr(fsName, '/');
-	if (fsNameEnds) {
-		origSep = *fsNameEnds;
-		*fsNameEnds = '\0';
+	for (entry = Tcl_FirstHashEntry(mounts, &search); entry; entry = Tcl_NextHashEntry(&search)) {
+		xvfs_tclfs_mountFree((struct xvfs_tclfs_mount *) Tcl_GetHashValue(entry));
 	}
 
-	XVFS_DEBUG_PRINTF("... fsName = %s...", fsName);
+	Tcl_DeleteHashTable(mounts);
+	Tcl_Free((char *) mounts);
 
-	mapEntry = Tcl_FindHashEntry(&xvfs_tclfs_dispatch_map, fsName);
+	return;
+}
 
-	if (fsNameEnds) {
-		*fsNameEnds = origSep;
-	}
+static int xvfs_tclfs_mountCmd(ClientData clientData, Tcl_Interp *interp, int objc, Tcl_Obj *const objv[]) {
+	static const char *const optionNames[] = {"-cache", "-watch", NULL};
+	enum { OPTION_CACHE, OPTION_WATCH };
+	struct xvfs_tclfs_mount *mount;
+	struct xvfs_tclfs_mount_stamp stamp;
+	Tcl_HashTable *mounts;
+	Tcl_HashEntry *entry;
+	Tcl_Obj *fsName, *library, *cache;
+	int optionIndex, interval, isNew, argIdx;
 
-	if (mapEntry) {
-		retval = (struct xvfs_tclfs_instance_info *) Tcl_GetHashValue(mapEntry);
-		XVFS_DEBUG_PRINTF("... found a registered filesystem: %p", retval);
-	} else {
-		retval = NULL;
-		XVFS_DEBUG_PUTS("... found no registered filesystem.");
+	if (objc < 3 || (objc % 2) != 1) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-cache directory? ?-watch milliseconds? fsName library");
+
+		return(TCL_ERROR);
 	}
 
-	Tcl_DecrRefCount(path);
+	interval = 0;
+	cache = NULL;
+	for (argIdx = 1; argIdx < objc - 2; argIdx += 2) {
+		if (Tcl_GetIndexFromObj(interp, objv[argIdx], optionNames, "option", 0, &optionIndex) != TCL_OK) {
+			return(TCL_ERROR);
+		}
 
-	XVFS_DEBUG_LEAVE;
-	return(retval);
+		switch (optionIndex) {
+			case OPTION_CACHE:
+				cache = objv[argIdx + 1];
+				if (Tcl_GetCharLength(cache) == 0) {
+					cache = NULL;
+				}
 
-	/*
-	 * UNREACH: We do no need the more specific check because we
-	 * claim everything under the root, but we want to suppress
-	 * a warning about it not being used.
-	 */
-	xvfs_tclfs_pathInFilesystem(NULL, NULL, NULL);
-	return(NULL);
-}
+				break;
+			case OPTION_WATCH:
+				if (Tcl_GetIntFromObj(interp, objv[argIdx + 1], &interval) != TCL_OK) {
+					return(TCL_ERROR);
+				}
 
-static int xvfs_tclfs_dispatch_stat(Tcl_Obj *path, Tcl_StatBuf *statBuf) {
-	struct xvfs_tclfs_instance_info *instanceInfo;
+				if (interval < 0) {
+					Tcl_SetResult(interp, "-watch must not be negative", NULL);
 
-	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
-	if (!instanceInfo) {
-		Tcl_SetErrno(xvfs_errorToErrno(XVFS_RV_ERR_ENOENT));
+					return(TCL_ERROR);
+				}
 
-		return(-1);
+				break;
+		}
 	}
 
-	return(xvfs_tclfs_stat(path, statBuf, instanceInfo));
-}
+	fsName = objv[objc - 2];
+	library = objv[objc - 1];
 
-static int xvfs_tclfs_dispatch_access(Tcl_Obj *path, int mode) {
-	struct xvfs_tclfs_instance_info *instanceInfo;
+	if (xvfs_tclfs_mountStamp(library, &stamp) != 0) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("couldn't mount \"%s\": %s", Tcl_GetString(library), Tcl_PosixError(interp)));
 
-	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
-	if (!instanceInfo) {
-		return(-1);
+		return(TCL_ERROR);
 	}
 
-	return(xvfs_tclfs_access(path, mode, instanceInfo));
-}
+	if (xvfs_tclfs_mountLoad(interp, fsName, library, cache, &stamp) != TCL_OK) {
+		return(TCL_ERROR);
+	}
 
-static Tcl_Channel xvfs_tclfs_dispatch_openFileChannel(Tcl_Interp *interp, Tcl_Obj *path, int mode, int permissions) {
-	struct xvfs_tclfs_instance_info *instanceInfo;
+	/*
+	 * Mounting again replaces any watch on the same name, and a
+	 * watch interval of zero stops watching
+	 */
+	mounts = (Tcl_HashTable *) Tcl_GetAssocData(interp, XVFS_TCLFS_MOUNT_ASSOC, NULL);
+	if (!mounts) {
+		mounts = (Tcl_HashTable *) Tcl_Alloc(sizeof(*mounts));
+		Tcl_InitHashTable(mounts, TCL_STRING_KEYS);
+		Tcl_SetAssocData(interp, XVFS_TCLFS_MOUNT_ASSOC, xvfs_tclfs_mountDeleteAssoc, (ClientData) mounts);
+	}
 
-	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(path);
-	if (!instanceInfo) {
-		return(NULL);
+	entry = Tcl_FindHashEntry(mounts, Tcl_GetString(fsName));
+	if (entry) {
+		xvfs_tclfs_mountFree((struct xvfs_tclfs_mount *) Tcl_GetHashValue(entry));
+		Tcl_DeleteHashEntry(entry);
 	}
 
-	return(xvfs_tclfs_openFileChannel(interp, path, mode, permissions, instanceInfo));
-}
+	if (interval != 0) {
+		mount = (struct xvfs_tclfs_mount *) Tcl_Alloc(sizeof(*mount));
+		mount->interp = interp;
+		mount->fsName = Tcl_DuplicateObj(fsName);
+		mount->library = Tcl_FSGetNormalizedPath(interp, library);
+		mount->cache = NULL;
+		if (cache) {
+			mount->cache = Tcl_FSGetNormalizedPath(interp, cache);
+			if (!mount->cache) {
+				mount->cache = cache;
+			}
+		}
+		mount->interval = interval;
+		mount->seen = stamp;
+		mount->loaded = stamp;
+		Tcl_IncrRefCount(mount->fsName);
+		if (!mount->library) {
+			mount->library = library;
+		}
+		Tcl_IncrRefCount(mount->library);
+		if (mount->cache) {
+			Tcl_IncrRefCount(mount->cache);
+		}
 
-static int xvfs_tclfs_dispatch_matchInDir(Tcl_Interp *interp, Tcl_Obj *resultPtr, Tcl_Obj *pathPtr, const char *pattern, Tcl_GlobTypeData *types) {
-	struct xvfs_tclfs_instance_info *instanceInfo;
+		mount->timer = Tcl_CreateTimerHandler(interval, xvfs_tclfs_mountTimer, (ClientData) mount);
 
-	instanceInfo = xvfs_tclfs_dispatch_pathToInfo(pathPtr);
-	if (!instanceInfo) {
-		return(TCL_ERROR);
+		entry = Tcl_CreateHashEntry(mounts, Tcl_GetString(fsName), &isNew);
+		Tcl_SetHashValue(entry, mount);
 	}
 
-	return(xvfs_tclfs_matchInDir(interp, resultPtr, pathPtr, pattern, types, instanceInfo));
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf("%s%s", XVFS_ROOT_MOUNTPOINT, Tcl_GetString(fsName)));
+
+	return(TCL_OK);
 }
 
 int Xvfs_Init(Tcl_Interp *interp) {
@@ -1142,12 +5435,6 @@ int Xvfs_Init(Tcl_Interp *interp) {
 	const char *tclInitStubs_ret;
 #endif
 
-	/* XXX:TODO: Make this thread-safe */
-	if (registered) {
-		return(TCL_OK);
-	}
-	registered = 1;
-
 #ifdef USE_TCL_STUBS
 	/* Initialize Stubs */
 	tclInitStubs_ret = Tcl_InitStubs(interp, TCL_PATCH_LEVEL, 0);
@@ -1156,14 +5443,30 @@ int Xvfs_Init(Tcl_Interp *interp) {
 	}
 #endif
 
+	/*
+	 * Commands are created for every interpreter we are loaded into
+	 */
+	xvfs_tclfs_createCommands(interp);
+	if (interp) {
+		xvfs_tclfs_createCommand(interp, "::xvfs::mount", xvfs_tclfs_mountCmd);
+	}
+
+	/* XXX:TODO: Make this thread-safe */
+	if (registered) {
+		xvfs_traceAddCopy(interp, &xvfs_tclfs_dispatch_fsdata);
+
+		return(TCL_OK);
+	}
+	registered = 1;
+
 	xvfs_tclfs_dispatch_fs.typeName                   = "xvfsDispatch";
 	xvfs_tclfs_dispatch_fs.structureLength            = sizeof(xvfs_tclfs_dispatch_fs);
 	xvfs_tclfs_dispatch_fs.version                    = TCL_FILESYSTEM_VERSION_1;
 	xvfs_tclfs_dispatch_fs.pathInFilesystemProc       = xvfs_tclfs_dispatch_pathInFS;
-	xvfs_tclfs_dispatch_fs.dupInternalRepProc         = NULL;
-	xvfs_tclfs_dispatch_fs.freeInternalRepProc        = NULL;
+	xvfs_tclfs_dispatch_fs.dupInternalRepProc         = xvfs_tclfs_dupInternalRep;
+	xvfs_tclfs_dispatch_fs.freeInternalRepProc        = xvfs_tclfs_freeInternalRep;
 	xvfs_tclfs_dispatch_fs.internalToNormalizedProc   = NULL;
-	xvfs_tclfs_dispatch_fs.createInternalRepProc      = NULL;
+	xvfs_tclfs_dispatch_fs.createInternalRepProc      = xvfs_tclfs_dispatch_createInternalRep;
 	xvfs_tclfs_dispatch_fs.normalizePathProc          = NULL;
 	xvfs_tclfs_dispatch_fs.filesystemPathTypeProc     = NULL;
 	xvfs_tclfs_dispatch_fs.filesystemSeparatorProc    = NULL;
@@ -1174,9 +5477,9 @@ int Xvfs_Init(Tcl_Interp *interp) {
 	xvfs_tclfs_dispatch_fs.utimeProc                  = NULL;
 	xvfs_tclfs_dispatch_fs.linkProc                   = NULL;
 	xvfs_tclfs_dispatch_fs.listVolumesProc            = NULL;
-	xvfs_tclfs_dispatch_fs.fileAttrStringsProc        = NULL;
-	xvfs_tclfs_dispatch_fs.fileAttrsGetProc           = NULL;
-	xvfs_tclfs_dispatch_fs.fileAttrsSetProc           = NULL;
+	xvfs_tclfs_dispatch_fs.fileAttrStringsProc        = xvfs_tclfs_fileAttrStrings;
+	xvfs_tclfs_dispatch_fs.fileAttrsGetProc           = xvfs_tclfs_dispatch_fileAttrsGet;
+	xvfs_tclfs_dispatch_fs.fileAttrsSetProc           = xvfs_tclfs_fileAttrsSet;
 	xvfs_tclfs_dispatch_fs.createDirectoryProc        = NULL;
 	xvfs_tclfs_dispatch_fs.removeDirectoryProc        = NULL;
 	xvfs_tclfs_dispatch_fs.deleteFileProc             = NULL;
@@ -1186,10 +5489,14 @@ int Xvfs_Init(Tcl_Interp *interp) {
 	xvfs_tclfs_dispatch_fs.lstatProc                  = NULL;
 	xvfs_tclfs_dispatch_fs.loadFileProc               = NULL;
 	xvfs_tclfs_dispatch_fs.getCwdProc                 = NULL;
-	xvfs_tclfs_dispatch_fs.chdirProc                  = NULL;
+	xvfs_tclfs_dispatch_fs.chdirProc                  = xvfs_tclfs_dispatch_chdir;
 
 	memcpy(xvfs_tclfs_dispatch_fsdata.magic, XVFS_INTERNAL_SERVER_MAGIC, XVFS_INTERNAL_SERVER_MAGIC_LEN);
 	xvfs_tclfs_dispatch_fsdata.registerProc = Xvfs_Register;
+	xvfs_tclfs_dispatch_fsdata.pathToFSInfoProc = xvfs_tclfs_dispatch_pathToFSInfo;
+	xvfs_tclfs_dispatch_fsdata.releaseProc = xvfs_tclfs_dispatch_release;
+	xvfs_tclfs_dispatch_fsdata.traceEnableProc = xvfs_traceEnable;
+	xvfs_tclfs_dispatch_fsdata.traceCollectProc = xvfs_traceCollect;
 
 	tclRet = Tcl_FSRegister((ClientData) &xvfs_tclfs_dispatch_fsdata, &xvfs_tclfs_dispatch_fs);
 	if (tclRet != TCL_OK) {
@@ -1211,12 +5518,18 @@ int Xvfs_Init(Tcl_Interp *interp) {
 	 */
 	Tcl_InitHashTable(&xvfs_tclfs_dispatch_map, TCL_STRING_KEYS);
 
+	xvfs_accessTraceOpen();
+	xvfs_traceAddCopy(interp, &xvfs_tclfs_dispatch_fsdata);
+
 	return(TCL_OK);
 }
 
 int Xvfs_Register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo) {
 	Tcl_HashEntry *mapEntry;
-	struct xvfs_tclfs_instance_info *instanceInfo;
+	struct xvfs_tclfs_instance_info *instanceInfo, *replaced;
+	struct xvfs_tclfs_mount_pending *pending;
+	Tcl_LoadHandle loadHandle;
+	Tcl_StatBuf rootInfo;
 	int dispatchInitRet;
 	int new;
 
@@ -1226,29 +5539,110 @@ int Xvfs_Register(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo) {
 	}
 
 	/*
-	 * Verify this is for a protocol we support
+	 * Images loaded by "xvfs::mount" are validated before they
+	 * replace anything, and take ownership of their library
 	 */
-	if (fsInfo->protocolVersion != XVFS_PROTOCOL_VERSION) {
+	pending = (struct xvfs_tclfs_mount_pending *) Tcl_GetThreadData(&xvfs_tclfs_mountPendingKey, sizeof(*pending));
+	if (!pending->fsName) {
+		pending = NULL;
+	} else if (strcmp(pending->fsName, fsInfo->name) != 0) {
+		/*
+		 * Only the filesystem being mounted is taken from a
+		 * library that contains several, since the library is
+		 * unloaded once that one is replaced
+		 */
+		return(TCL_OK);
+	}
+
+	/*
+	 * Verify this is for a protocol we support, images built
+	 * against older versions simply lack the newer fields
+	 */
+	if (fsInfo->protocolVersion < 1 || fsInfo->protocolVersion > XVFS_PROTOCOL_VERSION) {
+		if (pending) {
+			pending->rejected = 1;
+		}
+
 		if (interp) {
 			Tcl_SetResult(interp, "Protocol mismatch", NULL);
 		}
 		return(TCL_ERROR);
 	}
 
+	loadHandle = NULL;
+	if (pending) {
+		if (fsInfo->getStatProc("", XVFS_INODE_NULL, &rootInfo) != 0 || !(rootInfo.st_mode & 040000)) {
+			pending->rejected = 1;
+
+			if (interp) {
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("image \"%s\" has no root directory", fsInfo->name));
+			}
+			return(TCL_ERROR);
+		}
+
+		loadHandle = pending->loadHandle;
+		pending->registered = 1;
+	}
+
+	Tcl_MutexLock(&xvfs_tclfs_instanceMutex);
+
+	/*
+	 * Registering the same image again (such as from another
+	 * interpreter) leaves it mounted as it is
+	 */
+	new = 0;
+	mapEntry = Tcl_CreateHashEntry(&xvfs_tclfs_dispatch_map, fsInfo->name, &new);
+	replaced = NULL;
+	if (!new) {
+		replaced = (struct xvfs_tclfs_instance_info *) Tcl_GetHashValue(mapEntry);
+
+		if (replaced->fsInfo == fsInfo) {
+			Tcl_MutexUnlock(&xvfs_tclfs_instanceMutex);
+
+			/*
+			 * A cached copy which is already mounted was handed
+			 * back by the dynamic linker, so this load of it is
+			 * not needed
+			 */
+			if (loadHandle) {
+				Tcl_FSUnloadFile(NULL, loadHandle);
+			}
+
+			xvfs_tclfs_registerPackageIndex(interp, replaced->mountpoint, fsInfo);
+
+			return(TCL_OK);
+		}
+	}
+
 	/*
-	 * Create the structure needed
+	 * Create the structure needed, the filesystem holds the first
+	 * reference to it
 	 */
 	instanceInfo = (struct xvfs_tclfs_instance_info *) Tcl_Alloc(sizeof(*instanceInfo));
 	instanceInfo->fsInfo = fsInfo;
 	instanceInfo->mountpoint = Tcl_ObjPrintf("%s%s", XVFS_ROOT_MOUNTPOINT, fsInfo->name);
+	instanceInfo->fs = &xvfs_tclfs_dispatch_fs;
+	instanceInfo->generation = ++xvfs_tclfs_dispatch_generation;
+	instanceInfo->refCount = 1;
+	instanceInfo->loadHandle = loadHandle;
 	Tcl_IncrRefCount(instanceInfo->mountpoint);
 
+	Tcl_SetHashValue(mapEntry, instanceInfo);
+
+	Tcl_MutexUnlock(&xvfs_tclfs_instanceMutex);
+
 	/*
-	 * Register a hash table entry for this name
+	 * Whatever was mounted under this name before is released
+	 * once nothing is using it any more
 	 */
-	new = 0;
-	mapEntry = Tcl_CreateHashEntry(&xvfs_tclfs_dispatch_map, fsInfo->name, &new);
-	Tcl_SetHashValue(mapEntry, instanceInfo);
+	if (replaced) {
+		Tcl_FSMountsChanged(&xvfs_tclfs_dispatch_fs);
+
+		xvfs_tclfs_instanceRelease(replaced);
+	}
+
+	xvfs_tclfs_registerPackageIndex(interp, instanceInfo->mountpoint, fsInfo);
+	xvfs_tclfs_registerPrefetch(interp, instanceInfo->mountpoint, fsInfo);
 
 	return(TCL_OK);
 }
@@ -3,25 +3,71 @@
 
 #include <tcl.h>
 
-#define XVFS_PROTOCOL_VERSION 1
+#define XVFS_PROTOCOL_VERSION 6
 
 typedef const char **(*xvfs_proc_getChildren_t)(const char *path, long inode, Tcl_WideInt *count);
 typedef const unsigned char *(*xvfs_proc_getData_t)(const char *path, long inode, Tcl_WideInt start, Tcl_WideInt *length);
 typedef int (*xvfs_proc_getStat_t)(const char *path, long inode, Tcl_StatBuf *statBuf);
+typedef const char *(*xvfs_proc_getPackageIndex_t)(void);
+typedef const unsigned char *(*xvfs_proc_getAttribute_t)(const char *path, long inode, int attribute, Tcl_WideInt *length);
+typedef int (*xvfs_walk_callback_t)(const char *path, long inode, int isDirectory, void *clientData);
+typedef Tcl_WideInt (*xvfs_proc_walk_t)(const char *path, long inode, xvfs_walk_callback_t callback, void *clientData);
+typedef const void *(*xvfs_proc_getMetadata_t)(Tcl_WideInt *length);
+typedef const long *(*xvfs_proc_getPrefetch_t)(Tcl_WideInt *count);
 
 /*
  * Interface for the filesystem to fill out before registering.
  * The protocolVersion is provided first so that if this
  * needs to change over time it can be appropriately handled.
+ * Fields are only ever added to the end, along with a new
+ * protocolVersion.
  */
 struct Xvfs_FSInfo {
-	int                      protocolVersion;
-	const char               *name;
-	xvfs_proc_getChildren_t  getChildrenProc;
-	xvfs_proc_getData_t      getDataProc;
-	xvfs_proc_getStat_t      getStatProc;
+	int                          protocolVersion;
+	const char                   *name;
+	xvfs_proc_getChildren_t      getChildrenProc;
+	xvfs_proc_getData_t          getDataProc;
+	xvfs_proc_getStat_t          getStatProc;
+	/* Version 2 */
+	xvfs_proc_getPackageIndex_t  getPackageIndexProc;
+	/* Version 3 */
+	xvfs_proc_getAttribute_t     getAttributeProc;
+	/* Version 4 */
+	xvfs_proc_walk_t             walkProc;
+	/* Version 5 */
+	xvfs_proc_getMetadata_t      getMetadataProc;
+	/* Version 6 */
+	xvfs_proc_getPrefetch_t      getPrefetchProc;
 };
 
+/*
+ * walkProc calls the callback for everything beneath a directory,
+ * each directory before its contents, with paths relative to the
+ * root of the filesystem.  It stops early if the callback returns
+ * non-zero, and returns the number of entries visited.
+ */
+
+/*
+ * getMetadataProc returns the table describing every entry in the
+ * image, and its size in bytes, so that the memory it occupies can
+ * be accounted for.
+ */
+
+/*
+ * getPrefetchProc returns the inodes of the files to prefetch once
+ * the image is registered, in priority order, as profiled when the
+ * image was built.  Most images have none.
+ */
+
+/*
+ * Attributes precomputed by the generator which may be requested
+ * from getAttributeProc.  An attribute a file does not have is
+ * returned as NULL with a length of 0.  This is part of the ABI
+ * and must not be changed.
+ */
+#define XVFS_ATTRIBUTE_DIGEST 0
+#define XVFS_ATTRIBUTE_GZIP   1
+
 /*
  * Error codes for various calls.  This is part of the ABI and must
  * not be changed.
@@ -43,6 +89,50 @@ struct Xvfs_FSInfo {
 
 #define XVFS_REGISTER_INTERFACE(name) int name(Tcl_Interp *interp, struct Xvfs_FSInfo *fsInfo);
 
+/*
+ * Embedded files may also be used from C without a channel.
+ * Xvfs_Lookup() finds a file by its full path (such as
+ * "//xvfs:/example/main.tcl") in whichever xvfs filesystem serves
+ * it, returning a handle, or NULL with an error message left in the
+ * interpreter (if one is given).  Xvfs_MapFile() provides a
+ * read-only view of the file's contents directly from the image,
+ * which remains valid, from any thread, until the handle is passed
+ * to Xvfs_ReleaseFile().  The image cannot be unloaded while a
+ * handle to one of its files is held.  These are provided by the
+ * server, or by the core built into a flexible or standalone image,
+ * and work with any image regardless of which copy of the core
+ * registered it.
+ */
+struct Xvfs_File;
+
+#define XVFS_LOOKUP_INTERFACE(name) struct Xvfs_File *name(Tcl_Interp *interp, const char *path);
+#define XVFS_MAPFILE_INTERFACE(name) int name(struct Xvfs_File *file, const unsigned char **data, Tcl_WideInt *length);
+#define XVFS_RELEASEFILE_INTERFACE(name) void name(struct Xvfs_File *file);
+
+/*
+ * Directories may be listed from C a batch at a time, without
+ * building the whole listing.  Xvfs_OpenDir() returns a cursor over
+ * the entries of a directory (or NULL with an error message left in
+ * the interpreter, if one is given), limited to the types given as
+ * XVFS_DIR_TYPE_* flags (0 for all) and to names matching a
+ * "string match" pattern (NULL for all).  Each call to Xvfs_ReadDir()
+ * fills in up to "count" of the next entries' names and/or inodes
+ * (either array may be NULL) and returns how many it filled in,
+ * 0 once the listing is exhausted, or a negative XVFS_RV_ERR_* code.
+ * An entry that cannot be read ends a batch early, with the entries
+ * before it returned and the error returned by the next call.
+ * Names point into the image and remain valid until the cursor is
+ * passed to Xvfs_CloseDir(), which releases the image.
+ */
+struct Xvfs_Dir;
+
+#define XVFS_DIR_TYPE_DIRECTORY 1
+#define XVFS_DIR_TYPE_FILE      2
+
+#define XVFS_OPENDIR_INTERFACE(name) struct Xvfs_Dir *name(Tcl_Interp *interp, const char *path, int types, const char *pattern);
+#define XVFS_READDIR_INTERFACE(name) Tcl_WideInt name(struct Xvfs_Dir *dir, const char **names, long *inodes, Tcl_WideInt count);
+#define XVFS_CLOSEDIR_INTERFACE(name) void name(struct Xvfs_Dir *dir);
+
 #if defined(XVFS_MODE_STANDALONE)
 /*
  * In standalone mode, we just redefine calls to
@@ -51,6 +141,18 @@ struct Xvfs_FSInfo {
  */
 #  define Xvfs_Register xvfs_standalone_register
 static XVFS_REGISTER_INTERFACE(Xvfs_Register)
+#  define Xvfs_Lookup xvfs_tclfs_lookup
+#  define Xvfs_MapFile xvfs_tclfs_mapFile
+#  define Xvfs_ReleaseFile xvfs_tclfs_releaseFile
+#  define Xvfs_OpenDir xvfs_tclfs_openDir
+#  define Xvfs_ReadDir xvfs_tclfs_readDir
+#  define Xvfs_CloseDir xvfs_tclfs_closeDir
+static XVFS_LOOKUP_INTERFACE(Xvfs_Lookup)
+static XVFS_MAPFILE_INTERFACE(Xvfs_MapFile)
+static XVFS_RELEASEFILE_INTERFACE(Xvfs_ReleaseFile)
+static XVFS_OPENDIR_INTERFACE(Xvfs_OpenDir)
+static XVFS_READDIR_INTERFACE(Xvfs_ReadDir)
+static XVFS_CLOSEDIR_INTERFACE(Xvfs_CloseDir)
 
 #elif defined(XVFS_MODE_FLEXIBLE)
 /*
@@ -62,14 +164,32 @@ static XVFS_REGISTER_INTERFACE(Xvfs_Register)
  */
 #  define Xvfs_Register xvfs_flexible_register
 static XVFS_REGISTER_INTERFACE(Xvfs_Register)
+#  define Xvfs_Lookup xvfs_tclfs_lookup
+#  define Xvfs_MapFile xvfs_tclfs_mapFile
+#  define Xvfs_ReleaseFile xvfs_tclfs_releaseFile
+#  define Xvfs_OpenDir xvfs_tclfs_openDir
+#  define Xvfs_ReadDir xvfs_tclfs_readDir
+#  define Xvfs_CloseDir xvfs_tclfs_closeDir
+static XVFS_LOOKUP_INTERFACE(Xvfs_Lookup)
+static XVFS_MAPFILE_INTERFACE(Xvfs_MapFile)
+static XVFS_RELEASEFILE_INTERFACE(Xvfs_ReleaseFile)
+static XVFS_OPENDIR_INTERFACE(Xvfs_OpenDir)
+static XVFS_READDIR_INTERFACE(Xvfs_ReadDir)
+static XVFS_CLOSEDIR_INTERFACE(Xvfs_CloseDir)
 
 #elif defined(XVFS_MODE_CLIENT)
 /*
- * In client mode we declare an external symbol named
- * Xvfs_Register() that must be provided by the environment
- * we are loaded into
+ * In client mode we declare external symbols named
+ * Xvfs_Register() (and the rest of the API) that must be
+ * provided by the environment we are loaded into
  */
 extern XVFS_REGISTER_INTERFACE(Xvfs_Register)
+extern XVFS_LOOKUP_INTERFACE(Xvfs_Lookup)
+extern XVFS_MAPFILE_INTERFACE(Xvfs_MapFile)
+extern XVFS_RELEASEFILE_INTERFACE(Xvfs_ReleaseFile)
+extern XVFS_OPENDIR_INTERFACE(Xvfs_OpenDir)
+extern XVFS_READDIR_INTERFACE(Xvfs_ReadDir)
+extern XVFS_CLOSEDIR_INTERFACE(Xvfs_CloseDir)
 
 #elif defined(XVFS_MODE_SERVER)
 /*
@@ -77,12 +197,24 @@ extern XVFS_REGISTER_INTERFACE(Xvfs_Register)
  * for flexible/client modes, just forward declare it
  */
 XVFS_REGISTER_INTERFACE(Xvfs_Register)
+XVFS_LOOKUP_INTERFACE(Xvfs_Lookup)
+XVFS_MAPFILE_INTERFACE(Xvfs_MapFile)
+XVFS_RELEASEFILE_INTERFACE(Xvfs_ReleaseFile)
+XVFS_OPENDIR_INTERFACE(Xvfs_OpenDir)
+XVFS_READDIR_INTERFACE(Xvfs_ReadDir)
+XVFS_CLOSEDIR_INTERFACE(Xvfs_CloseDir)
 int Xvfs_Init(Tcl_Interp *interp);
 
 #else
 #  error Unsupported XVFS_MODE
 #endif
 #undef XVFS_REGISTER_INTERFACE
+#undef XVFS_LOOKUP_INTERFACE
+#undef XVFS_MAPFILE_INTERFACE
+#undef XVFS_RELEASEFILE_INTERFACE
+#undef XVFS_OPENDIR_INTERFACE
+#undef XVFS_READDIR_INTERFACE
+#undef XVFS_CLOSEDIR_INTERFACE
 
 /*
  * In flexible or standalone mode, directly include what
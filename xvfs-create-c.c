@@ -5,18 +5,60 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#ifdef XVFS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+struct xvfs_filesystem {
+	char *name;
+	char **directories;
+	unsigned long directory_count;
+};
 
 struct xvfs_options {
 	char *name;
-	char *directory;
+	char **directories;
+	unsigned long directory_count;
+	struct xvfs_filesystem *filesystems;
+	unsigned long filesystem_count;
+	char *access_trace;
+	char *payload_align;
+	char *output;
+	char *shards;
+	char *gzip;
+	char *prefetch;
+	int prefetch_traced;
+	unsigned long align;
+	unsigned long shard_count;
+	char **gzip_patterns;
+	unsigned long gzip_pattern_count;
 };
 
-struct xvfs_state {
+struct xvfs_entry {
+	char *name;
+	char *source;
+	int is_dir;
+	int removed;
 	char **children;
 	unsigned long child_count;
-	unsigned long child_len;
+	unsigned long size;
+	unsigned long shard;
+	unsigned long subtree_end;
+	unsigned long crc;
+	unsigned long adler;
+};
+
+struct xvfs_state {
+	struct xvfs_entry *entries;
+	unsigned long entry_count;
+	unsigned long entry_len;
+	unsigned long *inodes;
+	unsigned long *order;
+	unsigned long traced_count;
 	int bucket_count;
 	int max_index;
+	unsigned long filter_block_count;
 };
 
 enum xvfs_minirivet_mode {
@@ -25,6 +67,42 @@ enum xvfs_minirivet_mode {
 	XVFS_MINIRIVET_MODE_TCL_PRINT
 };
 
+#ifndef XVFS_HAVE_ZLIB
+/*
+ * crc32() compatible with the one from zlib
+ */
+static unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int len) {
+	static unsigned long table[256];
+	static int table_computed = 0;
+	unsigned long value;
+	int idx, bit;
+
+	if (!table_computed) {
+		for (idx = 0; idx < 256; idx++) {
+			value = idx;
+			for (bit = 0; bit < 8; bit++) {
+				if (value & 1) {
+					value = 0xedb88320UL ^ (value >> 1);
+				} else {
+					value = value >> 1;
+				}
+			}
+			table[idx] = value;
+		}
+
+		table_computed = 1;
+	}
+
+	crc = crc ^ 0xffffffffUL;
+	while (len > 0) {
+		crc = table[(crc ^ *buf) & 0xff] ^ (crc >> 8);
+		buf++;
+		len--;
+	}
+
+	return(crc ^ 0xffffffffUL);
+}
+
 /*
  * adler32() function from zlib 1.1.4 and under the same license
  */
@@ -45,9 +123,9 @@ static unsigned long adler32(unsigned long adler, const unsigned char *buf, unsi
 
 		while (k >= 16) {
 			for (i = 0; i < 16; i++) {
-				s2 += buf[i];
+				s1 += buf[i];
+				s2 += s1;
 			}
-			s1 = buf[15];
 
 			buf += 16;
 			k   -= 16;
@@ -66,151 +144,1091 @@ static unsigned long adler32(unsigned long adler, const unsigned char *buf, unsi
 
 	return((s2 << 16) | s1);
 }
+#endif
+
+/*
+ * Emit a string the same way the Tcl implementation (sanitizeCString) does
+ */
+static void xvfs_print_c_string(FILE *outfp, const char * const string) {
+	const unsigned char *string_p;
+
+	fputc('"', outfp);
+	for (string_p = (const unsigned char *) string; *string_p; string_p++) {
+		if (isalnum(*string_p) || *string_p == '.' || *string_p == '/' || *string_p == '-') {
+			fputc(*string_p, outfp);
+		} else {
+			fprintf(outfp, "\\%03o", (int) *string_p);
+		}
+	}
+	fputc('"', outfp);
+
+	return;
+}
+
+static struct xvfs_entry *xvfs_append_entry(struct xvfs_state *xvfs_state) {
+	struct xvfs_entry *entry;
+
+	if (xvfs_state->entry_count == xvfs_state->entry_len) {
+		xvfs_state->entry_len = xvfs_state->entry_len * 2 + 64;
+		xvfs_state->entries = realloc(xvfs_state->entries, sizeof(*xvfs_state->entries) * xvfs_state->entry_len);
+	}
+
+	entry = &xvfs_state->entries[xvfs_state->entry_count];
+	xvfs_state->entry_count++;
+
+	memset(entry, 0, sizeof(*entry));
+
+	return(entry);
+}
+
+static struct xvfs_entry *xvfs_add_entry(struct xvfs_state *xvfs_state, const char * const name) {
+	struct xvfs_entry *entry;
+
+	entry = xvfs_append_entry(xvfs_state);
+	entry->name = strdup(name);
+
+	return(entry);
+}
+
+static void xvfs_free_entry(struct xvfs_entry *entry) {
+	unsigned long child_idx;
+
+	for (child_idx = 0; child_idx < entry->child_count; child_idx++) {
+		free(entry->children[child_idx]);
+	}
+
+	free(entry->children);
+	free(entry->source);
+	free(entry->name);
+
+	return;
+}
 
 /*
  * Handle XVFS Rivet template file substitution
  */
-static void parse_xvfs_minirivet_file(FILE *outfp, const char * const external_file_name, const char * const internal_file_name) {
+static void parse_xvfs_minirivet_file(FILE *outfp, struct xvfs_entry *entry, int *first_row) {
 	FILE *fp;
 	unsigned long file_size;
 	unsigned char buf[10];
 	size_t item_count;
 	int idx;
 
-	fp = fopen(external_file_name, "rb");
+	file_size = 0;
+	entry->crc = crc32(0, NULL, 0);
+	entry->adler = adler32(0, NULL, 0);
+
+	fp = fopen(entry->source, "rb");
+	if (fp) {
+		while (1) {
+			item_count = fread(&buf, 1, sizeof(buf), fp);
+			if (item_count <= 0) {
+				break;
+			}
+
+			entry->crc = crc32(entry->crc, buf, item_count);
+			entry->adler = adler32(entry->adler, buf, item_count);
+
+			if (!*first_row) {
+				fprintf(outfp, "\n");
+			}
+			*first_row = 0;
+
+			fprintf(outfp, "\t\"");
+			for (idx = 0; idx < item_count; idx++) {
+				fprintf(outfp, "\\x%02x", (int) buf[idx]);
+			}
+			fprintf(outfp, "\"");
+
+			file_size += item_count;
+		}
+
+		fclose(fp);
+	}
+
+	entry->size = file_size;
+
+	return;
+}
+
+#ifdef XVFS_HAVE_ZLIB
+/*
+ * Emit binary data the same way the Tcl implementation (binaryToCHex)
+ * does, as rows of 10 bytes each starting with the given prefix
+ */
+static void xvfs_print_c_hex(FILE *outfp, const unsigned char *data, unsigned long length, const char * const prefix) {
+	unsigned long idx;
+
+	for (idx = 0; idx < length; idx++) {
+		if ((idx % 10) == 0) {
+			if (idx != 0) {
+				fprintf(outfp, "\"\n");
+			}
+
+			fprintf(outfp, "%s\"", prefix);
+		}
+
+		fprintf(outfp, "\\x%02x", (int) data[idx]);
+	}
+
+	if (length == 0) {
+		fprintf(outfp, "%s\"", prefix);
+	}
+	fprintf(outfp, "\"");
+
+	return;
+}
+
+/*
+ * Determine if a pre-compressed variant of a file was requested
+ */
+static int xvfs_gzip_requested(const struct xvfs_options * const options, const char * const name) {
+	unsigned long idx;
+
+	for (idx = 0; idx < options->gzip_pattern_count; idx++) {
+		if (fnmatch(options->gzip_patterns[idx], name, 0) == 0) {
+			return(1);
+		}
+	}
+
+	return(0);
+}
+
+/*
+ * Compress a file the same way the Tcl implementation ("zlib gzip
+ * -level 9") does, returning NULL unless the result is smaller
+ */
+static unsigned char *xvfs_gzip_file(const struct xvfs_entry * const entry, unsigned long *gzip_size) {
+	z_stream stream;
+	unsigned char *data, *gzip;
+	unsigned long data_size, gzip_len;
+	FILE *fp;
+	int deflate_ret;
+
+	fp = fopen(entry->source, "rb");
 	if (!fp) {
-		return;
+		return(NULL);
 	}
 
-	fprintf(outfp, "\t{\n");
-	fprintf(outfp, "\t\t.name = \"%s\",\n", internal_file_name);
-	fprintf(outfp, "\t\t.type = XVFS_FILE_TYPE_REG,\n");
-	fprintf(outfp, "\t\t.data.fileContents = (const unsigned char *) \"");
+	data = malloc(entry->size + 1);
+	data_size = fread(data, 1, entry->size, fp);
+	fclose(fp);
+
+	memset(&stream, 0, sizeof(stream));
+	deflate_ret = deflateInit2(&stream, 9, Z_DEFLATED, MAX_WBITS + 16, MAX_MEM_LEVEL, Z_DEFAULT_STRATEGY);
+	if (deflate_ret != Z_OK) {
+		free(data);
 
-	file_size = 0;
+		return(NULL);
+	}
+
+	gzip_len = deflateBound(&stream, data_size);
+	gzip = malloc(gzip_len);
+
+	stream.next_in = data;
+	stream.avail_in = data_size;
+	stream.next_out = gzip;
+	stream.avail_out = gzip_len;
+
+	deflate_ret = deflate(&stream, Z_FINISH);
+	*gzip_size = stream.total_out;
+	deflateEnd(&stream);
+	free(data);
+
+	if (deflate_ret != Z_STREAM_END || *gzip_size >= data_size) {
+		free(gzip);
+
+		return(NULL);
+	}
+
+	return(gzip);
+}
+#endif
+
+/*
+ * Emit zero bytes to move the next payload onto an alignment boundary
+ */
+static void parse_xvfs_minirivet_padding(FILE *outfp, unsigned long padding, int *first_row) {
+	unsigned long idx;
+
+	for (idx = 0; idx < padding; idx++) {
+		if ((idx % 64) == 0) {
+			if (idx != 0) {
+				fprintf(outfp, "\"");
+			}
+
+			if (!*first_row) {
+				fprintf(outfp, "\n");
+			}
+			*first_row = 0;
+
+			fprintf(outfp, "\t\"");
+		}
+
+		fprintf(outfp, "\\x00");
+	}
+
+	if (padding != 0) {
+		fprintf(outfp, "\"");
+	}
+
+	return;
+}
+
+/*
+ * Join a directory and a name into a newly allocated path, an empty
+ * directory yields just the name
+ */
+static char *xvfs_join_path(const char * const directory, const char * const name) {
+	char *path;
+
+	path = malloc(strlen(directory) + strlen(name) + 2);
+	if (strcmp(directory, "") == 0) {
+		strcpy(path, name);
+	} else {
+		sprintf(path, "%s/%s", directory, name);
+	}
+
+	return(path);
+}
+
+static void parse_xvfs_minirivet_directory(FILE *outfp, struct xvfs_state *xvfs_state, const char * const directory, const char * const prefix) {
+	unsigned long child_idx, child_len, subdir_idx, subdir_count, subdir_len;
+	DIR *dp;
+	struct dirent *file_info;
+	struct stat file_stat;
+	struct xvfs_entry *entry;
+	char *full_path;
+	char *rel_path;
+	char **children, **subdirs;
+	int stat_ret;
+
+	dp = opendir(directory);
+	if (!dp) {
+		return;
+	}
+
+	child_idx = 0;
+	child_len = 0;
+	children = NULL;
+	subdir_count = 0;
+	subdir_len = 0;
+	subdirs = NULL;
 	while (1) {
-		item_count = fread(&buf, 1, sizeof(buf), fp);
-		if (item_count <= 0) {
+		file_info = readdir(dp);
+		if (!file_info) {
+			break;
+		}
+
+		if (strcmp(file_info->d_name, ".") == 0) {
+			continue;
+		}
+
+		if (strcmp(file_info->d_name, "..") == 0) {
+			continue;
+		}
+
+		full_path = xvfs_join_path(directory, file_info->d_name);
+
+		stat_ret = stat(full_path, &file_stat);
+		if (stat_ret != 0) {
+			fprintf(stderr, "warning: Unable to access %s, skipping\n", full_path);
+			free(full_path);
+
+			continue;
+		}
+
+		/*
+		 * Files are listed before subdirectories, as by
+		 * xvfs-create, so that both produce the same image
+		 */
+		if (S_ISDIR(file_stat.st_mode)) {
+			if (subdir_count == subdir_len) {
+				subdir_len = subdir_len * 2 + 16;
+				subdirs = realloc(subdirs, sizeof(*subdirs) * subdir_len);
+			}
+
+			subdirs[subdir_count] = strdup(file_info->d_name);
+			subdir_count++;
+			free(full_path);
+
+			continue;
+		}
+
+		if (child_idx == child_len) {
+			child_len = child_len * 2 + 64;
+			children = realloc(children, sizeof(*children) * child_len);
+		}
+
+		children[child_idx] = strdup(file_info->d_name);
+		child_idx++;
+
+		rel_path = xvfs_join_path(prefix, file_info->d_name);
+
+		entry = xvfs_add_entry(xvfs_state, rel_path);
+		entry->source = strdup(full_path);
+		entry->size = file_stat.st_size;
+
+		free(full_path);
+		free(rel_path);
+	}
+
+	closedir(dp);
+
+	for (subdir_idx = 0; subdir_idx < subdir_count; subdir_idx++) {
+		if (child_idx == child_len) {
+			child_len = child_len * 2 + 64;
+			children = realloc(children, sizeof(*children) * child_len);
+		}
+
+		children[child_idx] = subdirs[subdir_idx];
+		child_idx++;
+
+		full_path = xvfs_join_path(directory, subdirs[subdir_idx]);
+		rel_path = xvfs_join_path(prefix, subdirs[subdir_idx]);
+
+		parse_xvfs_minirivet_directory(outfp, xvfs_state, full_path, rel_path);
+
+		free(full_path);
+		free(rel_path);
+	}
+	free(subdirs);
+
+	entry = xvfs_add_entry(xvfs_state, prefix);
+	entry->is_dir = 1;
+	entry->children = children;
+	entry->child_count = child_idx;
+	entry->size = child_idx;
+
+	return;
+}
+
+static const struct xvfs_entry *xvfs_sort_entries;
+static int xvfs_compare_entry_index(const void *a_p, const void *b_p) {
+	const unsigned long *a = a_p, *b = b_p;
+
+	return(strcmp(xvfs_sort_entries[*a].name, xvfs_sort_entries[*b].name));
+}
+
+/*
+ * Find an entry by name in a list of entry indexes sorted by name,
+ * returning -1 if there is none
+ */
+static long xvfs_find_entry(const struct xvfs_state *xvfs_state, const unsigned long *by_name, const char * const name) {
+	unsigned long low, high, mid;
+	int compare_ret;
+
+	low = 0;
+	high = xvfs_state->entry_count;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		compare_ret = strcmp(xvfs_state->entries[by_name[mid]].name, name);
+		if (compare_ret == 0) {
+			return(by_name[mid]);
+		}
+
+		if (compare_ret < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return(-1);
+}
+
+static unsigned long *xvfs_sort_by_name(const struct xvfs_state *xvfs_state) {
+	unsigned long *by_name;
+	unsigned long idx;
+
+	by_name = malloc(sizeof(*by_name) * (xvfs_state->entry_count + 1));
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		by_name[idx] = idx;
+	}
+	xvfs_sort_entries = xvfs_state->entries;
+	qsort(by_name, xvfs_state->entry_count, sizeof(*by_name), xvfs_compare_entry_index);
+
+	return(by_name);
+}
+
+/*
+ * Merge a layer into the entries found so far, the layer shadowing
+ * whatever is below it at the same paths, so that any number of
+ * layers make a single image with a single index.  Directories in
+ * both keep their children from below, followed by any new ones
+ */
+static void xvfs_merge_layer(struct xvfs_state *xvfs_state, struct xvfs_state *layer) {
+	struct xvfs_entry *entry, *lower;
+	unsigned long *by_name;
+	unsigned long idx, child_idx, lower_idx, name_len, kept;
+	char *child_path;
+	long found, child;
+
+	by_name = xvfs_sort_by_name(xvfs_state);
+
+	for (idx = 0; idx < layer->entry_count; idx++) {
+		entry = &layer->entries[idx];
+
+		found = xvfs_find_entry(xvfs_state, by_name, entry->name);
+		if (found < 0) {
+			continue;
+		}
+
+		lower = &xvfs_state->entries[found];
+		entry->removed = 1;
+
+		if (entry->is_dir && lower->is_dir) {
+			for (child_idx = 0; child_idx < entry->child_count; child_idx++) {
+				child_path = xvfs_join_path(lower->name, entry->children[child_idx]);
+				child = xvfs_find_entry(xvfs_state, by_name, child_path);
+				free(child_path);
+
+				if (child >= 0) {
+					free(entry->children[child_idx]);
+
+					continue;
+				}
+
+				lower->children = realloc(lower->children, sizeof(*lower->children) * (lower->child_count + 1));
+				lower->children[lower->child_count] = entry->children[child_idx];
+				lower->child_count++;
+			}
+			lower->size = lower->child_count;
+
+			entry->child_count = 0;
+			xvfs_free_entry(entry);
+
+			continue;
+		}
+
+		/*
+		 * Anything else is replaced outright, and a directory
+		 * replaced by a file takes everything beneath it along
+		 */
+		if (lower->is_dir) {
+			name_len = strlen(lower->name);
+			for (lower_idx = 0; lower_idx < xvfs_state->entry_count; lower_idx++) {
+				if (strncmp(xvfs_state->entries[lower_idx].name, lower->name, name_len) == 0 && xvfs_state->entries[lower_idx].name[name_len] == '/') {
+					xvfs_state->entries[lower_idx].removed = 1;
+				}
+			}
+		}
+
+		xvfs_free_entry(lower);
+		*lower = *entry;
+		lower->removed = 0;
+	}
+
+	free(by_name);
+
+	kept = 0;
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		if (xvfs_state->entries[idx].removed) {
+			xvfs_free_entry(&xvfs_state->entries[idx]);
+
+			continue;
+		}
+
+		xvfs_state->entries[kept] = xvfs_state->entries[idx];
+		kept++;
+	}
+	xvfs_state->entry_count = kept;
+
+	/*
+	 * Entries only found in this layer follow the rest
+	 */
+	for (idx = 0; idx < layer->entry_count; idx++) {
+		if (layer->entries[idx].removed) {
+			continue;
+		}
+
+		entry = xvfs_append_entry(xvfs_state);
+		*entry = layer->entries[idx];
+	}
+
+	free(layer->entries);
+
+	return;
+}
+
+static unsigned long xvfs_number_entry(struct xvfs_state *xvfs_state, const unsigned long *by_name, unsigned long *numbered, unsigned long idx, unsigned long inode) {
+	struct xvfs_entry *entry;
+	unsigned long child_idx;
+	char *child_name;
+	long child;
+
+	numbered[idx] = 1;
+	xvfs_state->inodes[inode] = idx;
+	inode++;
+
+	entry = &xvfs_state->entries[idx];
+	for (child_idx = 0; entry->is_dir && child_idx < entry->child_count; child_idx++) {
+		child_name = xvfs_join_path(entry->name, entry->children[child_idx]);
+		child = xvfs_find_entry(xvfs_state, by_name, child_name);
+		free(child_name);
+
+		if (child < 0 || numbered[child]) {
+			continue;
+		}
+
+		inode = xvfs_number_entry(xvfs_state, by_name, numbered, child, inode);
+	}
+
+	entry->subtree_end = inode;
+
+	return(inode);
+}
+
+/*
+ * Number the entries in preorder, each directory immediately followed
+ * by everything beneath it, so that any subtree is a contiguous range
+ * of inodes.  Anything not reachable from the root is numbered after
+ * it, in the order it was found
+ */
+static void xvfs_number_entries(struct xvfs_state *xvfs_state, const unsigned long *by_name) {
+	unsigned long *numbered;
+	unsigned long idx, inode;
+	long root;
+
+	xvfs_state->inodes = malloc(sizeof(*xvfs_state->inodes) * (xvfs_state->entry_count + 1));
+	numbered = calloc(xvfs_state->entry_count + 1, sizeof(*numbered));
+
+	inode = 0;
+	root = xvfs_find_entry(xvfs_state, by_name, "");
+	if (root >= 0) {
+		inode = xvfs_number_entry(xvfs_state, by_name, numbered, root, inode);
+	}
+
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		if (numbered[idx]) {
+			continue;
+		}
+
+		inode = xvfs_number_entry(xvfs_state, by_name, numbered, idx, inode);
+	}
+
+	free(numbered);
+
+	return;
+}
+
+/*
+ * Number the entries, then order their payloads: anything in the
+ * access trace goes first in the order it was first touched,
+ * followed by everything else in inode order
+ */
+static void parse_xvfs_minirivet_order(struct xvfs_state *xvfs_state, const struct xvfs_options * const options) {
+	unsigned long *by_name, *placed;
+	unsigned long idx, order_idx;
+	FILE *fp;
+	char *line, *field, *path;
+	size_t line_len;
+	int field_idx;
+	long found;
+
+	by_name = xvfs_sort_by_name(xvfs_state);
+
+	xvfs_number_entries(xvfs_state, by_name);
+
+	xvfs_state->order = malloc(sizeof(*xvfs_state->order) * (xvfs_state->entry_count + 1));
+	placed = calloc(xvfs_state->entry_count + 1, sizeof(*placed));
+	order_idx = 0;
+
+	fp = NULL;
+	if (options->access_trace) {
+		fp = fopen(options->access_trace, "r");
+		if (!fp) {
+			fprintf(stderr, "warning: Unable to open access trace %s, ignoring\n", options->access_trace);
+		}
+	}
+
+	if (fp) {
+		line = NULL;
+		line_len = 0;
+		while (getline(&line, &line_len, fp) != -1) {
+			line[strcspn(line, "\r\n")] = '\0';
+
+			/*
+			 * <op> <fsName> <inode> <path> ...
+			 */
+			path = NULL;
+			field = line;
+			for (field_idx = 0; field && field_idx < 4; field_idx++) {
+				if (field_idx == 1 && strncmp(field, options->name, strlen(options->name)) != 0) {
+					break;
+				}
+
+				if (field_idx == 1 && field[strlen(options->name)] != '\t') {
+					break;
+				}
+
+				if (field_idx == 3) {
+					path = field;
+					path[strcspn(path, "\t")] = '\0';
+					break;
+				}
+
+				field = strchr(field, '\t');
+				if (field) {
+					field++;
+				}
+			}
+
+			if (!path) {
+				continue;
+			}
+
+			found = xvfs_find_entry(xvfs_state, by_name, path);
+			if (found < 0 || placed[found]) {
+				continue;
+			}
+
+			placed[found] = 1;
+			xvfs_state->order[order_idx] = found;
+			order_idx++;
+		}
+
+		free(line);
+		fclose(fp);
+	}
+
+	xvfs_state->traced_count = order_idx;
+
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		if (placed[xvfs_state->inodes[idx]]) {
+			continue;
+		}
+
+		xvfs_state->order[order_idx] = xvfs_state->inodes[idx];
+		order_idx++;
+	}
+
+	free(placed);
+	free(by_name);
+
+	return;
+}
+
+/*
+ * Preamble for payload shards, which are compiled on their own
+ * without the rest of the image
+ */
+static const char * const xvfs_shard_preamble = 
+	"#ifndef XVFS_ALIGNED\n"
+	"#  if defined(__GNUC__) || defined(__clang__)\n"
+	"#    define XVFS_ALIGNED(n) __attribute__((aligned(n)))\n"
+	"#  elif defined(_MSC_VER)\n"
+	"#    define XVFS_ALIGNED(n) __declspec(align(n))\n"
+	"#  else\n"
+	"#    define XVFS_ALIGNED(n)\n"
+	"#  endif\n"
+	"#endif\n"
+	"\n"
+	"#ifndef XVFS_INTERNAL\n"
+	"#  if defined(__GNUC__) || defined(__clang__)\n"
+	"#    define XVFS_INTERNAL __attribute__((visibility(\"hidden\")))\n"
+	"#  else\n"
+	"#    define XVFS_INTERNAL\n"
+	"#  endif\n"
+	"#endif\n"
+	"\n";
+
+/*
+ * Shard files are named after the output file, "<root>-shard<N>.c",
+ * or "<root>-<fsName>-shard<N>.c" for libraries with several filesystems
+ */
+static char *xvfs_shard_file_name(const struct xvfs_options * const options, unsigned long shard) {
+	const char *tail, *extension;
+	char *file_name;
+	size_t root_len;
+
+	tail = strrchr(options->output, '/');
+	if (!tail) {
+		tail = options->output;
+	}
+
+	extension = strrchr(tail, '.');
+	if (extension) {
+		root_len = extension - options->output;
+	} else {
+		root_len = strlen(options->output);
+	}
+
+	file_name = malloc(root_len + strlen(options->name) + 32);
+	if (options->filesystem_count > 1) {
+		sprintf(file_name, "%.*s-%s-shard%lu.c", (int) root_len, options->output, options->name, shard);
+	} else {
+		sprintf(file_name, "%.*s-shard%lu.c", (int) root_len, options->output, shard);
+	}
+
+	return(file_name);
+}
+
+/*
+ * Checksum a file the same way it is when it is emitted
+ */
+static void xvfs_checksum_file(struct xvfs_entry *entry) {
+	FILE *fp;
+	unsigned char buf[8192];
+	size_t item_count;
+
+	entry->crc = crc32(0, NULL, 0);
+	entry->adler = adler32(0, NULL, 0);
+
+	fp = fopen(entry->source, "rb");
+	if (!fp) {
+		return;
+	}
+
+	while ((item_count = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		entry->crc = crc32(entry->crc, buf, item_count);
+		entry->adler = adler32(entry->adler, buf, item_count);
+	}
+
+	fclose(fp);
+
+	return;
+}
+
+static int xvfs_same_contents(const struct xvfs_entry *a, const struct xvfs_entry *b) {
+	FILE *a_fp, *b_fp;
+	unsigned char a_buf[8192], b_buf[8192];
+	size_t a_count, b_count;
+	int retval;
+
+	a_fp = fopen(a->source, "rb");
+	b_fp = fopen(b->source, "rb");
+
+	retval = (a_fp && b_fp);
+	while (retval) {
+		a_count = fread(a_buf, 1, sizeof(a_buf), a_fp);
+		b_count = fread(b_buf, 1, sizeof(b_buf), b_fp);
+		if (a_count != b_count || memcmp(a_buf, b_buf, a_count) != 0) {
+			retval = 0;
+		}
+
+		if (a_count == 0) {
 			break;
 		}
+	}
+
+	if (a_fp) {
+		fclose(a_fp);
+	}
+	if (b_fp) {
+		fclose(b_fp);
+	}
+
+	return(retval);
+}
+
+static const unsigned long *xvfs_sort_positions;
+static int xvfs_compare_entry_contents(const void *a_p, const void *b_p) {
+	const struct xvfs_entry *a, *b;
+
+	a = &xvfs_sort_entries[*(const unsigned long *) a_p];
+	b = &xvfs_sort_entries[*(const unsigned long *) b_p];
+
+	if (a->shard != b->shard) {
+		return(a->shard < b->shard ? -1 : 1);
+	}
+	if (a->size != b->size) {
+		return(a->size < b->size ? -1 : 1);
+	}
+	if (a->crc != b->crc) {
+		return(a->crc < b->crc ? -1 : 1);
+	}
+	if (a->adler != b->adler) {
+		return(a->adler < b->adler ? -1 : 1);
+	}
+
+	return(0);
+}
+
+static int xvfs_compare_entry_contents_position(const void *a_p, const void *b_p) {
+	unsigned long a_position, b_position;
+	int compare_ret;
+
+	compare_ret = xvfs_compare_entry_contents(a_p, b_p);
+	if (compare_ret != 0) {
+		return(compare_ret);
+	}
+
+	a_position = xvfs_sort_positions[*(const unsigned long *) a_p];
+	b_position = xvfs_sort_positions[*(const unsigned long *) b_p];
+
+	return(a_position < b_position ? -1 : (a_position > b_position));
+}
+
+/*
+ * Files with identical contents, such as those that are unchanged
+ * between layers, share the first copy of them in their shard.  Only
+ * files the same size as another in the same shard are checksummed
+ * up front to find them
+ */
+static unsigned long *xvfs_share_payloads(struct xvfs_state *xvfs_state) {
+	unsigned long *shared, *positions, *by_contents;
+	unsigned long idx, group, count;
+	struct xvfs_entry *entry, *neighbor;
+
+	shared = malloc(sizeof(*shared) * (xvfs_state->entry_count + 1));
+	positions = malloc(sizeof(*positions) * (xvfs_state->entry_count + 1));
+	by_contents = malloc(sizeof(*by_contents) * (xvfs_state->entry_count + 1));
+
+	count = 0;
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		shared[idx] = idx;
+		positions[xvfs_state->order[idx]] = idx;
+
+		entry = &xvfs_state->entries[xvfs_state->order[idx]];
+		if (entry->is_dir) {
+			continue;
+		}
+
+		entry->crc = 0;
+		entry->adler = 0;
+		by_contents[count] = xvfs_state->order[idx];
+		count++;
+	}
+
+	xvfs_sort_entries = xvfs_state->entries;
+	xvfs_sort_positions = positions;
+	qsort(by_contents, count, sizeof(*by_contents), xvfs_compare_entry_contents_position);
+
+	for (idx = 0; idx < count; idx++) {
+		entry = &xvfs_state->entries[by_contents[idx]];
+
+		if (idx > 0) {
+			neighbor = &xvfs_state->entries[by_contents[idx - 1]];
+			if (neighbor->shard == entry->shard && neighbor->size == entry->size) {
+				xvfs_checksum_file(entry);
+
+				continue;
+			}
+		}
+
+		if (idx + 1 < count) {
+			neighbor = &xvfs_state->entries[by_contents[idx + 1]];
+			if (neighbor->shard == entry->shard && neighbor->size == entry->size) {
+				xvfs_checksum_file(entry);
+			}
+		}
+	}
+
+	qsort(by_contents, count, sizeof(*by_contents), xvfs_compare_entry_contents_position);
 
-		if (file_size != 0) {
-			fprintf(outfp, "\n\t\t\t\"");
-		}
+	group = 0;
+	for (idx = 1; idx < count; idx++) {
+		if (xvfs_compare_entry_contents(&by_contents[group], &by_contents[idx]) != 0) {
+			group = idx;
 
-		for (idx = 0; idx < item_count; idx++) {
-			fprintf(outfp, "\\x%02x", (int) buf[idx]);
+			continue;
 		}
-		fprintf(outfp, "\"");
 
-		file_size += item_count;
+		if (xvfs_same_contents(&xvfs_state->entries[by_contents[group]], &xvfs_state->entries[by_contents[idx]])) {
+			shared[by_contents[idx]] = by_contents[group];
+		}
 	}
 
-	fclose(fp);
+	free(by_contents);
+	free(positions);
 
-	fprintf(outfp, ",\n");
-	fprintf(outfp, "\t\t.size = %lu\n", file_size);
-	fprintf(outfp, "\t},\n");
+	return(shared);
 }
 
-static void parse_xvfs_minirivet_directory(FILE *outfp, struct xvfs_state *xvfs_state, const char * const directory, const char * const prefix) {
-	const unsigned int max_path_len = 8192, max_children = 65536;
-	unsigned long child_idx, child_count;
-	DIR *dp;
-	struct dirent *file_info;
-	struct stat file_stat;
-	char *full_path_buf;
-	char *rel_path_buf;
-	char **children;
-	int stat_ret;
-	int snprintf_ret;
+static void parse_xvfs_minirivet_payload(FILE *outfp, struct xvfs_state *xvfs_state, const struct xvfs_options * const options, unsigned long shard, const unsigned long *shared, unsigned long *offsets) {
+	struct xvfs_entry *entry;
+	unsigned long idx, offset, align;
+	int first_row;
 
-	dp = opendir(directory);
-	if (!dp) {
-		return;
+	align = options->align;
+	if (options->shard_count > 1) {
+		fprintf(outfp, "XVFS_INTERNAL const unsigned char");
+	} else {
+		fprintf(outfp, "static const unsigned char");
+	}
+	if (align > 1) {
+		fprintf(outfp, " XVFS_ALIGNED(%lu)", align);
+	}
+	if (options->shard_count > 1) {
+		fprintf(outfp, " xvfs_%s_payload_%lu[] = \n", options->name, shard);
+	} else {
+		fprintf(outfp, " xvfs_%s_payload[] = \n", options->name);
 	}
 
-	full_path_buf = malloc(max_path_len);
-	rel_path_buf = malloc(max_path_len);
-	children = malloc(sizeof(*children) * max_children);
-
-	child_idx = 0;
-	while (1) {
-		file_info = readdir(dp);
-		if (!file_info) {
-			break;
-		}
-
-		if (strcmp(file_info->d_name, ".") == 0) {
+	offset = 0;
+	first_row = 1;
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		entry = &xvfs_state->entries[xvfs_state->order[idx]];
+		if (entry->is_dir) {
 			continue;
 		}
 
-		if (strcmp(file_info->d_name, "..") == 0) {
+		if (entry->shard != shard) {
 			continue;
 		}
 
-		snprintf_ret = snprintf(full_path_buf, max_path_len, "%s/%s", directory, file_info->d_name);
-		if (snprintf_ret >= max_path_len) {
-			continue;
-		}
+		if (shared[xvfs_state->order[idx]] != xvfs_state->order[idx]) {
+			offsets[xvfs_state->order[idx]] = offsets[shared[xvfs_state->order[idx]]];
 
-		snprintf_ret = snprintf(rel_path_buf, max_path_len, "%s%s%s",
-			prefix,
-			strcmp(prefix, "") == 0 ? "" : "/",
-			file_info->d_name
-		);
-		if (snprintf_ret >= max_path_len) {
 			continue;
 		}
 
-		stat_ret = stat(full_path_buf, &file_stat);
-		if (stat_ret != 0) {
-			continue;
+		/*
+		 * Payloads at least as large as the alignment start on
+		 * an alignment boundary so that they may be advised
+		 * without affecting their neighbors
+		 */
+		if (align > 1 && (offset % align) != 0 && entry->size >= align) {
+			parse_xvfs_minirivet_padding(outfp, align - (offset % align), &first_row);
+			offset += align - (offset % align);
 		}
 
-		children[child_idx] = strdup(file_info->d_name);
-		child_idx++;
+		parse_xvfs_minirivet_file(outfp, entry, &first_row);
 
-		if (S_ISDIR(file_stat.st_mode)) {
-			parse_xvfs_minirivet_directory(outfp, xvfs_state, full_path_buf, rel_path_buf);
-		} else {
-			parse_xvfs_minirivet_file(outfp, full_path_buf, rel_path_buf);
+		offsets[xvfs_state->order[idx]] = offset;
+		offset += entry->size;
+	}
+	if (first_row) {
+		fprintf(outfp, "\t\"\"");
+	}
+	fprintf(outfp, ";\n");
+
+	return;
+}
+
+static int parse_xvfs_minirivet_entries(FILE *outfp, struct xvfs_state *xvfs_state, const struct xvfs_options * const options) {
+	struct xvfs_entry *entry;
+	unsigned long *offsets, *shared;
+	unsigned long long total_size, start;
+	unsigned long idx, child_idx, shard;
+	char *shard_file_name;
+	FILE *shard_fp;
+#ifdef XVFS_HAVE_ZLIB
+	unsigned char *gzip;
+	unsigned long gzip_size;
+#endif
 
-			xvfs_state->children[xvfs_state->child_count] = strdup(rel_path_buf);
-			xvfs_state->child_count++;
+	offsets = malloc(sizeof(*offsets) * (xvfs_state->entry_count + 1));
+
+	/*
+	 * All file contents are placed in a single array so that
+	 * their placement in the image follows the payload order.  When
+	 * sharding, that array is cut into pieces of roughly equal
+	 * size which are each written to their own file, so that they
+	 * may be compiled in parallel
+	 */
+	total_size = 0;
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		entry = &xvfs_state->entries[idx];
+		if (!entry->is_dir) {
+			total_size += entry->size;
 		}
 	}
-	free(full_path_buf);
-	free(rel_path_buf);
 
-	child_count = child_idx;
+	start = 0;
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		entry = &xvfs_state->entries[xvfs_state->order[idx]];
+		if (entry->is_dir) {
+			continue;
+		}
 
-	fprintf(outfp, "\t{\n");
-	fprintf(outfp, "\t\t.name = \"%s\",\n", prefix);
-	fprintf(outfp, "\t\t.type = XVFS_FILE_TYPE_DIR,\n");
-	fprintf(outfp, "\t\t.data.dirChildren  = (const char *[]) {");
-	for (child_idx = 0; child_idx < child_count; child_idx++) {
-		if (child_idx != 0) {
-			fprintf(outfp, ", ");
+		if (total_size == 0) {
+			entry->shard = 0;
+		} else {
+			entry->shard = (start * options->shard_count) / total_size;
 		}
+		start += entry->size;
+	}
 
-		fprintf(outfp, "\"%s\"", children[child_idx]);
+	shared = xvfs_share_payloads(xvfs_state);
 
-		free(children[child_idx]);
-	}
-	fprintf(outfp, "},\n");
-	fprintf(outfp, "\t\t.size = %lu\n", child_count);
+	if (options->shard_count == 1) {
+		parse_xvfs_minirivet_payload(outfp, xvfs_state, options, 0, shared, offsets);
+		fprintf(outfp, "\n");
+	} else {
+		for (shard = 0; shard < options->shard_count; shard++) {
+			shard_file_name = xvfs_shard_file_name(options, shard);
+			shard_fp = fopen(shard_file_name, "w");
+			if (!shard_fp) {
+				fprintf(stderr, "error: Unable to create %s\n", shard_file_name);
+				free(shard_file_name);
+				free(offsets);
+				free(shared);
+
+				return(0);
+			}
 
-	free(children);
+			fprintf(shard_fp, "/*\n");
+			fprintf(shard_fp, " * Payload shard %lu of %lu for the ", shard, options->shard_count);
+			xvfs_print_c_string(shard_fp, options->name);
+			fprintf(shard_fp, " image\n");
+			fprintf(shard_fp, " */\n");
+			fprintf(shard_fp, "%s", xvfs_shard_preamble);
+			parse_xvfs_minirivet_payload(shard_fp, xvfs_state, options, shard, shared, offsets);
+			fclose(shard_fp);
+			free(shard_file_name);
+
+			fprintf(outfp, "extern XVFS_INTERNAL const unsigned char xvfs_%s_payload_%lu[];\n", options->name, shard);
+		}
+		fprintf(outfp, "\n");
+	}
 
-	fprintf(outfp, "\t},\n");
+	fprintf(outfp, "static const struct xvfs_file_data xvfs_%s_data[] = {\n", options->name);
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		entry = &xvfs_state->entries[xvfs_state->inodes[idx]];
+
+		fprintf(outfp, "\t{\n");
+		fprintf(outfp, "\t\t.name = ");
+		xvfs_print_c_string(outfp, entry->name);
+		fprintf(outfp, ",\n");
+		if (entry->is_dir) {
+			fprintf(outfp, "\t\t.type = XVFS_FILE_TYPE_DIR,\n");
+			if (entry->child_count == 0) {
+				fprintf(outfp, "\t\t.data.dirChildren  = NULL,\n");
+			} else {
+				fprintf(outfp, "\t\t.data.dirChildren  = (const char *[]) {");
+				for (child_idx = 0; child_idx < entry->child_count; child_idx++) {
+					if (child_idx != 0) {
+						fprintf(outfp, ", ");
+					}
 
-	xvfs_state->children[xvfs_state->child_count] = strdup(prefix);
-	xvfs_state->child_count++;
+					xvfs_print_c_string(outfp, entry->children[child_idx]);
+				}
+				fprintf(outfp, "},\n");
+			}
+			fprintf(outfp, "\t\t.subtreeEnd = %lu,\n", entry->subtree_end);
+		} else {
+			fprintf(outfp, "\t\t.type = XVFS_FILE_TYPE_REG,\n");
+			if (options->shard_count > 1) {
+				fprintf(outfp, "\t\t.data.fileContents = xvfs_%s_payload_%lu + %lu,\n", options->name, entry->shard, offsets[xvfs_state->inodes[idx]]);
+			} else {
+				fprintf(outfp, "\t\t.data.fileContents = xvfs_%s_payload + %lu,\n", options->name, offsets[xvfs_state->inodes[idx]]);
+			}
+			fprintf(outfp, "\t\t.digest = \"%08lx%08lx\",\n", entry->crc, entry->adler);
+#ifdef XVFS_HAVE_ZLIB
+			gzip = NULL;
+			if (xvfs_gzip_requested(options, entry->name)) {
+				gzip = xvfs_gzip_file(entry, &gzip_size);
+			}
+			if (gzip) {
+				fprintf(outfp, "\t\t.gzipContents = (const unsigned char *)\n");
+				xvfs_print_c_hex(outfp, gzip, gzip_size, "\t\t\t");
+				fprintf(outfp, ",\n");
+				fprintf(outfp, "\t\t.gzipSize = %lu,\n", gzip_size);
+				free(gzip);
+			}
+#endif
+		}
+		fprintf(outfp, "\t\t.size = %lu\n", entry->size);
+		fprintf(outfp, "\t},\n");
+	}
+	fprintf(outfp, "};\n");
 
-	closedir(dp);
+	free(offsets);
+	free(shared);
 
-	return;
+	return(1);
 }
 
 static void parse_xvfs_minirivet_hashtable_header(FILE *outfp, struct xvfs_state *xvfs_state) {
@@ -219,14 +1237,15 @@ static void parse_xvfs_minirivet_hashtable_header(FILE *outfp, struct xvfs_state
 	int idx1, idx2;
 	int check_hash;
 	int first_entry;
+	const char *name;
 
-	if (xvfs_state->child_count > max_bucket_count) {
+	if (xvfs_state->entry_count > max_bucket_count) {
 		bucket_count = max_bucket_count;
 	} else {
-		bucket_count = xvfs_state->child_count;
+		bucket_count = xvfs_state->entry_count;
 	}
 	xvfs_state->bucket_count = bucket_count;
-	xvfs_state->max_index = xvfs_state->child_count;
+	xvfs_state->max_index = xvfs_state->entry_count;
 
 	fprintf(outfp, "\tlong pathIndex_idx;\n");
 	fprintf(outfp, "\tint pathIndex_hash;\n");
@@ -239,8 +1258,9 @@ static void parse_xvfs_minirivet_hashtable_header(FILE *outfp, struct xvfs_state
 		fprintf(outfp, "\t\t");
 		first_entry = 1;
 
-		for (idx2 = 0; idx2 < xvfs_state->child_count; idx2++) {
-			check_hash = adler32(0, (unsigned char *) xvfs_state->children[idx2], strlen(xvfs_state->children[idx2])) % bucket_count;
+		for (idx2 = 0; idx2 < xvfs_state->entry_count; idx2++) {
+			name = xvfs_state->entries[xvfs_state->inodes[idx2]].name;
+			check_hash = adler32(0, (unsigned char *) name, strlen(name)) % bucket_count;
 			if (check_hash != idx1) {
 				continue;
 			}
@@ -265,11 +1285,6 @@ static void parse_xvfs_minirivet_hashtable_header(FILE *outfp, struct xvfs_state
 		fprintf(outfp, "\t};\n");
 	}
 
-	for (idx2 = 0; idx2 < xvfs_state->child_count; idx2++) {
-		free(xvfs_state->children[idx2]);
-	}
-	free(xvfs_state->children);
-
 	fprintf(outfp, "\tstatic const long * const pathIndex_hashTable[%i] = {\n", bucket_count);
 	for (idx1 = 0; idx1 < bucket_count; idx1++) {
 		fprintf(outfp, "\t\tpathIndex_hashTable_%i,\n", idx1);
@@ -278,7 +1293,7 @@ static void parse_xvfs_minirivet_hashtable_header(FILE *outfp, struct xvfs_state
 	return;
 }
 
-static void parse_xvfs_minirivet_hashtable_body(FILE *outfp, struct xvfs_state *xvfs_state) {
+static void parse_xvfs_minirivet_hashtable_body(FILE *outfp, const struct xvfs_options * const options, struct xvfs_state *xvfs_state) {
 	fprintf(outfp, "\tpathIndex_hash = Tcl_ZlibAdler32(0, (unsigned char *) path, pathLen) %% %i;\n", xvfs_state->bucket_count);
 	fprintf(outfp, "\tfor (pathIndex_idx = 0; pathIndex_idx < %i; pathIndex_idx++) {\n", xvfs_state->max_index);
 	fprintf(outfp, "\t\tpathIndex = pathIndex_hashTable[pathIndex_hash][pathIndex_idx];\n");
@@ -286,14 +1301,309 @@ static void parse_xvfs_minirivet_hashtable_body(FILE *outfp, struct xvfs_state *
 	fprintf(outfp, "\t\t\tbreak;\n");
 	fprintf(outfp, "\t\t}\n");
 	fprintf(outfp, "\n");
-	fprintf(outfp, "\t\tif (strcmp(path, xvfs_example_data[pathIndex].name) == 0) {\n");
+	fprintf(outfp, "\t\tif (strcmp(path, xvfs_%s_data[pathIndex].name) == 0) {\n", options->name);
 	fprintf(outfp, "\t\t\treturn(pathIndex);\n");
 	fprintf(outfp, "\t\t}\n");
 	fprintf(outfp, "\t}\n");
 	return;
 }
 
-static void parse_xvfs_minirivet_handle_tcl_print(FILE *outfp, const struct xvfs_options * const options, struct xvfs_state *xvfs_state, char *command) {
+static void parse_xvfs_minirivet_filter_header(FILE *outfp, struct xvfs_state *xvfs_state) {
+	const unsigned long bits_per_name = 12;
+	unsigned long long *blocks;
+	unsigned long block_count, block, idx;
+	unsigned long hash, hash2;
+	const char *name;
+
+	/*
+	 * A blocked Bloom filter: each name sets 3 bits within a single
+	 * 64-bit block, so a lookup touches exactly one word
+	 */
+	block_count = ((xvfs_state->entry_count * bits_per_name) + 63) / 64;
+	if (block_count < 1) {
+		block_count = 1;
+	}
+	xvfs_state->filter_block_count = block_count;
+
+	blocks = calloc(block_count, sizeof(*blocks));
+
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		name = xvfs_state->entries[idx].name;
+		hash = crc32(0, (unsigned char *) name, strlen(name));
+		block = hash % block_count;
+		hash2 = (hash * 0x9E3779B1UL) & 0xffffffffUL;
+
+		blocks[block] |= 1ULL << (hash2 >> 26);
+		blocks[block] |= 1ULL << ((hash2 >> 20) & 63);
+		blocks[block] |= 1ULL << ((hash2 >> 14) & 63);
+	}
+
+	fprintf(outfp, "\tunsigned int pathFilter_hash, pathFilter_hash2;\n");
+	fprintf(outfp, "\tTcl_WideUInt pathFilter_mask;\n");
+	fprintf(outfp, "\tstatic const Tcl_WideUInt pathFilter_blocks[%lu] = {\n", block_count);
+	for (block = 0; block < block_count; block++) {
+		if ((block % 4) == 0) {
+			fprintf(outfp, "\t\t");
+		} else {
+			fprintf(outfp, " ");
+		}
+
+		fprintf(outfp, "0x%016llxULL,", blocks[block]);
+
+		if ((block % 4) == 3 || block == (block_count - 1)) {
+			fprintf(outfp, "\n");
+		}
+	}
+	fprintf(outfp, "\t};");
+
+	free(blocks);
+
+	return;
+}
+
+static void parse_xvfs_minirivet_filter_body(FILE *outfp, struct xvfs_state *xvfs_state) {
+	fprintf(outfp, "\tpathFilter_hash = Tcl_ZlibCRC32(0, (unsigned char *) path, pathLen);\n");
+	fprintf(outfp, "\tpathFilter_hash2 = (pathFilter_hash * 0x9E3779B1U) & 0xffffffffU;\n");
+	fprintf(outfp, "\tpathFilter_mask = (((Tcl_WideUInt) 1) << (pathFilter_hash2 >> 26)) |\n");
+	fprintf(outfp, "\t\t(((Tcl_WideUInt) 1) << ((pathFilter_hash2 >> 20) & 63)) |\n");
+	fprintf(outfp, "\t\t(((Tcl_WideUInt) 1) << ((pathFilter_hash2 >> 14) & 63));\n");
+	fprintf(outfp, "\tif ((pathFilter_blocks[pathFilter_hash %% %lu] & pathFilter_mask) != pathFilter_mask) {\n", xvfs_state->filter_block_count);
+	fprintf(outfp, "\t\treturn(XVFS_NAME_LOOKUP_ERROR);\n");
+	fprintf(outfp, "\t}");
+
+	return;
+}
+
+static int xvfs_compare_string(const void *a_p, const void *b_p) {
+	return(strcmp(*(char * const *) a_p, *(char * const *) b_p));
+}
+
+/*
+ * Find the packages a pkgIndex.tcl script declares.  There is no Tcl
+ * interpreter here to evaluate it in, as xvfs-create does, so instead
+ * look for every "package ifneeded <name>" command in it.  A name that
+ * is not a plain word, or finding none at all, gives "*" (source it for
+ * any package).  A declaration in a branch that would not be taken is
+ * still listed, which only means the script is sourced for it
+ */
+static char *xvfs_package_index_packages(const struct xvfs_entry * const entry) {
+	FILE *fp;
+	char *script, *packages, *name, *command_p;
+	char **names;
+	unsigned long name_count, idx, packages_len;
+	size_t script_len, name_len, offset;
+	int command_start, wildcard;
+
+	script = NULL;
+	script_len = 0;
+	fp = fopen(entry->source, "rb");
+	if (fp) {
+		script = malloc(entry->size + 1);
+		script_len = fread(script, 1, entry->size, fp);
+		fclose(fp);
+	}
+
+	if (!script) {
+		return(strdup("*"));
+	}
+	script[script_len] = '\0';
+
+	names = NULL;
+	name_count = 0;
+	wildcard = 0;
+	command_start = 1;
+	for (offset = 0; offset < script_len && !wildcard; offset++) {
+		if (strchr(" \t", script[offset])) {
+			continue;
+		}
+
+		if (!command_start || strncmp(script + offset, "package", 7) != 0) {
+			command_start = (strchr("\n;{[", script[offset]) != NULL);
+			continue;
+		}
+		command_start = 0;
+
+		command_p = script + offset + 7;
+		if (!strchr(" \t", *command_p)) {
+			continue;
+		}
+		command_p += strspn(command_p, " \t");
+
+		if (strncmp(command_p, "ifneeded", 8) != 0 || !strchr(" \t", command_p[8])) {
+			continue;
+		}
+		command_p += 8;
+		command_p += strspn(command_p, " \t");
+
+		name_len = strcspn(command_p, " \t\r\n;]}");
+		if (name_len == 0 || strcspn(command_p, "$[\\{\"") < name_len) {
+			wildcard = 1;
+			continue;
+		}
+
+		name = malloc(name_len + 1);
+		memcpy(name, command_p, name_len);
+		name[name_len] = '\0';
+
+		names = realloc(names, sizeof(*names) * (name_count + 1));
+		names[name_count] = name;
+		name_count++;
+	}
+
+	free(script);
+
+	if (name_count == 0) {
+		wildcard = 1;
+	}
+
+	packages = NULL;
+	if (!wildcard) {
+		qsort(names, name_count, sizeof(*names), xvfs_compare_string);
+
+		packages_len = 0;
+		for (idx = 0; idx < name_count; idx++) {
+			packages_len += strlen(names[idx]) + 1;
+		}
+
+		packages = malloc(packages_len + 1);
+		packages[0] = '\0';
+		for (idx = 0; idx < name_count; idx++) {
+			if (idx != 0 && strcmp(names[idx], names[idx - 1]) == 0) {
+				continue;
+			}
+
+			if (packages[0] != '\0') {
+				strcat(packages, " ");
+			}
+			strcat(packages, names[idx]);
+		}
+	}
+
+	for (idx = 0; idx < name_count; idx++) {
+		free(names[idx]);
+	}
+	free(names);
+
+	if (wildcard) {
+		return(strdup("*"));
+	}
+
+	return(packages);
+}
+
+/*
+ * Records of "kind<TAB>packages<TAB>path<NEWLINE>" for every package
+ * index script and Tcl module in the image
+ */
+static void parse_xvfs_minirivet_package_index(FILE *outfp, struct xvfs_state *xvfs_state) {
+	struct xvfs_entry *entry;
+	const char *kind, *tail, *extension;
+	char *record, *packages;
+	unsigned long idx;
+	int first_record;
+
+	first_record = 1;
+	for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+		entry = &xvfs_state->entries[xvfs_state->inodes[idx]];
+		if (entry->is_dir) {
+			continue;
+		}
+
+		if (strpbrk(entry->name, "\t\n")) {
+			continue;
+		}
+
+		tail = strrchr(entry->name, '/');
+		if (tail) {
+			tail++;
+		} else {
+			tail = entry->name;
+		}
+		extension = strrchr(tail, '.');
+
+		if (strcmp(tail, "pkgIndex.tcl") == 0) {
+			kind = "pkgIndex";
+			packages = xvfs_package_index_packages(entry);
+		} else if (extension && strcmp(extension, ".tm") == 0) {
+			kind = "tm";
+			packages = strdup("");
+		} else {
+			continue;
+		}
+
+		record = malloc(strlen(kind) + strlen(packages) + strlen(entry->name) + 4);
+		sprintf(record, "%s\t%s\t%s\n", kind, packages, entry->name);
+		free(packages);
+
+		if (!first_record) {
+			fprintf(outfp, "\n");
+		}
+		first_record = 0;
+
+		fprintf(outfp, "\t\t");
+		xvfs_print_c_string(outfp, record);
+
+		free(record);
+	}
+
+	if (first_record) {
+		fprintf(outfp, "\t\t\"\"");
+	}
+
+	return;
+}
+
+/*
+ * The body of getPrefetch: with --prefetch, the inodes of every file
+ * in the access trace in the order they were first touched
+ */
+static void parse_xvfs_minirivet_prefetch_list(FILE *outfp, const struct xvfs_options * const options, struct xvfs_state *xvfs_state) {
+	unsigned long *inode_of;
+	unsigned long idx, count;
+
+	count = 0;
+	if (options->prefetch_traced) {
+		inode_of = malloc(sizeof(*inode_of) * (xvfs_state->entry_count + 1));
+		for (idx = 0; idx < xvfs_state->entry_count; idx++) {
+			inode_of[xvfs_state->inodes[idx]] = idx;
+		}
+
+		for (idx = 0; idx < xvfs_state->traced_count; idx++) {
+			if (xvfs_state->entries[xvfs_state->order[idx]].is_dir) {
+				continue;
+			}
+
+			if (count == 0) {
+				fprintf(outfp, "\tstatic const long prefetch[] = {\n");
+			} else {
+				fprintf(outfp, ",\n");
+			}
+
+			fprintf(outfp, "\t\t%lu", inode_of[xvfs_state->order[idx]]);
+			count++;
+		}
+
+		free(inode_of);
+	}
+
+	if (count == 0) {
+		fprintf(outfp, "\t*count = 0;\n");
+		fprintf(outfp, "\treturn(NULL);");
+
+		return;
+	}
+
+	fprintf(outfp, "\n\t};\n");
+	fprintf(outfp, "\n");
+	fprintf(outfp, "\t*count = %lu;\n", count);
+	fprintf(outfp, "\treturn(prefetch);");
+
+	return;
+}
+
+static int parse_xvfs_minirivet_handle_tcl_print(FILE *outfp, const struct xvfs_options * const options, struct xvfs_state *xvfs_state, char *command) {
+	struct xvfs_state layer;
+	unsigned long idx;
 	char *buffer_p, *buffer_e;
 
 	buffer_p = command;
@@ -310,24 +1620,50 @@ static void parse_xvfs_minirivet_handle_tcl_print(FILE *outfp, const struct xvfs
 	if (strcmp(buffer_p, "$::xvfs::fsName") == 0) {
 		fprintf(outfp, "%s", options->name);
 	} else if (strcmp(buffer_p, "$::xvfs::fileInfoStruct") == 0) {
-		fprintf(outfp, "static const struct xvfs_file_data xvfs_");
-		fprintf(outfp, "%s", options->name);
-		fprintf(outfp, "_data[] = {\n");
-		parse_xvfs_minirivet_directory(outfp, xvfs_state, options->directory, "");
-		fprintf(outfp, "};\n");
+		parse_xvfs_minirivet_directory(outfp, xvfs_state, options->directories[0], "");
+		for (idx = 1; idx < options->directory_count; idx++) {
+			memset(&layer, 0, sizeof(layer));
+			parse_xvfs_minirivet_directory(outfp, &layer, options->directories[idx], "");
+			xvfs_merge_layer(xvfs_state, &layer);
+		}
+		parse_xvfs_minirivet_order(xvfs_state, options);
+		if (!parse_xvfs_minirivet_entries(outfp, xvfs_state, options)) {
+			return(0);
+		}
 	} else if (strcmp(buffer_p, "[zlib adler32 $::xvfs::fsName 0]") == 0) {
 		fprintf(outfp, "%lu", adler32(0, (unsigned char *) options->name, strlen(options->name)));
 	} else if (strcmp(buffer_p, "[llength $::xvfs::outputFiles]") == 0) {
-		fprintf(outfp, "%lu", xvfs_state->child_count);
+		fprintf(outfp, "%lu", xvfs_state->entry_count);
 	} else if (strcmp(buffer_p, "$hashTableHeader") == 0) {
 		parse_xvfs_minirivet_hashtable_header(outfp, xvfs_state);
 	} else if (strcmp(buffer_p, "[dict get $hashTable body]") == 0) {
-		parse_xvfs_minirivet_hashtable_body(outfp, xvfs_state);
+		parse_xvfs_minirivet_hashtable_body(outfp, options, xvfs_state);
+	} else if (strcmp(buffer_p, "$::xvfs::packageIndex") == 0) {
+		parse_xvfs_minirivet_package_index(outfp, xvfs_state);
+	} else if (strcmp(buffer_p, "$::xvfs::prefetchList") == 0) {
+		parse_xvfs_minirivet_prefetch_list(outfp, options, xvfs_state);
+	} else if (strcmp(buffer_p, "$filterHeader") == 0) {
+		parse_xvfs_minirivet_filter_header(outfp, xvfs_state);
+	} else if (strcmp(buffer_p, "[dict get $filter body]") == 0) {
+		parse_xvfs_minirivet_filter_body(outfp, xvfs_state);
+	} else if (strcmp(buffer_p, "$::xvfs::initRegistrations") == 0) {
+		/*
+		 * The first filesystem registers all of the others
+		 */
+		if (options->name == options->filesystems[0].name) {
+			for (idx = 1; idx < options->filesystem_count; idx++) {
+				fprintf(outfp, "\n");
+				fprintf(outfp, "\tregister_ret = Xvfs_Register(interp, &xvfs_%s_fsInfo);\n", options->filesystems[idx].name);
+				fprintf(outfp, "\tif (register_ret != TCL_OK) {\n");
+				fprintf(outfp, "\t\treturn(register_ret);\n");
+				fprintf(outfp, "\t}\n");
+			}
+		}
 	} else {
 		fprintf(outfp, "@INVALID@%s@INVALID@", buffer_p);
 	}
 
-	return;
+	return(1);
 }
 
 static int parse_xvfs_minirivet(FILE *outfp, const char * const template, const struct xvfs_options * const options) {
@@ -337,9 +1673,11 @@ static int parse_xvfs_minirivet(FILE *outfp, const char * const template, const
 	char tcl_buffer[8192], *tcl_buffer_p;
 	enum xvfs_minirivet_mode mode;
 
-	xvfs_state.child_count = 0;
-	xvfs_state.child_len   = 65536;
-	xvfs_state.children    = malloc(sizeof(*xvfs_state.children) * xvfs_state.child_len);
+	xvfs_state.entry_count = 0;
+	xvfs_state.entry_len   = 0;
+	xvfs_state.entries     = NULL;
+	xvfs_state.inodes      = NULL;
+	xvfs_state.order       = NULL;
 
 #define parse_xvfs_minirivet_getbyte(var) var = template[template_idx]; template_idx++; if (var == 0) { break; }
 
@@ -388,7 +1726,9 @@ static int parse_xvfs_minirivet(FILE *outfp, const char * const template, const
 					*tcl_buffer_p = '\0';
 
 					if (mode == XVFS_MINIRIVET_MODE_TCL_PRINT) {
-						parse_xvfs_minirivet_handle_tcl_print(outfp, options, &xvfs_state, tcl_buffer);
+						if (!parse_xvfs_minirivet_handle_tcl_print(outfp, options, &xvfs_state, tcl_buffer)) {
+							return(0);
+						}
 					}
 
 					mode = XVFS_MINIRIVET_MODE_COPY;
@@ -415,11 +1755,13 @@ static int parse_xvfs_minirivet(FILE *outfp, const char * const template, const
 }
 
 static int xvfs_create(FILE *outfp, const struct xvfs_options * const options) {
-	const int template_len = 65536;
 	const char * const template_file = "lib/xvfs/xvfs.c.rvt";
+	struct xvfs_options fs_options;
+	struct xvfs_filesystem *filesystem;
+	unsigned long idx;
 	FILE *fp;
-	char *template, *template_p;
-	int template_remain;
+	char *template;
+	size_t template_len, template_size;
 	size_t fread_ret;
 	int retval;
 
@@ -428,31 +1770,48 @@ static int xvfs_create(FILE *outfp, const struct xvfs_options * const options) {
 		return(0);
 	}
 
-	template = malloc(template_len);
-	template_remain = template_len;
+	template_len = 0;
+	template_size = 65536;
+	template = malloc(template_size);
 	if (!template) {
 		fclose(fp);
 
 		return(0);
 	}
 
-	template_p = template;
 	while (1) {
-		fread_ret = fread(template_p, 1, template_remain, fp);
+		if (template_len + 1 >= template_size) {
+			template_size *= 2;
+			template = realloc(template, template_size);
+		}
+
+		fread_ret = fread(template + template_len, 1, template_size - template_len - 1, fp);
 		if (fread_ret <= 0) {
 			break;
 		}
 
-		template_p += fread_ret;
-		template_remain -= fread_ret;
-	}
-	if (template_remain > 0) {
-		*template_p = '\0';
+		template_len += fread_ret;
 	}
+	template[template_len] = '\0';
 
 	fclose(fp);
 
-	retval = parse_xvfs_minirivet(outfp, template, options);
+	/*
+	 * The template is emitted once for each filesystem, the first
+	 * one last so that its initialization can register all of the
+	 * others
+	 */
+	retval = 1;
+	for (idx = 1; idx <= options->filesystem_count && retval; idx++) {
+		filesystem = &options->filesystems[idx % options->filesystem_count];
+
+		fs_options = *options;
+		fs_options.name = filesystem->name;
+		fs_options.directories = filesystem->directories;
+		fs_options.directory_count = filesystem->directory_count;
+
+		retval = parse_xvfs_minirivet(outfp, template, &fs_options);
+	}
 
 	free(template);
 
@@ -462,19 +1821,78 @@ static int xvfs_create(FILE *outfp, const struct xvfs_options * const options) {
 /*
  * Parse command line options
  */
+static void xvfs_add_filesystem(struct xvfs_options *options, char *name, struct xvfs_filesystem *pending) {
+	options->filesystems = realloc(options->filesystems, sizeof(*options->filesystems) * (options->filesystem_count + 1));
+	options->filesystems[options->filesystem_count] = *pending;
+	options->filesystems[options->filesystem_count].name = name;
+	options->filesystem_count++;
+
+	pending->directories = NULL;
+	pending->directory_count = 0;
+
+	return;
+}
+
 static int parse_options(int argc, char **argv, struct xvfs_options *options) {
+	struct xvfs_filesystem pending = {0};
+	char *pending_name = NULL;
 	char *arg;
 	char **option;
 	int idx;
+	unsigned long fs_idx, check_idx;
 	int retval;
 
 	for (idx = 0; idx < argc; idx++) {
 		arg = argv[idx];
 
 		if (strcmp(arg, "--directory") == 0) {
-			option = &options->directory;
+			/*
+			 * Each additional directory is layered over the
+			 * ones before it
+			 */
+			idx++;
+			if (idx >= argc) {
+				break;
+			}
+
+			pending.directories = realloc(pending.directories, sizeof(*pending.directories) * (pending.directory_count + 1));
+			pending.directories[pending.directory_count] = argv[idx];
+			pending.directory_count++;
+
+			continue;
 		} else if (strcmp(arg, "--name") == 0) {
-			option = &options->name;
+			/*
+			 * Each name takes the directories just before it,
+			 * or if there are none, the ones just after it
+			 */
+			idx++;
+			if (idx >= argc) {
+				break;
+			}
+
+			if (pending_name || pending.directory_count == 0) {
+				if (pending_name) {
+					xvfs_add_filesystem(options, pending_name, &pending);
+				}
+
+				pending_name = argv[idx];
+			} else {
+				xvfs_add_filesystem(options, argv[idx], &pending);
+			}
+
+			continue;
+		} else if (strcmp(arg, "--access-trace") == 0) {
+			option = &options->access_trace;
+		} else if (strcmp(arg, "--payload-align") == 0) {
+			option = &options->payload_align;
+		} else if (strcmp(arg, "--output") == 0) {
+			option = &options->output;
+		} else if (strcmp(arg, "--shards") == 0) {
+			option = &options->shards;
+		} else if (strcmp(arg, "--gzip") == 0) {
+			option = &options->gzip;
+		} else if (strcmp(arg, "--prefetch") == 0) {
+			option = &options->prefetch;
 		} else {
 			fprintf(stderr, "Invalid argument %s\n", arg);
 
@@ -486,15 +1904,80 @@ static int parse_options(int argc, char **argv, struct xvfs_options *options) {
 		*option = arg;
 	}
 
+	if (pending_name || pending.directory_count != 0) {
+		xvfs_add_filesystem(options, pending_name, &pending);
+	}
+
 	retval = 1;
-	if (!options->directory) {		
+	if (options->filesystem_count == 0) {
 		fprintf(stderr, "error: --directory must be specified\n");
+		fprintf(stderr, "error: --name must be specified\n");
 		retval = 0;
 	}
 
-	if (!options->name) {
-		fprintf(stderr, "error: --name must be specified\n");
+	for (fs_idx = 0; fs_idx < options->filesystem_count; fs_idx++) {
+		if (options->filesystems[fs_idx].directory_count == 0) {
+			fprintf(stderr, "error: --directory must be specified\n");
+			retval = 0;
+		}
+
+		if (!options->filesystems[fs_idx].name) {
+			fprintf(stderr, "error: --name must be specified\n");
+			retval = 0;
+
+			continue;
+		}
+
+		for (check_idx = 0; check_idx < fs_idx; check_idx++) {
+			if (options->filesystems[check_idx].name && strcmp(options->filesystems[check_idx].name, options->filesystems[fs_idx].name) == 0) {
+				fprintf(stderr, "error: each --name may only be used once\n");
+				retval = 0;
+			}
+		}
+	}
+
+	if (options->payload_align) {
+		options->align = strtoul(options->payload_align, &arg, 10);
+		if (*arg != '\0' || (options->align & (options->align - 1)) != 0) {
+			fprintf(stderr, "error: --payload-align must be a power of two\n");
+			retval = 0;
+		}
+	}
+
+	options->shard_count = 1;
+	if (options->shards) {
+		options->shard_count = strtoul(options->shards, &arg, 10);
+		if (*arg != '\0' || options->shard_count < 1) {
+			fprintf(stderr, "error: --shards must be a positive integer\n");
+			retval = 0;
+		} else if (options->shard_count > 1 && !options->output) {
+			fprintf(stderr, "error: --shards requires --output\n");
+			retval = 0;
+		}
+	}
+
+	if (options->prefetch) {
+		if (strcmp(options->prefetch, "true") == 0 || strcmp(options->prefetch, "1") == 0) {
+			options->prefetch_traced = 1;
+		} else if (strcmp(options->prefetch, "false") == 0 || strcmp(options->prefetch, "0") == 0) {
+			options->prefetch_traced = 0;
+		} else {
+			fprintf(stderr, "error: --prefetch must be a boolean\n");
+			retval = 0;
+		}
+	}
+
+	if (options->gzip) {
+#ifdef XVFS_HAVE_ZLIB
+		for (arg = strtok(options->gzip, ","); arg; arg = strtok(NULL, ",")) {
+			options->gzip_patterns = realloc(options->gzip_patterns, sizeof(*options->gzip_patterns) * (options->gzip_pattern_count + 1));
+			options->gzip_patterns[options->gzip_pattern_count] = arg;
+			options->gzip_pattern_count++;
+		}
+#else
+		fprintf(stderr, "error: --gzip requires building with XVFS_HAVE_ZLIB\n");
 		retval = 0;
+#endif
 	}
 
 	return(retval);
@@ -502,6 +1985,7 @@ static int parse_options(int argc, char **argv, struct xvfs_options *options) {
 
 int main(int argc, char **argv) {
 	struct xvfs_options options = {0};
+	FILE *outfp;
 	int parse_options_ret, xvfs_create_ret;
 
 	argc--;
@@ -512,7 +1996,22 @@ int main(int argc, char **argv) {
 		return(1);
 	}
 
-	xvfs_create_ret = xvfs_create(stdout, &options);
+	outfp = stdout;
+	if (options.output) {
+		outfp = fopen(options.output, "w");
+		if (!outfp) {
+			fprintf(stderr, "error: Unable to create %s\n", options.output);
+
+			return(1);
+		}
+	}
+
+	xvfs_create_ret = xvfs_create(outfp, &options);
+
+	if (outfp != stdout) {
+		fclose(outfp);
+	}
+
 	if (!xvfs_create_ret) {
 		return(1);
 	}
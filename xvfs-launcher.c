@@ -0,0 +1,118 @@
+/*
+ * Single-binary Tcl application launcher: the Tcl script library
+ * (fsName "tcl") and an application directory (fsName "app") are
+ * compiled into this executable as one standalone image, which is
+ * registered before Tcl_Init() so that the interpreter boots entirely
+ * from xvfs.  The main script (XVFS_LAUNCHER_MAIN, relative to the
+ * application directory) is then run from the image with the
+ * command line arguments in $argv.
+ *
+ * The image is generated by "make xvfs-launcher", see the Makefile
+ * for the variables that select the directories and main script.
+ *
+ * Encodings are loaded from the image as well; only an encoding that
+ * Tcl needs for the system locale before any interpreter exists (i.e.,
+ * one that is not built in to Tcl, such as iso8859-15) is still read
+ * from the compiled-in library directory.
+ */
+#include <tcl.h>
+
+#ifndef XVFS_ROOT_MOUNTPOINT
+#  define XVFS_ROOT_MOUNTPOINT "//xvfs:/"
+#endif
+#ifndef XVFS_LAUNCHER_MAIN
+#  define XVFS_LAUNCHER_MAIN "main.tcl"
+#endif
+
+/*
+ * xvfs-core.c undefines XVFS_ROOT_MOUNTPOINT, so the paths are fixed
+ * before the image is included
+ */
+#define XVFS_LAUNCHER_LIBRARY XVFS_ROOT_MOUNTPOINT "tcl"
+#define XVFS_LAUNCHER_APP     XVFS_ROOT_MOUNTPOINT "app"
+
+static const char *xvfs_launcher_library = XVFS_LAUNCHER_LIBRARY;
+static const char *xvfs_launcher_encodings = XVFS_LAUNCHER_LIBRARY "/encoding";
+static const char *xvfs_launcher_app = XVFS_LAUNCHER_APP;
+static const char *xvfs_launcher_main = XVFS_LAUNCHER_APP "/" XVFS_LAUNCHER_MAIN;
+
+/*
+ * Run once Tcl_Init() has sourced init.tcl: restrict the package and
+ * module paths to the image (init.tcl also adds a "lib" directory
+ * next to the executable to "auto_path") and satisfy "package require"
+ * from the package index of the image alone.  The module paths are set
+ * without loading tm.tcl, which would add (and normalize) directories
+ * on disk.  Modules are looked for in the "tcl8/<version>" directories,
+ * or directly in "tcl8" if it holds any, which is where some
+ * distributions keep them inside the script library.
+ *
+ * An application that needs packages from disk may restore the stock
+ * handler with:
+ *     package unknown [list ::xvfs::packageUnknown {::tcl::tm::UnknownHandler ::tclPkgUnknown}]
+ */
+static const char *xvfs_launcher_initScript =
+	"set ::auto_path [lsearch -all -inline -glob $::auto_path " XVFS_ROOT_MOUNTPOINT "*]\n"
+	"namespace eval ::tcl::tm {\n"
+	"	variable paths [list]\n"
+	"}\n"
+	"foreach dir [list [info library] " XVFS_LAUNCHER_APP "] {\n"
+	"	if {![file isdirectory $dir/tcl8]} {\n"
+	"		continue\n"
+	"	}\n"
+	"	if {[llength [glob -nocomplain -directory $dir/tcl8 *.tm]] != 0} {\n"
+	"		lappend ::tcl::tm::paths $dir/tcl8\n"
+	"	} else {\n"
+	"		lappend ::tcl::tm::paths {*}[glob -nocomplain -types d -directory $dir/tcl8 *]\n"
+	"	}\n"
+	"}\n"
+	"unset -nocomplain dir\n"
+	"package unknown [list ::xvfs::packageUnknown {}]\n";
+
+#undef  XVFS_DEBUG
+#define XVFS_MODE_STANDALONE
+#include "xvfs-launcher-image.c"
+
+static int xvfs_launcher_appInit(Tcl_Interp *interp) {
+	Tcl_Obj *searchPath;
+	int tclRet;
+
+	tclRet = Xvfs_tcl_Init(interp);
+	if (tclRet != TCL_OK) {
+		return(tclRet);
+	}
+
+	/*
+	 * With "tcl_library" set init.tcl is only looked for there, and
+	 * with "auto_path" set $env(TCLLIBPATH) and "tcl_pkgPath" would
+	 * be the only other directories added to it, so drop the
+	 * compiled-in "tcl_pkgPath"
+	 */
+	Tcl_SetVar(interp, "tcl_library", xvfs_launcher_library, TCL_GLOBAL_ONLY);
+	Tcl_SetVar(interp, "auto_path", xvfs_launcher_app, TCL_GLOBAL_ONLY);
+	Tcl_UnsetVar(interp, "tcl_pkgPath", TCL_GLOBAL_ONLY);
+
+	searchPath = Tcl_NewListObj(0, NULL);
+	Tcl_ListObjAppendElement(NULL, searchPath, Tcl_NewStringObj(xvfs_launcher_encodings, -1));
+	Tcl_SetEncodingSearchPath(searchPath);
+
+	tclRet = Tcl_Init(interp);
+	if (tclRet != TCL_OK) {
+		return(tclRet);
+	}
+
+	return(Tcl_EvalEx(interp, xvfs_launcher_initScript, -1, TCL_EVAL_GLOBAL));
+}
+
+int main(int argc, char **argv) {
+	/*
+	 * Tcl_Main() only treats argv[1] as the script to run when no
+	 * startup script has been set, so every argument is passed on to
+	 * the main script
+	 */
+	Tcl_FindExecutable(argv[0]);
+	Tcl_SetStartupScript(Tcl_NewStringObj(xvfs_launcher_main, -1), "utf-8");
+
+	Tcl_Main(argc, argv, xvfs_launcher_appInit);
+
+	return(1);
+}